@@ -0,0 +1,127 @@
+/* -*- Mode: C; tab-width: 3; c-basic-offset: 3; indent-tabs-mode: nil -*- */
+/* vim: set filetype=C tabstop=3 softtabstop=3 shiftwidth=3 expandtab: */
+
+/* ekvs -- Copyright (C) 2011 GameClay LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#define _GNU_SOURCE
+
+#include "counters.h"
+
+#include <linux/perf_event.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+static const char* counter_names[COUNTER_COUNT] = {
+   "cycles", "instructions", "llc_misses", "dtlb_misses", "branch_misses"
+};
+
+static int open_event(uint32_t type, uint64_t config)
+{
+   struct perf_event_attr attr;
+
+   memset(&attr, 0, sizeof(attr));
+   attr.size = sizeof(attr);
+   attr.type = type;
+   attr.config = config;
+   attr.disabled = 1;
+   attr.exclude_kernel = 1;
+   attr.exclude_hv = 1;
+   attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+   return (int)syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+int counters_open(struct counters* c)
+{
+   int i, opened = 0;
+
+   c->fd[COUNTER_CYCLES] = open_event(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES);
+   c->fd[COUNTER_INSTRUCTIONS] = open_event(PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS);
+   c->fd[COUNTER_LLC_MISSES] = open_event(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES);
+   c->fd[COUNTER_DTLB_MISSES] = open_event(PERF_TYPE_HW_CACHE,
+      PERF_COUNT_HW_CACHE_DTLB | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16));
+   c->fd[COUNTER_BRANCH_MISSES] = open_event(PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES);
+   for(i = 0; i < COUNTER_COUNT; i++)
+   {
+      if(c->fd[i] >= 0) opened++;
+   }
+   counters_reset(c);
+   return opened;
+}
+
+void counters_start(struct counters* c)
+{
+   int i;
+   for(i = 0; i < COUNTER_COUNT; i++)
+   {
+      if(c->fd[i] < 0) continue;
+      ioctl(c->fd[i], PERF_EVENT_IOC_RESET, 0);
+      ioctl(c->fd[i], PERF_EVENT_IOC_ENABLE, 0);
+   }
+}
+
+void counters_stop(struct counters* c)
+{
+   uint64_t value[3];    /* Count, time enabled, time running */
+   int i;
+
+   for(i = 0; i < COUNTER_COUNT; i++)
+   {
+      if(c->fd[i] < 0) continue;
+      ioctl(c->fd[i], PERF_EVENT_IOC_DISABLE, 0);
+      if(read(c->fd[i], value, sizeof(value)) != sizeof(value) || value[2] == 0) continue;
+      c->total[i] += (uint64_t)((double)value[0] * ((double)value[1] / (double)value[2]));
+   }
+}
+
+void counters_reset(struct counters* c)
+{
+   memset(c->total, 0, sizeof(c->total));
+}
+
+void counters_print(const struct counters* c, double ops)
+{
+   int i;
+
+   for(i = 0; i < COUNTER_COUNT; i++)
+   {
+      if(c->fd[i] >= 0)
+      {
+         printf(" %s/op=%.3f", counter_names[i], (double)c->total[i] / ops);
+      }
+      else
+      {
+         printf(" %s/op=n/a", counter_names[i]);
+      }
+   }
+   if(c->fd[COUNTER_CYCLES] >= 0 && c->fd[COUNTER_INSTRUCTIONS] >= 0 && c->total[COUNTER_CYCLES] != 0)
+   {
+      printf(" ipc=%.2f", (double)c->total[COUNTER_INSTRUCTIONS] / (double)c->total[COUNTER_CYCLES]);
+   }
+}
+
+void counters_close(struct counters* c)
+{
+   int i;
+   for(i = 0; i < COUNTER_COUNT; i++)
+   {
+      if(c->fd[i] >= 0) close(c->fd[i]);
+      c->fd[i] = -1;
+   }
+}
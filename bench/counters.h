@@ -0,0 +1,56 @@
+/* -*- Mode: C; tab-width: 3; c-basic-offset: 3; indent-tabs-mode: nil -*- */
+/* vim: set filetype=C tabstop=3 softtabstop=3 shiftwidth=3 expandtab: */
+
+/* ekvs -- Copyright (C) 2011 GameClay LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+/* Hardware counters for the benchmarks, read through perf_event_open. Events
+ * which the kernel or the machine does not offer stay closed and are reported
+ * as n/a, so the benchmarks still run, with timings only. */
+
+#ifndef _EKVS_BENCH_COUNTERS_H_
+#define _EKVS_BENCH_COUNTERS_H_
+
+#include <stdint.h>
+
+enum {
+   COUNTER_CYCLES,
+   COUNTER_INSTRUCTIONS,
+   COUNTER_LLC_MISSES,
+   COUNTER_DTLB_MISSES,
+   COUNTER_BRANCH_MISSES,
+   COUNTER_COUNT
+};
+
+struct counters {
+   int fd[COUNTER_COUNT];
+   uint64_t total[COUNTER_COUNT];    /* Scaled for the time each event was multiplexed out */
+};
+
+/* Open the events, disabled, and return how many could be */
+int counters_open(struct counters* c);
+
+/* Count between start and stop, adding to the totals */
+void counters_start(struct counters* c);
+void counters_stop(struct counters* c);
+void counters_reset(struct counters* c);
+
+/* Print each total divided by ops, and instructions per cycle */
+void counters_print(const struct counters* c, double ops);
+
+void counters_close(struct counters* c);
+
+#endif
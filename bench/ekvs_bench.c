@@ -0,0 +1,565 @@
+/* -*- Mode: C; tab-width: 3; c-basic-offset: 3; indent-tabs-mode: nil -*- */
+/* vim: set filetype=C tabstop=3 softtabstop=3 shiftwidth=3 expandtab: */
+
+/* ekvs -- Copyright (C) 2011 GameClay LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* YCSB-style workloads against ekvs, with results written as JSON to stdout.
+ *
+ *    ekvs_bench [-w workloads] [-n records] [-o operations] [-k key size]
+ *               [-v value size] [-d zipfian|uniform] [-f path] [-a ring size] [-s seed]
+ *               [-e hash|lsm]
+ *
+ * Workloads are selected by letter, e.g. -w abf, and default to all of A-F:
+ *
+ *    A  50% read, 50% update
+ *    B  95% read, 5% update
+ *    C  100% read
+ *    D  95% read of recently inserted keys, 5% insert
+ *    E  95% scan of up to 100 keys, 5% insert
+ *    F  50% read, 50% read-modify-write
+ *
+ * ekvs has no ordered iteration, so a scan reads a run of consecutively
+ * numbered keys with ekvs_mget.
+ *
+ * Without -f the store is in-memory and the snapshot phase writes to a scratch
+ * file. With -f the store is file-backed, every modification goes through the
+ * binlog, and a recovery phase times ekvs_open against a growing binlog. -a
+ * queues binlog records for a writer thread, see ekvs_opts.async_binlog_size.
+ *
+ * -e lsm runs against the LSM engine, which needs -f, see ekvs_opts.engine. For
+ * a file-backed store, the amplification phase reports the bytes written to
+ * disk per byte of keys and values set. */
+
+#define _POSIX_C_SOURCE 199309L
+
+#include <ekvs/ekvs.h>
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+
+#define ZIPFIAN_THETA 0.99
+#define MAX_SCAN 100
+#define RECOVERY_STEPS 4
+
+/* Latency histogram: exact below 16ns, then 16 linear sub-buckets per power of two (~6% error) */
+#define HIST_SUB_BITS 4
+#define HIST_SUB (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS (64 * HIST_SUB)
+
+typedef enum {
+   op_read = 0,
+   op_update,
+   op_insert,
+   op_scan,
+   op_rmw,
+   op_count
+} bench_op;
+
+static const char* op_names[op_count] = { "read", "update", "insert", "scan", "read_modify_write" };
+
+typedef struct {
+   uint64_t count;
+   uint64_t max;
+   uint64_t buckets[HIST_BUCKETS];
+} histogram;
+
+typedef struct {
+   char name;
+   int read, update, insert, scan, rmw;   /* Percentages */
+   int latest;                            /* Reads favour recently inserted keys */
+} workload;
+
+static const workload workloads[] = {
+   { 'a', 50, 50, 0, 0, 0, 0 },
+   { 'b', 95, 5, 0, 0, 0, 0 },
+   { 'c', 100, 0, 0, 0, 0, 0 },
+   { 'd', 95, 0, 5, 0, 0, 1 },
+   { 'e', 0, 0, 5, 95, 0, 0 },
+   { 'f', 50, 0, 0, 0, 50, 0 }
+};
+
+typedef struct {
+   uint64_t items;
+   double zetan;
+   double alpha;
+   double eta;
+   double half_pow_theta;
+} zipfian;
+
+typedef struct {
+   uint64_t records;       /* Keys currently in the store */
+   uint64_t operations;
+   size_t key_sz;
+   size_t value_sz;
+   int uniform;
+   const char* path;       /* NULL for in-memory */
+   size_t async_binlog_size;
+   uint32_t engine;
+   uint64_t written;       /* Bytes of keys and values set */
+   uint64_t rng;
+   zipfian zipf;
+   char* key;
+   char* value;
+   const char** scan_keys;
+   char* scan_keybuf;
+   ekvs_view* scan_views;
+   histogram hist[op_count];
+} bench;
+
+static double now_ns()
+{
+   struct timespec ts;
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return (double)ts.tv_sec * 1e9 + (double)ts.tv_nsec;
+}
+
+static uint64_t next_rand(uint64_t* state)
+{
+   uint64_t x = *state;
+   x ^= x << 13;
+   x ^= x >> 7;
+   x ^= x << 17;
+   *state = x;
+   return x;
+}
+
+static double next_unit(uint64_t* state)
+{
+   return (double)(next_rand(state) >> 11) / 9007199254740992.0;
+}
+
+static uint64_t fnv_hash(uint64_t value)
+{
+   uint64_t hash = 0xcbf29ce484222325UL;
+   int i;
+   for(i = 0; i < 8; i++)
+   {
+      hash ^= (value >> (i * 8)) & 0xff;
+      hash *= 0x100000001b3UL;
+   }
+   return hash;
+}
+
+/* Gray et al., "Quickly Generating Billion-Record Synthetic Databases", as used by YCSB */
+static void zipfian_init(zipfian* zipf, uint64_t items)
+{
+   double zeta2 = 1.0 + pow(0.5, ZIPFIAN_THETA);
+   uint64_t i;
+
+   zipf->items = items;
+   zipf->zetan = 0;
+   for(i = 1; i <= items; i++) zipf->zetan += 1.0 / pow((double)i, ZIPFIAN_THETA);
+   zipf->alpha = 1.0 / (1.0 - ZIPFIAN_THETA);
+   zipf->eta = (1.0 - pow(2.0 / (double)items, 1.0 - ZIPFIAN_THETA)) / (1.0 - zeta2 / zipf->zetan);
+   zipf->half_pow_theta = pow(0.5, ZIPFIAN_THETA);
+}
+
+static uint64_t zipfian_next(const zipfian* zipf, uint64_t* state)
+{
+   double u = next_unit(state);
+   double uz = u * zipf->zetan;
+   uint64_t rank;
+
+   if(uz < 1.0) return 0;
+   if(uz < 1.0 + zipf->half_pow_theta) return 1;
+   rank = (uint64_t)((double)zipf->items * pow(zipf->eta * u - zipf->eta + 1.0, zipf->alpha));
+   return (rank < zipf->items ? rank : zipf->items - 1);
+}
+
+/* Index of an existing key. Zipfian ranks are scattered so the hot keys are not neighbours. */
+static uint64_t choose_key(bench* b, int latest)
+{
+   uint64_t rank;
+
+   if(b->uniform) rank = next_rand(&b->rng) % b->records;
+   else rank = zipfian_next(&b->zipf, &b->rng) % b->records;
+
+   if(latest) return b->records - 1 - rank;
+   return (b->uniform ? rank : fnv_hash(rank) % b->records);
+}
+
+static void format_key(const bench* b, char* key, uint64_t index)
+{
+   char digits[24];
+   size_t len = (size_t)sprintf(digits, "%lu", (unsigned long)index);
+
+   /* "user" followed by the zero-padded index, key_sz bytes in all */
+   memcpy(key, "user", 4);
+   memset(key + 4, '0', b->key_sz - 4 - len);
+   memcpy(key + b->key_sz - len, digits, len);
+   key[b->key_sz] = '\0';
+}
+
+static void fill_value(bench* b)
+{
+   uint64_t stamp = next_rand(&b->rng);
+   memcpy(b->value, &stamp, (b->value_sz < sizeof(stamp) ? b->value_sz : sizeof(stamp)));
+}
+
+static void hist_record(histogram* hist, uint64_t ns)
+{
+   unsigned int msb = 0;
+   unsigned int index;
+
+   if(ns < HIST_SUB)
+      index = (unsigned int)ns;
+   else
+   {
+      while((ns >> msb) > 1) msb++;
+      index = (msb - HIST_SUB_BITS + 1) * HIST_SUB + (unsigned int)((ns >> (msb - HIST_SUB_BITS)) & (HIST_SUB - 1));
+   }
+   hist->buckets[index]++;
+   hist->count++;
+   if(ns > hist->max) hist->max = ns;
+}
+
+static uint64_t hist_bucket_value(unsigned int index)
+{
+   unsigned int msb;
+   if(index < HIST_SUB) return index;
+   msb = index / HIST_SUB + HIST_SUB_BITS - 1;
+   return (uint64_t)(HIST_SUB + index % HIST_SUB) << (msb - HIST_SUB_BITS);
+}
+
+static uint64_t hist_percentile(const histogram* hist, double percentile)
+{
+   uint64_t target = (uint64_t)ceil((double)hist->count * percentile / 100.0);
+   uint64_t seen = 0;
+   unsigned int i;
+
+   if(target == 0) target = 1;
+   for(i = 0; i < HIST_BUCKETS; i++)
+   {
+      seen += hist->buckets[i];
+      if(seen >= target) return hist_bucket_value(i);
+   }
+   return hist->max;
+}
+
+static void print_latencies(const bench* b)
+{
+   int op;
+   int first = 1;
+
+   printf("\"latency_ns\": {");
+   for(op = 0; op < op_count; op++)
+   {
+      const histogram* hist = &b->hist[op];
+      if(hist->count == 0) continue;
+      printf("%s\"%s\": {\"count\": %lu, \"p50\": %lu, \"p99\": %lu, \"p999\": %lu, \"max\": %lu}",
+         (first ? "" : ", "), op_names[op], (unsigned long)hist->count,
+         (unsigned long)hist_percentile(hist, 50.0), (unsigned long)hist_percentile(hist, 99.0),
+         (unsigned long)hist_percentile(hist, 99.9), (unsigned long)hist->max);
+      first = 0;
+   }
+   printf("}");
+}
+
+static long file_size(const char* path)
+{
+   struct stat st;
+   if(path == NULL || stat(path, &st) != 0) return 0;
+   return (long)st.st_size;
+}
+
+static int do_set(bench* b, ekvs store)
+{
+   b->written += b->key_sz + b->value_sz;
+   return ekvs_set(store, b->key, b->value, b->value_sz);
+}
+
+static int do_insert(bench* b, ekvs store)
+{
+   format_key(b, b->key, b->records);
+   fill_value(b);
+   if(do_set(b, store) != EKVS_OK) return EKVS_FAIL;
+   b->records++;
+   return EKVS_OK;
+}
+
+static int do_op(bench* b, ekvs store, const workload* w, bench_op op)
+{
+   const void* data;
+   size_t data_sz;
+   uint64_t start;
+   uint64_t i;
+   size_t scan_len;
+   int ret;
+
+   switch(op)
+   {
+      case op_read:
+         format_key(b, b->key, choose_key(b, w->latest));
+         ret = ekvs_get(store, b->key, &data, &data_sz);
+         return (ret == EKVS_NO_KEY ? EKVS_OK : ret);
+
+      case op_update:
+         format_key(b, b->key, choose_key(b, w->latest));
+         fill_value(b);
+         return do_set(b, store);
+
+      case op_insert:
+         return do_insert(b, store);
+
+      case op_scan:
+         start = choose_key(b, 0);
+         scan_len = 1 + (size_t)(next_rand(&b->rng) % MAX_SCAN);
+         if(start + scan_len > b->records) scan_len = (size_t)(b->records - start);
+         for(i = 0; i < scan_len; i++) format_key(b, (char*)b->scan_keys[i], start + i);
+         return ekvs_mget(store, b->scan_keys, scan_len, b->scan_views);
+
+      case op_rmw:
+         format_key(b, b->key, choose_key(b, w->latest));
+         ret = ekvs_get(store, b->key, &data, &data_sz);
+         if(ret == EKVS_OK)
+         {
+            /* The value is only valid until the next modification */
+            memcpy(b->value, data, (data_sz < b->value_sz ? data_sz : b->value_sz));
+         }
+         else if(ret != EKVS_NO_KEY) return ret;
+         fill_value(b);
+         return do_set(b, store);
+
+      default:
+         return EKVS_FAIL;
+   }
+}
+
+static bench_op pick_op(bench* b, const workload* w)
+{
+   int roll = (int)(next_rand(&b->rng) % 100);
+   if((roll -= w->read) < 0) return op_read;
+   if((roll -= w->update) < 0) return op_update;
+   if((roll -= w->insert) < 0) return op_insert;
+   if((roll -= w->scan) < 0) return op_scan;
+   return op_rmw;
+}
+
+static int run_load(bench* b, ekvs store, uint64_t records)
+{
+   double start = now_ns();
+   double elapsed;
+   double op_start;
+
+   memset(b->hist, 0, sizeof(b->hist));
+   while(b->records < records)
+   {
+      op_start = now_ns();
+      if(do_insert(b, store) != EKVS_OK) return EKVS_FAIL;
+      hist_record(&b->hist[op_insert], (uint64_t)(now_ns() - op_start));
+   }
+   elapsed = (now_ns() - start) / 1e9;
+
+   printf("    {\"phase\": \"load\", \"ops\": %lu, \"seconds\": %.6f, \"ops_per_sec\": %.1f, ",
+      (unsigned long)records, elapsed, (double)records / elapsed);
+   print_latencies(b);
+   printf("}");
+   return EKVS_OK;
+}
+
+static int run_workload(bench* b, ekvs store, const workload* w)
+{
+   double start = now_ns();
+   double elapsed;
+   double op_start;
+   uint64_t i;
+
+   memset(b->hist, 0, sizeof(b->hist));
+   for(i = 0; i < b->operations; i++)
+   {
+      bench_op op = pick_op(b, w);
+      op_start = now_ns();
+      if(do_op(b, store, w, op) != EKVS_OK) return EKVS_FAIL;
+      hist_record(&b->hist[op], (uint64_t)(now_ns() - op_start));
+   }
+   elapsed = (now_ns() - start) / 1e9;
+
+   printf(",\n    {\"phase\": \"run\", \"workload\": \"%c\", \"ops\": %lu, \"seconds\": %.6f, \"ops_per_sec\": %.1f, ",
+      w->name, (unsigned long)b->operations, elapsed, (double)b->operations / elapsed);
+   print_latencies(b);
+   printf("}");
+   return EKVS_OK;
+}
+
+static int run_snapshot(bench* b, ekvs store, const char* scratch)
+{
+   double start = now_ns();
+   double elapsed;
+
+   if(ekvs_snapshot(store, b->path == NULL ? scratch : NULL) != EKVS_OK) return EKVS_FAIL;
+   elapsed = (now_ns() - start) / 1e6;
+
+   printf(",\n    {\"phase\": \"snapshot\", \"records\": %lu, \"file_bytes\": %ld, \"ms\": %.3f}",
+      (unsigned long)b->records, file_size(b->path == NULL ? scratch : b->path), elapsed);
+   if(b->path == NULL) remove(scratch);
+   return EKVS_OK;
+}
+
+/* Bytes written to disk by the binlog, SSTables and the last snapshot, per byte set */
+static int run_amplification(bench* b, ekvs store)
+{
+   ekvs_runtime_stats stats;
+   uint64_t disk;
+
+   if(ekvs_stats(store, &stats) != EKVS_OK) return EKVS_FAIL;
+   disk = stats.binlog_bytes + stats.lsm_bytes_written + (uint64_t)file_size(b->path);
+
+   printf(",\n    {\"phase\": \"amplification\", \"user_bytes\": %lu, \"binlog_bytes\": %lu, \"table_bytes\": %lu, \"compactions\": %lu, \"write_amplification\": %.2f}",
+      (unsigned long)b->written, (unsigned long)stats.binlog_bytes, (unsigned long)stats.lsm_bytes_written,
+      (unsigned long)stats.lsm_compactions, (double)disk / (double)(b->written != 0 ? b->written : 1));
+   return EKVS_OK;
+}
+
+/* Starts from a fresh snapshot, then grows the binlog by half the key count between opens */
+static int run_recovery(bench* b, ekvs* store, const ekvs_opts* opts)
+{
+   long snapshot_size = file_size(b->path);
+   double start;
+   double elapsed;
+   uint64_t i;
+   int step;
+
+   for(step = 0; step < RECOVERY_STEPS; step++)
+   {
+      ekvs_close(*store);
+      start = now_ns();
+      if(ekvs_open(store, b->path, opts) != EKVS_OK) return EKVS_FAIL;
+      elapsed = (now_ns() - start) / 1e6;
+
+      printf(",\n    {\"phase\": \"recovery\", \"records\": %lu, \"binlog_bytes\": %ld, \"ms\": %.3f}",
+         (unsigned long)b->records, file_size(b->path) - snapshot_size, elapsed);
+
+      for(i = 0; i < b->records / 2; i++)
+      {
+         format_key(b, b->key, next_rand(&b->rng) % b->records);
+         fill_value(b);
+         if(do_set(b, *store) != EKVS_OK) return EKVS_FAIL;
+      }
+   }
+   return EKVS_OK;
+}
+
+static int usage(const char* name)
+{
+   fprintf(stderr, "usage: %s [-w workloads] [-n records] [-o operations] [-k key size] [-v value size] [-d zipfian|uniform] [-f path] [-a ring size] [-s seed] [-e hash|lsm]\n", name);
+   return 1;
+}
+
+int main(int argc, char** argv)
+{
+   const char* selected = "abcdef";
+   uint64_t records = 100000;
+   uint64_t inserts;
+   const char* scratch = "ekvs_bench.snapshot";
+   ekvs_opts opts;
+   ekvs store;
+   bench b;
+   int i;
+   size_t w;
+   int ret = 0;
+
+   memset(&b, 0, sizeof(b));
+   b.operations = 100000;
+   b.key_sz = 24;
+   b.value_sz = 100;
+   b.rng = 88172645463325252UL;
+
+   for(i = 1; i < argc; i++)
+   {
+      if(argv[i][0] != '-' || argv[i][1] == '\0' || argv[i][2] != '\0' || i + 1 >= argc) return usage(argv[0]);
+      switch(argv[i][1])
+      {
+         case 'w': selected = argv[++i]; break;
+         case 'n': records = strtoul(argv[++i], NULL, 10); break;
+         case 'o': b.operations = strtoul(argv[++i], NULL, 10); break;
+         case 'k': b.key_sz = strtoul(argv[++i], NULL, 10); break;
+         case 'v': b.value_sz = strtoul(argv[++i], NULL, 10); break;
+         case 'd': b.uniform = (strcmp(argv[++i], "uniform") == 0); break;
+         case 'f': b.path = argv[++i]; break;
+         case 'a': b.async_binlog_size = strtoul(argv[++i], NULL, 10); break;
+         case 's': b.rng = strtoul(argv[++i], NULL, 10) | 1; break;
+         case 'e': b.engine = (strcmp(argv[++i], "lsm") == 0 ? ekvs_engine_lsm : ekvs_engine_hash); break;
+         default: return usage(argv[0]);
+      }
+   }
+
+   /* Room for "user" and 20 digits */
+   if(records == 0 || b.key_sz < 24 || b.value_sz == 0)
+   {
+      fprintf(stderr, "ekvs_bench: need at least one record, keys of at least 24 bytes and non-empty values.\n");
+      return 1;
+   }
+
+   if(b.engine == ekvs_engine_lsm && b.path == NULL)
+   {
+      fprintf(stderr, "ekvs_bench: the LSM engine needs a file, see -f.\n");
+      return 1;
+   }
+
+   b.key = malloc(b.key_sz + 1);
+   b.value = malloc(b.value_sz);
+   b.scan_keybuf = malloc(MAX_SCAN * (b.key_sz + 1));
+   b.scan_keys = malloc(MAX_SCAN * sizeof(const char*));
+   b.scan_views = malloc(MAX_SCAN * sizeof(ekvs_view));
+   if(b.key == NULL || b.value == NULL || b.scan_keybuf == NULL || b.scan_keys == NULL || b.scan_views == NULL) return 1;
+   for(i = 0; i < MAX_SCAN; i++) b.scan_keys[i] = &b.scan_keybuf[i * (b.key_sz + 1)];
+   memset(b.value, 'v', b.value_sz);
+   if(!b.uniform) zipfian_init(&b.zipf, records);
+
+   /* Size the table for the load and the inserts of every selected workload */
+   inserts = 0;
+   for(w = 0; w < sizeof(workloads) / sizeof(workloads[0]); w++)
+   {
+      if(strchr(selected, workloads[w].name) != NULL) inserts += b.operations * workloads[w].insert / 100;
+   }
+   memset(&opts, 0, sizeof(opts));
+   opts.initial_table_size = (b.engine == ekvs_engine_hash ? records + inserts : 0);
+   opts.async_binlog_size = b.async_binlog_size;
+   opts.engine = b.engine;
+   if(b.path != NULL) remove(b.path);
+   if(ekvs_open(&store, b.path, &opts) != EKVS_OK) return 1;
+
+   printf("{\n  \"benchmark\": \"ekvs_bench\",\n");
+   printf("  \"config\": {\"records\": %lu, \"operations\": %lu, \"key_size\": %lu, \"value_size\": %lu, \"distribution\": \"%s\", \"mode\": \"%s\", \"engine\": \"%s\", \"async_binlog_size\": %lu},\n",
+      (unsigned long)records, (unsigned long)b.operations, (unsigned long)b.key_sz, (unsigned long)b.value_sz,
+      (b.uniform ? "uniform" : "zipfian"), (b.path == NULL ? "memory" : "file"), (b.engine == ekvs_engine_lsm ? "lsm" : "hash"), (unsigned long)b.async_binlog_size);
+   printf("  \"results\": [\n");
+
+   if(run_load(&b, store, records) != EKVS_OK) ret = 1;
+   for(w = 0; ret == 0 && w < sizeof(workloads) / sizeof(workloads[0]); w++)
+   {
+      if(strchr(selected, workloads[w].name) == NULL) continue;
+      if(run_workload(&b, store, &workloads[w]) != EKVS_OK) ret = 1;
+   }
+
+   if(ret == 0 && run_snapshot(&b, store, scratch) != EKVS_OK) ret = 1;
+   if(ret == 0 && b.path != NULL && run_amplification(&b, store) != EKVS_OK) ret = 1;
+   if(ret == 0 && b.path != NULL && run_recovery(&b, &store, &opts) != EKVS_OK) ret = 1;
+   printf("\n  ]\n}\n");
+
+   if(ret != 0) fprintf(stderr, "ekvs_bench: operation failed (%d).\n", ekvs_last_error(store));
+   ekvs_close(store);
+   free(b.scan_views);
+   free(b.scan_keys);
+   free(b.scan_keybuf);
+   free(b.value);
+   free(b.key);
+   return ret;
+}
@@ -0,0 +1,118 @@
+/* -*- Mode: C; tab-width: 3; c-basic-offset: 3; indent-tabs-mode: nil -*- */
+/* vim: set filetype=C tabstop=3 softtabstop=3 shiftwidth=3 expandtab: */
+
+/* ekvs -- Copyright (C) 2011 GameClay LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* Compares ekvs_mget against a loop of ekvs_get, for batches of random keys.
+ *
+ *    mget [keys] [batch]
+ *
+ * The default of 4M keys makes the table and entries several hundred MB, well
+ * beyond the last level cache of current machines. */
+
+#define _POSIX_C_SOURCE 199309L
+
+#include <ekvs/ekvs.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define KEY_FMT "key:%lu"
+#define KEY_SLOT 32  /* "key:" and up to 20 digits */
+
+static double now_ns()
+{
+   struct timespec ts;
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return (double)ts.tv_sec * 1e9 + (double)ts.tv_nsec;
+}
+
+static unsigned long next_rand(unsigned long* state)
+{
+   /* xorshift, good enough to defeat the hardware prefetchers */
+   unsigned long x = *state;
+   x ^= x << 13;
+   x ^= x >> 7;
+   x ^= x << 17;
+   *state = x;
+   return x;
+}
+
+int main(int argc, char** argv)
+{
+   unsigned long num_keys = (argc > 1 ? strtoul(argv[1], NULL, 10) : 4UL * 1024 * 1024);
+   unsigned long batch = (argc > 2 ? strtoul(argv[2], NULL, 10) : 2000);
+   unsigned long rounds;
+   unsigned long i, r;
+   unsigned long state = 88172645463325252UL;
+   unsigned long found = 0;
+   char* keybuf;
+   const char** keys;
+   ekvs_view* views;
+   ekvs_opts opts;
+   ekvs store;
+   double start, get_ns, mget_ns;
+
+   if(num_keys == 0 || batch == 0) return 1;
+   rounds = (num_keys / batch > 200 ? num_keys / batch : 200);
+
+   memset(&opts, 0, sizeof(opts));
+   opts.initial_table_size = num_keys;
+   if(ekvs_open(&store, NULL, &opts) != EKVS_OK) return 1;
+
+   keybuf = malloc(batch * KEY_SLOT);
+   keys = malloc(batch * sizeof(const char*));
+   views = malloc(batch * sizeof(ekvs_view));
+   if(keybuf == NULL || keys == NULL || views == NULL) return 1;
+
+   for(i = 0; i < num_keys; i++)
+   {
+      sprintf(keybuf, KEY_FMT, i);
+      ekvs_set(store, keybuf, &i, sizeof(i));
+   }
+   for(i = 0; i < batch; i++) keys[i] = &keybuf[i * KEY_SLOT];
+
+   /* Each timed batch draws fresh keys, so neither side finds the other's lines in cache */
+   get_ns = mget_ns = 0;
+   for(r = 0; r < rounds; r++)
+   {
+      for(i = 0; i < batch; i++) sprintf(&keybuf[i * KEY_SLOT], KEY_FMT, next_rand(&state) % num_keys);
+      start = now_ns();
+      for(i = 0; i < batch; i++)
+      {
+         if(ekvs_get(store, keys[i], &views[i].data, &views[i].data_sz) == EKVS_OK) found++;
+      }
+      get_ns += now_ns() - start;
+
+      for(i = 0; i < batch; i++) sprintf(&keybuf[i * KEY_SLOT], KEY_FMT, next_rand(&state) % num_keys);
+      start = now_ns();
+      ekvs_mget(store, keys, batch, views);
+      mget_ns += now_ns() - start;
+      for(i = 0; i < batch; i++) found += (views[i].status == EKVS_OK);
+   }
+
+   printf("keys=%lu batch=%lu rounds=%lu found=%lu\n", num_keys, batch, rounds, found);
+   printf("ekvs_get loop: %8.1f ns/key\n", get_ns / (double)(rounds * batch));
+   printf("ekvs_mget:     %8.1f ns/key (%.2fx)\n", mget_ns / (double)(rounds * batch), get_ns / mget_ns);
+
+   free(views);
+   free(keys);
+   free(keybuf);
+   ekvs_close(store);
+   return 0;
+}
@@ -0,0 +1,170 @@
+/* -*- Mode: C; tab-width: 3; c-basic-offset: 3; indent-tabs-mode: nil -*- */
+/* vim: set filetype=C tabstop=3 softtabstop=3 shiftwidth=3 expandtab: */
+
+/* ekvs -- Copyright (C) 2011 GameClay LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+/* Runs the core paths of the store in isolation, and reports time and hardware
+ * counters per operation: hashing, table inserts and lookups, growing the table
+ * and appending binlog records.
+ *
+ *    micro [keys] [binlog path]
+ *
+ * Keys, hashes and the lookup order are prepared up front, so only the path
+ * itself is timed and counted. Layout changes to entries or the table show up
+ * as changes in cycles, cache and TLB misses per operation. */
+
+#define _GNU_SOURCE
+
+#include <ekvs/ekvs.h>
+#include "../src/ekvs_internal.h"
+#include "counters.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define KEY_FMT "key:%lu"
+#define KEY_SLOT 32  /* "key:" and up to 20 digits */
+#define BINLOG_RECORDS 100000UL
+
+static double now_ns()
+{
+   struct timespec ts;
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return (double)ts.tv_sec * 1e9 + (double)ts.tv_nsec;
+}
+
+static unsigned long next_rand(unsigned long* state)
+{
+   /* xorshift, good enough to defeat the hardware prefetchers */
+   unsigned long x = *state;
+   x ^= x << 13;
+   x ^= x >> 7;
+   x ^= x << 17;
+   *state = x;
+   return x;
+}
+
+static void report(const char* path, unsigned long ops, double ns, const struct counters* c)
+{
+   printf("%-16s ops=%-9lu ns/op=%.1f", path, ops, ns / (double)ops);
+   counters_print(c, (double)ops);
+   printf("\n");
+}
+
+int main(int argc, char** argv)
+{
+   unsigned long num_keys = (argc > 1 ? strtoul(argv[1], NULL, 10) : 1024UL * 1024);
+   const char* binlog_path = (argc > 2 ? argv[2] : "micro_bench.db");
+   unsigned long state = 88172645463325252UL;
+   unsigned long i, found = 0, records;
+   size_t* key_sz;
+   uint64_t* hashes;
+   unsigned long* order;
+   char* keys;
+   struct counters c;
+   ekvs_opts opts;
+   ekvs store;
+   double start;
+
+   if(num_keys == 0) return 1;
+   keys = malloc(num_keys * KEY_SLOT);
+   key_sz = malloc(num_keys * sizeof(size_t));
+   hashes = malloc(num_keys * sizeof(uint64_t));
+   order = malloc(num_keys * sizeof(unsigned long));
+   if(keys == NULL || key_sz == NULL || hashes == NULL || order == NULL) return 1;
+   for(i = 0; i < num_keys; i++)
+   {
+      sprintf(&keys[i * KEY_SLOT], KEY_FMT, i);
+      key_sz[i] = strlen(&keys[i * KEY_SLOT]);
+      order[i] = next_rand(&state) % num_keys;
+   }
+
+   if(counters_open(&c) == 0) fprintf(stderr, "micro: perf_event_open unavailable, reporting time only.\n");
+   printf("keys=%lu\n", num_keys);
+
+   /* hashlittle2, as every keyed operation calls it */
+   counters_start(&c);
+   start = now_ns();
+   for(i = 0; i < num_keys; i++)
+   {
+      uint32_t pc = 0, pb = 0;
+      hashlittle2(&keys[i * KEY_SLOT], key_sz[i], &pc, &pb);
+      hashes[i] = pc + (((uint64_t)pb) << 32);
+   }
+   counters_stop(&c);
+   report("hashlittle2", num_keys, now_ns() - start, &c);
+
+   /* _ekvs_insert into a table large enough not to grow */
+   memset(&opts, 0, sizeof(opts));
+   opts.initial_table_size = num_keys * 2;
+   if(ekvs_open(&store, NULL, &opts) != EKVS_OK) return 1;
+   counters_reset(&c);
+   counters_start(&c);
+   start = now_ns();
+   for(i = 0; i < num_keys; i++)
+   {
+      _ekvs_insert(store, hashes[i], &keys[i * KEY_SLOT], &i, key_sz[i], sizeof(i), 0, 0);
+   }
+   counters_stop(&c);
+   report("_ekvs_insert", num_keys, now_ns() - start, &c);
+
+   /* _ekvs_retrieve of keys in random order */
+   counters_reset(&c);
+   counters_start(&c);
+   start = now_ns();
+   for(i = 0; i < num_keys; i++)
+   {
+      if(_ekvs_retrieve(store, hashes[order[i]], &keys[order[i] * KEY_SLOT], key_sz[order[i]]) != NULL) found++;
+   }
+   counters_stop(&c);
+   report("_ekvs_retrieve", num_keys, now_ns() - start, &c);
+   if(found != num_keys) fprintf(stderr, "micro: found %lu of %lu keys.\n", found, num_keys);
+
+   /* ekvs_grow_table, per key moved */
+   counters_reset(&c);
+   counters_start(&c);
+   start = now_ns();
+   if(ekvs_grow_table(store, (size_t)store->serialized.table_sz * 2) != EKVS_OK) return 1;
+   counters_stop(&c);
+   report("ekvs_grow_table", num_keys, now_ns() - start, &c);
+   ekvs_close(store);
+
+   /* _ekvs_binlog, which writes and flushes each record to the database file */
+   remove(binlog_path);
+   if(ekvs_open(&store, binlog_path, NULL) != EKVS_OK) return 1;
+   records = (num_keys < BINLOG_RECORDS ? num_keys : BINLOG_RECORDS);
+   counters_reset(&c);
+   counters_start(&c);
+   start = now_ns();
+   for(i = 0; i < records; i++)
+   {
+      _ekvs_binlog(store, EKVS_BINLOG_SET, 0, &keys[i * KEY_SLOT], key_sz[i], &i, sizeof(i));
+   }
+   counters_stop(&c);
+   report("_ekvs_binlog", records, now_ns() - start, &c);
+   ekvs_close(store);
+   remove(binlog_path);
+
+   counters_close(&c);
+   free(order);
+   free(hashes);
+   free(key_sz);
+   free(keys);
+   return 0;
+}
@@ -0,0 +1,127 @@
+/* -*- Mode: C; tab-width: 3; c-basic-offset: 3; indent-tabs-mode: nil -*- */
+/* vim: set filetype=C tabstop=3 softtabstop=3 shiftwidth=3 expandtab: */
+
+/* ekvs -- Copyright (C) 2011 GameClay LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+/* Times random lookups with the table on 4KB pages, transparent huge pages and
+ * the hugetlb pools (ekvs_opts.table_pages), with the hardware counters of
+ * counters.h, dTLB load misses among them, where perf_event_open is allowed.
+ *
+ *    tlb [keys] [lookups]
+ *
+ * The default of 16M keys makes a 128MB table. 2MB pages need vm.nr_hugepages
+ * set aside, and 1GB pages a table of at least 1GB, or 128M keys; modes which
+ * fall back are reported with the pages they got. */
+
+#define _POSIX_C_SOURCE 199309L
+
+#include <ekvs/ekvs.h>
+#include "counters.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define KEY_FMT "key:%lu"
+#define KEY_SLOT 32  /* "key:" and up to 20 digits */
+#define BATCH 2000
+
+static const char* page_names[] = { "4kb", "transparent", "2mb", "1gb" };
+
+static double now_ns()
+{
+   struct timespec ts;
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return (double)ts.tv_sec * 1e9 + (double)ts.tv_nsec;
+}
+
+static unsigned long next_rand(unsigned long* state)
+{
+   /* xorshift, good enough to defeat the hardware prefetchers */
+   unsigned long x = *state;
+   x ^= x << 13;
+   x ^= x >> 7;
+   x ^= x << 17;
+   *state = x;
+   return x;
+}
+
+static int run(unsigned long num_keys, unsigned long lookups, unsigned int pages, struct counters* c)
+{
+   char keybuf[BATCH][KEY_SLOT];
+   unsigned long state = 88172645463325252UL;
+   unsigned long i, done, found = 0;
+   const void* data;
+   size_t data_sz;
+   ekvs_runtime_stats stats;
+   ekvs_opts opts;
+   ekvs store;
+   double start, ns = 0;
+
+   memset(&opts, 0, sizeof(opts));
+   opts.initial_table_size = num_keys;
+   opts.table_pages = pages;
+   if(ekvs_open(&store, NULL, &opts) != EKVS_OK) return 1;
+   for(i = 0; i < num_keys; i++)
+   {
+      sprintf(keybuf[0], KEY_FMT, i);
+      ekvs_set(store, keybuf[0], &i, sizeof(i));
+   }
+
+   /* Keys are formatted outside of the timed and counted region */
+   counters_reset(c);
+   for(done = 0; done < lookups; done += BATCH)
+   {
+      for(i = 0; i < BATCH; i++) sprintf(keybuf[i], KEY_FMT, next_rand(&state) % num_keys);
+      counters_start(c);
+      start = now_ns();
+      for(i = 0; i < BATCH; i++)
+      {
+         if(ekvs_get(store, keybuf[i], &data, &data_sz) == EKVS_OK) found++;
+      }
+      ns += now_ns() - start;
+      counters_stop(c);
+   }
+
+   ekvs_stats(store, &stats);
+   printf("table_pages=%-11s got=%-11s found=%lu ns/op=%.1f", page_names[pages],
+      page_names[stats.table_pages], found, ns / (double)done);
+   counters_print(c, (double)done);
+   printf("\n");
+   ekvs_close(store);
+   return 0;
+}
+
+int main(int argc, char** argv)
+{
+   unsigned long num_keys = (argc > 1 ? strtoul(argv[1], NULL, 10) : 16UL * 1024 * 1024);
+   unsigned long lookups = (argc > 2 ? strtoul(argv[2], NULL, 10) : 4UL * 1024 * 1024);
+   unsigned int pages;
+   struct counters c;
+
+   if(num_keys == 0 || lookups == 0) return 1;
+   if(counters_open(&c) == 0) fprintf(stderr, "tlb: perf_event_open unavailable, reporting time only.\n");
+
+   printf("keys=%lu lookups=%lu\n", num_keys, lookups);
+   for(pages = ekvs_pages_default; pages <= ekvs_pages_1gb; pages++)
+   {
+      if(run(num_keys, lookups, pages, &c) != 0) return 1;
+   }
+   counters_close(&c);
+   return 0;
+}
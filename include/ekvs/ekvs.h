@@ -30,6 +30,57 @@ typedef void* (*ekvs_malloc_ptr)(size_t size);
 typedef void* (*ekvs_realloc_ptr)(void* ptr, size_t size);
 typedef void (*ekvs_free_ptr)(void* ptr);
 
+/**
+ * Callback invoked when a key is evicted to stay within ekvs_opts.max_memory.
+ *
+ * The key is not NUL-terminated, and neither key nor data may be accessed after the callback returns.
+ */
+typedef void (*ekvs_evict_ptr)(void* ctx, const char* key, size_t key_sz, const void* data, size_t data_sz);
+
+/* Read view iteration callback, see ekvs_view_iterate. Return non-zero to stop. */
+typedef int (*ekvs_view_iter_ptr)(void* ctx, const char* key, size_t key_sz, const void* data, size_t data_sz);
+
+/* Snapshot stream callbacks, see ekvs_snapshot_stream and ekvs_open_stream. Like fwrite and fread, they
+ * return the number of bytes written or read; a short write fails the snapshot, and 0 ends the stream. */
+typedef size_t (*ekvs_write_ptr)(void* ctx, const void* data, size_t size);
+typedef size_t (*ekvs_read_ptr)(void* ctx, void* data, size_t size);
+
+/**
+ * Event types reported to ekvs_opts.trace_callback
+ */
+typedef enum {
+   ekvs_trace_get          = 0,     /**< ekvs_get. probes is the number of entries compared. */
+   ekvs_trace_set          = 1,     /**< ekvs_set and ekvs_set_ex. probes is the chain position of the entry, bytes the binlog bytes written. */
+   ekvs_trace_del          = 2,     /**< ekvs_del. bytes is the binlog bytes written. */
+   ekvs_trace_binlog_write = 3,     /**< Framing and writing a binlog record, nested in the operation which logged it. */
+   ekvs_trace_binlog_flush = 4,     /**< Flushing binlog records to the file. With an asynchronous binlog, a batch written by the writer thread, reported from that thread. */
+   ekvs_trace_grow         = 5,     /**< Growing the table. bytes is the size of the new table. */
+   ekvs_trace_snapshot     = 6,     /**< Writing a snapshot. bytes is the size of the snapshot. */
+   ekvs_trace_evict        = 7,     /**< Evicting or spilling a key. probes is the number of buckets swept, bytes the value log bytes written by a spill. */
+   ekvs_trace_event_types  = 8
+} ekvs_trace_type;
+
+/**
+ * A traced operation or internal event
+ *
+ * Times are in ticks of the trace clock, see ekvs_trace_ticks_per_us. Events which happen
+ * during an operation are reported before it, and lie within its start and duration.
+ */
+typedef struct ekvs_trace_event ekvs_trace_event;
+struct ekvs_trace_event {
+   uint32_t type;                   /**< @see ekvs_trace_type */
+   uint64_t hash;                   /**< Hash of the key, or 0 for events which do not concern one key. */
+   uint64_t start;                  /**< Start time, in ticks. */
+   uint64_t duration;               /**< Duration, in ticks. */
+   uint64_t probes;                 /**< Work done searching, depending on the type. */
+   uint64_t bytes;                  /**< Bytes written, depending on the type. */
+};
+
+/**
+ * Callback receiving trace events. It is called synchronously, so should be cheap.
+ */
+typedef void (*ekvs_trace_ptr)(void* ctx, const ekvs_trace_event* event);
+
 /**
  * Options for operation and initialization of the ekvs database
  */
@@ -40,21 +91,191 @@ struct ekvs_opts {
    ekvs_malloc_ptr user_malloc;     /**< Pointer to a malloc function. Specify NULL to use standard malloc. */
    ekvs_realloc_ptr user_realloc;   /**< Pointer to a realloc function. Specify NULL to use standard realloc. */
    ekvs_free_ptr user_free;         /**< Pointer to a free function. Specify NULL to use standard free. */
+   uint64_t max_memory;             /**< Memory budget, in bytes, for entries and the table. When exceeded, keys are evicted (CLOCK). If 0, there is no budget. */
+   ekvs_evict_ptr evict_callback;   /**< Called for each evicted key. Specify NULL for no notification. */
+   void* evict_ctx;                 /**< User context passed to evict_callback. */
+   uint32_t spill_cold;             /**< If not 0, cold values are moved to the value log to stay within max_memory rather than evicted, leaving only the key and the location of the value in memory. ekvs_get reads them back in. Requires a value log, see vlog_path. */
+   size_t vlog_threshold;           /**< Values of at least this many bytes are stored in the value log, and only referenced by the table. If 0, values are always stored in the table. */
+   const char* vlog_path;           /**< Filename prefix of the value log. If NULL, the database filename with ".vlog" appended is used. Required for in-memory databases which use the value log. */
+   uint32_t compression;            /**< Compression of snapshot blocks and binlog records. @see ekvs_compression */
+   size_t compress_min_size;        /**< Binlog records with less data than this are not compressed. If 0, the value EKVS_COMPRESS_MIN_SIZE will be used. */
+   uint64_t binlog_segment_size;    /**< If not 0, a new database keeps its binlog in files of this many bytes next to it, named with ".log." and a number, which are preallocated and removed once covered by a snapshot. Existing databases keep the layout they were created with. */
+   size_t replica_backlog_size;     /**< If not 0, the most recent records are kept in this many bytes, so followers which reconnect with ekvs_replicate can catch up from their LSN rather than be sent a full copy. @see ekvs_replicate */
+   size_t async_binlog_size;        /**< If not 0, binlog records are queued in a ring buffer of this many bytes, and written and flushed to disk in batches by a background thread. @see ekvs_wait_durable */
+   ekvs_trace_ptr trace_callback;   /**< Called for each traced event. Specify NULL to disable tracing. ekvs_trace_ring_record may be used with a ring as trace_ctx. */
+   void* trace_ctx;                 /**< User context passed to trace_callback. */
+   uint32_t engine;                 /**< Storage engine of a new database. Existing databases keep the engine they were created with. @see ekvs_engine */
+   size_t lsm_memtable_size;        /**< Bytes of records an LSM store keeps in memory before writing them to an SSTable. If 0, the value EKVS_LSM_MEMTABLE_SIZE will be used. */
+   uint32_t max_checkpoints;        /**< Checkpoints kept before ekvs_checkpoint writes a full snapshot instead. If 0, the value EKVS_MAX_CHECKPOINTS will be used. @see ekvs_checkpoint */
+   uint32_t table_pages;            /**< Pages backing tables of 2MB or more. Smaller tables, and tables of stores with user allocators, always come from ekvs_malloc. @see ekvs_pages */
+   uint32_t numa_policy;            /**< NUMA placement of tables of 2MB or more, on Linux. @see ekvs_numa */
+   uint64_t numa_nodes;             /**< Nodes for numa_policy, one bit per node. If 0, every online node is used. */
+};
+
+/**
+ * Storage engines for ekvs_opts.engine
+ */
+typedef enum {
+   ekvs_engine_hash     = 0,        /**< Keep every key in an in-memory table, written to disk by snapshots. */
+   ekvs_engine_lsm      = 1         /**< Keep recent writes in a memtable, and flush them to sorted, immutable
+                                         SSTables which a background thread compacts level by level. Requires a
+                                         database file. Only ekvs_set, ekvs_set_ex, ekvs_get, ekvs_mget, ekvs_del,
+                                         the prepared key functions, ekvs_snapshot without a filename and
+                                         ekvs_compact are supported; other operations fail with EKVS_UNSUPPORTED.
+                                         A value returned by ekvs_get stays valid until the next modification or
+                                         snapshot. */
+} ekvs_engine;
+
+/**
+ * Page sizes for ekvs_opts.table_pages. The table is mapped rather than allocated for all but the default;
+ * each mode falls back to the next smaller one when its pages cannot be had, and ekvs_stats reports the
+ * mode in use.
+ */
+typedef enum {
+   ekvs_pages_default     = 0,      /**< Allocate the table with ekvs_malloc. */
+   ekvs_pages_transparent = 1,      /**< Map the table and advise the kernel to back it with transparent huge pages. */
+   ekvs_pages_2mb         = 2,      /**< Map the table from the pool of 2MB huge pages (vm.nr_hugepages). */
+   ekvs_pages_1gb         = 3       /**< Map tables of 1GB or more from the pool of 1GB huge pages. */
+} ekvs_pages;
+
+/**
+ * NUMA policies for ekvs_opts.numa_policy. The table is mapped to apply them.
+ */
+typedef enum {
+   ekvs_numa_default      = 0,      /**< Place pages on the node of the thread which first touches them. */
+   ekvs_numa_interleave   = 1,      /**< Spread pages round-robin over ekvs_opts.numa_nodes. */
+   ekvs_numa_bind         = 2       /**< Allocate pages only from ekvs_opts.numa_nodes. */
+} ekvs_numa;
+
+/**
+ * Compression modes for ekvs_opts.compression
+ */
+typedef enum {
+   ekvs_compress_none   = 0,        /**< Write snapshots and binlog records uncompressed. */
+   ekvs_compress_lz     = 1         /**< Compress with the bundled LZ codec. */
+} ekvs_compression;
+
+/**
+ * Cache counters reported by ekvs_get_cache_stats
+ */
+typedef struct ekvs_cache_stats ekvs_cache_stats;
+struct ekvs_cache_stats {
+   uint64_t hits;                   /**< Number of ekvs_get calls which found the key. */
+   uint64_t misses;                 /**< Number of ekvs_get calls which did not find the key. */
+   uint64_t evictions;              /**< Number of keys evicted to stay within the memory budget. */
+   uint64_t mem_used;               /**< Bytes currently used by entries (headers, keys and values) and the table. */
+   uint64_t mem_budget;             /**< The memory budget, or 0 if there is none. */
+   uint64_t spills;                 /**< Number of values moved to the value log to stay within the memory budget, see ekvs_opts.spill_cold. */
+   uint64_t faults;                 /**< Number of spilled values read back in by ekvs_get. */
+};
+
+/**
+ * Number of chain lengths counted by ekvs_runtime_stats.chain_lengths
+ */
+#define EKVS_STATS_CHAIN_LENGTHS 8
+
+/**
+ * Table shape, memory and I/O figures reported by ekvs_stats
+ *
+ * Counters are totals since the database was opened. When the library is built with EKVS_NO_STATS,
+ * the binlog, grow and snapshot counters are always 0.
+ */
+typedef struct ekvs_runtime_stats ekvs_runtime_stats;
+struct ekvs_runtime_stats {
+   uint64_t population;             /**< Number of keys. For an LSM store, the number of records, which counts replaced and deleted keys until they are compacted away. */
+   uint64_t table_size;             /**< Number of buckets in the table. */
+   uint64_t chain_lengths[EKVS_STATS_CHAIN_LENGTHS]; /**< Number of buckets holding i keys. The last element counts every longer chain too. */
+   uint64_t max_chain_length;       /**< Length of the longest chain. */
+   uint64_t key_bytes;              /**< Bytes of keys. */
+   uint64_t value_bytes;            /**< Bytes of values held in memory, including the nodes of large lists and sets. */
+   uint64_t overhead_bytes;         /**< Bytes of entry headers, unused capacity and the table. */
+   uint64_t binlog_size;            /**< Bytes of binlog following the last snapshot, in all segments when the binlog is segmented. */
+   uint64_t binlog_bytes;           /**< Bytes appended to the binlog. */
+   uint64_t binlog_records;         /**< Records appended to the binlog. */
+   uint64_t binlog_flushes;         /**< Flushes of the binlog. */
+   uint64_t binlog_write_ns;        /**< Total time spent appending binlog records, in nanoseconds. */
+   uint64_t binlog_write_max_ns;    /**< Longest binlog append, in nanoseconds. */
+   uint64_t grow_count;             /**< Number of times the table was grown. */
+   uint64_t grow_ns;                /**< Total time spent growing the table, in nanoseconds. */
+   uint64_t grow_max_ns;            /**< Longest table grow, in nanoseconds. */
+   uint64_t snapshot_count;         /**< Number of snapshots written. */
+   uint64_t snapshot_ns;            /**< Total time spent writing snapshots, in nanoseconds. */
+   uint64_t snapshot_max_ns;        /**< Longest snapshot, in nanoseconds. */
+   uint64_t replicas;               /**< Number of followers attached with ekvs_replicate. */
+   uint64_t replica_pending_bytes;  /**< Bytes of records queued for followers but not yet sent. */
+   uint64_t read_views;             /**< Number of open read views. */
+   uint64_t read_view_bytes;        /**< Bytes of superseded values kept for read views. */
+   uint64_t lsm_tables;             /**< Number of SSTables of an LSM store. */
+   uint64_t lsm_table_bytes;        /**< Bytes of SSTables of an LSM store. */
+   uint64_t lsm_memtable_bytes;     /**< Bytes of records in the memtable of an LSM store. */
+   uint64_t lsm_flushes;            /**< Number of memtables written to SSTables. */
+   uint64_t lsm_compactions;        /**< Number of compactions installed. */
+   uint64_t lsm_bytes_written;      /**< Bytes of SSTables written by flushes and compactions. */
+   uint64_t checkpoints;            /**< Number of checkpoints written since the last snapshot. */
+   uint64_t dirty_buckets;          /**< Number of buckets changed since the last checkpoint or snapshot. */
+   uint64_t checkpoint_bytes;       /**< Bytes of checkpoint files written. */
+   uint64_t table_pages;            /**< Pages backing the table, after any fallback. @see ekvs_pages */
+   uint64_t table_numa_policy;      /**< NUMA policy applied to the table, or ekvs_numa_default if it could not be. @see ekvs_numa */
+};
+
+/**
+ * Replication state of a follower, reported by ekvs_get_replica_status
+ */
+typedef struct ekvs_replica_status ekvs_replica_status;
+struct ekvs_replica_status {
+   uint64_t run_id;                 /**< Identifies the open of the leader the copy came from, or 0 before the first copy. */
+   uint64_t applied_lsn;            /**< Leader LSN up to which records have been applied, also returned by ekvs_lsn. */
+   uint64_t leader_lsn;             /**< Highest leader LSN received. */
+   uint64_t lag_bytes;              /**< Bytes of records received or announced but not yet applied. */
+   uint64_t lag_ns;                 /**< Time from the leader logging the last applied records to their application, in nanoseconds. */
+   uint64_t records;                /**< Records applied. */
+   uint64_t full_syncs;             /**< Number of full copies received. */
+   int synced;                      /**< 1 once the copy is complete and following the leader, 0 while it is being received. */
 };
 
 typedef struct _ekvs_db* ekvs;
+typedef struct _ekvs_trace_ring* ekvs_trace_ring;
+typedef struct _ekvs_read_view* ekvs_read_view;
+
+typedef struct ekvs_view ekvs_view;
+struct ekvs_view {
+   const void* data;                /**< The value, with the same lifetime as one returned by ekvs_get. NULL if the key was not found. */
+   size_t data_sz;                  /**< Size of the value. */
+   int status;                      /**< EKVS_OK, EKVS_NO_KEY, or another error code for this key. */
+};
+
+typedef struct ekvs_ref ekvs_ref;
+struct ekvs_ref {
+   const void* data;                /**< The value. Valid until ekvs_ref_release, even if the key is set or deleted meanwhile. */
+   size_t data_sz;                  /**< Size of the value. */
+   void* pin;                       /**< Internal, identifies the pinned entry. */
+};
+
+typedef struct ekvs_key ekvs_key;
+struct ekvs_key {
+   const char* key;                 /**< The key. Not copied, it must outlive the handle. */
+   size_t key_sz;                   /**< Size of the key. */
+   uint64_t hash;                   /**< Hash of the key. */
+   ekvs store;                      /**< Internal, the database the hint belongs to. */
+   uint64_t epoch;                  /**< Internal, when the hint was taken. */
+   void* hint;                      /**< Internal, the entry the key was last found in. */
+};
 
 #define EKVS_OK               0x00  /**< Operation successful */
 #define EKVS_FAIL             0x10  /**< Operation failed due to a non-specific error */
 #define EKVS_ALLOCATION_FAIL  0x11  /**< Operation failed due to a memory allocation error */
 #define EKVS_FILE_FAIL        0x12  /**< Operation failed due to a file i/o error */
 #define EKVS_NO_KEY           0x13  /**< Operation failed because the key did not exist */
+#define EKVS_READ_ONLY        0x14  /**< Operation failed because the database was opened with ekvs_open_readonly or ekvs_open_replica */
+#define EKVS_WRONG_TYPE       0x15  /**< Operation failed because the value of the key has the wrong type */
+#define EKVS_UNSUPPORTED      0x16  /**< Operation failed because the database does not support it, see ekvs_open_shared, ekvs_view_open and ekvs_opts.engine */
 
 /**
  * Flags that change the behavior for setting a key using ekvs_set_ex
  */
 typedef enum {
-   ekvs_set_no_grow     = 1 << 0    /**< Do not grow the table if the grow threshold has been exceeded as a result of this set. */
+   ekvs_set_no_grow     = 1 << 0,   /**< Do not grow the table if the grow threshold has been exceeded as a result of this set. */
+   ekvs_set_compress    = 1 << 1    /**< Keep the value compressed in memory until it is next retrieved. Intended for cold data. */
 } ekvs_set_flags;
 
 /**
@@ -68,6 +289,71 @@ typedef enum {
  */
 extern EKVS_API int ekvs_open(ekvs* store, const char* path, const ekvs_opts* opts);
 
+/**
+ * Write an immutable, indexed image of a database for use with ekvs_open_readonly.
+ *
+ * The image holds every key and value, followed by an open-addressed hash index of their offsets.
+ * It is written to a temporary file which is renamed into place once complete. Lists and sets have
+ * no read-only form and are left out of the image.
+ *
+ * @param store[in]     The ekvs database to write.
+ * @param path[in]      The filename of the image.
+ *
+ * @return EKVS_OK if successful, or an error code otherwise.
+ */
+extern EKVS_API int ekvs_build_readonly(ekvs store, const char* path);
+
+/**
+ * Open an image written by ekvs_build_readonly.
+ *
+ * The image is memory-mapped, so opening does not depend on its size, and processes opening the
+ * same image share its pages. ekvs_get returns pointers into the mapping. Operations which modify
+ * the database fail with EKVS_READ_ONLY.
+ *
+ * @param store[out]    The destination ekvs handle.
+ * @param path[in]      The filename of the image.
+ * @param opts[in]      Options; only the allocation functions are used.
+ *
+ * @return EKVS_OK if successful, or an error code otherwise.
+ */
+extern EKVS_API int ekvs_open_readonly(ekvs* store, const char* path, const ekvs_opts* opts);
+
+/**
+ * Open a database in a shared memory segment, which processes on the same host use concurrently.
+ *
+ * The segment is a file of a fixed size (on /dev/shm for one that is not kept on disk) which holds
+ * the table and every entry. The first process to open it with a non-zero size creates it; other
+ * processes attach to it, and their ekvs_get calls read the mapping without locks or copies.
+ * Modifications from any process are serialized by a robust lock, so a process which exits while
+ * modifying the database does not leave it unusable. The segment persists until it is removed.
+ *
+ * Only ekvs_set, ekvs_set_ex, ekvs_get, ekvs_mget and ekvs_del are supported; other
+ * operations fail with EKVS_UNSUPPORTED. A value returned by ekvs_get stays valid until this handle
+ * next modifies the database or calls ekvs_shared_refresh. The memory of replaced values is reused
+ * once every handle has done either, so a handle should call ekvs_shared_refresh regularly. A
+ * handle must not be used by more than one thread at a time, and at most 64 may be open at once.
+ *
+ * @param store[out]    The destination ekvs handle.
+ * @param path[in]      The filename of the segment.
+ * @param size[in]      The size of the segment to create, or 0 to only attach to an existing one.
+ * @param opts[in]      Options; the allocation functions, and initial_table_size and grow_threshold
+ *                      when the segment is created.
+ *
+ * @return EKVS_OK if successful, EKVS_ALLOCATION_FAIL if the segment is too small for the initial
+ *         table, or an error code otherwise. A set fails with EKVS_ALLOCATION_FAIL if the segment
+ *         is full.
+ */
+extern EKVS_API int ekvs_open_shared(ekvs* store, const char* path, uint64_t size, const ekvs_opts* opts);
+
+/**
+ * Declare that values previously returned to a handle of a shared database are no longer used.
+ *
+ * @param store[in]     The ekvs handle, opened with ekvs_open_shared.
+ *
+ * @return EKVS_OK if successful, or an error code otherwise.
+ */
+extern EKVS_API int ekvs_shared_refresh(ekvs store);
+
 /**
  * Close an ekvs database.
  *
@@ -78,6 +364,8 @@ extern EKVS_API void ekvs_close(ekvs store);
 /**
  * Write the state of the table to disk.
  *
+ * Updating the file specified during ekvs_open also folds in and removes any checkpoints.
+ *
  * @param store[in]     The ekvs database to serialize.
  * @param snapshot_to   If a filename is specified, it will write the snapshot to that location.
  *                      If NULL, the file specified during ekvs_open will be updated.
@@ -86,6 +374,50 @@ extern EKVS_API void ekvs_close(ekvs store);
  */
 extern EKVS_API int ekvs_snapshot(ekvs store, const char* snapshot_to);
 
+/**
+ * Write the buckets changed since the last checkpoint or snapshot to a checkpoint file next to the
+ * database, named with ".ckpt." and a number, and drop the binlog it covers.
+ *
+ * ekvs_open loads the snapshot, then each checkpoint in order, then replays the binlog. Once
+ * ekvs_opts.max_checkpoints are kept, or more than half of the buckets changed, a full snapshot is
+ * written instead.
+ *
+ * @param store[in]     The ekvs database to checkpoint, opened with a database file.
+ *
+ * @return EKVS_OK if successful, EKVS_UNSUPPORTED for shared and LSM stores, or an error code otherwise.
+ */
+extern EKVS_API int ekvs_checkpoint(ekvs store);
+
+/**
+ * Write the state of the table to a callback, without a temporary file.
+ *
+ * The stream is written in blocks of up to 64KB, compressed if ekvs_opts.compression is set, with
+ * values held in the value log written in place. The binlog and database file are left alone, so
+ * this works for in-memory stores too.
+ *
+ * @param store[in]     The ekvs database to serialize.
+ * @param write_cb[in]  Called with each chunk of the stream, in order.
+ * @param ctx[in]       User context passed to write_cb.
+ *
+ * @return EKVS_OK if successful, EKVS_FILE_FAIL if write_cb wrote less than it was given,
+ *         EKVS_UNSUPPORTED for shared and LSM stores, or an error code otherwise.
+ */
+extern EKVS_API int ekvs_snapshot_stream(ekvs store, ekvs_write_ptr write_cb, void* ctx);
+
+/**
+ * Open an in-memory ekvs database from a stream written by ekvs_snapshot_stream.
+ *
+ * @param store[out]    The ekvs handle that will be filled out.
+ * @param read_cb[in]   Called for the next bytes of the stream until all of it is read.
+ * @param ctx[in]       User context passed to read_cb.
+ * @param opts[in]      Options, as for an in-memory ekvs_open. The table starts at least as large as
+ *                      the one the stream was written from. Specify NULL for defaults.
+ *
+ * @return EKVS_OK if successful, EKVS_FILE_FAIL if the stream is cut short or corrupt, or an error
+ *         code otherwise.
+ */
+extern EKVS_API int ekvs_open_stream(ekvs* store, ekvs_read_ptr read_cb, void* ctx, const ekvs_opts* opts);
+
 /**
  * The last error code which was generated by an ekvs operation.
  *
@@ -93,6 +425,16 @@ extern EKVS_API int ekvs_snapshot(ekvs store, const char* snapshot_to);
  */
 extern EKVS_API int ekvs_last_error(ekvs store);
 
+/**
+ * The number of bytes of binlog which were discarded when the database was opened.
+ *
+ * Binlog records are checksummed. Replay stops at the first damaged or incomplete record
+ * (for example, one torn by a crash), and the file is truncated there.
+ *
+ * @return Number of bytes discarded, or 0 if the binlog was intact.
+ */
+extern EKVS_API uint64_t ekvs_discarded_bytes(ekvs store);
+
 /**
  * Set a key to a value.
  *
@@ -125,6 +467,66 @@ static EKVS_API int ekvs_set(ekvs store, const char* key, const void* data, size
    return ekvs_set_ex(store, key, data, data_sz, 0);
 }
 
+/**
+ * Append data to the value of a key, creating the key if it does not exist.
+ *
+ * The value is extended in place, with room reserved for further appends, and only the appended
+ * data is written to the binlog.
+ *
+ * @param store[in]     The ekvs database to modify.
+ * @param key[in]       The key whose value should be extended.
+ * @param data[in]      The data to append.
+ * @param data_sz[in]   The size of the data being appended.
+ *
+ * @return EKVS_OK if successful, or an error code otherwise.
+ */
+extern EKVS_API int ekvs_append(ekvs store, const char* key, const void* data, size_t data_sz);
+
+/**
+ * Overwrite part of the value of a key, starting at an offset.
+ *
+ * The value is extended if the range ends past it, and a gap between the old end and the offset is
+ * zero-filled. A key which does not exist is created. Only the range is written to the binlog.
+ *
+ * @param store[in]     The ekvs database to modify.
+ * @param key[in]       The key whose value should be modified.
+ * @param offset[in]    The offset, in bytes, at which to write.
+ * @param data[in]      The data to write.
+ * @param data_sz[in]   The size of the data being written.
+ *
+ * @return EKVS_OK if successful, or an error code otherwise.
+ */
+extern EKVS_API int ekvs_setrange(ekvs store, const char* key, size_t offset, const void* data, size_t data_sz);
+
+/**
+ * Add to the counter stored at a key.
+ *
+ * Counters are stored as a native int64_t, which is also what ekvs_get returns for them. A key
+ * which does not exist starts at 0, and a value holding a decimal number (optionally NUL-terminated)
+ * is converted to a counter. Each call writes a small increment record to the binlog.
+ *
+ * @param store[in]     The ekvs database to modify.
+ * @param key[in]       The key of the counter.
+ * @param delta[in]     The amount to add.
+ * @param result[out]   If not NULL, assigned the new value of the counter.
+ *
+ * @return EKVS_OK if successful, EKVS_WRONG_TYPE if the value is not a number, EKVS_FAIL if the
+ *         counter would overflow, or an error code otherwise.
+ */
+extern EKVS_API int ekvs_incrby(ekvs store, const char* key, int64_t delta, int64_t* result);
+
+/**
+ * Subtract from the counter stored at a key. @see ekvs_incrby
+ *
+ * @param store[in]     The ekvs database to modify.
+ * @param key[in]       The key of the counter.
+ * @param delta[in]     The amount to subtract.
+ * @param result[out]   If not NULL, assigned the new value of the counter.
+ *
+ * @return EKVS_OK if successful, or an error code otherwise.
+ */
+extern EKVS_API int ekvs_decrby(ekvs store, const char* key, int64_t delta, int64_t* result);
+
 /**
  * Retrieve the value associated with a key.
  *
@@ -138,6 +540,154 @@ static EKVS_API int ekvs_set(ekvs store, const char* key, const void* data, size
  */
 extern EKVS_API int ekvs_get(ekvs store, const char* key, const void** data, size_t* data_sz);
 
+/**
+ * Retrieve the values associated with a batch of keys.
+ *
+ * Equivalent to calling ekvs_get for each key, but the lookups are interleaved so that the cache
+ * misses of several keys are outstanding at once. Worthwhile when the table is much larger than
+ * the cache.
+ *
+ * @param store[in]     The ekvs database to query.
+ * @param keys[in]      The keys to retrieve.
+ * @param n[in]         The number of keys.
+ * @param views[out]    An array of n views, assigned the value and status of each key.
+ *
+ * @return EKVS_OK if the batch was processed, or an error code otherwise. Missing keys are reported
+ *         in the status of their view.
+ */
+extern EKVS_API int ekvs_mget(ekvs store, const char** keys, size_t n, ekvs_view* views);
+
+/**
+ * Retrieve the value associated with a key, and pin it until released.
+ *
+ * Unlike ekvs_get, the value stays in place when the key is later set or deleted; writers install
+ * a new version instead, and the pinned one is freed by the last ekvs_ref_release. Pinned keys are
+ * not evicted. All references must be released before the database is closed. LSM and shared
+ * stores have nothing to pin, and fail with EKVS_UNSUPPORTED.
+ *
+ * @param store[in]     The ekvs database to query.
+ * @param key[in]       The key to retrieve.
+ * @param ref[out]      Assigned the location and size of the value.
+ *
+ * @return EKVS_OK if successful, or an error code otherwise.
+ */
+extern EKVS_API int ekvs_get_ref(ekvs store, const char* key, ekvs_ref* ref);
+
+/**
+ * Release a reference obtained with ekvs_get_ref. Releasing a reference twice is harmless.
+ *
+ * @param store[in]     The ekvs database the reference came from.
+ * @param ref[in]       The reference to release.
+ */
+extern EKVS_API void ekvs_ref_release(ekvs store, ekvs_ref* ref);
+
+/**
+ * Prepare a handle for a key which is used often, so later operations skip measuring and hashing it.
+ *
+ * The handle also remembers where the key was last found. While no entry of the database has been
+ * freed or moved since, operations using the handle go straight to it, and a set of a plain value
+ * of the same size overwrites it in place.
+ *
+ * @param store[in]     The ekvs database the handle will be used with.
+ * @param key[in]       The key. It need not be terminated, and is not copied.
+ * @param key_sz[in]    The size of the key.
+ * @param handle[out]   The handle to prepare.
+ *
+ * @return EKVS_OK if successful, or an error code otherwise.
+ */
+extern EKVS_API int ekvs_key_prepare(ekvs store, const char* key, size_t key_sz, ekvs_key* handle);
+
+/**
+ * Retrieve the value associated with a prepared key. @see ekvs_get
+ *
+ * @param store[in]     The ekvs database to query.
+ * @param handle[in]    The prepared key.
+ * @param data[out]     Assigned the location of the value.
+ * @param data_sz[out]  Assigned the size of the value.
+ *
+ * @return EKVS_OK if successful, or an error code otherwise.
+ */
+extern EKVS_API int ekvs_get_h(ekvs store, ekvs_key* handle, const void** data, size_t* data_sz);
+
+/**
+ * Assign a value to a prepared key. @see ekvs_set_ex
+ *
+ * @param store[in]     The ekvs database to modify.
+ * @param handle[in]    The prepared key.
+ * @param data[in]      The value.
+ * @param data_sz[in]   The size of the value.
+ * @param flags[in]     Flags to use while assigning the value. @see ekvs_set_flags
+ *
+ * @return EKVS_OK if successful, or an error code otherwise.
+ */
+extern EKVS_API int ekvs_set_h(ekvs store, ekvs_key* handle, const void* data, size_t data_sz, uint32_t flags);
+
+/**
+ * Delete a prepared key. @see ekvs_del
+ *
+ * @param store[in]     The ekvs database to modify.
+ * @param handle[in]    The prepared key.
+ *
+ * @return EKVS_OK if successful, or an error code otherwise.
+ */
+extern EKVS_API int ekvs_del_h(ekvs store, ekvs_key* handle);
+
+/**
+ * Open a read view, which sees the database as it is now while it continues to be modified.
+ *
+ * Values are not copied when the view is opened. Instead, the first time a key is changed after
+ * the view was opened, the value the view sees is copied and kept until the view is closed, so a
+ * view costs memory in proportion to the keys changed while it is open. Views of images and shared
+ * stores are not supported, and fail with EKVS_UNSUPPORTED.
+ *
+ * @param store[in]     The ekvs database to view.
+ * @param view[out]     The destination view handle.
+ *
+ * @return EKVS_OK if successful, or an error code otherwise.
+ */
+extern EKVS_API int ekvs_view_open(ekvs store, ekvs_read_view* view);
+
+/**
+ * Retrieve the value a key had when a read view was opened.
+ *
+ * Values the view kept are valid until it is closed; values which have not changed since are
+ * read from the database, and have the same lifetime as one returned by ekvs_get.
+ *
+ * @param view[in]      The read view to query.
+ * @param key[in]       The key to retrieve.
+ * @param data[out]     Assigned the location of the value.
+ * @param data_sz[out]  Assigned the size of the value.
+ *
+ * @return EKVS_OK if successful, EKVS_NO_KEY if the key did not exist when the view was opened,
+ *         EKVS_WRONG_TYPE if it held a list or set, EKVS_ALLOCATION_FAIL if a value the view needed could not be kept, or an error code
+ *         otherwise.
+ */
+extern EKVS_API int ekvs_view_get(ekvs_read_view view, const char* key, const void** data, size_t* data_sz);
+
+/**
+ * Call a function for every key and value in the database as it was when a read view was opened.
+ *
+ * Keys are visited in no particular order. Lists and sets are passed in their serialized form. The
+ * callback must not modify the database; values are only valid until it returns.
+ *
+ * @param view[in]      The read view to iterate.
+ * @param callback[in]  Called for each key. Return non-zero to stop the iteration.
+ * @param ctx[in]       User context passed to callback.
+ *
+ * @return EKVS_OK if successful, EKVS_ALLOCATION_FAIL if a value the view needed could not be kept,
+ *         or an error code otherwise.
+ */
+extern EKVS_API int ekvs_view_iterate(ekvs_read_view view, ekvs_view_iter_ptr callback, void* ctx);
+
+/**
+ * Close a read view, and free the values kept for it which no other view needs.
+ *
+ * Views must be closed before their database; ekvs_close frees views which are still open.
+ *
+ * @param view[in]      The read view to close.
+ */
+extern EKVS_API void ekvs_view_close(ekvs_read_view view);
+
 /**
  * Delete a key, and free the memory used for storage of the data it references.
  *
@@ -148,9 +698,365 @@ extern EKVS_API int ekvs_get(ekvs store, const char* key, const void** data, siz
  */
 extern EKVS_API int ekvs_del(ekvs store, const char* key);
 
-/* TODO: lists/sets ala redis? */
+/**
+ * Retrieve the log sequence number of the last modification. LSNs count the bytes logged since the
+ * database was opened, and increase with every modification of a file-backed database, or of an
+ * in-memory database with followers. A follower returns the LSN of its leader it has applied up to.
+ *
+ * @param store[in]     The ekvs database to query.
+ *
+ * @return The LSN of the last modification, or 0 if there has been none.
+ */
+extern EKVS_API uint64_t ekvs_lsn(ekvs store);
+
+/**
+ * Retrieve the log sequence number up to which modifications are known to be on disk.
+ *
+ * @param store[in]     The ekvs database to query.
+ *
+ * @return The durable LSN.
+ */
+extern EKVS_API uint64_t ekvs_durable_lsn(ekvs store);
+
+/**
+ * Wait until the modifications up to an LSN are on disk.
+ *
+ * With an asynchronous binlog this waits for the writer thread. Otherwise the binlog is flushed to disk
+ * by the caller, if it has not been already.
+ *
+ * @param store[in]     The ekvs database.
+ * @param lsn[in]       The LSN to wait for, usually from ekvs_lsn.
+ *
+ * @return EKVS_OK if successful, or an error code otherwise.
+ */
+extern EKVS_API int ekvs_wait_durable(ekvs store, uint64_t lsn);
+
+/**
+ * Stream the records of a database to a follower.
+ *
+ * The follower is first brought up to date: if this database still holds the records logged since
+ * from_lsn in its backlog, they are sent; otherwise the follower is sent a full copy of the table.
+ * Every record logged afterwards is then sent as it is logged. Sends never block: records which the
+ * descriptor does not accept immediately are queued, and sent by later modifications or by
+ * ekvs_replicate_flush. Followers which fall too far behind, or whose descriptor fails, are detached.
+ *
+ * Records are sent once written, so with an asynchronous binlog a follower may be ahead of the disk.
+ * An in-memory database logs to its followers only. Writes to a closed pipe raise SIGPIPE, which
+ * sockets do not.
+ *
+ * @param store[in]     The ekvs database to stream.
+ * @param fd[in]        The descriptor to write to, usually a socket or pipe. It is made non-blocking,
+ *                      and is not closed by ekvs.
+ * @param run_id[in]    The run_id of the follower's ekvs_replica_status, or 0 for a new follower.
+ * @param from_lsn[in]  The applied_lsn of the follower's ekvs_replica_status, or 0 for a new follower.
+ *
+ * @return EKVS_OK if successful, or an error code otherwise.
+ */
+extern EKVS_API int ekvs_replicate(ekvs store, int fd, uint64_t run_id, uint64_t from_lsn);
+
+/**
+ * Send the records queued for followers, as far as their descriptors accept them without blocking.
+ *
+ * @param store[in]     The ekvs database being streamed.
+ *
+ * @return EKVS_OK if successful, or EKVS_FILE_FAIL if a follower was detached because its descriptor failed.
+ */
+extern EKVS_API int ekvs_replicate_flush(ekvs store);
+
+/**
+ * Stop streaming to a follower.
+ *
+ * @param store[in]     The ekvs database being streamed.
+ * @param fd[in]        The descriptor passed to ekvs_replicate.
+ *
+ * @return EKVS_OK if successful, or EKVS_NO_KEY if no follower is attached with that descriptor.
+ */
+extern EKVS_API int ekvs_replicate_stop(ekvs store, int fd);
+
+/**
+ * Open an in-memory follower of a database streamed with ekvs_replicate.
+ *
+ * Records are applied by ekvs_replica_poll, and may be read with ekvs_get and the other read
+ * operations meanwhile. Operations which modify the database fail with EKVS_READ_ONLY.
+ *
+ * @param store[out]    The destination ekvs handle.
+ * @param fd[in]        The descriptor to read the stream from. It is made non-blocking, and is not closed by ekvs.
+ * @param opts[in]      Creation options, as for ekvs_open.
+ *
+ * @return EKVS_OK if successful, or an error code otherwise.
+ */
+extern EKVS_API int ekvs_open_replica(ekvs* store, int fd, const ekvs_opts* opts);
+
+/**
+ * Switch a follower to a new stream, for example after its leader has restarted.
+ *
+ * The copy is kept, so the leader can resume from its run_id and applied_lsn.
+ *
+ * @param store[in]     The follower.
+ * @param fd[in]        The descriptor to read the stream from.
+ *
+ * @return EKVS_OK if successful, or an error code otherwise.
+ */
+extern EKVS_API int ekvs_replica_attach(ekvs store, int fd);
+
+/**
+ * Apply the records which have arrived on a follower's stream.
+ *
+ * @param store[in]      The follower.
+ * @param timeout_ms[in] Time to wait for the stream to become readable, in milliseconds. 0 does not
+ *                       wait, and a negative value waits indefinitely.
+ *
+ * @return EKVS_OK if successful, EKVS_FILE_FAIL if the stream has ended or is damaged, after which
+ *         the follower must be reattached, or an error code otherwise.
+ */
+extern EKVS_API int ekvs_replica_poll(ekvs store, int timeout_ms);
+
+/**
+ * Retrieve the replication state and lag of a follower.
+ *
+ * @param store[in]     The follower.
+ * @param status[out]   The destination for the state.
+ *
+ * @return EKVS_OK if successful, or an error code otherwise.
+ */
+extern EKVS_API int ekvs_get_replica_status(ekvs store, ekvs_replica_status* status);
+
+/**
+ * Retrieve the cache counters and memory accounting of a database.
+ *
+ * @param store[in]     The ekvs database to query.
+ * @param stats[out]    The destination for the counters.
+ *
+ * @return EKVS_OK if successful, or an error code otherwise.
+ */
+extern EKVS_API int ekvs_get_cache_stats(ekvs store, ekvs_cache_stats* stats);
+
+/**
+ * Retrieve the table shape, memory use and I/O counters of a database.
+ *
+ * The chain lengths and byte counts are gathered by walking the table, so this takes time proportional
+ * to the size of the database.
+ *
+ * @param store[in]     The ekvs database to query.
+ * @param stats[out]    The destination for the figures.
+ *
+ * @return EKVS_OK if successful, or an error code otherwise.
+ */
+extern EKVS_API int ekvs_stats(ekvs store, ekvs_runtime_stats* stats);
+
+/**
+ * Garbage-collect the value log.
+ *
+ * Copies the values still referenced by the table into a new value log generation, and
+ * snapshots the database so that it references the new generation before the old one is removed.
+ * Like any other modification, this invalidates pointers previously returned by ekvs_get for
+ * values in the value log. Use ekvs_get_ref to keep such a value valid across a collection.
+ *
+ * @param store[in]     The ekvs database whose value log should be collected.
+ *
+ * @return EKVS_OK if successful, or an error code otherwise.
+ */
+extern EKVS_API int ekvs_vlog_gc(ekvs store);
+
+/**
+ * Flush the memtable of an LSM store, and merge its SSTables into one, dropping replaced and deleted keys.
+ *
+ * Compactions otherwise run in the background as the store is written to, merging each level into the
+ * next once it outgrows its capacity.
+ *
+ * @param store[in]     The ekvs database to compact, opened with ekvs_opts.engine set to ekvs_engine_lsm.
+ *
+ * @return EKVS_OK if successful, EKVS_UNSUPPORTED for other databases, or an error code otherwise.
+ */
+extern EKVS_API int ekvs_compact(ekvs store);
+
+/**
+ * Push an element onto the head of a list, creating the list if the key does not exist.
+ *
+ * Lists and sets are stored compactly while small, and move to a quicklist or hash set as they
+ * grow. Each change writes only the element to the binlog. A list or set is deleted when its last
+ * element is removed. ekvs_get fails with EKVS_WRONG_TYPE on them.
+ *
+ * @param store[in]     The ekvs database to modify.
+ * @param key[in]       The key of the list.
+ * @param elem[in]      The element to push.
+ * @param elem_sz[in]   The size of the element.
+ *
+ * @return EKVS_OK if successful, EKVS_WRONG_TYPE if the key holds something other than a list,
+ *         or an error code otherwise.
+ */
+extern EKVS_API int ekvs_lpush(ekvs store, const char* key, const void* elem, size_t elem_sz);
+
+/**
+ * Push an element onto the tail of a list. @see ekvs_lpush
+ *
+ * @param store[in]     The ekvs database to modify.
+ * @param key[in]       The key of the list.
+ * @param elem[in]      The element to push.
+ * @param elem_sz[in]   The size of the element.
+ *
+ * @return EKVS_OK if successful, or an error code otherwise.
+ */
+extern EKVS_API int ekvs_rpush(ekvs store, const char* key, const void* elem, size_t elem_sz);
+
+/**
+ * Remove the element at the head of a list.
+ *
+ * @param store[in]     The ekvs database to modify.
+ * @param key[in]       The key of the list.
+ * @param elem[out]     Assigned the location of the removed element, which is valid until the next
+ *                      call on the database.
+ * @param elem_sz[out]  Assigned the size of the removed element.
+ *
+ * @return EKVS_OK if successful, EKVS_NO_KEY if the list does not exist, or an error code otherwise.
+ */
+extern EKVS_API int ekvs_lpop(ekvs store, const char* key, const void** elem, size_t* elem_sz);
+
+/**
+ * Remove the element at the tail of a list. @see ekvs_lpop
+ *
+ * @param store[in]     The ekvs database to modify.
+ * @param key[in]       The key of the list.
+ * @param elem[out]     Assigned the location of the removed element.
+ * @param elem_sz[out]  Assigned the size of the removed element.
+ *
+ * @return EKVS_OK if successful, EKVS_NO_KEY if the list does not exist, or an error code otherwise.
+ */
+extern EKVS_API int ekvs_rpop(ekvs store, const char* key, const void** elem, size_t* elem_sz);
+
+/**
+ * Retrieve a range of elements of a list.
+ *
+ * Indices start at 0, and negative indices count back from the tail (-1 is the last element). Both
+ * ends are inclusive, and are clamped to the list. Views point into the database, and are valid
+ * until it is next modified.
+ *
+ * @param store[in]     The ekvs database to query.
+ * @param key[in]       The key of the list.
+ * @param start[in]     Index of the first element.
+ * @param stop[in]      Index of the last element.
+ * @param views[out]    Assigned the elements in the range, up to max_views of them.
+ * @param max_views[in] The number of views available.
+ * @param count[out]    Assigned the number of elements in the range, which may exceed max_views.
+ *
+ * @return EKVS_OK if successful, or an error code otherwise. A missing list is empty.
+ */
+extern EKVS_API int ekvs_lrange(ekvs store, const char* key, int64_t start, int64_t stop, ekvs_view* views,
+   size_t max_views, size_t* count);
+
+/**
+ * Retrieve the length of a list. A missing list has length 0.
+ *
+ * @param store[in]     The ekvs database to query.
+ * @param key[in]       The key of the list.
+ * @param len[out]      Assigned the number of elements.
+ *
+ * @return EKVS_OK if successful, or an error code otherwise.
+ */
+extern EKVS_API int ekvs_llen(ekvs store, const char* key, uint64_t* len);
+
+/**
+ * Add an element to a set, creating the set if the key does not exist.
+ *
+ * Sets of canonical decimal integers are stored as sorted native integers while small. @see ekvs_lpush
+ *
+ * @param store[in]     The ekvs database to modify.
+ * @param key[in]       The key of the set.
+ * @param elem[in]      The element to add.
+ * @param elem_sz[in]   The size of the element.
+ * @param added[out]    If not NULL, assigned 1 if the element was added, or 0 if it was already a member.
+ *
+ * @return EKVS_OK if successful, EKVS_WRONG_TYPE if the key holds something other than a set,
+ *         or an error code otherwise.
+ */
+extern EKVS_API int ekvs_sadd(ekvs store, const char* key, const void* elem, size_t elem_sz, int* added);
+
+/**
+ * Remove an element from a set.
+ *
+ * @param store[in]     The ekvs database to modify.
+ * @param key[in]       The key of the set.
+ * @param elem[in]      The element to remove.
+ * @param elem_sz[in]   The size of the element.
+ *
+ * @return EKVS_OK if successful, EKVS_NO_KEY if the set or element does not exist, or an error code otherwise.
+ */
+extern EKVS_API int ekvs_srem(ekvs store, const char* key, const void* elem, size_t elem_sz);
+
+/**
+ * Test whether an element is a member of a set.
+ *
+ * @param store[in]     The ekvs database to query.
+ * @param key[in]       The key of the set.
+ * @param elem[in]      The element to look for.
+ * @param elem_sz[in]   The size of the element.
+ * @param is_member[out] Assigned 1 if the element is a member, or 0 otherwise.
+ *
+ * @return EKVS_OK if successful, or an error code otherwise.
+ */
+extern EKVS_API int ekvs_sismember(ekvs store, const char* key, const void* elem, size_t elem_sz, int* is_member);
+
+/**
+ * Retrieve the number of elements in a set. A missing set has 0.
+ *
+ * @param store[in]     The ekvs database to query.
+ * @param key[in]       The key of the set.
+ * @param card[out]     Assigned the number of elements.
+ *
+ * @return EKVS_OK if successful, or an error code otherwise.
+ */
+extern EKVS_API int ekvs_scard(ekvs store, const char* key, uint64_t* card);
+
+/**
+ * Number of trace clock ticks per microsecond, measured on first use.
+ *
+ * The trace clock is the time stamp counter on x86 with GCC compatible compilers, and the monotonic
+ * clock in nanoseconds elsewhere.
+ */
+extern EKVS_API double ekvs_trace_ticks_per_us(void);
+
+/**
+ * Create a ring buffer which keeps the most recent trace events.
+ *
+ * Events are recorded without locks, so one ring may collect from stores used on several threads,
+ * and be dumped while they run. Events overwritten during a dump are skipped.
+ *
+ * @param ring[out]     The new ring.
+ * @param capacity[in]  Number of events kept, rounded up to a power of two.
+ *
+ * @return EKVS_OK if successful, or an error code otherwise.
+ */
+extern EKVS_API int ekvs_trace_ring_create(ekvs_trace_ring* ring, size_t capacity);
+
+/**
+ * Destroy a trace ring. No store may still be recording to it.
+ *
+ * @param ring[in]      The ring to destroy.
+ */
+extern EKVS_API void ekvs_trace_ring_destroy(ekvs_trace_ring ring);
+
+/**
+ * Record an event in a trace ring. Its signature matches ekvs_trace_ptr, with the ring as the context.
+ *
+ * @param ring[in]      The ekvs_trace_ring to record into.
+ * @param event[in]     The event.
+ */
+extern EKVS_API void ekvs_trace_ring_record(void* ring, const ekvs_trace_event* event);
+
+/**
+ * Write the events held by a trace ring as Chrome trace JSON, for chrome://tracing or Perfetto.
+ *
+ * @param ring[in]      The ring to dump.
+ * @param path[in]      The file to write.
+ *
+ * @return EKVS_OK if successful, or an error code otherwise.
+ */
+extern EKVS_API int ekvs_trace_ring_dump(ekvs_trace_ring ring, const char* path);
 
 #define EKVS_INITIAL_TABLE_SIZE 128
 #define EKVS_GROW_THRESHOLD 0.75f
+#define EKVS_COMPRESS_MIN_SIZE 256
+#define EKVS_LSM_MEMTABLE_SIZE (4 * 1024 * 1024)
+#define EKVS_MAX_CHECKPOINTS 16
 
 #endif
@@ -18,23 +18,254 @@
 
 #include "ekvs_internal.h"
 
+#include <unistd.h>
+
 ekvs_malloc_ptr ekvs_malloc = malloc;
 ekvs_realloc_ptr ekvs_realloc = realloc;
 ekvs_free_ptr ekvs_free = free;
 
-int ekvs_open(ekvs* store, const char* path, const ekvs_opts* opts)
+/* Link an entry loaded from a snapshot to the end of its chain */
+static void _ekvs_link_loaded(ekvs db, struct _ekvs_db_entry* new_entry)
 {
-   ekvs db;
-   FILE* dbfile = NULL;
-   int file_created = 0;
-   /* Check for NULL store */
-   if(store == NULL)
+   struct _ekvs_db_entry* cur_entry;
+   uint64_t hash;
+   uint32_t pc = 0, pb = 0;
+
+   hashlittle2(new_entry->key_data, new_entry->key_sz, &pc, &pb);
+   hash = pc + (((uint64_t)pb) << 32);
+   new_entry->chain = NULL;
+   cur_entry = db->table[hash % db->serialized.table_sz];
+   if(cur_entry == NULL)
    {
-      fprintf(stderr, "ekvs: NULL store parameter passed to ekvs_open.\n");
-      return EKVS_FAIL;
+      db->table[hash % db->serialized.table_sz] = new_entry;
+   }
+   else
+   {
+      while(cur_entry->chain != NULL)
+      {
+         cur_entry = cur_entry->chain;
+      }
+      cur_entry->chain = new_entry;
    }
+   db->table_population++;
+   db->mem_used += EKVS_ENTRY_SIZE(new_entry->key_sz, new_entry->data_sz);
+}
 
-   /* Check for user-specified allocators */
+/* The checksum covers the block header and the stored bytes */
+static uint32_t _ekvs_block_checksum(const struct _ekvs_block_header* header, const void* stored)
+{
+   uint32_t crc = _ekvs_crc32c(0, header, offsetof(struct _ekvs_block_header, checksum));
+   return _ekvs_crc32c(crc, stored, (size_t)header->stored_sz);
+}
+
+/* Load the serialized entries of one snapshot block */
+static int _ekvs_load_block(ekvs db, const char* block, size_t block_sz)
+{
+   struct _ekvs_db_entry entry;
+   struct _ekvs_db_entry* new_entry;
+   const size_t header_sz = sizeof(entry.flags) + sizeof(entry.key_sz) + sizeof(entry.data_sz);
+   size_t pos = 0;
+
+   entry.refs = 0;
+   while(pos < block_sz)
+   {
+      if(block_sz - pos < header_sz) return EKVS_FILE_FAIL;
+      memcpy(&entry.flags, block + pos, sizeof(entry.flags));
+      memcpy(&entry.key_sz, block + pos + sizeof(entry.flags), sizeof(entry.key_sz));
+      memcpy(&entry.data_sz, block + pos + sizeof(entry.flags) + sizeof(entry.key_sz), sizeof(entry.data_sz));
+      pos += header_sz;
+      if(entry.key_sz > block_sz - pos || entry.data_sz > block_sz - pos - entry.key_sz) return EKVS_FILE_FAIL;
+
+      /* Allocate enough space for the entry. */
+      new_entry = ekvs_malloc(EKVS_ENTRY_SIZE(entry.key_sz, entry.data_sz));
+      if(new_entry == NULL) return EKVS_ALLOCATION_FAIL;
+      memcpy(new_entry, &entry, sizeof(struct _ekvs_db_entry) - 1);
+      memcpy(new_entry->key_data, block + pos, entry.key_sz + entry.data_sz);
+      pos += entry.key_sz + entry.data_sz;
+
+      _ekvs_link_loaded(db, new_entry);
+   }
+
+   return EKVS_OK;
+}
+
+/* Snapshot blocks are read from a file, or from the callback passed to ekvs_open_stream */
+struct _ekvs_block_reader {
+   FILE* file;
+   ekvs_read_ptr read_cb;
+   void* ctx;
+   uint64_t remaining;        /* Bytes which may still be read */
+};
+
+static int _ekvs_block_in(struct _ekvs_block_reader* reader, void* data, size_t size)
+{
+   size_t got = 0;
+
+   if(size > reader->remaining) return EKVS_FILE_FAIL;
+   if(reader->file != NULL)
+   {
+      got = fread(data, 1, size, reader->file);
+   }
+   else
+   {
+      while(got < size)
+      {
+         size_t n = reader->read_cb(reader->ctx, (char*)data + got, size - got);
+         if(n == 0 || n > size - got) break;
+         got += n;
+      }
+   }
+   reader->remaining -= got;
+   return (got == size ? EKVS_OK : EKVS_FILE_FAIL);
+}
+
+/* Load snapshot blocks until the reader has nothing left, or up to an empty block */
+static int _ekvs_load_blocks(ekvs db, struct _ekvs_block_reader* reader)
+{
+   struct _ekvs_block_header block;
+   char* stored = NULL;
+   char* raw = NULL;
+   size_t raw_cap = 0;
+   int load_error = EKVS_OK;
+
+   /* Read the snapshot, one block at a time */
+   while(reader->remaining > 0 && load_error == EKVS_OK)
+   {
+      load_error = EKVS_FILE_FAIL;
+      if(_ekvs_block_in(reader, &block, sizeof(block)) != EKVS_OK) break;
+
+      /* Never trust a length before the checksum has been verified */
+      if(block.stored_sz > reader->remaining) break;
+      stored = ekvs_realloc(stored, (size_t)(block.stored_sz != 0 ? block.stored_sz : 1));
+      if(stored == NULL) break;
+      if(_ekvs_block_in(reader, stored, (size_t)block.stored_sz) != EKVS_OK) break;
+      if(_ekvs_block_checksum(&block, stored) != block.checksum) break;
+      if(block.raw_sz == 0)
+      {
+         load_error = EKVS_OK;
+         break;
+      }
+
+      if(block.flags & EKVS_BLOCK_COMPRESSED)
+      {
+         if(raw_cap < block.raw_sz)
+         {
+            raw = ekvs_realloc(raw, (size_t)block.raw_sz);
+            if(raw == NULL) break;
+            raw_cap = (size_t)block.raw_sz;
+         }
+         if(_ekvs_lz_decompress(stored, (size_t)block.stored_sz, raw, (size_t)block.raw_sz) != block.raw_sz) break;
+         load_error = _ekvs_load_block(db, raw, (size_t)block.raw_sz);
+      }
+      else
+      {
+         load_error = _ekvs_load_block(db, stored, (size_t)block.stored_sz);
+      }
+   }
+   ekvs_free(stored);
+   ekvs_free(raw);
+
+   return load_error;
+}
+
+static char* _ekvs_checkpoint_fname(const char* db_fname, uint64_t sequence, const char* suffix)
+{
+   char* fname = ekvs_malloc(strlen(db_fname) + strlen(suffix) + 28);
+   if(fname != NULL) sprintf(fname, "%s.ckpt.%lu%s", db_fname, (unsigned long)sequence, suffix);
+   return fname;
+}
+
+/* Replace the buckets a checkpoint lists with the entries it holds */
+static int _ekvs_load_checkpoint(ekvs db, uint64_t sequence)
+{
+   struct _ekvs_checkpoint_header header;
+   struct _ekvs_block_reader reader;
+   struct _ekvs_db_entry* entry;
+   struct _ekvs_db_entry* prev_entry;
+   uint64_t* buckets = NULL;
+   uint64_t* listed = NULL;
+   char* fname = _ekvs_checkpoint_fname(db->db_fname, sequence, "");
+   FILE* file = NULL;
+   uint64_t i;
+   int ret = EKVS_FILE_FAIL;
+
+   if(fname == NULL) return EKVS_ALLOCATION_FAIL;
+   file = fopen(fname, "rb");
+   if(file == NULL || fread(&header, sizeof(header), 1, file) != 1) goto ekvs_load_checkpoint_done;
+   if(header.magic != EKVS_CHECKPOINT_MAGIC || header.version != EKVS_FORMAT_VERSION ||
+      header.sequence != sequence || header.table_sz == 0 || header.bucket_count > header.table_sz)
+   {
+      goto ekvs_load_checkpoint_done;
+   }
+
+   ret = EKVS_ALLOCATION_FAIL;
+   buckets = ekvs_malloc((size_t)(header.bucket_count != 0 ? header.bucket_count : 1) * sizeof(uint64_t));
+   if(buckets == NULL) goto ekvs_load_checkpoint_done;
+   ret = EKVS_FILE_FAIL;
+   if(fread(buckets, sizeof(uint64_t), (size_t)header.bucket_count, file) != header.bucket_count) goto ekvs_load_checkpoint_done;
+   if(_ekvs_crc32c(_ekvs_crc32c(0, buckets, (size_t)header.bucket_count * sizeof(uint64_t)), &header,
+      offsetof(struct _ekvs_checkpoint_header, checksum)) != header.checksum)
+   {
+      goto ekvs_load_checkpoint_done;
+   }
+   for(i = 0; i < header.bucket_count; i++)
+   {
+      if(buckets[i] >= header.table_sz) goto ekvs_load_checkpoint_done;
+   }
+
+   if(header.table_sz == db->serialized.table_sz)
+   {
+      for(i = 0; i < header.bucket_count; i++)
+      {
+         while(db->table[buckets[i]] != NULL) _ekvs_remove(db, buckets[i], db->table[buckets[i]], NULL);
+      }
+   }
+   else
+   {
+      /* The table grew after the checkpoint was written, so its keys are spread over other buckets */
+      ret = EKVS_ALLOCATION_FAIL;
+      listed = ekvs_malloc((size_t)EKVS_DIRTY_WORDS(header.table_sz) * sizeof(uint64_t));
+      if(listed == NULL) goto ekvs_load_checkpoint_done;
+      memset(listed, 0, (size_t)EKVS_DIRTY_WORDS(header.table_sz) * sizeof(uint64_t));
+      for(i = 0; i < header.bucket_count; i++) listed[buckets[i] / 64] |= (uint64_t)1 << (buckets[i] % 64);
+      for(i = 0; i < db->serialized.table_sz; i++)
+      {
+         prev_entry = NULL;
+         entry = db->table[i];
+         while(entry != NULL)
+         {
+            uint64_t bucket = _ekvs_hash(entry->key_data, entry->key_sz) % header.table_sz;
+            if(listed[bucket / 64] & ((uint64_t)1 << (bucket % 64)))
+            {
+               _ekvs_remove(db, i, entry, prev_entry);
+               entry = (prev_entry != NULL ? prev_entry->chain : db->table[i]);
+            }
+            else
+            {
+               prev_entry = entry;
+               entry = entry->chain;
+            }
+         }
+      }
+   }
+
+   memset(&reader, 0, sizeof(reader));
+   reader.file = file;
+   reader.remaining = header.blocks_sz;
+   ret = _ekvs_load_blocks(db, &reader);
+   if(ret == EKVS_OK && reader.remaining != 0) ret = EKVS_FILE_FAIL;
+
+ekvs_load_checkpoint_done:
+   if(ret != EKVS_OK) fprintf(stderr, "ekvs: failed to load checkpoint %s.\n", fname);
+   if(file != NULL) fclose(file);
+   ekvs_free(listed);
+   ekvs_free(buckets);
+   ekvs_free(fname);
+   return ret;
+}
+
+int _ekvs_use_allocators(const ekvs_opts* opts)
+{
    if(opts != NULL && (opts->user_malloc != NULL || opts->user_realloc != NULL || opts->user_free != NULL))
    {
       if(opts->user_malloc == NULL || opts->user_realloc == NULL || opts->user_free == NULL)
@@ -52,11 +283,63 @@ int ekvs_open(ekvs* store, const char* path, const ekvs_opts* opts)
       ekvs_realloc = realloc;
       ekvs_free = free;
    }
+   return EKVS_OK;
+}
+
+int ekvs_open(ekvs* store, const char* path, const ekvs_opts* opts)
+{
+   ekvs db;
+   FILE* dbfile = NULL;
+   int file_created = 0;
+   /* Check for NULL store */
+   if(store == NULL)
+   {
+      fprintf(stderr, "ekvs: NULL store parameter passed to ekvs_open.\n");
+      return EKVS_FAIL;
+   }
+
+   /* Spilled values need somewhere to go */
+   if(opts != NULL && opts->spill_cold != 0 && opts->vlog_path == NULL && path == NULL)
+   {
+      fprintf(stderr, "ekvs: spill_cold requires a value log, specify vlog_path for in-memory databases.\n");
+      return EKVS_FAIL;
+   }
+
+   /* SSTables live next to the database file */
+   if(opts != NULL && opts->engine == ekvs_engine_lsm && path == NULL)
+   {
+      fprintf(stderr, "ekvs: the LSM engine requires a database file.\n");
+      return EKVS_FAIL;
+   }
+
+   /* Check for user-specified allocators */
+   if(_ekvs_use_allocators(opts) != EKVS_OK) return EKVS_FAIL;
 
    /* Allocate structure */
    *store = ekvs_malloc(sizeof(struct _ekvs_db));
    if(*store == NULL) return EKVS_ALLOCATION_FAIL;
    db = *store;
+   db->ro_map = NULL;
+   db->ro_map_sz = 0;
+   db->shm_map = NULL;
+   db->shm_map_sz = 0;
+   db->lsm = NULL;
+   db->dirty = NULL;
+   db->dirty_count = 0;
+   db->max_checkpoints = (opts == NULL || opts->max_checkpoints == 0 ? EKVS_MAX_CHECKPOINTS : opts->max_checkpoints);
+   db->table_pages = (opts != NULL ? opts->table_pages : ekvs_pages_default);
+   db->numa_policy = (opts != NULL ? opts->numa_policy : ekvs_numa_default);
+   db->numa_nodes = (opts != NULL ? opts->numa_nodes : 0);
+   db->table_map_sz = 0;
+   db->retired = NULL;
+   db->views = NULL;
+   db->entry_epoch = 0;
+   db->view_count = 0;
+   db->versions = NULL;
+   db->versions_sz = 0;
+   db->version_count = 0;
+   db->version_bytes = 0;
+   db->version = 0;
 
    /* If a cache file is specified, open it */
    db->db_fname = NULL;
@@ -94,14 +377,92 @@ int ekvs_open(ekvs* store, const char* path, const ekvs_opts* opts)
       db->grow_threshold = opts->grow_threshold;
    }
 
+   /* Memory budget and eviction */
+   memset(&db->cache_stats, 0, sizeof(db->cache_stats));
+   memset(&db->stats, 0, sizeof(db->stats));
+   db->clock_hand = 0;
+   db->evict_stalled = 0;
+   db->evict_stalled_victim = 0;
+   if(opts != NULL)
+   {
+      db->mem_budget = opts->max_memory;
+      db->evict_callback = opts->evict_callback;
+      db->evict_ctx = opts->evict_ctx;
+      db->spill_cold = (opts->spill_cold != 0);
+   }
+   else
+   {
+      db->mem_budget = 0;
+      db->evict_callback = NULL;
+      db->evict_ctx = NULL;
+      db->spill_cold = 0;
+   }
+
+   /* Compression */
+   db->compression = (opts != NULL ? opts->compression : ekvs_compress_none);
+   db->compress_min_size = (opts == NULL || opts->compress_min_size == 0 ? EKVS_COMPRESS_MIN_SIZE : opts->compress_min_size);
+   db->scratch = NULL;
+   db->scratch_sz = 0;
+   db->replaying = 0;
+   db->discarded_bytes = 0;
+
+   db->lsn = 0;
+   db->durable_lsn = 0;
+   db->writer = NULL;
+   db->segment_file = NULL;
+   db->segment = 0;
+   db->segment_end = 0;
+   db->segment_logged = 0;
+   db->leader = NULL;
+   db->follower = NULL;
+
+   /* Tracing */
+   db->trace_callback = (opts != NULL ? opts->trace_callback : NULL);
+   db->trace_ctx = (opts != NULL ? opts->trace_ctx : NULL);
+
+   /* Value log, opened on first use */
+   db->vlog_threshold = (opts != NULL ? opts->vlog_threshold : 0);
+   db->vlog_prefix = NULL;
+   db->vlog_file = NULL;
+   db->vlog_end = 0;
+   db->vlog_synced = 0;
+   db->vlog_map = NULL;
+   db->vlog_map_sz = 0;
+   db->vlog_old_maps = NULL;
+   if(opts != NULL && opts->vlog_path != NULL)
+   {
+      db->vlog_prefix = ekvs_malloc(strlen(opts->vlog_path) + 1);
+      strcpy(db->vlog_prefix, opts->vlog_path);
+   }
+   else if(path != NULL)
+   {
+      db->vlog_prefix = ekvs_malloc(strlen(path) + 6);
+      sprintf(db->vlog_prefix, "%s.vlog", path);
+   }
+
    /* Read in the serialized attributes of the db */
    if(dbfile != NULL && file_created == 0)
    {
       fseek(dbfile, 0, SEEK_SET);
-      fread(&db->serialized, sizeof(db->serialized), 1, dbfile);
+      if(fread(&db->serialized, sizeof(db->serialized), 1, dbfile) != 1 ||
+         db->serialized.magic != EKVS_MAGIC || db->serialized.version != EKVS_FORMAT_VERSION)
+      {
+         fprintf(stderr, "ekvs: %s is not an ekvs database, or was written by an unsupported version.\n", path);
+         fclose(dbfile);
+         ekvs_free(db->vlog_prefix);
+         ekvs_free(db->db_fname);
+         ekvs_free(*store);
+         return EKVS_FILE_FAIL;
+      }
    }
    else
    {
+      db->serialized.magic = EKVS_MAGIC;
+      db->serialized.version = EKVS_FORMAT_VERSION;
+      db->serialized.vlog_gen = 0;
+      db->serialized.segment_size = (opts != NULL && dbfile != NULL ? opts->binlog_segment_size : 0);
+      db->serialized.first_segment = 0;
+
       /* Set the initial table size */
       if(opts == NULL || opts->initial_table_size == 0)
       {
@@ -112,8 +473,10 @@ int ekvs_open(ekvs* store, const char* path, const ekvs_opts* opts)
          db->serialized.table_sz = opts->initial_table_size;
       }
 
-      /* No binlog yet */
+      /* No snapshot or binlog yet */
       db->serialized.binlog_start = db->serialized.binlog_end = sizeof(struct _ekvs_db_serialized);
+      db->serialized.snapshot_end = sizeof(struct _ekvs_db_serialized);
+      db->serialized.checkpoints = 0;
 
       /* Serialize initial DB settings */
       if(dbfile != NULL)
@@ -124,92 +487,120 @@ int ekvs_open(ekvs* store, const char* path, const ekvs_opts* opts)
    }
 
    /* Set up the hash-table */
-   db->table = ekvs_malloc(sizeof(struct _ekvs_db_entry*) * db->serialized.table_sz);
+   db->table = _ekvs_table_alloc(db, db->serialized.table_sz, &db->table_map_sz, &db->table_pages_used, &db->table_numa_used);
    if(db->table == NULL)
    {
-      fclose(dbfile);
+      if(dbfile != NULL) fclose(dbfile);
+      ekvs_free(db->vlog_prefix);
+      ekvs_free(db->db_fname);
       ekvs_free(*store);
       return EKVS_ALLOCATION_FAIL;
    }
 
-   /* Initialize table to NULL, and set population to 0 */
-   memset(db->table, 0, sizeof(struct _ekvs_db_entry*) * db->serialized.table_sz);
+   /* The table starts out empty */
    db->table_population = 0;
+   db->mem_used = sizeof(struct _ekvs_db_entry*) * db->serialized.table_sz;
+
+   /* The engine is chosen when the database is created; an LSM store is marked by its manifest */
+   if(dbfile != NULL && (file_created ? (opts != NULL && opts->engine == ekvs_engine_lsm) : _ekvs_lsm_exists(path)))
+   {
+      int ret = _ekvs_lsm_open(db, path, file_created, (opts != NULL ? opts->lsm_memtable_size : 0));
+      if(ret != EKVS_OK)
+      {
+         db->binlog_enabled = 0;
+         ekvs_close(db);
+         *store = NULL;
+         return ret;
+      }
+   }
+
+   /* File-backed tables track the buckets which change between checkpoints */
+   if(dbfile != NULL && db->lsm == NULL)
+   {
+      db->dirty = ekvs_malloc(EKVS_DIRTY_WORDS(db->serialized.table_sz) * sizeof(uint64_t));
+      if(db->dirty == NULL)
+      {
+         ekvs_close(db);
+         *store = NULL;
+         return EKVS_ALLOCATION_FAIL;
+      }
+      memset(db->dirty, 0, EKVS_DIRTY_WORDS(db->serialized.table_sz) * sizeof(uint64_t));
+   }
 
-   /* Load up the table */
+   /* Load up the table: the snapshot, then the checkpoints written since */
    if(dbfile != NULL)
    {
-      struct _ekvs_db_entry entry;
-      struct _ekvs_db_entry* new_entry;
-      struct _ekvs_db_entry* cur_entry;
-      long int binlog_start = db->serialized.binlog_start;
-      long int binlog_end = db->serialized.binlog_end;
+      struct _ekvs_block_reader reader;
       long int filepos = ftell(dbfile);
-      uint64_t hash;
-      uint32_t pc, pb;
-      char operation;
+      int load_error = EKVS_FILE_FAIL;
+      uint64_t i;
 
-      entry.chain = NULL;
+      memset(&reader, 0, sizeof(reader));
+      reader.file = dbfile;
+      if(filepos != -1L && filepos <= db->serialized.snapshot_end)
+      {
+         reader.remaining = (uint64_t)(db->serialized.snapshot_end - filepos);
+         load_error = _ekvs_load_blocks(db, &reader);
+      }
+      if(load_error != EKVS_OK)
+      {
+         fprintf(stderr, "ekvs: failed to load snapshot from %s.\n", path);
+      }
+      for(i = 1; i <= db->serialized.checkpoints && load_error == EKVS_OK; i++)
+      {
+         load_error = _ekvs_load_checkpoint(db, i);
+      }
+      if(load_error != EKVS_OK)
+      {
+         db->binlog_enabled = 0;
+         ekvs_close(db);
+         *store = NULL;
+         return load_error;
+      }
 
-      /* Read the snapshot */
-      while(filepos < binlog_start && !feof(dbfile))
+      /* Only what the binlog replays is newer than the checkpoints */
+      if(db->dirty != NULL)
       {
-         fread(&entry.flags, sizeof(entry.flags), 1, dbfile);
-         fread(&entry.key_sz, sizeof(entry.key_sz), 1, dbfile);
-         fread(&entry.data_sz, sizeof(entry.data_sz), 1, dbfile);
+         memset(db->dirty, 0, EKVS_DIRTY_WORDS(db->serialized.table_sz) * sizeof(uint64_t));
+         db->dirty_count = 0;
+      }
+      /* Verify and replay the binlog, dropping a torn tail */
+      db->binlog_enabled = 0;
+      load_error = _ekvs_load_binlog(db);
+      if(load_error == EKVS_OK && db->serialized.segment_size != 0) load_error = _ekvs_segment_load(db);
+      if(load_error != EKVS_OK)
+      {
+         ekvs_close(db);
+         *store = NULL;
+         return load_error;
+      }
 
-         /* Allocate enough space for the entry. */
-         new_entry = ekvs_malloc(sizeof(struct _ekvs_db_entry) + entry.key_sz + entry.data_sz - 1);
-         memcpy(new_entry, &entry, sizeof(struct _ekvs_db_entry) - 1);
-         fread(new_entry->key_data, 1, entry.key_sz + entry.data_sz, dbfile);
-         filepos = ftell(dbfile);
+      /* A snapshot written without a budget may not fit in this one */
+      _ekvs_fit_budget(db, NULL);
+      db->binlog_enabled = 1;
 
-         /* Assign to table, and increment population */
-         pc = pb = 0;
-         hashlittle2(new_entry->key_data, entry.key_sz, &pc, &pb);
-         hash = pc + (((uint64_t)pb) << 32);
-         cur_entry = db->table[hash % (*store)->serialized.table_sz];
-         if(cur_entry == NULL) 
-         {
-            db->table[hash % (*store)->serialized.table_sz] = new_entry;
-         }
-         else
+      if(opts != NULL && opts->async_binlog_size != 0)
+      {
+         load_error = _ekvs_writer_start(db, opts->async_binlog_size);
+         if(load_error != EKVS_OK)
          {
-            while(cur_entry->chain != NULL)
-            {
-               cur_entry = cur_entry->chain;
-            }
-            cur_entry->chain = new_entry;
+            ekvs_close(db);
+            *store = NULL;
+            return load_error;
          }
-         db->table_population++;
       }
+   }
 
-      /* Read/replay the binlog */
-      db->binlog_enabled = 0;
-      fseek(dbfile, binlog_start, SEEK_SET);
-      new_entry = ekvs_malloc(sizeof(struct _ekvs_db_entry));
-      while(binlog_start != binlog_end && filepos < binlog_end)
-      {
-         fread(&operation, sizeof(operation), 1, dbfile);
-         fread(&entry.flags, sizeof(entry.flags), 1, dbfile);
-         fread(&entry.key_sz, sizeof(entry.key_sz), 1, dbfile);
-         fread(&entry.data_sz, sizeof(entry.data_sz), 1, dbfile);
-
-         new_entry = ekvs_realloc(new_entry, sizeof(struct _ekvs_db_entry) + entry.key_sz + entry.data_sz - 1);
-         memcpy(new_entry, &entry, sizeof(struct _ekvs_db_entry) - 1);
-         fread(new_entry->key_data, 1, entry.key_sz + entry.data_sz, dbfile);
-         filepos = ftell(dbfile);
-
-         /* Replay */
-         db->last_error = _ekvs_replay_binlog_entry(*store, operation, new_entry);
-         if(db->last_error != EKVS_OK)
-         {
-            fprintf(stderr, "Error replaying binlog.");
-            break;
-         }
+   /* Keep recent records for followers which reconnect */
+   if(opts != NULL && opts->replica_backlog_size != 0)
+   {
+      int ret = _ekvs_replica_start(db, opts->replica_backlog_size);
+      if(ret != EKVS_OK)
+      {
+         ekvs_close(db);
+         *store = NULL;
+         return ret;
       }
-      ekvs_free(new_entry);
-      db->binlog_enabled = 1;
    }
 
    (*store)->last_error = EKVS_OK;
@@ -219,11 +610,24 @@ int ekvs_open(ekvs* store, const char* path, const ekvs_opts* opts)
 
 void ekvs_close(ekvs store)
 {
-   if(store != NULL)
+   if(store != NULL && store->ro_map != NULL)
+   {
+      _ekvs_ro_close(store);
+   }
+   else if(store != NULL && store->shm_map != NULL)
+   {
+      _ekvs_shm_close(store);
+   }
+   else if(store != NULL)
    {
       uint64_t i;
       struct _ekvs_db_entry* cur_entry;
       struct _ekvs_db_entry* del_entry;
+      if(store->writer != NULL) _ekvs_writer_stop(store);
+      _ekvs_lsm_close(store);
+      _ekvs_segment_close(store);
+      _ekvs_replica_close(store);
+      _ekvs_view_close_all(store);
       for(i = 0; i < store->serialized.table_sz; i++)
       {
          cur_entry = store->table[i];
@@ -231,16 +635,175 @@ void ekvs_close(ekvs store)
          {
             del_entry = cur_entry;
             cur_entry = cur_entry->chain;
+            if(del_entry->flags & EKVS_ENTRY_COLLECTION) _ekvs_coll_release(store, del_entry);
             ekvs_free(del_entry);
          }
       }
+      while(store->retired != NULL)
+      {
+         del_entry = store->retired;
+         store->retired = del_entry->chain;
+         ekvs_free(del_entry);
+      }
+      _ekvs_vlog_close(store);
+      ekvs_free(store->scratch);
+      ekvs_free(store->vlog_prefix);
       ekvs_free(store->db_fname);
-      ekvs_free(store->table);
-      fclose(store->db_file);
+      ekvs_free(store->dirty);
+      if(store->table != NULL) _ekvs_table_free(store->table, store->table_map_sz);
+      if(store->db_file != NULL) fclose(store->db_file);
       ekvs_free(store);
    }
 }
 
+/* Snapshot blocks are accumulated here, and compressed on the way out if enabled. They go to a file,
+ * or to the callback passed to ekvs_snapshot_stream. */
+struct _ekvs_block_writer {
+   char* block;
+   size_t block_sz;
+   size_t block_cap;
+   char* packed;
+   size_t packed_cap;
+   FILE* file;
+   ekvs_write_ptr write_cb;
+   void* ctx;
+   int inline_values;         /* Write values held in the value log rather than their location */
+   uint64_t written;
+};
+
+static int _ekvs_block_out(struct _ekvs_block_writer* writer, const void* data, size_t size)
+{
+   if(writer->file != NULL)
+   {
+      if(fwrite(data, 1, size, writer->file) != size) return EKVS_FILE_FAIL;
+   }
+   else if(writer->write_cb(writer->ctx, data, size) != size)
+   {
+      return EKVS_FILE_FAIL;
+   }
+   writer->written += size;
+   return EKVS_OK;
+}
+
+static int _ekvs_flush_block(ekvs store, struct _ekvs_block_writer* writer)
+{
+   struct _ekvs_block_header header;
+   const char* out = writer->block;
+
+   if(writer->block_sz == 0) return EKVS_OK;
+
+   header.raw_sz = header.stored_sz = writer->block_sz;
+   header.flags = 0;
+
+   if(store->compression == ekvs_compress_lz)
+   {
+      size_t bound = _ekvs_lz_bound(writer->block_sz);
+      size_t packed_sz = 0;
+      if(writer->packed_cap < bound)
+      {
+         char* packed = ekvs_realloc(writer->packed, bound);
+         if(packed != NULL)
+         {
+            writer->packed = packed;
+            writer->packed_cap = bound;
+         }
+      }
+      if(writer->packed_cap >= bound)
+      {
+         packed_sz = _ekvs_lz_compress(writer->block, writer->block_sz, writer->packed, writer->packed_cap);
+      }
+
+      /* Incompressible blocks are stored raw */
+      if(packed_sz != 0 && packed_sz < writer->block_sz)
+      {
+         header.stored_sz = packed_sz;
+         header.flags |= EKVS_BLOCK_COMPRESSED;
+         out = writer->packed;
+      }
+   }
+
+   header.checksum = _ekvs_block_checksum(&header, out);
+   if(_ekvs_block_out(writer, &header, sizeof(header)) != EKVS_OK) return EKVS_FILE_FAIL;
+   if(_ekvs_block_out(writer, out, (size_t)header.stored_sz) != EKVS_OK) return EKVS_FILE_FAIL;
+   writer->block_sz = 0;
+   return EKVS_OK;
+}
+
+static int _ekvs_write_entry(ekvs store, struct _ekvs_block_writer* writer, const struct _ekvs_db_entry* entry)
+{
+   const size_t header_sz = sizeof(entry->flags) + sizeof(entry->key_sz) + sizeof(entry->data_sz);
+   const char* data = &entry->key_data[entry->key_sz];
+   size_t data_sz = entry->data_sz;
+   size_t key_data_sz;
+   char flags = entry->flags & (EKVS_ENTRY_PERSISTENT | EKVS_ENTRY_SPILLED);
+   char* rec;
+
+   /* Lists and sets are written in their flat encoding; other values as stored */
+   if(entry->flags & EKVS_ENTRY_COLLECTION)
+   {
+      data = _ekvs_coll_flatten(store, entry, &data_sz);
+      if(data == NULL) return EKVS_ALLOCATION_FAIL;
+   }
+   else if((entry->flags & EKVS_ENTRY_VLOG) && writer->inline_values)
+   {
+      data = _ekvs_entry_value(store, entry, &data_sz);
+      if(data == NULL) return EKVS_FILE_FAIL;
+      flags = (char)(flags & ~(EKVS_ENTRY_VLOG | EKVS_ENTRY_SPILLED));
+   }
+   key_data_sz = entry->key_sz + data_sz;
+
+   if(writer->block_cap - writer->block_sz < header_sz + key_data_sz)
+   {
+      size_t new_cap = writer->block_cap * 2;
+      char* block;
+      if(new_cap < writer->block_sz + header_sz + key_data_sz) new_cap = writer->block_sz + header_sz + key_data_sz;
+      block = ekvs_realloc(writer->block, new_cap);
+      if(block == NULL) return EKVS_ALLOCATION_FAIL;
+      writer->block = block;
+      writer->block_cap = new_cap;
+   }
+
+   rec = writer->block + writer->block_sz;
+   memcpy(rec, &flags, sizeof(flags));
+   memcpy(rec + sizeof(flags), &entry->key_sz, sizeof(entry->key_sz));
+   memcpy(rec + sizeof(flags) + sizeof(entry->key_sz), &data_sz, sizeof(data_sz));
+   memcpy(rec + header_sz, entry->key_data, entry->key_sz);
+   memcpy(rec + header_sz + entry->key_sz, data, data_sz);
+   writer->block_sz += header_sz + key_data_sz;
+
+   if(writer->block_sz >= EKVS_BLOCK_SIZE) return _ekvs_flush_block(store, writer);
+   return EKVS_OK;
+}
+
+/* Drain the writer, and start a new segment, so that the records logged so far can be dropped once a
+ * snapshot or checkpoint which covers them is in place */
+static int _ekvs_binlog_cut(ekvs store)
+{
+   int ret;
+
+   if(store->writer != NULL)
+   {
+      ret = _ekvs_writer_drain(store);
+      if(ret != EKVS_OK) return ret;
+   }
+
+   if(store->segment_file != NULL && store->segment_end != 0) return _ekvs_segment_roll(store);
+   return EKVS_OK;
+}
+
+/* Remove checkpoint files from first to last, once a snapshot covers them */
+static void _ekvs_remove_checkpoints(ekvs store, uint64_t first, uint64_t last)
+{
+   uint64_t i;
+
+   for(i = first; i <= last; i++)
+   {
+      char* fname = _ekvs_checkpoint_fname(store->db_fname, i, "");
+      if(fname != NULL) remove(fname);
+      ekvs_free(fname);
+   }
+}
+
 int ekvs_snapshot(ekvs store, const char* snapshot_to)
 {
    uint64_t i;
@@ -248,8 +811,12 @@ int ekvs_snapshot(ekvs store, const char* snapshot_to)
    FILE* dbfile;
    struct _ekvs_db_entry* entry;
    char* tmp_fname = NULL;
-   size_t key_data_sz;
+   int replace_db = (snapshot_to == NULL || strcmp(snapshot_to, "") == 0);
+   int ret = EKVS_FILE_FAIL;
+   struct _ekvs_block_writer writer;
    struct _ekvs_db_serialized new_serialized;
+   uint64_t stat_start;
+   uint64_t trace_start;
 
    if(store == NULL)
    {
@@ -257,10 +824,48 @@ int ekvs_snapshot(ekvs store, const char* snapshot_to)
       return EKVS_FAIL;
    }
 
+   if(store->ro_map != NULL)
+   {
+      store->last_error = EKVS_READ_ONLY;
+      return EKVS_READ_ONLY;
+   }
+
+   if(store->shm_map != NULL)
+   {
+      store->last_error = EKVS_UNSUPPORTED;
+      return EKVS_UNSUPPORTED;
+   }
+
+   EKVS_STAT_START(stat_start);
+   EKVS_TRACE_START(store, trace_start);
    table_sz = store->serialized.table_sz;
 
+   /* The snapshot replaces the file the writer thread appends to */
+   if(replace_db)
+   {
+      ret = _ekvs_binlog_cut(store);
+      if(ret != EKVS_OK)
+      {
+         store->last_error = ret;
+         return ret;
+      }
+      ret = EKVS_FILE_FAIL;
+   }
+
+   /* An LSM store writes its memtable to an SSTable, and the snapshot of its empty table resets the binlog */
+   if(store->lsm != NULL)
+   {
+      ret = (replace_db ? _ekvs_lsm_flush(store) : EKVS_UNSUPPORTED);
+      if(ret != EKVS_OK)
+      {
+         store->last_error = ret;
+         return ret;
+      }
+      ret = EKVS_FILE_FAIL;
+   }
+
    /* Create a temporary file */
-   if(snapshot_to == NULL || strcmp(snapshot_to, "") == 0)
+   if(replace_db)
    {
       if(store->db_fname == NULL)
       {
@@ -271,68 +876,427 @@ int ekvs_snapshot(ekvs store, const char* snapshot_to)
       sprintf(tmp_fname, "%s.lock", store->db_fname);
       dbfile = fopen(tmp_fname, "wb+"); /* TODO: fopen_s? */
 
-      if(dbfile == NULL)
-      {
-         ekvs_free(tmp_fname);
-         fprintf(stderr, "ekvs: failed to create temporary snapshot file.\n");
-         return EKVS_FILE_FAIL;
-      }
+      if(dbfile == NULL)
+      {
+         ekvs_free(tmp_fname);
+         fprintf(stderr, "ekvs: failed to create temporary snapshot file.\n");
+         return EKVS_FILE_FAIL;
+      }
+   }
+   else
+   {
+      dbfile = fopen(snapshot_to, "wb+"); /* TODO: fopen_s? */
+
+      if(dbfile == NULL)
+      {
+         fprintf(stderr, "ekvs: failed to create specified snapshot file (%s).\n", snapshot_to);
+         return EKVS_FILE_FAIL;
+      }
+   }
+   
+   /* Leave room for the serialized blob, then write out the table */
+   memset(&writer, 0, sizeof(writer));
+   writer.file = dbfile;
+   if(fseek(dbfile, sizeof(struct _ekvs_db_serialized), SEEK_SET) != 0) goto ekvs_snapshot_err;
+   for(i = 0; i < table_sz; i++)
+   {
+      entry = store->table[i];
+      while(entry != NULL)
+      {
+         ret = _ekvs_write_entry(store, &writer, entry);
+         if(ret != EKVS_OK) goto ekvs_snapshot_err;
+         entry = entry->chain;
+      }
+   }
+   ret = _ekvs_flush_block(store, &writer);
+   if(ret != EKVS_OK) goto ekvs_snapshot_err;
+   ekvs_free(writer.block);
+   ekvs_free(writer.packed);
+   writer.block = writer.packed = NULL;
+   ret = EKVS_FILE_FAIL;
+
+   /* Now write serialization blob */
+   memcpy(&new_serialized, &store->serialized, sizeof(struct _ekvs_db_serialized));
+   new_serialized.table_sz = table_sz;
+   new_serialized.binlog_start = new_serialized.binlog_end = new_serialized.snapshot_end = ftell(dbfile);
+   new_serialized.first_segment = store->segment;
+   new_serialized.checkpoints = 0;
+   if(new_serialized.binlog_end == -1L) goto ekvs_snapshot_err;
+   if(fseek(dbfile, 0, SEEK_SET) != 0) goto ekvs_snapshot_err;
+   if(fwrite(&new_serialized, sizeof(struct _ekvs_db_serialized), 1, dbfile) != 1) goto ekvs_snapshot_err;
+
+   /* Records which were durable in the old binlog are only in the snapshot now */
+   if(replace_db && _ekvs_vlog_sync(store) != EKVS_OK) goto ekvs_snapshot_err;
+   if(replace_db && (fflush(dbfile) != 0 || fdatasync(fileno(dbfile)) != 0)) goto ekvs_snapshot_err;
+
+   /* Close temporary file, rename */
+   fclose(dbfile);
+   if(replace_db)
+   {
+      uint64_t old_first_segment = store->serialized.first_segment;
+      uint64_t old_checkpoints = store->serialized.checkpoints;
+
+      memcpy(&store->serialized, &new_serialized, sizeof(struct _ekvs_db_serialized));
+      fclose(store->db_file);
+      remove(store->db_fname);
+      rename(tmp_fname, store->db_fname);
+      store->db_file = fopen(store->db_fname, "rb+");
+      if(store->segment_file != NULL)
+      {
+         if(store->segment > old_first_segment) _ekvs_segment_drop(store, old_first_segment, store->segment - 1);
+         store->segment_logged = store->segment_end;
+      }
+      else if(store->writer != NULL)
+      {
+         _ekvs_writer_rebase(store, (uint64_t)store->serialized.binlog_end);
+      }
+
+      /* The snapshot folds in every checkpoint */
+      if(old_checkpoints != 0) _ekvs_remove_checkpoints(store, 1, old_checkpoints);
+      if(store->dirty != NULL)
+      {
+         memset(store->dirty, 0, EKVS_DIRTY_WORDS(store->serialized.table_sz) * sizeof(uint64_t));
+         store->dirty_count = 0;
+      }
+   }
+   ekvs_free(tmp_fname);
+
+   EKVS_STAT_ADD(store, snapshot_count, 1);
+   EKVS_STAT_TIME(store, snapshot, stat_start);
+   EKVS_TRACE(store, ekvs_trace_snapshot, 0, trace_start, 0, (uint64_t)new_serialized.binlog_start);
+   store->last_error = EKVS_OK;
+   return EKVS_OK;
+
+ekvs_snapshot_err:
+   ekvs_free(writer.block);
+   ekvs_free(writer.packed);
+   fclose(dbfile);
+   remove(replace_db ? tmp_fname : snapshot_to);
+   ekvs_free(tmp_fname);
+   store->last_error = ret;
+   return ret;
+}
+
+int ekvs_checkpoint(ekvs store)
+{
+   struct _ekvs_checkpoint_header header;
+   struct _ekvs_db_serialized new_serialized;
+   struct _ekvs_block_writer writer;
+   struct _ekvs_db_entry* entry;
+   uint64_t old_first_segment;
+   uint64_t words;
+   uint64_t word;
+   uint64_t bucket;
+   uint32_t crc = 0;
+   char* fname = NULL;
+   char* tmp_fname = NULL;
+   FILE* file = NULL;
+   long int blocks_start;
+   long int blocks_end;
+   uint64_t i;
+   int pass;
+   int ret;
+
+   if(store == NULL)
+   {
+      fprintf(stderr, "ekvs: NULL store parameter passed to ekvs_checkpoint.\n");
+      return EKVS_FAIL;
+   }
+
+   if(store->ro_map != NULL)
+   {
+      store->last_error = EKVS_READ_ONLY;
+      return EKVS_READ_ONLY;
+   }
+
+   if(store->shm_map != NULL || store->lsm != NULL)
+   {
+      store->last_error = EKVS_UNSUPPORTED;
+      return EKVS_UNSUPPORTED;
+   }
+
+   if(store->dirty == NULL)
+   {
+      fprintf(stderr, "ekvs: checkpoints require a database file.\n");
+      store->last_error = EKVS_FILE_FAIL;
+      return EKVS_FILE_FAIL;
+   }
+
+   /* Once most buckets changed, or the chain is long, rewriting everything is cheaper to write and to load */
+   if(store->dirty_count * 2 > store->serialized.table_sz || store->serialized.checkpoints >= store->max_checkpoints)
+   {
+      return ekvs_snapshot(store, NULL);
+   }
+
+   ret = _ekvs_binlog_cut(store);
+   if(ret != EKVS_OK)
+   {
+      store->last_error = ret;
+      return ret;
+   }
+
+   /* The error path frees the writer's buffers */
+   memset(&writer, 0, sizeof(writer));
+   fname = _ekvs_checkpoint_fname(store->db_fname, store->serialized.checkpoints + 1, "");
+   tmp_fname = _ekvs_checkpoint_fname(store->db_fname, store->serialized.checkpoints + 1, ".tmp");
+   if(fname == NULL || tmp_fname == NULL)
+   {
+      ret = EKVS_ALLOCATION_FAIL;
+      goto ekvs_checkpoint_err;
+   }
+
+   ret = EKVS_FILE_FAIL;
+   file = fopen(tmp_fname, "wb");
+   if(file == NULL)
+   {
+      fprintf(stderr, "ekvs: failed to create checkpoint file (%s).\n", tmp_fname);
+
+      /* Whatever is in the way is not ours to remove */
+      ekvs_free(tmp_fname);
+      tmp_fname = NULL;
+      goto ekvs_checkpoint_err;
+   }
+
+   /* The header is rewritten once the sizes are known. The first pass lists the dirty buckets, the second
+    * writes their entries. */
+   memset(&header, 0, sizeof(header));
+   writer.file = file;
+   if(fwrite(&header, sizeof(header), 1, file) != 1) goto ekvs_checkpoint_err;
+   words = EKVS_DIRTY_WORDS(store->serialized.table_sz);
+   blocks_start = 0;
+   for(pass = 0; pass < 2; pass++)
+   {
+      for(i = 0; i < words; i++)
+      {
+         for(word = store->dirty[i]; word != 0; word &= word - 1)
+         {
+            bucket = i * 64;
+            while((word & ((uint64_t)1 << (bucket % 64))) == 0) bucket++;
+            if(bucket >= store->serialized.table_sz) break;
+            if(pass == 0)
+            {
+               if(fwrite(&bucket, sizeof(bucket), 1, file) != 1) goto ekvs_checkpoint_err;
+               crc = _ekvs_crc32c(crc, &bucket, sizeof(bucket));
+               header.bucket_count++;
+               continue;
+            }
+            for(entry = store->table[bucket]; entry != NULL; entry = entry->chain)
+            {
+               ret = _ekvs_write_entry(store, &writer, entry);
+               if(ret != EKVS_OK) goto ekvs_checkpoint_err;
+               ret = EKVS_FILE_FAIL;
+            }
+         }
+      }
+      if(pass == 0) blocks_start = ftell(file);
+   }
+   ret = _ekvs_flush_block(store, &writer);
+   if(ret != EKVS_OK) goto ekvs_checkpoint_err;
+   ret = EKVS_FILE_FAIL;
+   blocks_end = ftell(file);
+   if(blocks_start == -1L || blocks_end == -1L) goto ekvs_checkpoint_err;
+
+   header.magic = EKVS_CHECKPOINT_MAGIC;
+   header.version = EKVS_FORMAT_VERSION;
+   header.sequence = store->serialized.checkpoints + 1;
+   header.table_sz = store->serialized.table_sz;
+   header.blocks_sz = (uint64_t)(blocks_end - blocks_start);
+   header.checksum = _ekvs_crc32c(crc, &header, offsetof(struct _ekvs_checkpoint_header, checksum));
+   if(fseek(file, 0, SEEK_SET) != 0) goto ekvs_checkpoint_err;
+   if(fwrite(&header, sizeof(header), 1, file) != 1) goto ekvs_checkpoint_err;
+   if(_ekvs_vlog_sync(store) != EKVS_OK) goto ekvs_checkpoint_err;
+   if(fflush(file) != 0 || fdatasync(fileno(file)) != 0) goto ekvs_checkpoint_err;
+   fclose(file);
+   file = NULL;
+   if(rename(tmp_fname, fname) != 0) goto ekvs_checkpoint_err;
+
+   /* The checkpoint counts once the header says so; until then, recovery replays the old binlog instead */
+   memcpy(&new_serialized, &store->serialized, sizeof(new_serialized));
+   new_serialized.checkpoints++;
+   new_serialized.binlog_start = new_serialized.binlog_end;
+   new_serialized.first_segment = store->segment;
+   if(fseek(store->db_file, 0, SEEK_SET) != 0) goto ekvs_checkpoint_err;
+   if(fwrite(&new_serialized, sizeof(new_serialized), 1, store->db_file) != 1 ||
+      fflush(store->db_file) != 0 || fdatasync(fileno(store->db_file)) != 0)
+   {
+      /* Put back the header the binlog would otherwise rewrite */
+      if(fseek(store->db_file, 0, SEEK_SET) == 0) fwrite(&store->serialized, sizeof(store->serialized), 1, store->db_file);
+      fflush(store->db_file);
+      goto ekvs_checkpoint_err;
+   }
+   old_first_segment = store->serialized.first_segment;
+   memcpy(&store->serialized, &new_serialized, sizeof(new_serialized));
+   if(store->segment_file != NULL)
+   {
+      if(store->segment > old_first_segment) _ekvs_segment_drop(store, old_first_segment, store->segment - 1);
+      store->segment_logged = store->segment_end;
+   }
+
+   memset(store->dirty, 0, (size_t)words * sizeof(uint64_t));
+   store->dirty_count = 0;
+   EKVS_STAT_ADD(store, checkpoint_bytes, (uint64_t)blocks_end);
+   ekvs_free(writer.block);
+   ekvs_free(writer.packed);
+   ekvs_free(tmp_fname);
+   ekvs_free(fname);
+   store->last_error = EKVS_OK;
+   return EKVS_OK;
+
+ekvs_checkpoint_err:
+   if(file != NULL)
+   {
+      fclose(file);
+   }
+   if(tmp_fname != NULL) remove(tmp_fname);
+   ekvs_free(writer.block);
+   ekvs_free(writer.packed);
+   ekvs_free(tmp_fname);
+   ekvs_free(fname);
+   store->last_error = ret;
+   return ret;
+}
+
+int ekvs_snapshot_stream(ekvs store, ekvs_write_ptr write_cb, void* ctx)
+{
+   struct _ekvs_stream_header header;
+   struct _ekvs_block_header end;
+   struct _ekvs_block_writer writer;
+   struct _ekvs_db_entry* entry;
+   uint64_t stat_start;
+   uint64_t trace_start;
+   uint64_t i;
+   int ret;
+
+   if(store == NULL)
+   {
+      fprintf(stderr, "ekvs: NULL store parameter passed to ekvs_snapshot_stream.\n");
+      return EKVS_FAIL;
+   }
+
+   if(write_cb == NULL)
+   {
+      fprintf(stderr, "ekvs: NULL write_cb parameter passed to ekvs_snapshot_stream.\n");
+      return EKVS_FAIL;
+   }
+
+   if(store->ro_map != NULL)
+   {
+      store->last_error = EKVS_READ_ONLY;
+      return EKVS_READ_ONLY;
+   }
+
+   if(store->shm_map != NULL || store->lsm != NULL)
+   {
+      store->last_error = EKVS_UNSUPPORTED;
+      return EKVS_UNSUPPORTED;
+   }
+
+   EKVS_STAT_START(stat_start);
+   EKVS_TRACE_START(store, trace_start);
+
+   memset(&header, 0, sizeof(header));
+   header.magic = EKVS_STREAM_MAGIC;
+   header.version = EKVS_FORMAT_VERSION;
+   header.table_sz = store->serialized.table_sz;
+   header.population = store->table_population;
+   header.checksum = _ekvs_crc32c(0, &header, offsetof(struct _ekvs_stream_header, checksum));
+
+   /* The receiver may not share the value log, so values are written out of it */
+   memset(&writer, 0, sizeof(writer));
+   writer.write_cb = write_cb;
+   writer.ctx = ctx;
+   writer.inline_values = 1;
+   ret = _ekvs_block_out(&writer, &header, sizeof(header));
+   for(i = 0; i < store->serialized.table_sz && ret == EKVS_OK; i++)
+   {
+      for(entry = store->table[i]; entry != NULL && ret == EKVS_OK; entry = entry->chain)
+      {
+         ret = _ekvs_write_entry(store, &writer, entry);
+      }
+   }
+   if(ret == EKVS_OK) ret = _ekvs_flush_block(store, &writer);
+
+   /* An empty block ends the stream */
+   if(ret == EKVS_OK)
+   {
+      memset(&end, 0, sizeof(end));
+      end.checksum = _ekvs_block_checksum(&end, "");
+      ret = _ekvs_block_out(&writer, &end, sizeof(end));
+   }
+   ekvs_free(writer.block);
+   ekvs_free(writer.packed);
+
+   if(ret == EKVS_OK)
+   {
+      EKVS_STAT_ADD(store, snapshot_count, 1);
+      EKVS_STAT_TIME(store, snapshot, stat_start);
+      EKVS_TRACE(store, ekvs_trace_snapshot, 0, trace_start, 0, writer.written);
+   }
+   store->last_error = ret;
+   return ret;
+}
+
+int ekvs_open_stream(ekvs* store, ekvs_read_ptr read_cb, void* ctx, const ekvs_opts* opts)
+{
+   struct _ekvs_stream_header header;
+   struct _ekvs_block_reader reader;
+   ekvs_opts stream_opts;
+   ekvs db;
+   int ret;
+
+   if(store == NULL)
+   {
+      fprintf(stderr, "ekvs: NULL store parameter passed to ekvs_open_stream.\n");
+      return EKVS_FAIL;
+   }
+   *store = NULL;
+
+   if(read_cb == NULL)
+   {
+      fprintf(stderr, "ekvs: NULL read_cb parameter passed to ekvs_open_stream.\n");
+      return EKVS_FAIL;
    }
-   else
+
+   memset(&reader, 0, sizeof(reader));
+   reader.read_cb = read_cb;
+   reader.ctx = ctx;
+   reader.remaining = (uint64_t)-1;
+   if(_ekvs_block_in(&reader, &header, sizeof(header)) != EKVS_OK ||
+      header.magic != EKVS_STREAM_MAGIC || header.version != EKVS_FORMAT_VERSION || header.table_sz == 0 ||
+      _ekvs_crc32c(0, &header, offsetof(struct _ekvs_stream_header, checksum)) != header.checksum)
    {
-      dbfile = fopen(snapshot_to, "wb+"); /* TODO: fopen_s? */
+      fprintf(stderr, "ekvs: stream is not an ekvs snapshot.\n");
+      return EKVS_FILE_FAIL;
+   }
 
-      if(dbfile == NULL)
-      {
-         fprintf(stderr, "ekvs: failed to create specified snapshot file (%s).\n", snapshot_to);
-         return EKVS_FILE_FAIL;
-      }
+   /* Entries are linked without growing, so start with a table as large as the sender's */
+   if(opts != NULL)
+   {
+      memcpy(&stream_opts, opts, sizeof(stream_opts));
    }
-   
-   /* Leave room for the serialized blob, then write out the table */
-   if(fseek(dbfile, sizeof(struct _ekvs_db_serialized), SEEK_SET) != 0) goto ekvs_snapshot_err;
-   for(i = 0; i < table_sz; i++)
+   else
    {
-      entry = store->table[i];
-      while(entry != NULL)
-      {
-         key_data_sz = entry->key_sz + entry->data_sz;
-         if(fwrite(&entry->flags, sizeof(entry->flags), 1, dbfile) != 1) goto ekvs_snapshot_err;
-         if(fwrite(&entry->key_sz, sizeof(entry->key_sz), 1, dbfile) != 1) goto ekvs_snapshot_err;
-         if(fwrite(&entry->data_sz, sizeof(entry->data_sz), 1, dbfile) != 1) goto ekvs_snapshot_err;
-         if(fwrite(entry->key_data, 1, key_data_sz, dbfile) != key_data_sz) goto ekvs_snapshot_err;
-         entry = entry->chain;
-      }
+      memset(&stream_opts, 0, sizeof(stream_opts));
    }
+   if(stream_opts.initial_table_size < header.table_sz) stream_opts.initial_table_size = header.table_sz;
 
-   /* Now write serialization blob */
-   new_serialized.table_sz = table_sz;
-   new_serialized.binlog_start = new_serialized.binlog_end = ftell(dbfile);
-   if(new_serialized.binlog_end == -1L) goto ekvs_snapshot_err;
-   if(fseek(dbfile, 0, SEEK_SET) != 0) goto ekvs_snapshot_err;
-   if(fwrite(&new_serialized, sizeof(struct _ekvs_db_serialized), 1, dbfile) != 1) goto ekvs_snapshot_err;
-   memcpy(&store->serialized, &new_serialized, sizeof(struct _ekvs_db_serialized));
+   ret = ekvs_open(&db, NULL, &stream_opts);
+   if(ret != EKVS_OK) return ret;
 
-   /* Close temporary file, rename */
-   fclose(dbfile);
-   if(snapshot_to == NULL)
+   ret = _ekvs_load_blocks(db, &reader);
+   if(ret == EKVS_OK && db->table_population != header.population) ret = EKVS_FILE_FAIL;
+   if(ret != EKVS_OK)
    {
-      fclose(store->db_file);
-      remove(store->db_fname);
-      rename(tmp_fname, store->db_fname);
-      store->db_file = fopen(store->db_fname, "rb+");
+      fprintf(stderr, "ekvs: failed to load snapshot from stream.\n");
+      ekvs_close(db);
+      return ret;
    }
-   ekvs_free(tmp_fname);
 
-   store->last_error = EKVS_OK;
-   return EKVS_OK;
+   /* A snapshot written without a budget may not fit in this one */
+   _ekvs_fit_budget(db, NULL);
 
-ekvs_snapshot_err:
-   ekvs_free(tmp_fname);
-   fclose(dbfile);
-   remove(tmp_fname);
-   store->last_error = EKVS_FILE_FAIL;
-   return EKVS_FILE_FAIL;
+   *store = db;
+   return EKVS_OK;
 }
 
 int ekvs_last_error(ekvs store)
@@ -347,10 +1311,33 @@ int ekvs_grow_table(ekvs store, size_t new_sz)
    uint64_t hash;
    uint32_t pc, pb;
    uint64_t i, old_table_sz = store->serialized.table_sz;
-   struct _ekvs_db_entry** new_table = ekvs_malloc(sizeof(struct _ekvs_db_entry*) * new_sz);
+   struct _ekvs_db_entry** new_table;
+   size_t new_map_sz;
+   uint32_t new_pages, new_numa;
+   uint64_t* new_dirty = NULL;
+   uint64_t stat_start;
+   uint64_t trace_start;
+
+   if(store->ro_map != NULL) return EKVS_READ_ONLY;
+   if(store->shm_map != NULL || store->lsm != NULL) return EKVS_UNSUPPORTED;
+
+   EKVS_STAT_START(stat_start);
+   EKVS_TRACE_START(store, trace_start);
 
+   new_table = _ekvs_table_alloc(store, new_sz, &new_map_sz, &new_pages, &new_numa);
    if(new_table == NULL) return EKVS_ALLOCATION_FAIL;
-   memset(new_table, 0, sizeof(struct _ekvs_db_entry*) * new_sz);
+
+   /* Keys move between buckets, so every bucket is dirty and the next checkpoint is a snapshot */
+   if(store->dirty != NULL)
+   {
+      new_dirty = ekvs_malloc(EKVS_DIRTY_WORDS(new_sz) * sizeof(uint64_t));
+      if(new_dirty == NULL)
+      {
+         _ekvs_table_free(new_table, new_map_sz);
+         return EKVS_ALLOCATION_FAIL;
+      }
+      memset(new_dirty, 0xff, EKVS_DIRTY_WORDS(new_sz) * sizeof(uint64_t));
+   }
 
    for(i = 0; i < old_table_sz; i++)
    {
@@ -389,22 +1376,38 @@ int ekvs_grow_table(ekvs store, size_t new_sz)
       if(fflush(store->db_file) != 0) goto ekvs_grow_table_err;
    }
 
-   ekvs_free(store->table);
+   _ekvs_table_free(store->table, store->table_map_sz);
    store->table = new_table;
+   store->table_map_sz = new_map_sz;
+   store->table_pages_used = new_pages;
+   store->table_numa_used = new_numa;
+   if(new_dirty != NULL)
+   {
+      ekvs_free(store->dirty);
+      store->dirty = new_dirty;
+      store->dirty_count = new_sz;
+   }
+   store->mem_used += sizeof(struct _ekvs_db_entry*) * new_sz;
+   store->mem_used -= sizeof(struct _ekvs_db_entry*) * old_table_sz;
+   EKVS_STAT_ADD(store, grow_count, 1);
+   EKVS_STAT_TIME(store, grow, stat_start);
+   EKVS_TRACE(store, ekvs_trace_grow, 0, trace_start, 0, sizeof(struct _ekvs_db_entry*) * new_sz);
    return EKVS_OK;
 
 ekvs_grow_table_err:
-   ekvs_free(new_table);
+   _ekvs_table_free(new_table, new_map_sz);
+   ekvs_free(new_dirty);
    store->serialized.table_sz = old_table_sz;
    return EKVS_FILE_FAIL;
 }
 
 int ekvs_set_ex(ekvs store, const char* key, const void* data, size_t data_sz, uint32_t set_flags)
 {
-   uint64_t hash, old_hash;
-   uint32_t pc = 0, pb = 0;
-   struct _ekvs_db_entry* new_entry = NULL;
    size_t key_sz = 0;
+   uint64_t hash;
+   uint64_t trace_start;
+   uint64_t lsn;
+   int ret;
 
    if(store == NULL)
    {
@@ -417,34 +1420,99 @@ int ekvs_set_ex(ekvs store, const char* key, const void* data, size_t data_sz, u
       fprintf(stderr, "ekvs: NULL key parameter passed to ekvs_set_ex.\n");
       return EKVS_FAIL;
    }
+
+   if(store->ro_map != NULL || store->follower != NULL)
+   {
+      store->last_error = EKVS_READ_ONLY;
+      return EKVS_READ_ONLY;
+   }
    
    key_sz = strlen(key);
-   hashlittle2(key, key_sz, &pc, &pb);
-   hash = pc + (((uint64_t)pb) << 32);
+   if(store->shm_map != NULL)
+   {
+      return _ekvs_shm_set(store, _ekvs_hash(key, key_sz), key, key_sz, data, data_sz);
+   }
+
+   EKVS_TRACE_START(store, trace_start);
+   lsn = store->lsn;
+   hash = _ekvs_hash(key, key_sz);
+   ret = _ekvs_set_value(store, hash, key, key_sz, data, data_sz, set_flags);
+   EKVS_TRACE(store, ekvs_trace_set, hash, trace_start, _ekvs_trace_probes(store, hash, key, key_sz),
+      store->lsn - lsn);
+   return ret;
+}
+
+int _ekvs_set_value(ekvs store, uint64_t hash, const char* key, size_t key_sz, const void* data, size_t data_sz,
+   uint32_t set_flags)
+{
+   /* SSTables hold values themselves, and compress nothing */
+   if(store->lsm != NULL) return _ekvs_lsm_set(store, hash, key, key_sz, data, data_sz);
+
+   /* Large values go to the value log, and the table only holds their location */
+   if(store->vlog_threshold != 0 && data_sz >= store->vlog_threshold && store->vlog_prefix != NULL)
+   {
+      struct _ekvs_vlog_ptr ptr;
+      store->last_error = _ekvs_vlog_append(store, key, key_sz, data, data_sz, &ptr);
+      if(store->last_error != EKVS_OK) return store->last_error;
+      return _ekvs_set(store, hash, key, key_sz, &ptr, sizeof(ptr), EKVS_ENTRY_VLOG, set_flags);
+   }
+
+   /* Cold values can be kept packed until they are next read */
+   if(set_flags & ekvs_set_compress)
+   {
+      void* packed;
+      size_t packed_sz = _ekvs_lz_pack(data, data_sz, &packed);
+      if(packed_sz != 0)
+      {
+         int ret = _ekvs_set(store, hash, key, key_sz, packed, packed_sz, EKVS_ENTRY_COMPRESSED, set_flags);
+         ekvs_free(packed);
+         return ret;
+      }
+   }
+
+   return _ekvs_set(store, hash, key, key_sz, data, data_sz, 0, set_flags);
+}
+
+int _ekvs_set(ekvs store, uint64_t hash, const char* key, size_t key_sz, const void* data, size_t data_sz,
+   char entry_flags, uint32_t set_flags)
+{
+   struct _ekvs_db_entry* new_entry = NULL;
 
-   new_entry = _ekvs_insert(store, hash, key, data, key_sz, data_sz, set_flags);
+   /* Binlog replay of an LSM store */
+   if(store->lsm != NULL) return _ekvs_lsm_set(store, hash, key, key_sz, data, data_sz);
+
+   new_entry = _ekvs_insert(store, hash, key, data, key_sz, data_sz, entry_flags, set_flags);
    if(new_entry == NULL)
    {
       store->last_error = EKVS_ALLOCATION_FAIL;
    }
    else if(store->binlog_enabled)
    {
-      store->last_error = _ekvs_binlog(store, EKVS_BINLOG_SET, 0 /* flags */, key, data, data_sz);
+      store->last_error = _ekvs_binlog(store, EKVS_BINLOG_SET, entry_flags, key, key_sz, data, data_sz);
    }
    else
    {
       store->last_error = EKVS_OK;
    }
 
+   /* Evict until the budget is met, keeping the entry just assigned. Replay
+    * applies the evictions which were logged instead. */
+   if(new_entry != NULL && store->replaying == 0)
+   {
+      int ret = _ekvs_fit_budget(store, new_entry);
+      if(ret != EKVS_OK) store->last_error = ret;
+   }
+
    return store->last_error;
 }
 
 int ekvs_get(ekvs store, const char* key, const void** data, size_t* data_sz)
 {
-   struct _ekvs_db_entry* entry = NULL;
    uint64_t hash;
    uint32_t pc = 0, pb = 0;
-   size_t key_sz = 0;
+   size_t key_sz;
+   uint64_t trace_start;
+   int ret;
 
    if(store == NULL)
    {
@@ -458,21 +1526,160 @@ int ekvs_get(ekvs store, const char* key, const void** data, size_t* data_sz)
       return EKVS_FAIL;
    }
 
+   EKVS_TRACE_START(store, trace_start);
+   key_sz = strlen(key);
+   hashlittle2(key, key_sz, &pc, &pb);
+   hash = pc + (((uint64_t)pb) << 32);
+   ret = _ekvs_get(store, hash, key, key_sz, data, data_sz, NULL);
+   EKVS_TRACE(store, ekvs_trace_get, hash, trace_start, _ekvs_trace_probes(store, hash, key, key_sz), 0);
+   return ret;
+}
+
+int ekvs_get_ref(ekvs store, const char* key, ekvs_ref* ref)
+{
+   struct _ekvs_db_entry* entry = NULL;
+   uint64_t hash;
+   uint32_t pc = 0, pb = 0;
+   size_t key_sz;
+
+   if(store == NULL)
+   {
+      fprintf(stderr, "ekvs: NULL store parameter passed to ekvs_get_ref.\n");
+      return EKVS_FAIL;
+   }
+
+   if(key == NULL)
+   {
+      fprintf(stderr, "ekvs: NULL key parameter passed to ekvs_get_ref.\n");
+      return EKVS_FAIL;
+   }
+
+   if(ref == NULL)
+   {
+      fprintf(stderr, "ekvs: NULL ref parameter passed to ekvs_get_ref.\n");
+      return EKVS_FAIL;
+   }
+
+   /* Flushes and compactions unmap values, and shared segments reuse them once every handle has
+    * moved on, so neither has anything to pin */
+   if(store->lsm != NULL || store->shm_map != NULL)
+   {
+      ref->pin = NULL;
+      ref->data = NULL;
+      ref->data_sz = 0;
+      store->last_error = EKVS_UNSUPPORTED;
+      return EKVS_UNSUPPORTED;
+   }
+
    key_sz = strlen(key);
    hashlittle2(key, key_sz, &pc, &pb);
    hash = pc + (((uint64_t)pb) << 32);
-   entry = _ekvs_retrieve(store, hash, key, key_sz);
+
+   ref->pin = NULL;
+   if(_ekvs_get(store, hash, key, key_sz, &ref->data, &ref->data_sz, &entry) == EKVS_OK && entry != NULL)
+   {
+      /* Writers leave pinned entries alone, see _ekvs_free_entry */
+      entry->refs++;
+      ref->pin = entry;
+   }
+
+   return store->last_error;
+}
+
+void ekvs_ref_release(ekvs store, ekvs_ref* ref)
+{
+   struct _ekvs_db_entry* entry;
+   struct _ekvs_db_entry** link;
+
+   if(store == NULL || ref == NULL || ref->pin == NULL) return;
+
+   entry = ref->pin;
+   ref->pin = NULL;
+   ref->data = NULL;
+   ref->data_sz = 0;
+
+   entry->refs--;
+
+   /* A pinned entry is never evicted, so the next sweep may find this one */
+   if(entry->refs == 0) store->evict_stalled = 0;
+   if(entry->refs == 0 && (entry->flags & EKVS_ENTRY_RETIRED))
+   {
+      link = &store->retired;
+      while(*link != entry) link = &(*link)->chain;
+      *link = entry->chain;
+      ekvs_free(entry);
+   }
+}
+
+int _ekvs_get(ekvs store, uint64_t hash, const char* key, size_t key_sz, const void** data, size_t* data_sz,
+   struct _ekvs_db_entry** found)
+{
+   struct _ekvs_db_entry* entry = NULL;
+
+   if(store->ro_map != NULL)
+   {
+      return _ekvs_ro_get(store, hash, key, key_sz, data, data_sz);
+   }
+
+   if(store->shm_map != NULL)
+   {
+      return _ekvs_shm_get(store, hash, key, key_sz, data, data_sz);
+   }
+
+   if(store->lsm != NULL)
+   {
+      return _ekvs_lsm_get(store, hash, key, key_sz, data, data_sz);
+   }
+
+   /* Callers may already know the entry, see ekvs_get_h */
+   entry = (found != NULL && *found != NULL ? *found : _ekvs_retrieve(store, hash, key, key_sz));
+   if(entry != NULL && (entry->flags & EKVS_ENTRY_COLLECTION))
+   {
+      *data = NULL;
+      *data_sz = 0;
+      store->last_error = EKVS_WRONG_TYPE;
+      return store->last_error;
+   }
+
+   if(entry != NULL && (entry->flags & EKVS_ENTRY_COMPRESSED))
+   {
+      /* The value is hot again, keep it unpacked */
+      struct _ekvs_db_entry* inflated = _ekvs_inflate(store, hash, entry);
+      if(inflated == NULL)
+      {
+         *data = NULL;
+         *data_sz = 0;
+         store->last_error = EKVS_ALLOCATION_FAIL;
+         return store->last_error;
+      }
+      entry = inflated;
+   }
+
+   if(entry != NULL && (entry->flags & EKVS_ENTRY_SPILLED))
+   {
+      /* Also hot again. The budget is enforced by the next write, so values returned earlier stay put. */
+      if(_ekvs_unspill(store, hash, &entry) != EKVS_OK)
+      {
+         *data = NULL;
+         *data_sz = 0;
+         return store->last_error;
+      }
+   }
+
    if(entry == NULL)
    {
       *data = NULL;
       *data_sz = 0;
+      store->cache_stats.misses++;
       store->last_error = EKVS_NO_KEY;
    }
    else
    {
-      *data = &entry->key_data[entry->key_sz];
-      *data_sz = entry->data_sz;
-      store->last_error = EKVS_OK;
+      entry->flags |= EKVS_ENTRY_ACCESSED;
+      store->cache_stats.hits++;
+      *data = _ekvs_entry_value(store, entry, data_sz);
+      store->last_error = (*data != NULL || *data_sz == 0 ? EKVS_OK : EKVS_FILE_FAIL);
+      if(found != NULL) *found = entry;
    }
    
    return store->last_error;
@@ -480,11 +1687,10 @@ int ekvs_get(ekvs store, const char* key, const void** data, size_t* data_sz)
 
 int ekvs_del(ekvs store, const char* key)
 {
-   struct _ekvs_db_entry* entry = NULL;
-   struct _ekvs_db_entry* prev_entry = NULL;
+   uint64_t trace_start;
+   uint64_t lsn;
    uint64_t hash;
-   uint32_t pc = 0, pb = 0;
-   size_t key_sz = 0;
+   int ret;
 
    if(store == NULL)
    {
@@ -498,39 +1704,52 @@ int ekvs_del(ekvs store, const char* key)
       return EKVS_FAIL;
    }
 
-   key_sz = strlen(key);
-   hashlittle2(key, key_sz, &pc, &pb);
-   hash = pc + (((uint64_t)pb) << 32);
+   if(store->ro_map != NULL || store->follower != NULL)
+   {
+      store->last_error = EKVS_READ_ONLY;
+      return EKVS_READ_ONLY;
+   }
+
+   if(store->shm_map != NULL)
+   {
+      return _ekvs_shm_del(store, _ekvs_hash(key, strlen(key)), key, strlen(key));
+   }
+
+   EKVS_TRACE_START(store, trace_start);
+   lsn = store->lsn;
+   hash = _ekvs_hash(key, strlen(key));
+   ret = _ekvs_del(store, hash, key, strlen(key));
+   EKVS_TRACE(store, ekvs_trace_del, hash, trace_start, 0, store->lsn - lsn);
+   return ret;
+}
+
+int _ekvs_del(ekvs store, uint64_t hash, const char* key, size_t key_sz)
+{
+   struct _ekvs_db_entry* entry = NULL;
+   struct _ekvs_db_entry* prev_entry = NULL;
+
+   if(store->lsm != NULL) return _ekvs_lsm_del(store, hash, key, key_sz);
+
    entry = store->table[hash % store->serialized.table_sz];
+
+   /* Traverse chain */
+   while(entry != NULL && (key_sz != entry->key_sz || memcmp(key, entry->key_data, key_sz) != 0))
+   {
+      prev_entry = entry;
+      entry = entry->chain;
+   }
+
    if(entry == NULL)
    {
       store->last_error = EKVS_NO_KEY;
    }
    else
    {
-      /* Traverse chain */
-      while(key_sz != entry->key_sz || memcmp(key, entry->key_data, key_sz) != 0)
-      {
-         prev_entry = entry;
-         entry = entry->chain;
-      }
-
-      /* Unlink or remove from table, then deallocate */
-      if(prev_entry != NULL)
-      {
-         prev_entry->chain = entry->chain;
-      }
-      else
-      {
-         store->table[hash % store->serialized.table_sz] = entry->chain;
-      }
-      ekvs_free(entry);
-
-      store->table_population--;
+      _ekvs_remove(store, hash, entry, prev_entry);
 
       if(store->binlog_enabled)
       {
-         store->last_error = _ekvs_binlog(store, EKVS_BINLOG_DEL, 0 /* flags */, key, NULL, 0);
+         store->last_error = _ekvs_binlog(store, EKVS_BINLOG_DEL, 0 /* flags */, key, key_sz, NULL, 0);
       }
       else
       {
@@ -544,12 +1763,14 @@ int ekvs_del(ekvs store, const char* key)
 /********************** Helpers and debugging aids **********************/
 
 struct _ekvs_db_entry* _ekvs_insert(ekvs store, uint64_t hash, const char* key, const void* data,
-   size_t key_sz, size_t data_sz, uint32_t set_flags)
+   size_t key_sz, size_t data_sz, char entry_flags, uint32_t set_flags)
 {
    struct _ekvs_db_entry* cur_entry = NULL;
    struct _ekvs_db_entry* new_entry = NULL;
    int test_grow = 0;
 
+   EKVS_VIEW_PRESERVE(store, hash, key, key_sz);
+   EKVS_MARK_DIRTY(store, hash);
    cur_entry = store->table[hash % store->serialized.table_sz];
    if(cur_entry != NULL)
    {
@@ -564,35 +1785,59 @@ struct _ekvs_db_entry* _ekvs_insert(ekvs store, uint64_t hash, const char* key,
       if(cur_entry == NULL)
       {
          /* Collision */
-         new_entry = ekvs_malloc(sizeof(struct _ekvs_db_entry) + key_sz + data_sz - 1);
-         new_entry->chain = first_entry;
+         new_entry = ekvs_malloc(EKVS_ENTRY_SIZE(key_sz, data_sz));
+         if(new_entry != NULL) new_entry->chain = first_entry;
          test_grow = 1;
       }
       else
       {
          int was_first_entry = (first_entry == cur_entry ? 1 : 0);
-         if(prev_entry != NULL) prev_entry->chain = cur_entry->chain;
-         new_entry = ekvs_realloc(cur_entry, sizeof(struct _ekvs_db_entry) + key_sz + data_sz - 1);
+         size_t old_sz = EKVS_ENTRY_ALLOC_SIZE(cur_entry);
+         /* Collections are released only once the new value has memory, a failed set leaves them intact */
+         if(cur_entry->refs > 0)
+         {
+            /* Readers hold the old value, install a new version beside it */
+            new_entry = ekvs_malloc(EKVS_ENTRY_SIZE(key_sz, data_sz));
+            if(new_entry == NULL) return NULL;
+            new_entry->chain = cur_entry->chain;
+            if(cur_entry->flags & EKVS_ENTRY_COLLECTION) _ekvs_coll_release(store, cur_entry);
+            _ekvs_free_entry(store, cur_entry);
+         }
+         else
+         {
+            new_entry = ekvs_realloc(cur_entry, EKVS_ENTRY_SIZE(key_sz, data_sz));
+            if(new_entry == NULL) return NULL;
+            if(new_entry->flags & EKVS_ENTRY_COLLECTION) _ekvs_coll_release(store, new_entry);
+            store->entry_epoch++;
+         }
+         store->mem_used -= old_sz;
+         if(prev_entry != NULL) prev_entry->chain = new_entry->chain;
          if(was_first_entry == 0) new_entry->chain = first_entry;
       }
    }
    else
    {
-      new_entry = ekvs_malloc(sizeof(struct _ekvs_db_entry) + key_sz + data_sz - 1);
-      new_entry->chain = NULL;
+      new_entry = ekvs_malloc(EKVS_ENTRY_SIZE(key_sz, data_sz));
+      if(new_entry != NULL) new_entry->chain = NULL;
       test_grow = 1;
    }
 
    if(new_entry != NULL)
    {
-      /* Chain assigned above */
-      new_entry->flags = 0;
+      /* Chain assigned above. New values start with a second chance on the eviction clock. */
+      new_entry->flags = entry_flags | EKVS_ENTRY_ACCESSED;
+      new_entry->refs = 0;
       new_entry->key_sz = key_sz;
       new_entry->data_sz = data_sz;
       memcpy(new_entry->key_data, key, key_sz);
       memcpy(&new_entry->key_data[key_sz], data, data_sz);
 
       store->table[hash % store->serialized.table_sz] = new_entry;
+      store->mem_used += EKVS_ENTRY_SIZE(key_sz, data_sz);
+   }
+   else
+   {
+      return NULL;
    }
 
    /* Grow table if needed */
@@ -629,3 +1874,125 @@ struct _ekvs_db_entry* _ekvs_retrieve(ekvs store, uint64_t hash, const char* key
    
    return entry;
 }
+
+void _ekvs_mark_dirty(ekvs store, uint64_t hash)
+{
+   uint64_t bucket = hash % store->serialized.table_sz;
+   uint64_t bit = (uint64_t)1 << (bucket % 64);
+
+   if((store->dirty[bucket / 64] & bit) == 0)
+   {
+      store->dirty[bucket / 64] |= bit;
+      store->dirty_count++;
+   }
+}
+
+void _ekvs_remove(ekvs store, uint64_t hash, struct _ekvs_db_entry* entry, struct _ekvs_db_entry* prev_entry)
+{
+   /* Callers clearing the table pass the bucket rather than the hash */
+   EKVS_VIEW_PRESERVE(store, _ekvs_hash(entry->key_data, entry->key_sz), entry->key_data, entry->key_sz);
+   EKVS_MARK_DIRTY(store, hash);
+
+   /* Unlink or remove from table, then deallocate */
+   if(prev_entry != NULL)
+   {
+      prev_entry->chain = entry->chain;
+   }
+   else
+   {
+      store->table[hash % store->serialized.table_sz] = entry->chain;
+   }
+   store->mem_used -= EKVS_ENTRY_ALLOC_SIZE(entry);
+   store->table_population--;
+   _ekvs_free_entry(store, entry);
+}
+
+void _ekvs_free_entry(ekvs store, struct _ekvs_db_entry* entry)
+{
+   store->entry_epoch++;
+
+   /* Pinned entries are kept until ekvs_ref_release drops the last reference */
+   if(entry->refs > 0)
+   {
+      entry->flags |= EKVS_ENTRY_RETIRED;
+      entry->chain = store->retired;
+      store->retired = entry;
+   }
+   else
+   {
+      if(entry->flags & EKVS_ENTRY_COLLECTION) _ekvs_coll_release(store, entry);
+      ekvs_free(entry);
+   }
+}
+
+const void* _ekvs_entry_value(ekvs store, const struct _ekvs_db_entry* entry, size_t* data_sz)
+{
+   if(entry->flags & EKVS_ENTRY_COLLECTION)
+   {
+      return _ekvs_coll_flatten(store, entry, data_sz);
+   }
+
+   if(entry->flags & EKVS_ENTRY_VLOG)
+   {
+      struct _ekvs_vlog_ptr ptr;
+      memcpy(&ptr, &entry->key_data[entry->key_sz], sizeof(ptr));
+      *data_sz = (size_t)ptr.size;
+      return _ekvs_vlog_read(store, &ptr);
+   }
+
+   if(entry->flags & EKVS_ENTRY_COMPRESSED)
+   {
+      const char* packed = &entry->key_data[entry->key_sz];
+      void* raw;
+      *data_sz = _ekvs_lz_packed_size(packed, entry->data_sz);
+      raw = _ekvs_scratch(store, *data_sz);
+      if(raw == NULL || _ekvs_lz_unpack(packed, entry->data_sz, raw) != EKVS_OK) return NULL;
+      return raw;
+   }
+
+   *data_sz = entry->data_sz;
+   return &entry->key_data[entry->key_sz];
+}
+
+/* Replace a compressed entry with an uncompressed copy, in the same chain position */
+struct _ekvs_db_entry* _ekvs_inflate(ekvs store, uint64_t hash, struct _ekvs_db_entry* entry)
+{
+   struct _ekvs_db_entry** link = &store->table[hash % store->serialized.table_sz];
+   struct _ekvs_db_entry* inflated;
+   const char* packed = &entry->key_data[entry->key_sz];
+   size_t raw_sz = _ekvs_lz_packed_size(packed, entry->data_sz);
+
+   inflated = ekvs_malloc(EKVS_ENTRY_SIZE(entry->key_sz, raw_sz));
+   if(inflated == NULL) return NULL;
+   if(_ekvs_lz_unpack(packed, entry->data_sz, &inflated->key_data[entry->key_sz]) != EKVS_OK)
+   {
+      ekvs_free(inflated);
+      return NULL;
+   }
+   inflated->chain = entry->chain;
+   inflated->flags = entry->flags & ~EKVS_ENTRY_COMPRESSED;
+   inflated->refs = 0;
+   inflated->key_sz = entry->key_sz;
+   inflated->data_sz = raw_sz;
+   memcpy(inflated->key_data, entry->key_data, entry->key_sz);
+
+   while(*link != entry) link = &(*link)->chain;
+   *link = inflated;
+
+   store->mem_used += EKVS_ENTRY_SIZE(inflated->key_sz, inflated->data_sz);
+   store->mem_used -= EKVS_ENTRY_SIZE(entry->key_sz, entry->data_sz);
+   _ekvs_free_entry(store, entry);
+   return inflated;
+}
+
+void* _ekvs_scratch(ekvs store, size_t size)
+{
+   if(store->scratch_sz < size || store->scratch == NULL)
+   {
+      char* scratch = ekvs_realloc(store->scratch, size != 0 ? size : 1);
+      if(scratch == NULL) return NULL;
+      store->scratch = scratch;
+      store->scratch_sz = size;
+   }
+   return store->scratch;
+}
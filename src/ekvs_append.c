@@ -0,0 +1,265 @@
+/* -*- Mode: C; tab-width: 3; c-basic-offset: 3; indent-tabs-mode: nil -*- */
+/* vim: set filetype=C tabstop=3 softtabstop=3 shiftwidth=3 expandtab: */
+
+/* ekvs -- Copyright (C) 2011 GameClay LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "ekvs_internal.h"
+
+/* Appends and range writes modify table-resident values in place, and only
+ * the bytes written are logged. Entries which grow this way are allocated with
+ * power-of-two capacity, so a run of appends reallocates O(log n) times; the
+ * capacity is derived from data_sz, and EKVS_ENTRY_GROWN marks such entries.
+ * Values in the value log, or which would move there, are rewritten whole. */
+
+size_t _ekvs_grown_capacity(size_t data_sz)
+{
+   size_t cap = 16;
+   while(cap < data_sz && (cap << 1) > cap) cap <<= 1;
+   return (cap < data_sz ? data_sz : cap);
+}
+
+static int _ekvs_write_range_check(ekvs store, const char* key, const char* caller)
+{
+   if(store == NULL)
+   {
+      fprintf(stderr, "ekvs: NULL store parameter passed to %s.\n", caller);
+      return EKVS_FAIL;
+   }
+
+   if(key == NULL)
+   {
+      fprintf(stderr, "ekvs: NULL key parameter passed to %s.\n", caller);
+      return EKVS_FAIL;
+   }
+
+   if(store->ro_map != NULL || store->follower != NULL)
+   {
+      store->last_error = EKVS_READ_ONLY;
+      return EKVS_READ_ONLY;
+   }
+
+   if(store->shm_map != NULL || store->lsm != NULL)
+   {
+      store->last_error = EKVS_UNSUPPORTED;
+      return EKVS_UNSUPPORTED;
+   }
+
+   return EKVS_OK;
+}
+
+int ekvs_append(ekvs store, const char* key, const void* data, size_t data_sz)
+{
+   int ret = _ekvs_write_range_check(store, key, "ekvs_append");
+   if(ret != EKVS_OK) return ret;
+   return _ekvs_write_range(store, key, strlen(key), 1 /* append */, 0, data, data_sz);
+}
+
+int ekvs_setrange(ekvs store, const char* key, size_t offset, const void* data, size_t data_sz)
+{
+   int ret = _ekvs_write_range_check(store, key, "ekvs_setrange");
+   if(ret != EKVS_OK) return ret;
+   return _ekvs_write_range(store, key, strlen(key), 0, offset, data, data_sz);
+}
+
+/* Build the whole new value, and assign it like ekvs_set_ex would */
+static int _ekvs_rewrite_range(ekvs store, uint64_t hash, const char* key, size_t key_sz,
+   const struct _ekvs_db_entry* entry, size_t offset, const void* data, size_t data_sz, size_t new_sz)
+{
+   size_t old_sz = 0;
+   const void* old_data = NULL;
+   char* value;
+   int ret;
+
+   if(entry != NULL)
+   {
+      old_data = _ekvs_entry_value(store, entry, &old_sz);
+      if(old_data == NULL && old_sz != 0)
+      {
+         store->last_error = EKVS_FILE_FAIL;
+         return EKVS_FILE_FAIL;
+      }
+   }
+
+   value = ekvs_malloc(new_sz != 0 ? new_sz : 1);
+   if(value == NULL)
+   {
+      store->last_error = EKVS_ALLOCATION_FAIL;
+      return EKVS_ALLOCATION_FAIL;
+   }
+   if(old_sz != 0) memcpy(value, old_data, old_sz);
+   if(offset > old_sz) memset(value + old_sz, 0, offset - old_sz);
+   memcpy(value + offset, data, data_sz);
+
+   ret = _ekvs_set_value(store, hash, key, key_sz, value, new_sz, 0);
+   ekvs_free(value);
+   return ret;
+}
+
+int _ekvs_write_range(ekvs store, const char* key, size_t key_sz, int append, size_t offset, const void* data, size_t data_sz)
+{
+   struct _ekvs_db_entry* entry;
+   struct _ekvs_db_entry* prev_entry = NULL;
+   size_t old_sz = 0;
+   size_t old_cap;
+   size_t new_sz;
+   uint64_t hash;
+   uint32_t pc = 0, pb = 0;
+
+   if(data == NULL && data_sz != 0)
+   {
+      fprintf(stderr, "ekvs: NULL data parameter passed with a non-zero size.\n");
+      return EKVS_FAIL;
+   }
+
+   hashlittle2(key, key_sz, &pc, &pb);
+   hash = pc + (((uint64_t)pb) << 32);
+
+   entry = store->table[hash % store->serialized.table_sz];
+   while(entry != NULL && (key_sz != entry->key_sz || memcmp(key, entry->key_data, key_sz) != 0))
+   {
+      prev_entry = entry;
+      entry = entry->chain;
+   }
+
+   if(entry != NULL && (entry->flags & EKVS_ENTRY_COMPRESSED))
+   {
+      /* Inflated in the same chain position, prev_entry is unchanged */
+      entry = _ekvs_inflate(store, hash, entry);
+      if(entry == NULL)
+      {
+         store->last_error = EKVS_ALLOCATION_FAIL;
+         return EKVS_ALLOCATION_FAIL;
+      }
+   }
+
+   if(entry != NULL && (entry->flags & (EKVS_ENTRY_INT | EKVS_ENTRY_COLLECTION)))
+   {
+      store->last_error = EKVS_WRONG_TYPE;
+      return EKVS_WRONG_TYPE;
+   }
+
+   if(entry != NULL)
+   {
+      if(entry->flags & EKVS_ENTRY_VLOG)
+      {
+         struct _ekvs_vlog_ptr ptr;
+         memcpy(&ptr, &entry->key_data[entry->key_sz], sizeof(ptr));
+         old_sz = (size_t)ptr.size;
+      }
+      else
+      {
+         old_sz = entry->data_sz;
+      }
+   }
+
+   if(append) offset = old_sz;
+   if(offset > (size_t)-1 - data_sz)
+   {
+      store->last_error = EKVS_FAIL;
+      return EKVS_FAIL;
+   }
+   new_sz = (offset + data_sz > old_sz ? offset + data_sz : old_sz);
+
+   EKVS_VIEW_PRESERVE(store, hash, key, key_sz);
+   EKVS_MARK_DIRTY(store, hash);
+
+   /* New keys are logged as a set, as are values in (or bound for) the value log */
+   if(entry == NULL || (entry->flags & EKVS_ENTRY_VLOG) ||
+      (store->vlog_threshold != 0 && new_sz >= store->vlog_threshold && store->vlog_prefix != NULL))
+   {
+      return _ekvs_rewrite_range(store, hash, key, key_sz, entry, offset, data, data_sz, new_sz);
+   }
+
+   old_cap = ((entry->flags & EKVS_ENTRY_GROWN) ? _ekvs_grown_capacity(old_sz) : old_sz);
+   if(entry->refs > 0 || new_sz > old_cap)
+   {
+      size_t old_alloc = EKVS_ENTRY_ALLOC_SIZE(entry);
+      size_t new_cap = (new_sz > old_cap ? _ekvs_grown_capacity(new_sz) : old_cap);
+      struct _ekvs_db_entry* new_entry;
+
+      if(entry->refs > 0)
+      {
+         /* Readers hold the old value, install a new version in its place */
+         new_entry = ekvs_malloc(EKVS_ENTRY_SIZE(key_sz, new_cap));
+         if(new_entry != NULL)
+         {
+            memcpy(new_entry, entry, EKVS_ENTRY_SIZE(key_sz, old_sz));
+            new_entry->refs = 0;
+            _ekvs_free_entry(store, entry);
+         }
+      }
+      else
+      {
+         new_entry = ekvs_realloc(entry, EKVS_ENTRY_SIZE(key_sz, new_cap));
+         store->entry_epoch++;
+      }
+      if(new_entry == NULL)
+      {
+         store->last_error = EKVS_ALLOCATION_FAIL;
+         return EKVS_ALLOCATION_FAIL;
+      }
+
+      if(prev_entry != NULL) prev_entry->chain = new_entry;
+      else store->table[hash % store->serialized.table_sz] = new_entry;
+
+      if(new_cap == _ekvs_grown_capacity(new_sz)) new_entry->flags |= EKVS_ENTRY_GROWN;
+      else new_entry->flags &= ~EKVS_ENTRY_GROWN;
+      store->mem_used += EKVS_ENTRY_SIZE(key_sz, new_cap);
+      store->mem_used -= old_alloc;
+      entry = new_entry;
+   }
+
+   if(offset > old_sz) memset(&entry->key_data[key_sz + old_sz], 0, offset - old_sz);
+   memcpy(&entry->key_data[key_sz + offset], data, data_sz);
+   entry->data_sz = new_sz;
+   entry->flags |= EKVS_ENTRY_ACCESSED;
+
+   if(store->binlog_enabled)
+   {
+      if(append)
+      {
+         store->last_error = _ekvs_binlog(store, EKVS_BINLOG_APPEND, 0 /* flags */, key, key_sz, data, data_sz);
+      }
+      else
+      {
+         uint64_t offset64 = offset;
+         char* delta = _ekvs_scratch(store, sizeof(offset64) + data_sz);
+         if(delta == NULL)
+         {
+            store->last_error = EKVS_ALLOCATION_FAIL;
+         }
+         else
+         {
+            memcpy(delta, &offset64, sizeof(offset64));
+            memcpy(delta + sizeof(offset64), data, data_sz);
+            store->last_error = _ekvs_binlog(store, EKVS_BINLOG_SETRANGE, 0 /* flags */, key, key_sz, delta,
+               sizeof(offset64) + data_sz);
+         }
+      }
+   }
+   else
+   {
+      store->last_error = EKVS_OK;
+   }
+
+   if(store->replaying == 0)
+   {
+      int ret = _ekvs_fit_budget(store, entry);
+      if(ret != EKVS_OK) store->last_error = ret;
+   }
+
+   return store->last_error;
+}
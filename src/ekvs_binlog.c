@@ -18,69 +18,404 @@
 
 #include "ekvs_internal.h"
 
-int _ekvs_replay_binlog_entry(ekvs store, char operation, const struct _ekvs_db_entry* entry)
+#include <unistd.h>
+
+/* The binlog is read in large chunks, and records are parsed from memory */
+#define EKVS_BINLOG_READ_CHUNK (1024 * 1024)
+
+struct _ekvs_binlog_reader {
+   FILE* file;
+   long int buf_pos;    /* File offset of buf[0] */
+   long int file_end;
+   char* buf;
+   size_t buf_len;
+   size_t buf_cap;
+   size_t rec_off;      /* Offset of the current record in buf */
+};
+
+/* Make sure at least need bytes of the current record are buffered */
+static int _ekvs_binlog_fill(struct _ekvs_binlog_reader* reader, size_t need)
+{
+   size_t avail = reader->buf_len - reader->rec_off;
+   size_t want;
+   size_t got;
+
+   if(avail >= need) return EKVS_OK;
+
+   /* Slide the partial record to the front */
+   memmove(reader->buf, reader->buf + reader->rec_off, avail);
+   reader->buf_pos += (long int)reader->rec_off;
+   reader->buf_len = avail;
+   reader->rec_off = 0;
+
+   if(reader->buf_cap < need || reader->buf_cap < EKVS_BINLOG_READ_CHUNK)
+   {
+      size_t cap = (need > EKVS_BINLOG_READ_CHUNK ? need : EKVS_BINLOG_READ_CHUNK);
+      char* buf = ekvs_realloc(reader->buf, cap);
+      if(buf == NULL) return EKVS_ALLOCATION_FAIL;
+      reader->buf = buf;
+      reader->buf_cap = cap;
+   }
+
+   want = reader->buf_cap - reader->buf_len;
+   if((long int)want > reader->file_end - (reader->buf_pos + (long int)reader->buf_len))
+   {
+      want = (size_t)(reader->file_end - (reader->buf_pos + (long int)reader->buf_len));
+   }
+   if(fseek(reader->file, reader->buf_pos + (long int)reader->buf_len, SEEK_SET) != 0) return EKVS_FILE_FAIL;
+   got = fread(reader->buf + reader->buf_len, 1, want, reader->file);
+   reader->buf_len += got;
+
+   return (reader->buf_len >= need ? EKVS_OK : EKVS_FILE_FAIL);
+}
+
+static void _ekvs_record_header(const char* rec, uint32_t* crc, char* operation, char* flags, size_t* key_sz,
+   size_t* data_sz)
+{
+   memcpy(crc, rec, sizeof(*crc));
+   memcpy(operation, rec + sizeof(*crc), sizeof(*operation));
+   memcpy(flags, rec + sizeof(*crc) + sizeof(*operation), sizeof(*flags));
+   memcpy(key_sz, rec + sizeof(*crc) + 2 * sizeof(char), sizeof(*key_sz));
+   memcpy(data_sz, rec + sizeof(*crc) + 2 * sizeof(char) + sizeof(*key_sz), sizeof(*data_sz));
+}
+
+/* Replay the records of file from start, stopping at the first which is incomplete or fails its checksum */
+int _ekvs_replay_log(ekvs store, FILE* file, long int start, long int* valid_end, long int* file_end)
+{
+   struct _ekvs_binlog_reader reader;
+   const char* rec;
+   uint32_t crc;
+   char operation;
+   char flags;
+   size_t key_sz;
+   size_t data_sz;
+   size_t remaining;
+   int ret = EKVS_OK;
+
+   memset(&reader, 0, sizeof(reader));
+   reader.file = file;
+   reader.buf_pos = start;
+
+   /* Scan to the physical end of the file; binlog_end may be behind the last complete record */
+   if(fseek(reader.file, 0, SEEK_END) != 0) return EKVS_FILE_FAIL;
+   reader.file_end = ftell(reader.file);
+   if(reader.file_end < reader.buf_pos) return EKVS_FILE_FAIL;
+
+   store->replaying = 1;
+   while(_ekvs_binlog_fill(&reader, EKVS_BINLOG_HEADER_SIZE) == EKVS_OK)
+   {
+      _ekvs_record_header(reader.buf + reader.rec_off, &crc, &operation, &flags, &key_sz, &data_sz);
+
+      /* A torn write can leave garbage lengths; bound them by the file before allocating anything */
+      remaining = (size_t)(reader.file_end - (reader.buf_pos + (long int)reader.rec_off)) - EKVS_BINLOG_HEADER_SIZE;
+      if(key_sz > remaining || data_sz > remaining - key_sz) break;
+      if(_ekvs_binlog_fill(&reader, EKVS_BINLOG_HEADER_SIZE + key_sz + data_sz) != EKVS_OK) break;
+
+      rec = reader.buf + reader.rec_off;
+      if(_ekvs_crc32c(0, rec + sizeof(crc), EKVS_BINLOG_HEADER_SIZE - sizeof(crc) + key_sz + data_sz) != crc) break;
+
+      ret = _ekvs_replay_binlog_entry(store, operation, flags, rec + EKVS_BINLOG_HEADER_SIZE, key_sz,
+         rec + EKVS_BINLOG_HEADER_SIZE + key_sz, data_sz);
+      if(ret != EKVS_OK)
+      {
+         fprintf(stderr, "ekvs: failed to replay binlog record at offset %ld.\n", reader.buf_pos + (long int)reader.rec_off);
+         break;
+      }
+      reader.rec_off += EKVS_BINLOG_HEADER_SIZE + key_sz + data_sz;
+   }
+   store->replaying = 0;
+   ekvs_free(reader.buf);
+
+   *valid_end = reader.buf_pos + (long int)reader.rec_off;
+   *file_end = reader.file_end;
+   return ret;
+}
+
+/* Replay records held in memory, which must all be complete and intact */
+int _ekvs_replay_records(ekvs store, const char* buf, size_t len, uint64_t* records)
+{
+   uint32_t crc;
+   char operation;
+   char flags;
+   size_t key_sz;
+   size_t data_sz;
+   size_t pos = 0;
+   int ret = EKVS_OK;
+
+   store->replaying = 1;
+   while(pos < len)
+   {
+      ret = EKVS_FILE_FAIL;
+      if(len - pos < EKVS_BINLOG_HEADER_SIZE) break;
+      _ekvs_record_header(buf + pos, &crc, &operation, &flags, &key_sz, &data_sz);
+      if(key_sz > len - pos - EKVS_BINLOG_HEADER_SIZE ||
+         data_sz > len - pos - EKVS_BINLOG_HEADER_SIZE - key_sz) break;
+      if(_ekvs_crc32c(0, buf + pos + sizeof(crc), EKVS_BINLOG_HEADER_SIZE - sizeof(crc) + key_sz + data_sz) != crc) break;
+
+      ret = _ekvs_replay_binlog_entry(store, operation, flags, buf + pos + EKVS_BINLOG_HEADER_SIZE, key_sz,
+         buf + pos + EKVS_BINLOG_HEADER_SIZE + key_sz, data_sz);
+      if(ret != EKVS_OK) break;
+      pos += EKVS_BINLOG_HEADER_SIZE + key_sz + data_sz;
+      (*records)++;
+   }
+   store->replaying = 0;
+
+   return ret;
+}
+
+int _ekvs_load_binlog(ekvs store)
+{
+   long int valid_end;
+   long int file_end;
+   int ret;
+
+   ret = _ekvs_replay_log(store, store->db_file, store->serialized.binlog_start, &valid_end, &file_end);
+   if(ret != EKVS_OK) return ret;
+
+   /* Drop everything after the last good record, so appends start from a clean tail */
+   store->discarded_bytes = (uint64_t)(file_end - valid_end);
+   if(valid_end != file_end || valid_end != store->serialized.binlog_end)
+   {
+      if(store->discarded_bytes != 0)
+      {
+         fprintf(stderr, "ekvs: discarded %lu bytes of damaged binlog tail.\n", (unsigned long)store->discarded_bytes);
+      }
+      store->serialized.binlog_end = valid_end;
+      if(fseek(store->db_file, 0, SEEK_SET) != 0) return EKVS_FILE_FAIL;
+      if(fwrite(&store->serialized, sizeof(store->serialized), 1, store->db_file) != 1) return EKVS_FILE_FAIL;
+      if(fflush(store->db_file) != 0) return EKVS_FILE_FAIL;
+      if(ftruncate(fileno(store->db_file), valid_end) != 0) return EKVS_FILE_FAIL;
+   }
+
+   return EKVS_OK;
+}
+
+uint64_t ekvs_discarded_bytes(ekvs store)
+{
+   return store->discarded_bytes;
+}
+
+int _ekvs_replay_binlog_entry(ekvs store, char operation, char flags, const char* key, size_t key_sz,
+   const void* data, size_t data_sz)
 {
    int ret = EKVS_OK;
-   char* key = ekvs_malloc(entry->key_sz + 1);
-   memcpy(key, entry->key_data, entry->key_sz);
-   key[entry->key_sz] = '\0';
+   void* unpacked = NULL;
+
+   /* Unpack compressed records */
+   if(flags & EKVS_RECORD_COMPRESSED)
+   {
+      size_t raw_sz = _ekvs_lz_packed_size(data, data_sz);
+      unpacked = ekvs_malloc(raw_sz != 0 ? raw_sz : 1);
+      if(unpacked == NULL) return EKVS_ALLOCATION_FAIL;
+      if(_ekvs_lz_unpack(data, data_sz, unpacked) != EKVS_OK)
+      {
+         ekvs_free(unpacked);
+         return EKVS_FILE_FAIL;
+      }
+      data = unpacked;
+      data_sz = raw_sz;
+   }
 
    switch(operation)
    {
       case EKVS_BINLOG_SET:
       {
-         const void* data = &entry->key_data[entry->key_sz];
-         ret = ekvs_set(store, key, data, entry->data_sz);
+         ret = _ekvs_set(store, _ekvs_hash(key, key_sz), key, key_sz, data, data_sz, flags & EKVS_ENTRY_PERSISTENT, 0);
          break;
       }
       case EKVS_BINLOG_DEL:
       {
-         ret = ekvs_del(store, key);
+         /* The key may already be gone if it was evicted */
+         ret = _ekvs_del(store, _ekvs_hash(key, key_sz), key, key_sz);
+         if(ret == EKVS_NO_KEY) ret = EKVS_OK;
+         break;
+      }
+      case EKVS_BINLOG_APPEND:
+      {
+         ret = _ekvs_write_range(store, key, key_sz, 1 /* append */, 0, data, data_sz);
+         break;
+      }
+      case EKVS_BINLOG_SETRANGE:
+      {
+         uint64_t offset;
+         if(data_sz < sizeof(offset))
+         {
+            ret = EKVS_FILE_FAIL;
+            break;
+         }
+         memcpy(&offset, data, sizeof(offset));
+         ret = _ekvs_write_range(store, key, key_sz, 0, (size_t)offset, (const char*)data + sizeof(offset),
+            data_sz - sizeof(offset));
+         break;
+      }
+      case EKVS_BINLOG_INCR:
+      {
+         int64_t delta;
+         if(data_sz != sizeof(delta))
+         {
+            ret = EKVS_FILE_FAIL;
+            break;
+         }
+         memcpy(&delta, data, sizeof(delta));
+         ret = _ekvs_incr(store, key, key_sz, delta, NULL);
+         break;
+      }
+      case EKVS_BINLOG_LPUSH:
+      case EKVS_BINLOG_RPUSH:
+      {
+         ret = _ekvs_list_push(store, key, key_sz, operation == EKVS_BINLOG_LPUSH, data, data_sz);
+         break;
+      }
+      case EKVS_BINLOG_LPOP:
+      case EKVS_BINLOG_RPOP:
+      {
+         const void* elem;
+         size_t elem_sz;
+         ret = _ekvs_list_pop(store, key, key_sz, operation == EKVS_BINLOG_LPOP, &elem, &elem_sz);
+         if(ret == EKVS_NO_KEY) ret = EKVS_OK;
+         break;
+      }
+      case EKVS_BINLOG_SADD:
+      {
+         ret = _ekvs_set_add(store, key, key_sz, data, data_sz, NULL);
+         break;
+      }
+      case EKVS_BINLOG_SREM:
+      {
+         ret = _ekvs_set_remove(store, key, key_sz, data, data_sz);
+         if(ret == EKVS_NO_KEY) ret = EKVS_OK;
          break;
       }
    }
 
-   ekvs_free(key);
+   ekvs_free(unpacked);
 
    return ret;
 }
 
-int _ekvs_binlog(ekvs store, char operation, char flags, const char* key, const void* data, size_t data_sz)
+size_t _ekvs_binlog_header(char* header, char operation, char flags, const char* key, size_t key_sz,
+   const void* data, size_t data_sz)
 {
-   FILE* binlog = store->db_file;
-   size_t temp;
-   struct _ekvs_db_entry entry;
-   long int binlog_end = store->serialized.binlog_end;
-   entry.flags = flags;
-   entry.key_sz = strlen(key);
-   entry.data_sz = data_sz;
-
-   /* Write binlog entry */
-   if(fseek(binlog, binlog_end, SEEK_SET) != 0) goto _ekvs_binlog_fail;
-   if(fwrite(&operation, sizeof(operation), 1, binlog) != 1) goto _ekvs_binlog_fail;
-   if(fwrite(&entry.flags, sizeof(entry.flags), 1, binlog) != 1) goto _ekvs_binlog_fail;
-   if(fwrite(&entry.key_sz, sizeof(entry.key_sz), 1, binlog) != 1) goto _ekvs_binlog_fail;
-   if(fwrite(&entry.data_sz, sizeof(entry.data_sz), 1, binlog) != 1) goto _ekvs_binlog_fail;
-   if(fwrite(key, 1, entry.key_sz, binlog) != entry.key_sz) goto _ekvs_binlog_fail;
-   if(fwrite(data, 1, entry.data_sz, binlog) != entry.data_sz) goto _ekvs_binlog_fail;
-
-   /* Update binlog end */
-   store->serialized.binlog_end = ftell(binlog);
-   if(store->serialized.binlog_end == -1L) goto _ekvs_binlog_fail;
-
-   /* TODO: Check size of binlog to see if we should write a snapshot */
-
-   /* Write new binlog end */
-   if(fseek(binlog, 0, SEEK_SET) != 0) goto _ekvs_binlog_fail;
-   if(fwrite(&store->serialized, sizeof(store->serialized), 1, binlog) != 1) goto _ekvs_binlog_fail;
-
-   /* Flush to disk */
-   if(fflush(binlog) != 0) goto _ekvs_binlog_fail;
+   uint32_t crc;
+
+   memcpy(header + sizeof(crc), &operation, sizeof(operation));
+   memcpy(header + sizeof(crc) + sizeof(operation), &flags, sizeof(flags));
+   memcpy(header + sizeof(crc) + 2 * sizeof(char), &key_sz, sizeof(key_sz));
+   memcpy(header + sizeof(crc) + 2 * sizeof(char) + sizeof(key_sz), &data_sz, sizeof(data_sz));
+   crc = _ekvs_crc32c(0, header + sizeof(crc), EKVS_BINLOG_HEADER_SIZE - sizeof(crc));
+   crc = _ekvs_crc32c(crc, key, key_sz);
+   crc = _ekvs_crc32c(crc, data, data_sz);
+   memcpy(header, &crc, sizeof(crc));
+   return EKVS_BINLOG_HEADER_SIZE + key_sz + data_sz;
+}
+
+int _ekvs_binlog(ekvs store, char operation, char flags, const char* key, size_t key_sz, const void* data, size_t data_sz)
+{
+   FILE* binlog = _ekvs_binlog_file(store);
+   long int binlog_end = (store->segment_file != NULL ? (long int)store->segment_end : store->serialized.binlog_end);
+   void* packed = NULL;
+   char header[EKVS_BINLOG_HEADER_SIZE];
+   size_t record_sz;
+   uint64_t stat_start;
+   uint64_t trace_start;
+
+   EKVS_STAT_START(stat_start);
+   EKVS_TRACE_START(store, trace_start);
+
+   /* Compress large records; data which is already packed, or only locates a value, is left alone */
+   if(store->compression == ekvs_compress_lz && data_sz >= store->compress_min_size &&
+      (flags & (EKVS_ENTRY_COMPRESSED | EKVS_ENTRY_VLOG)) == 0)
+   {
+      size_t packed_sz = _ekvs_lz_pack(data, data_sz, &packed);
+      if(packed_sz != 0)
+      {
+         flags |= EKVS_RECORD_COMPRESSED;
+         data = packed;
+         data_sz = packed_sz;
+      }
+   }
+
+   /* Frame the record */
+   record_sz = _ekvs_binlog_header(header, operation, flags, key, key_sz, data, data_sz);
+
+   /* Start a new segment rather than split a record across two */
+   if(store->segment_file != NULL && store->segment_end != 0 &&
+      store->segment_end + record_sz > store->serialized.segment_size)
+   {
+      if(_ekvs_segment_roll(store) != EKVS_OK) goto _ekvs_binlog_fail;
+      binlog = store->segment_file;
+      binlog_end = 0;
+   }
+
+   /* In-memory stores log only to their followers */
+   if(binlog == NULL)
+   {
+      EKVS_TRACE(store, ekvs_trace_binlog_write, _ekvs_hash(key, key_sz), trace_start, 0, record_sz);
+   }
+   /* Queue the record for the writer thread, which writes and flushes it in order */
+   else if(store->writer != NULL)
+   {
+      if(_ekvs_writer_append(store, header, sizeof(header)) != EKVS_OK) goto _ekvs_binlog_fail;
+      if(_ekvs_writer_append(store, key, key_sz) != EKVS_OK) goto _ekvs_binlog_fail;
+      if(_ekvs_writer_append(store, data, data_sz) != EKVS_OK) goto _ekvs_binlog_fail;
+      _ekvs_writer_publish(store);
+      EKVS_TRACE(store, ekvs_trace_binlog_write, _ekvs_hash(key, key_sz), trace_start, 0, record_sz);
+   }
+   else
+   {
+      /* Write binlog entry */
+      if(fseek(binlog, binlog_end, SEEK_SET) != 0) goto _ekvs_binlog_fail;
+      if(fwrite(header, 1, sizeof(header), binlog) != sizeof(header)) goto _ekvs_binlog_fail;
+      if(fwrite(key, 1, key_sz, binlog) != key_sz) goto _ekvs_binlog_fail;
+      if(fwrite(data, 1, data_sz, binlog) != data_sz) goto _ekvs_binlog_fail;
+
+      /* Segments are found by scanning, only the database file records where its binlog ends */
+      if(store->segment_file == NULL)
+      {
+         /* Update binlog end */
+         store->serialized.binlog_end = ftell(binlog);
+         if(store->serialized.binlog_end == -1L) goto _ekvs_binlog_fail;
+
+         /* TODO: Check size of binlog to see if we should write a snapshot */
+
+         /* Write new binlog end */
+         if(fseek(binlog, 0, SEEK_SET) != 0) goto _ekvs_binlog_fail;
+         if(fwrite(&store->serialized, sizeof(store->serialized), 1, binlog) != 1) goto _ekvs_binlog_fail;
+      }
+
+      EKVS_TRACE(store, ekvs_trace_binlog_write, _ekvs_hash(key, key_sz), trace_start, 0, record_sz);
+
+      /* Flush to disk */
+      EKVS_TRACE_START(store, trace_start);
+      if(fflush(binlog) != 0) goto _ekvs_binlog_fail;
+      EKVS_TRACE(store, ekvs_trace_binlog_flush, 0, trace_start, 0, record_sz);
+      EKVS_STAT_ADD(store, binlog_flushes, 1);
+   }
+
+   if(store->segment_file != NULL)
+   {
+      store->segment_end += record_sz;
+      store->segment_logged += record_sz;
+   }
+   else if(store->writer != NULL)
+   {
+      store->serialized.binlog_end += (long int)record_sz;
+   }
+   store->lsn += record_sz;
+
+   /* Followers are sent the record once it is logged, see ekvs_replica.c */
+   if(store->leader != NULL) _ekvs_replica_feed(store, header, key, key_sz, data, data_sz);
+
+   EKVS_STAT_ADD(store, binlog_bytes, record_sz);
+   EKVS_STAT_ADD(store, binlog_records, 1);
+   EKVS_STAT_TIME(store, binlog_write, stat_start);
 
+   ekvs_free(packed);
    return EKVS_OK;
 
 _ekvs_binlog_fail:
    /* Rollback, and return file error */
-   store->serialized.binlog_end = binlog_end;
+   ekvs_free(packed);
+   if(store->segment_file == NULL) store->serialized.binlog_end = binlog_end;
    return EKVS_FILE_FAIL;
 }
@@ -0,0 +1,265 @@
+/* -*- Mode: C; tab-width: 3; c-basic-offset: 3; indent-tabs-mode: nil -*- */
+/* vim: set filetype=C tabstop=3 softtabstop=3 shiftwidth=3 expandtab: */
+
+/* ekvs -- Copyright (C) 2011 GameClay LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "ekvs_internal.h"
+
+int ekvs_get_cache_stats(ekvs store, ekvs_cache_stats* stats)
+{
+   if(store == NULL)
+   {
+      fprintf(stderr, "ekvs: NULL store parameter passed to ekvs_get_cache_stats.\n");
+      return EKVS_FAIL;
+   }
+
+   if(stats == NULL)
+   {
+      fprintf(stderr, "ekvs: NULL stats parameter passed to ekvs_get_cache_stats.\n");
+      return EKVS_FAIL;
+   }
+
+   memcpy(stats, &store->cache_stats, sizeof(ekvs_cache_stats));
+   stats->mem_used = store->mem_used;
+   if(store->shm_map != NULL)
+   {
+      uint64_t population, table_sz;
+      _ekvs_shm_stats(store, &population, &table_sz, &stats->mem_used);
+   }
+   stats->mem_budget = store->mem_budget;
+
+   store->last_error = EKVS_OK;
+   return EKVS_OK;
+}
+
+/* Only plain values larger than a value log pointer are worth spilling. Counters
+ * are smaller than the pointer, and collections would have to be rebuilt. */
+#define EKVS_SPILLABLE(entry) \
+   (((entry)->flags & (EKVS_ENTRY_VLOG | EKVS_ENTRY_INT | EKVS_ENTRY_COLLECTION)) == 0 && \
+    (entry)->data_sz > sizeof(struct _ekvs_vlog_ptr))
+
+/* Whether the clock may take an entry, once it is no longer the one being kept */
+#define EKVS_EVICTABLE(store, entry) \
+   ((entry)->refs == 0 && ((store)->spill_cold == 0 || EKVS_SPILLABLE(entry)))
+
+/* Move the value of an entry to the value log, leaving the key and a pointer in
+ * the same chain position. Nothing is logged, the value has not changed. */
+static int _ekvs_spill(ekvs store, uint64_t bucket, struct _ekvs_db_entry* entry,
+   struct _ekvs_db_entry* prev_entry, size_t* spilled_sz)
+{
+   struct _ekvs_db_entry* spilled;
+   struct _ekvs_vlog_ptr ptr;
+   const void* data;
+   size_t data_sz;
+   int ret;
+
+   data = _ekvs_entry_value(store, entry, &data_sz);
+   if(data == NULL) return EKVS_ALLOCATION_FAIL;
+
+   spilled = ekvs_malloc(EKVS_ENTRY_SIZE(entry->key_sz, sizeof(ptr)));
+   if(spilled == NULL) return EKVS_ALLOCATION_FAIL;
+   ret = _ekvs_vlog_append(store, entry->key_data, entry->key_sz, data, data_sz, &ptr);
+   if(ret != EKVS_OK)
+   {
+      ekvs_free(spilled);
+      return ret;
+   }
+
+   spilled->chain = entry->chain;
+   spilled->flags = EKVS_ENTRY_VLOG | EKVS_ENTRY_SPILLED;
+   spilled->refs = 0;
+   spilled->key_sz = entry->key_sz;
+   spilled->data_sz = sizeof(ptr);
+   memcpy(spilled->key_data, entry->key_data, entry->key_sz);
+   memcpy(&spilled->key_data[entry->key_sz], &ptr, sizeof(ptr));
+
+   if(prev_entry != NULL) prev_entry->chain = spilled;
+   else store->table[bucket] = spilled;
+   store->mem_used -= EKVS_ENTRY_ALLOC_SIZE(entry);
+   store->mem_used += EKVS_ENTRY_SIZE(spilled->key_sz, spilled->data_sz);
+   _ekvs_free_entry(store, entry);
+
+   *spilled_sz = data_sz;
+   return EKVS_OK;
+}
+
+/* Read a spilled value back into the table, in the same chain position. Values
+ * which are large enough for the value log anyway are left there. */
+int _ekvs_unspill(ekvs store, uint64_t hash, struct _ekvs_db_entry** entry)
+{
+   struct _ekvs_db_entry** link = &store->table[hash % store->serialized.table_sz];
+   struct _ekvs_db_entry* spilled = *entry;
+   struct _ekvs_db_entry* resident;
+   struct _ekvs_vlog_ptr ptr;
+   const void* data;
+
+   memcpy(&ptr, &spilled->key_data[spilled->key_sz], sizeof(ptr));
+   if(store->vlog_threshold != 0 && ptr.size >= store->vlog_threshold)
+   {
+      spilled->flags &= ~EKVS_ENTRY_SPILLED;
+      return EKVS_OK;
+   }
+
+   data = _ekvs_vlog_read(store, &ptr);
+   if(data == NULL && ptr.size != 0)
+   {
+      store->last_error = EKVS_FILE_FAIL;
+      return EKVS_FILE_FAIL;
+   }
+
+   resident = ekvs_malloc(EKVS_ENTRY_SIZE(spilled->key_sz, (size_t)ptr.size));
+   if(resident == NULL)
+   {
+      store->last_error = EKVS_ALLOCATION_FAIL;
+      return EKVS_ALLOCATION_FAIL;
+   }
+   resident->chain = spilled->chain;
+   resident->flags = spilled->flags & ~(EKVS_ENTRY_VLOG | EKVS_ENTRY_SPILLED);
+   resident->refs = 0;
+   resident->key_sz = spilled->key_sz;
+   resident->data_sz = (size_t)ptr.size;
+   memcpy(resident->key_data, spilled->key_data, spilled->key_sz);
+   memcpy(&resident->key_data[resident->key_sz], data, resident->data_sz);
+
+   while(*link != spilled) link = &(*link)->chain;
+   *link = resident;
+
+   store->mem_used += EKVS_ENTRY_SIZE(resident->key_sz, resident->data_sz);
+   store->mem_used -= EKVS_ENTRY_ALLOC_SIZE(spilled);
+   store->cache_stats.faults++;
+   store->evict_stalled = 0;
+   _ekvs_free_entry(store, spilled);
+   *entry = resident;
+   return EKVS_OK;
+}
+
+/* Evict a single entry using the CLOCK approximation of LRU. The hand sweeps
+ * the table one bucket at a time; entries read since the last sweep have
+ * EKVS_ENTRY_ACCESSED set, and get a second chance. Pinned entries are skipped,
+ * evicting them would not free anything. With spill_cold, the victim's value is
+ * moved to the value log instead, and entries which cannot be spilled are skipped.
+ *
+ * A sweep which finds nothing costs two revolutions, so it is remembered. Every
+ * write over the budget comes back here with the entry it keeps, so until then
+ * only the entry kept by the previous call can have become a victim; releasing
+ * a pin, reading a value back in, or going under the budget forgets the sweep. */
+int _ekvs_evict(ekvs store, const struct _ekvs_db_entry* keep)
+{
+   struct _ekvs_db_entry* entry;
+   struct _ekvs_db_entry* prev_entry;
+   uint64_t bucket;
+   uint64_t hash;
+   uint32_t pc, pb;
+   uint64_t swept = 0;
+   uint64_t table_sz = store->serialized.table_sz;
+   uint64_t trace_start;
+
+   if(store->evict_stalled && !store->evict_stalled_victim)
+   {
+      store->evict_stalled_victim = (keep != NULL && EKVS_EVICTABLE(store, keep));
+      return EKVS_FAIL;
+   }
+   store->evict_stalled = 0;
+
+   EKVS_TRACE_START(store, trace_start);
+
+   /* Two full revolutions clear every access bit, so anything evictable has been seen */
+   while(swept <= table_sz * 2)
+   {
+      bucket = store->clock_hand % table_sz;
+      prev_entry = NULL;
+      entry = store->table[bucket];
+      while(entry != NULL)
+      {
+         if(entry != keep && EKVS_EVICTABLE(store, entry))
+         {
+            if(entry->flags & EKVS_ENTRY_ACCESSED)
+            {
+               entry->flags &= ~EKVS_ENTRY_ACCESSED;
+            }
+            else if(store->spill_cold)
+            {
+               size_t spilled_sz;
+               int ret = _ekvs_spill(store, bucket, entry, prev_entry, &spilled_sz);
+               if(ret != EKVS_OK) return ret;
+
+               /* The victim was replaced in place */
+               entry = (prev_entry != NULL ? prev_entry->chain : store->table[bucket]);
+               store->cache_stats.spills++;
+               EKVS_TRACE(store, ekvs_trace_evict, _ekvs_hash(entry->key_data, entry->key_sz), trace_start,
+                  swept + 1, spilled_sz);
+               return EKVS_OK;
+            }
+            else
+            {
+               /* Leave the hand on this bucket, it may hold more victims */
+               if(store->evict_callback != NULL)
+               {
+                  size_t data_sz;
+                  const void* data = _ekvs_entry_value(store, entry, &data_sz);
+                  store->evict_callback(store->evict_ctx, entry->key_data, entry->key_sz, data, data_sz);
+               }
+
+               /* Keep the binlog consistent with what is resident; an entry which cannot be logged stays */
+               if(store->binlog_enabled)
+               {
+                  int ret = _ekvs_binlog(store, EKVS_BINLOG_DEL, 0 /* flags */, entry->key_data, entry->key_sz, NULL, 0);
+                  if(ret != EKVS_OK) return ret;
+               }
+
+               pc = pb = 0;
+               hashlittle2(entry->key_data, entry->key_sz, &pc, &pb);
+               hash = pc + (((uint64_t)pb) << 32);
+               _ekvs_remove(store, hash, entry, prev_entry);
+               store->cache_stats.evictions++;
+               EKVS_TRACE(store, ekvs_trace_evict, hash, trace_start, swept + 1, 0);
+               return EKVS_OK;
+            }
+         }
+         prev_entry = entry;
+         entry = entry->chain;
+      }
+      store->clock_hand = bucket + 1;
+      swept++;
+   }
+
+   store->evict_stalled = 1;
+   store->evict_stalled_victim = (keep != NULL && EKVS_EVICTABLE(store, keep));
+   return EKVS_FAIL;
+}
+
+/* Evict until the budget is met, keeping keep. Running out of victims leaves the
+ * store over its budget, which is not an error; failing to log or spill one is. */
+int _ekvs_fit_budget(ekvs store, const struct _ekvs_db_entry* keep)
+{
+   int ret;
+
+   if(store->mem_budget == 0) return EKVS_OK;
+   if(store->mem_used <= store->mem_budget)
+   {
+      /* Writes under the budget do not come through _ekvs_evict */
+      store->evict_stalled = 0;
+      return EKVS_OK;
+   }
+
+   while(store->mem_used > store->mem_budget)
+   {
+      ret = _ekvs_evict(store, keep);
+      if(ret == EKVS_FAIL) return EKVS_OK;
+      if(ret != EKVS_OK) return ret;
+   }
+   return EKVS_OK;
+}
@@ -0,0 +1,1450 @@
+/* -*- Mode: C; tab-width: 3; c-basic-offset: 3; indent-tabs-mode: nil -*- */
+/* vim: set filetype=C tabstop=3 softtabstop=3 shiftwidth=3 expandtab: */
+
+/* ekvs -- Copyright (C) 2011 GameClay LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "ekvs_internal.h"
+
+/* Lists and sets are entries flagged EKVS_ENTRY_COLLECTION. The first byte of
+ * the value is its encoding. Small collections are stored flat in the entry,
+ * as [encoding][int width][uint64_t count] followed by either packed elements
+ * ([varint size][bytes], the listpack and setpack encodings) or sorted native
+ * integers (the intset encoding). When a collection outgrows the limits in
+ * ekvs_internal.h, the value becomes [encoding][pointer] to a quicklist or
+ * hash set, and snapshots write it back out in the flat form. Oversized flat
+ * values found after loading are upgraded on first use.
+ *
+ * Every mutation logs one element-level binlog record, which replay applies
+ * through the same functions; a list or set which becomes empty is removed. */
+
+#define EKVS_COLL_LISTPACK    1
+#define EKVS_COLL_QUICKLIST   2
+#define EKVS_COLL_INTSET      3
+#define EKVS_COLL_SETPACK     4
+#define EKVS_COLL_HASHSET     5
+
+#define EKVS_COLL_HEADER      (2 + sizeof(uint64_t))
+#define EKVS_COLL_OBJECT      (1 + sizeof(void*))
+
+#define EKVS_COLL_LIST        0
+#define EKVS_COLL_SET         1
+
+struct _ekvs_ql_node {
+   struct _ekvs_ql_node* prev;
+   struct _ekvs_ql_node* next;
+   uint64_t count;
+   size_t sz;
+   size_t cap;
+   char* body;                /* Packed elements */
+};
+
+struct _ekvs_quicklist {
+   struct _ekvs_ql_node* head;
+   struct _ekvs_ql_node* tail;
+   uint64_t count;
+   size_t bytes;              /* Allocated, for the memory budget */
+};
+
+struct _ekvs_set_elem {
+   uint64_t hash;
+   size_t sz;
+   char data[1];
+};
+
+#define EKVS_SET_ELEM_SIZE(sz) (sizeof(struct _ekvs_set_elem) + (sz) - 1)
+
+/* Open addressing with linear probing, and backward shift deletion */
+struct _ekvs_hashset {
+   struct _ekvs_set_elem** slots;
+   uint64_t slot_count;       /* Power of two */
+   uint64_t count;
+   size_t bytes;              /* Allocated, for the memory budget */
+};
+
+/************************** Packed elements **************************/
+
+static size_t _ekvs_varint_size(size_t v)
+{
+   size_t n = 1;
+   while(v >= 0x80)
+   {
+      v >>= 7;
+      n++;
+   }
+   return n;
+}
+
+static size_t _ekvs_varint_put(char* dst, size_t v)
+{
+   size_t n = 0;
+   while(v >= 0x80)
+   {
+      dst[n++] = (char)((v & 0x7f) | 0x80);
+      v >>= 7;
+   }
+   dst[n++] = (char)v;
+   return n;
+}
+
+/* Returns the number of bytes read, or 0 if the varint is truncated */
+static size_t _ekvs_varint_get(const char* src, size_t avail, size_t* v)
+{
+   size_t n = 0;
+   unsigned shift = 0;
+
+   *v = 0;
+   while(n < avail && shift < sizeof(size_t) * 8)
+   {
+      unsigned char b = (unsigned char)src[n++];
+      *v |= (size_t)(b & 0x7f) << shift;
+      if((b & 0x80) == 0) return n;
+      shift += 7;
+   }
+   return 0;
+}
+
+/* Read the element at pos, returning the position after it, or 0 if it is malformed */
+static size_t _ekvs_pack_elem(const char* body, size_t body_sz, size_t pos, const char** elem, size_t* elem_sz)
+{
+   size_t len_sz = _ekvs_varint_get(body + pos, body_sz - pos, elem_sz);
+   if(len_sz == 0 || *elem_sz > body_sz - pos - len_sz) return 0;
+   *elem = body + pos + len_sz;
+   return pos + len_sz + *elem_sz;
+}
+
+static size_t _ekvs_pack_put(char* dst, const void* elem, size_t elem_sz)
+{
+   size_t n = _ekvs_varint_put(dst, elem_sz);
+   if(elem_sz != 0) memcpy(dst + n, elem, elem_sz);
+   return n + elem_sz;
+}
+
+/* Find the element at one end of a packed body, as [start, end) */
+static int _ekvs_pack_end(const char* body, size_t body_sz, int head, size_t* start, size_t* end)
+{
+   const char* elem;
+   size_t elem_sz;
+   size_t pos = 0;
+
+   if(body_sz == 0) return EKVS_FILE_FAIL;
+   do
+   {
+      *start = pos;
+      pos = _ekvs_pack_elem(body, body_sz, pos, &elem, &elem_sz);
+      if(pos == 0) return EKVS_FILE_FAIL;
+   } while(!head && pos < body_sz);
+   *end = pos;
+   return EKVS_OK;
+}
+
+/************************** Integers **************************/
+
+#define EKVS_INT64_MAX ((int64_t)(((uint64_t)1 << 63) - 1))
+
+/* Only canonical decimal text is stored as an integer, so it formats back identically */
+static int _ekvs_elem_int(const void* elem, size_t sz, int64_t* v)
+{
+   const char* text = elem;
+   uint64_t magnitude = 0;
+   uint64_t limit;
+   int negative;
+   size_t i;
+
+   if(sz == 0 || sz > 20) return 0;
+   negative = (text[0] == '-');
+   i = (size_t)negative;
+   if(i == sz || (text[i] == '0' && (sz > i + 1 || negative))) return 0;
+
+   limit = (negative ? (uint64_t)EKVS_INT64_MAX + 1 : (uint64_t)EKVS_INT64_MAX);
+   for(; i < sz; i++)
+   {
+      unsigned digit = (unsigned char)text[i] - '0';
+      if(digit > 9 || magnitude > (limit - digit) / 10) return 0;
+      magnitude = magnitude * 10 + digit;
+   }
+
+   if(negative) *v = (magnitude == (uint64_t)EKVS_INT64_MAX + 1 ? -EKVS_INT64_MAX - 1 : -(int64_t)magnitude);
+   else *v = (int64_t)magnitude;
+   return 1;
+}
+
+/* Formatted by hand, since long may be narrower than the values _ekvs_elem_int accepts */
+static size_t _ekvs_int_format(char* buf, int64_t v)
+{
+   char digits[20];
+   uint64_t magnitude = (v < 0 ? (uint64_t)0 - (uint64_t)v : (uint64_t)v);
+   size_t n = 0, sz = 0;
+
+   do
+   {
+      digits[n++] = (char)('0' + magnitude % 10);
+      magnitude /= 10;
+   } while(magnitude != 0);
+
+   if(v < 0) buf[sz++] = '-';
+   while(n > 0) buf[sz++] = digits[--n];
+   buf[sz] = '\0';
+   return sz;
+}
+
+static unsigned _ekvs_int_width(int64_t v)
+{
+   if(v >= -32768 && v <= 32767) return sizeof(int16_t);
+   if(v >= -2147483647L - 1 && v <= 2147483647L) return sizeof(int32_t);
+   return sizeof(int64_t);
+}
+
+static int64_t _ekvs_intset_get(const char* ints, unsigned width, uint64_t i)
+{
+   int16_t v16;
+   int32_t v32;
+   int64_t v64;
+
+   switch(width)
+   {
+      case sizeof(int16_t): memcpy(&v16, ints + i * width, width); return v16;
+      case sizeof(int32_t): memcpy(&v32, ints + i * width, width); return v32;
+   }
+   memcpy(&v64, ints + i * width, width);
+   return v64;
+}
+
+static void _ekvs_intset_put(char* ints, unsigned width, uint64_t i, int64_t v)
+{
+   int16_t v16 = (int16_t)v;
+   int32_t v32 = (int32_t)v;
+
+   switch(width)
+   {
+      case sizeof(int16_t): memcpy(ints + i * width, &v16, width); return;
+      case sizeof(int32_t): memcpy(ints + i * width, &v32, width); return;
+   }
+   memcpy(ints + i * width, &v, width);
+}
+
+/* Returns 1 if found; pos is the index of v, or where it would be inserted */
+static int _ekvs_intset_search(const char* ints, unsigned width, uint64_t count, int64_t v, uint64_t* pos)
+{
+   uint64_t lo = 0, hi = count;
+
+   while(lo < hi)
+   {
+      uint64_t mid = lo + (hi - lo) / 2;
+      int64_t cur = _ekvs_intset_get(ints, width, mid);
+      if(cur == v)
+      {
+         *pos = mid;
+         return 1;
+      }
+      if(cur < v) lo = mid + 1;
+      else hi = mid;
+   }
+   *pos = lo;
+   return 0;
+}
+
+/************************** Quicklist **************************/
+
+static void _ekvs_ql_unlink(struct _ekvs_quicklist* ql, struct _ekvs_ql_node* node)
+{
+   if(node->prev != NULL) node->prev->next = node->next;
+   else ql->head = node->next;
+   if(node->next != NULL) node->next->prev = node->prev;
+   else ql->tail = node->prev;
+   ql->bytes -= sizeof(struct _ekvs_ql_node) + node->cap;
+   ekvs_free(node->body);
+   ekvs_free(node);
+}
+
+static void _ekvs_ql_free(struct _ekvs_quicklist* ql)
+{
+   while(ql->head != NULL) _ekvs_ql_unlink(ql, ql->head);
+   ekvs_free(ql);
+}
+
+static int _ekvs_ql_push(struct _ekvs_quicklist* ql, int head, const void* elem, size_t elem_sz)
+{
+   size_t need = _ekvs_varint_size(elem_sz) + elem_sz;
+   struct _ekvs_ql_node* node = (head ? ql->head : ql->tail);
+
+   /* Start a new node once the end one is full */
+   if(node == NULL || (node->count > 0 && node->sz + need > EKVS_QUICKLIST_NODE_BYTES))
+   {
+      node = ekvs_malloc(sizeof(struct _ekvs_ql_node));
+      if(node == NULL) return EKVS_ALLOCATION_FAIL;
+      memset(node, 0, sizeof(struct _ekvs_ql_node));
+      if(head)
+      {
+         node->next = ql->head;
+         if(ql->head != NULL) ql->head->prev = node;
+         else ql->tail = node;
+         ql->head = node;
+      }
+      else
+      {
+         node->prev = ql->tail;
+         if(ql->tail != NULL) ql->tail->next = node;
+         else ql->head = node;
+         ql->tail = node;
+      }
+      ql->bytes += sizeof(struct _ekvs_ql_node);
+   }
+
+   if(node->cap - node->sz < need)
+   {
+      size_t cap = _ekvs_grown_capacity(node->sz + need);
+      char* body = ekvs_realloc(node->body, cap);
+      if(body == NULL)
+      {
+         if(node->count == 0) _ekvs_ql_unlink(ql, node);
+         return EKVS_ALLOCATION_FAIL;
+      }
+      ql->bytes += cap - node->cap;
+      node->body = body;
+      node->cap = cap;
+   }
+
+   if(head)
+   {
+      memmove(node->body + need, node->body, node->sz);
+      _ekvs_pack_put(node->body, elem, elem_sz);
+   }
+   else
+   {
+      _ekvs_pack_put(node->body + node->sz, elem, elem_sz);
+   }
+   node->sz += need;
+   node->count++;
+   ql->count++;
+   return EKVS_OK;
+}
+
+/* The element is copied to the scratch buffer */
+static int _ekvs_ql_pop(ekvs store, struct _ekvs_quicklist* ql, int head, const void** elem, size_t* elem_sz)
+{
+   struct _ekvs_ql_node* node = (head ? ql->head : ql->tail);
+   const char* found;
+   size_t start, end;
+   void* out;
+
+   if(node == NULL) return EKVS_NO_KEY;
+   if(_ekvs_pack_end(node->body, node->sz, head, &start, &end) != EKVS_OK) return EKVS_FILE_FAIL;
+   _ekvs_pack_elem(node->body, node->sz, start, &found, elem_sz);
+   out = _ekvs_scratch(store, *elem_sz);
+   if(out == NULL) return EKVS_ALLOCATION_FAIL;
+   memcpy(out, found, *elem_sz);
+   *elem = out;
+
+   memmove(node->body + start, node->body + end, node->sz - end);
+   node->sz -= end - start;
+   node->count--;
+   ql->count--;
+   if(node->count == 0) _ekvs_ql_unlink(ql, node);
+   return EKVS_OK;
+}
+
+/************************** Hash set **************************/
+
+static uint64_t _ekvs_elem_hash(const void* elem, size_t sz)
+{
+   uint32_t pc = 0, pb = 0;
+   hashlittle2(elem, sz, &pc, &pb);
+   return pc + (((uint64_t)pb) << 32);
+}
+
+/* Returns the slot holding the element, or the empty slot where it belongs */
+static uint64_t _ekvs_hs_find(const struct _ekvs_hashset* hs, uint64_t hash, const void* elem, size_t sz)
+{
+   uint64_t mask = hs->slot_count - 1;
+   uint64_t slot = hash & mask;
+   const struct _ekvs_set_elem* cur;
+
+   while((cur = hs->slots[slot]) != NULL)
+   {
+      if(cur->hash == hash && cur->sz == sz && memcmp(cur->data, elem, sz) == 0) break;
+      slot = (slot + 1) & mask;
+   }
+   return slot;
+}
+
+static int _ekvs_hs_resize(struct _ekvs_hashset* hs, uint64_t slot_count)
+{
+   struct _ekvs_set_elem** old_slots = hs->slots;
+   uint64_t old_count = hs->slot_count;
+   uint64_t i;
+
+   hs->slots = ekvs_malloc((size_t)slot_count * sizeof(struct _ekvs_set_elem*));
+   if(hs->slots == NULL)
+   {
+      hs->slots = old_slots;
+      return EKVS_ALLOCATION_FAIL;
+   }
+   memset(hs->slots, 0, (size_t)slot_count * sizeof(struct _ekvs_set_elem*));
+   hs->slot_count = slot_count;
+   for(i = 0; i < old_count; i++)
+   {
+      if(old_slots[i] == NULL) continue;
+      hs->slots[_ekvs_hs_find(hs, old_slots[i]->hash, old_slots[i]->data, old_slots[i]->sz)] = old_slots[i];
+   }
+   hs->bytes += (size_t)(slot_count - old_count) * sizeof(struct _ekvs_set_elem*);
+   ekvs_free(old_slots);
+   return EKVS_OK;
+}
+
+static struct _ekvs_hashset* _ekvs_hs_new(uint64_t expected)
+{
+   struct _ekvs_hashset* hs = ekvs_malloc(sizeof(struct _ekvs_hashset));
+   uint64_t slot_count = 16;
+
+   if(hs == NULL) return NULL;
+   while(slot_count < expected * 2) slot_count <<= 1;
+   memset(hs, 0, sizeof(struct _ekvs_hashset));
+   hs->bytes = sizeof(struct _ekvs_hashset);
+   if(_ekvs_hs_resize(hs, slot_count) != EKVS_OK)
+   {
+      ekvs_free(hs);
+      return NULL;
+   }
+   return hs;
+}
+
+static void _ekvs_hs_free(struct _ekvs_hashset* hs)
+{
+   uint64_t i;
+   for(i = 0; i < hs->slot_count; i++) ekvs_free(hs->slots[i]);
+   ekvs_free(hs->slots);
+   ekvs_free(hs);
+}
+
+static int _ekvs_hs_add(struct _ekvs_hashset* hs, const void* elem, size_t sz, int* added)
+{
+   uint64_t hash = _ekvs_elem_hash(elem, sz);
+   struct _ekvs_set_elem* new_elem;
+   uint64_t slot;
+
+   *added = 0;
+   if((hs->count + 1) * 4 > hs->slot_count * 3)
+   {
+      if(_ekvs_hs_resize(hs, hs->slot_count * 2) != EKVS_OK) return EKVS_ALLOCATION_FAIL;
+   }
+
+   slot = _ekvs_hs_find(hs, hash, elem, sz);
+   if(hs->slots[slot] != NULL) return EKVS_OK;
+
+   new_elem = ekvs_malloc(EKVS_SET_ELEM_SIZE(sz));
+   if(new_elem == NULL) return EKVS_ALLOCATION_FAIL;
+   new_elem->hash = hash;
+   new_elem->sz = sz;
+   if(sz != 0) memcpy(new_elem->data, elem, sz);
+   hs->slots[slot] = new_elem;
+   hs->count++;
+   hs->bytes += EKVS_SET_ELEM_SIZE(sz);
+   *added = 1;
+   return EKVS_OK;
+}
+
+static int _ekvs_hs_remove(struct _ekvs_hashset* hs, const void* elem, size_t sz)
+{
+   uint64_t mask = hs->slot_count - 1;
+   uint64_t hole = _ekvs_hs_find(hs, _ekvs_elem_hash(elem, sz), elem, sz);
+   uint64_t next;
+
+   if(hs->slots[hole] == NULL) return EKVS_NO_KEY;
+   hs->bytes -= EKVS_SET_ELEM_SIZE(hs->slots[hole]->sz);
+   ekvs_free(hs->slots[hole]);
+   hs->count--;
+
+   /* Pull back any element whose probe sequence passes through the hole */
+   for(next = (hole + 1) & mask; hs->slots[next] != NULL; next = (next + 1) & mask)
+   {
+      uint64_t home = hs->slots[next]->hash & mask;
+      if(((next - home) & mask) >= ((next - hole) & mask))
+      {
+         hs->slots[hole] = hs->slots[next];
+         hole = next;
+      }
+   }
+   hs->slots[hole] = NULL;
+   return EKVS_OK;
+}
+
+/************************** Entries **************************/
+
+static unsigned char _ekvs_coll_encoding(const struct _ekvs_db_entry* entry)
+{
+   return (unsigned char)entry->key_data[entry->key_sz];
+}
+
+static void* _ekvs_coll_object(const struct _ekvs_db_entry* entry)
+{
+   void* object;
+   memcpy(&object, &entry->key_data[entry->key_sz + 1], sizeof(object));
+   return object;
+}
+
+static uint64_t _ekvs_coll_count(const struct _ekvs_db_entry* entry)
+{
+   uint64_t count;
+   switch(_ekvs_coll_encoding(entry))
+   {
+      case EKVS_COLL_QUICKLIST: return ((struct _ekvs_quicklist*)_ekvs_coll_object(entry))->count;
+      case EKVS_COLL_HASHSET: return ((struct _ekvs_hashset*)_ekvs_coll_object(entry))->count;
+   }
+   memcpy(&count, &entry->key_data[entry->key_sz + 2], sizeof(count));
+   return count;
+}
+
+static void _ekvs_coll_set_count(struct _ekvs_db_entry* entry, uint64_t count)
+{
+   memcpy(&entry->key_data[entry->key_sz + 2], &count, sizeof(count));
+}
+
+size_t _ekvs_coll_bytes(const struct _ekvs_db_entry* entry)
+{
+   switch(_ekvs_coll_encoding(entry))
+   {
+      case EKVS_COLL_QUICKLIST: return ((struct _ekvs_quicklist*)_ekvs_coll_object(entry))->bytes;
+      case EKVS_COLL_HASHSET: return ((struct _ekvs_hashset*)_ekvs_coll_object(entry))->bytes;
+   }
+   return 0;
+}
+
+/* Resize the value of a collection, keeping its chain position. The allocation
+ * always holds _ekvs_grown_capacity(data_sz) bytes, so growth is amortized. */
+static struct _ekvs_db_entry* _ekvs_coll_resize(ekvs store, uint64_t hash, struct _ekvs_db_entry* entry, size_t data_sz)
+{
+   struct _ekvs_db_entry** link = &store->table[hash % store->serialized.table_sz];
+   struct _ekvs_db_entry* resized;
+   size_t old_alloc = EKVS_ENTRY_ALLOC_SIZE(entry);
+   size_t cap = _ekvs_grown_capacity(data_sz);
+
+   if((entry->flags & EKVS_ENTRY_GROWN) && _ekvs_grown_capacity(entry->data_sz) == cap)
+   {
+      entry->data_sz = data_sz;
+      return entry;
+   }
+
+   resized = ekvs_realloc(entry, EKVS_ENTRY_SIZE(entry->key_sz, cap));
+   store->entry_epoch++;
+   if(resized == NULL)
+   {
+      if(data_sz > entry->data_sz) return NULL;
+      /* A failed shrink keeps the larger block, which is only an accounting error */
+      entry->data_sz = data_sz;
+      return entry;
+   }
+   while(*link != entry) link = &(*link)->chain;
+   *link = resized;
+   resized->flags |= EKVS_ENTRY_GROWN;
+   resized->data_sz = data_sz;
+   store->mem_used += EKVS_ENTRY_SIZE(resized->key_sz, cap);
+   store->mem_used -= old_alloc;
+   return resized;
+}
+
+/* Point a collection at a quicklist or hash set, replacing its flat value */
+static struct _ekvs_db_entry* _ekvs_coll_attach(ekvs store, uint64_t hash, struct _ekvs_db_entry* entry,
+   unsigned char encoding, void* object, size_t object_bytes)
+{
+   entry = _ekvs_coll_resize(store, hash, entry, EKVS_COLL_OBJECT);
+   if(entry == NULL) return NULL;
+   entry->key_data[entry->key_sz] = (char)encoding;
+   memcpy(&entry->key_data[entry->key_sz + 1], &object, sizeof(object));
+   store->mem_used += object_bytes;
+   return entry;
+}
+
+static struct _ekvs_db_entry* _ekvs_coll_to_quicklist(ekvs store, uint64_t hash, struct _ekvs_db_entry* entry)
+{
+   struct _ekvs_quicklist* ql = ekvs_malloc(sizeof(struct _ekvs_quicklist));
+   const char* body = &entry->key_data[entry->key_sz + EKVS_COLL_HEADER];
+   size_t body_sz = entry->data_sz - EKVS_COLL_HEADER;
+   size_t pos = 0;
+
+   if(ql == NULL) return NULL;
+   memset(ql, 0, sizeof(struct _ekvs_quicklist));
+   ql->bytes = sizeof(struct _ekvs_quicklist);
+   while(pos < body_sz)
+   {
+      const char* elem;
+      size_t elem_sz;
+      pos = _ekvs_pack_elem(body, body_sz, pos, &elem, &elem_sz);
+      if(pos == 0 || _ekvs_ql_push(ql, 0 /* tail */, elem, elem_sz) != EKVS_OK)
+      {
+         _ekvs_ql_free(ql);
+         return NULL;
+      }
+   }
+
+   entry = _ekvs_coll_attach(store, hash, entry, EKVS_COLL_QUICKLIST, ql, ql->bytes);
+   if(entry == NULL) _ekvs_ql_free(ql);
+   return entry;
+}
+
+static struct _ekvs_db_entry* _ekvs_coll_to_hashset(ekvs store, uint64_t hash, struct _ekvs_db_entry* entry)
+{
+   const char* data = &entry->key_data[entry->key_sz];
+   uint64_t count = _ekvs_coll_count(entry);
+   struct _ekvs_hashset* hs = _ekvs_hs_new(count);
+   int added;
+   uint64_t i;
+
+   if(hs == NULL) return NULL;
+   if(data[0] == EKVS_COLL_INTSET)
+   {
+      char text[24];
+      for(i = 0; i < count; i++)
+      {
+         int64_t v = _ekvs_intset_get(data + EKVS_COLL_HEADER, (unsigned char)data[1], i);
+         if(_ekvs_hs_add(hs, text, _ekvs_int_format(text, v), &added) != EKVS_OK) goto _ekvs_coll_to_hashset_fail;
+      }
+   }
+   else
+   {
+      const char* body = data + EKVS_COLL_HEADER;
+      size_t body_sz = entry->data_sz - EKVS_COLL_HEADER;
+      size_t pos = 0;
+      while(pos < body_sz)
+      {
+         const char* elem;
+         size_t elem_sz;
+         pos = _ekvs_pack_elem(body, body_sz, pos, &elem, &elem_sz);
+         if(pos == 0 || _ekvs_hs_add(hs, elem, elem_sz, &added) != EKVS_OK) goto _ekvs_coll_to_hashset_fail;
+      }
+   }
+
+   entry = _ekvs_coll_attach(store, hash, entry, EKVS_COLL_HASHSET, hs, hs->bytes);
+   if(entry != NULL) return entry;
+
+_ekvs_coll_to_hashset_fail:
+   _ekvs_hs_free(hs);
+   return NULL;
+}
+
+static struct _ekvs_db_entry* _ekvs_coll_intset_to_setpack(ekvs store, uint64_t hash, struct _ekvs_db_entry* entry)
+{
+   uint64_t count = _ekvs_coll_count(entry);
+   unsigned width = (unsigned char)entry->key_data[entry->key_sz + 1];
+   char* packed = ekvs_malloc((size_t)count * 21 + 1);
+   size_t packed_sz = 0;
+   char text[24];
+   uint64_t i;
+
+   if(packed == NULL) return NULL;
+   for(i = 0; i < count; i++)
+   {
+      int64_t v = _ekvs_intset_get(&entry->key_data[entry->key_sz + EKVS_COLL_HEADER], width, i);
+      packed_sz += _ekvs_pack_put(packed + packed_sz, text, _ekvs_int_format(text, v));
+   }
+
+   entry = _ekvs_coll_resize(store, hash, entry, EKVS_COLL_HEADER + packed_sz);
+   if(entry != NULL)
+   {
+      entry->key_data[entry->key_sz] = EKVS_COLL_SETPACK;
+      entry->key_data[entry->key_sz + 1] = 0;
+      memcpy(&entry->key_data[entry->key_sz + EKVS_COLL_HEADER], packed, packed_sz);
+   }
+   ekvs_free(packed);
+   return entry;
+}
+
+/* Find a list or set, upgrading a flat value which is over the limits */
+static int _ekvs_coll_lookup(ekvs store, const char* key, size_t key_sz, int kind, uint64_t* hash,
+   struct _ekvs_db_entry** entry)
+{
+   uint32_t pc = 0, pb = 0;
+   unsigned char encoding;
+   uint64_t count;
+
+   hashlittle2(key, key_sz, &pc, &pb);
+   *hash = pc + (((uint64_t)pb) << 32);
+   *entry = _ekvs_retrieve(store, *hash, key, key_sz);
+   if(*entry == NULL) return EKVS_OK;
+
+   if(((*entry)->flags & EKVS_ENTRY_COLLECTION) == 0 || (*entry)->data_sz < 1) return EKVS_WRONG_TYPE;
+   encoding = _ekvs_coll_encoding(*entry);
+   if(kind == EKVS_COLL_LIST && encoding != EKVS_COLL_LISTPACK && encoding != EKVS_COLL_QUICKLIST) return EKVS_WRONG_TYPE;
+   if(kind == EKVS_COLL_SET && encoding != EKVS_COLL_INTSET && encoding != EKVS_COLL_SETPACK &&
+      encoding != EKVS_COLL_HASHSET) return EKVS_WRONG_TYPE;
+   if(encoding == EKVS_COLL_QUICKLIST || encoding == EKVS_COLL_HASHSET)
+   {
+      return ((*entry)->data_sz == EKVS_COLL_OBJECT ? EKVS_OK : EKVS_FILE_FAIL);
+   }
+   if((*entry)->data_sz < EKVS_COLL_HEADER) return EKVS_FILE_FAIL;
+
+   count = _ekvs_coll_count(*entry);
+   if(encoding == EKVS_COLL_LISTPACK &&
+      (count > EKVS_LISTPACK_MAX_COUNT || (*entry)->data_sz - EKVS_COLL_HEADER > EKVS_LISTPACK_MAX_BYTES))
+   {
+      *entry = _ekvs_coll_to_quicklist(store, *hash, *entry);
+   }
+   else if((encoding == EKVS_COLL_SETPACK && count > EKVS_SETPACK_MAX_COUNT) ||
+      (encoding == EKVS_COLL_INTSET && count > EKVS_INTSET_MAX_COUNT))
+   {
+      *entry = _ekvs_coll_to_hashset(store, *hash, *entry);
+   }
+   else
+   {
+      return EKVS_OK;
+   }
+
+   return (*entry != NULL ? EKVS_OK : EKVS_ALLOCATION_FAIL);
+}
+
+static struct _ekvs_db_entry* _ekvs_coll_create(ekvs store, uint64_t hash, const char* key, size_t key_sz,
+   unsigned char encoding, unsigned char width)
+{
+   char header[EKVS_COLL_HEADER];
+   memset(header, 0, sizeof(header));
+   header[0] = (char)encoding;
+   header[1] = (char)width;
+   return _ekvs_insert(store, hash, key, header, key_sz, sizeof(header), EKVS_ENTRY_COLLECTION, 0);
+}
+
+/* Log a successful mutation, remove the collection if it is now empty, and evict if it grew */
+static int _ekvs_coll_finish(ekvs store, uint64_t hash, struct _ekvs_db_entry* entry, char operation,
+   const char* key, size_t key_sz, const void* elem, size_t elem_sz, int ret)
+{
+   store->last_error = ret;
+   if(ret != EKVS_OK) return ret;
+
+   if(_ekvs_coll_count(entry) == 0)
+   {
+      struct _ekvs_db_entry* prev_entry = NULL;
+      struct _ekvs_db_entry* cur = store->table[hash % store->serialized.table_sz];
+      while(cur != entry)
+      {
+         prev_entry = cur;
+         cur = cur->chain;
+      }
+      _ekvs_remove(store, hash, entry, prev_entry);
+      entry = NULL;
+   }
+   else
+   {
+      entry->flags |= EKVS_ENTRY_ACCESSED;
+   }
+
+   if(store->binlog_enabled)
+   {
+      store->last_error = _ekvs_binlog(store, operation, 0 /* flags */, key, key_sz, elem, elem_sz);
+   }
+
+   if(entry != NULL && store->replaying == 0)
+   {
+      ret = _ekvs_fit_budget(store, entry);
+      if(ret != EKVS_OK) store->last_error = ret;
+   }
+
+   return store->last_error;
+}
+
+void _ekvs_coll_release(ekvs store, struct _ekvs_db_entry* entry)
+{
+   if(entry->data_sz != EKVS_COLL_OBJECT) return;
+   store->mem_used -= _ekvs_coll_bytes(entry);
+   switch(_ekvs_coll_encoding(entry))
+   {
+      case EKVS_COLL_QUICKLIST: _ekvs_ql_free(_ekvs_coll_object(entry)); break;
+      case EKVS_COLL_HASHSET: _ekvs_hs_free(_ekvs_coll_object(entry)); break;
+   }
+}
+
+const void* _ekvs_coll_flatten(ekvs store, const struct _ekvs_db_entry* entry, size_t* data_sz)
+{
+   unsigned char encoding = _ekvs_coll_encoding(entry);
+   uint64_t count = _ekvs_coll_count(entry);
+   char* flat;
+   size_t pos = EKVS_COLL_HEADER;
+
+   if(entry->data_sz != EKVS_COLL_OBJECT || (encoding != EKVS_COLL_QUICKLIST && encoding != EKVS_COLL_HASHSET))
+   {
+      *data_sz = entry->data_sz;
+      return &entry->key_data[entry->key_sz];
+   }
+
+   *data_sz = EKVS_COLL_HEADER;
+   if(encoding == EKVS_COLL_QUICKLIST)
+   {
+      const struct _ekvs_ql_node* node;
+      for(node = ((struct _ekvs_quicklist*)_ekvs_coll_object(entry))->head; node != NULL; node = node->next)
+      {
+         *data_sz += node->sz;
+      }
+      flat = _ekvs_scratch(store, *data_sz);
+      if(flat == NULL) return NULL;
+      for(node = ((struct _ekvs_quicklist*)_ekvs_coll_object(entry))->head; node != NULL; node = node->next)
+      {
+         memcpy(flat + pos, node->body, node->sz);
+         pos += node->sz;
+      }
+      flat[0] = EKVS_COLL_LISTPACK;
+   }
+   else
+   {
+      const struct _ekvs_hashset* hs = _ekvs_coll_object(entry);
+      uint64_t i;
+      for(i = 0; i < hs->slot_count; i++)
+      {
+         if(hs->slots[i] != NULL) *data_sz += _ekvs_varint_size(hs->slots[i]->sz) + hs->slots[i]->sz;
+      }
+      flat = _ekvs_scratch(store, *data_sz);
+      if(flat == NULL) return NULL;
+      for(i = 0; i < hs->slot_count; i++)
+      {
+         if(hs->slots[i] != NULL) pos += _ekvs_pack_put(flat + pos, hs->slots[i]->data, hs->slots[i]->sz);
+      }
+      flat[0] = EKVS_COLL_SETPACK;
+   }
+
+   flat[1] = 0;
+   memcpy(flat + 2, &count, sizeof(count));
+   return flat;
+}
+
+/************************** Lists **************************/
+
+int _ekvs_list_push(ekvs store, const char* key, size_t key_sz, int head, const void* elem, size_t elem_sz)
+{
+   struct _ekvs_db_entry* entry;
+   uint64_t hash;
+   int ret;
+
+   EKVS_VIEW_PRESERVE(store, _ekvs_hash(key, key_sz), key, key_sz);
+   ret = _ekvs_coll_lookup(store, key, key_sz, EKVS_COLL_LIST, &hash, &entry);
+
+   if(ret != EKVS_OK)
+   {
+      store->last_error = ret;
+      return ret;
+   }
+   EKVS_MARK_DIRTY(store, hash);
+
+   if(entry == NULL)
+   {
+      entry = _ekvs_coll_create(store, hash, key, key_sz, EKVS_COLL_LISTPACK, 0);
+      if(entry == NULL)
+      {
+         store->last_error = EKVS_ALLOCATION_FAIL;
+         return EKVS_ALLOCATION_FAIL;
+      }
+   }
+
+   if(_ekvs_coll_encoding(entry) == EKVS_COLL_LISTPACK)
+   {
+      size_t need = _ekvs_varint_size(elem_sz) + elem_sz;
+      size_t body_sz = entry->data_sz - EKVS_COLL_HEADER;
+      uint64_t count = _ekvs_coll_count(entry);
+
+      if(count + 1 > EKVS_LISTPACK_MAX_COUNT || body_sz + need > EKVS_LISTPACK_MAX_BYTES)
+      {
+         struct _ekvs_db_entry* upgraded = _ekvs_coll_to_quicklist(store, hash, entry);
+         if(upgraded == NULL) ret = EKVS_ALLOCATION_FAIL;
+         else entry = upgraded;
+      }
+      else
+      {
+         struct _ekvs_db_entry* resized = _ekvs_coll_resize(store, hash, entry, entry->data_sz + need);
+         if(resized == NULL)
+         {
+            ret = EKVS_ALLOCATION_FAIL;
+         }
+         else
+         {
+            char* body = &resized->key_data[resized->key_sz + EKVS_COLL_HEADER];
+            entry = resized;
+            if(head)
+            {
+               memmove(body + need, body, body_sz);
+               _ekvs_pack_put(body, elem, elem_sz);
+            }
+            else
+            {
+               _ekvs_pack_put(body + body_sz, elem, elem_sz);
+            }
+            _ekvs_coll_set_count(entry, count + 1);
+         }
+      }
+   }
+
+   if(ret == EKVS_OK && _ekvs_coll_encoding(entry) == EKVS_COLL_QUICKLIST)
+   {
+      struct _ekvs_quicklist* ql = _ekvs_coll_object(entry);
+      size_t bytes = ql->bytes;
+      ret = _ekvs_ql_push(ql, head, elem, elem_sz);
+      store->mem_used = store->mem_used + ql->bytes - bytes;
+   }
+
+   return _ekvs_coll_finish(store, hash, entry, head ? EKVS_BINLOG_LPUSH : EKVS_BINLOG_RPUSH, key, key_sz,
+      elem, elem_sz, ret);
+}
+
+int _ekvs_list_pop(ekvs store, const char* key, size_t key_sz, int head, const void** elem, size_t* elem_sz)
+{
+   struct _ekvs_db_entry* entry;
+   uint64_t hash;
+   int ret;
+
+   EKVS_VIEW_PRESERVE(store, _ekvs_hash(key, key_sz), key, key_sz);
+   ret = _ekvs_coll_lookup(store, key, key_sz, EKVS_COLL_LIST, &hash, &entry);
+
+   *elem = NULL;
+   *elem_sz = 0;
+   if(ret == EKVS_OK && entry == NULL) ret = EKVS_NO_KEY;
+   if(ret != EKVS_OK)
+   {
+      store->last_error = ret;
+      return ret;
+   }
+   EKVS_MARK_DIRTY(store, hash);
+
+   if(_ekvs_coll_encoding(entry) == EKVS_COLL_LISTPACK)
+   {
+      const char* body = &entry->key_data[entry->key_sz + EKVS_COLL_HEADER];
+      size_t body_sz = entry->data_sz - EKVS_COLL_HEADER;
+      const char* found;
+      size_t start, end;
+      void* out;
+
+      ret = _ekvs_pack_end(body, body_sz, head, &start, &end);
+      if(ret == EKVS_OK)
+      {
+         _ekvs_pack_elem(body, body_sz, start, &found, elem_sz);
+         out = _ekvs_scratch(store, *elem_sz);
+         if(out == NULL)
+         {
+            ret = EKVS_ALLOCATION_FAIL;
+         }
+         else
+         {
+            uint64_t count = _ekvs_coll_count(entry);
+            memcpy(out, found, *elem_sz);
+            *elem = out;
+            memmove((char*)body + start, body + end, body_sz - end);
+            entry = _ekvs_coll_resize(store, hash, entry, entry->data_sz - (end - start));
+            _ekvs_coll_set_count(entry, count - 1);
+         }
+      }
+   }
+   else
+   {
+      struct _ekvs_quicklist* ql = _ekvs_coll_object(entry);
+      size_t bytes = ql->bytes;
+      ret = _ekvs_ql_pop(store, ql, head, elem, elem_sz);
+      store->mem_used = store->mem_used + ql->bytes - bytes;
+   }
+
+   return _ekvs_coll_finish(store, hash, entry, head ? EKVS_BINLOG_LPOP : EKVS_BINLOG_RPOP, key, key_sz,
+      NULL, 0, ret);
+}
+
+/************************** Sets **************************/
+
+int _ekvs_set_add(ekvs store, const char* key, size_t key_sz, const void* elem, size_t elem_sz, int* added)
+{
+   struct _ekvs_db_entry* entry;
+   uint64_t hash;
+   int64_t v = 0;
+   int is_int = _ekvs_elem_int(elem, elem_sz, &v);
+   int was_added = 0;
+   int ret;
+
+   EKVS_VIEW_PRESERVE(store, _ekvs_hash(key, key_sz), key, key_sz);
+   ret = _ekvs_coll_lookup(store, key, key_sz, EKVS_COLL_SET, &hash, &entry);
+
+   if(ret != EKVS_OK)
+   {
+      store->last_error = ret;
+      return ret;
+   }
+   EKVS_MARK_DIRTY(store, hash);
+
+   if(entry == NULL)
+   {
+      entry = _ekvs_coll_create(store, hash, key, key_sz, is_int ? EKVS_COLL_INTSET : EKVS_COLL_SETPACK,
+         is_int ? sizeof(int16_t) : 0);
+      if(entry == NULL)
+      {
+         store->last_error = EKVS_ALLOCATION_FAIL;
+         return EKVS_ALLOCATION_FAIL;
+      }
+   }
+
+   if(_ekvs_coll_encoding(entry) == EKVS_COLL_INTSET)
+   {
+      uint64_t count = _ekvs_coll_count(entry);
+      unsigned width = (unsigned char)entry->key_data[entry->key_sz + 1];
+      uint64_t pos = 0;
+
+      if(is_int && _ekvs_intset_search(&entry->key_data[entry->key_sz + EKVS_COLL_HEADER], width, count, v, &pos))
+      {
+         /* Already a member */
+      }
+      else if(is_int && count + 1 <= EKVS_INTSET_MAX_COUNT)
+      {
+         unsigned new_width = _ekvs_int_width(v);
+         struct _ekvs_db_entry* resized;
+         uint64_t i;
+
+         if(new_width < width) new_width = width;
+         resized = _ekvs_coll_resize(store, hash, entry, EKVS_COLL_HEADER + (size_t)(count + 1) * new_width);
+         if(resized == NULL)
+         {
+            ret = EKVS_ALLOCATION_FAIL;
+         }
+         else
+         {
+            /* Move (and widen) from the back, so nothing is overwritten before it is read */
+            char* ints = &resized->key_data[resized->key_sz + EKVS_COLL_HEADER];
+            entry = resized;
+            for(i = count; i > pos; i--)
+            {
+               _ekvs_intset_put(ints, new_width, i, _ekvs_intset_get(ints, width, i - 1));
+            }
+            for(i = pos; new_width != width && i > 0; i--)
+            {
+               _ekvs_intset_put(ints, new_width, i - 1, _ekvs_intset_get(ints, width, i - 1));
+            }
+            _ekvs_intset_put(ints, new_width, pos, v);
+            entry->key_data[entry->key_sz + 1] = (char)new_width;
+            _ekvs_coll_set_count(entry, count + 1);
+            was_added = 1;
+         }
+      }
+      else
+      {
+         struct _ekvs_db_entry* converted;
+         if(count + 1 <= EKVS_SETPACK_MAX_COUNT && elem_sz <= EKVS_SETPACK_MAX_ELEMENT)
+         {
+            converted = _ekvs_coll_intset_to_setpack(store, hash, entry);
+         }
+         else
+         {
+            converted = _ekvs_coll_to_hashset(store, hash, entry);
+         }
+         if(converted == NULL) ret = EKVS_ALLOCATION_FAIL;
+         else entry = converted;
+      }
+   }
+
+   if(ret == EKVS_OK && was_added == 0 && _ekvs_coll_encoding(entry) == EKVS_COLL_SETPACK)
+   {
+      const char* body = &entry->key_data[entry->key_sz + EKVS_COLL_HEADER];
+      size_t body_sz = entry->data_sz - EKVS_COLL_HEADER;
+      uint64_t count = _ekvs_coll_count(entry);
+      size_t pos = 0;
+      int found = 0;
+
+      while(pos < body_sz && !found)
+      {
+         const char* cur;
+         size_t cur_sz;
+         pos = _ekvs_pack_elem(body, body_sz, pos, &cur, &cur_sz);
+         if(pos == 0)
+         {
+            ret = EKVS_FILE_FAIL;
+            break;
+         }
+         found = (cur_sz == elem_sz && memcmp(cur, elem, elem_sz) == 0);
+      }
+
+      if(ret == EKVS_OK && !found)
+      {
+         if(count + 1 > EKVS_SETPACK_MAX_COUNT || elem_sz > EKVS_SETPACK_MAX_ELEMENT)
+         {
+            struct _ekvs_db_entry* converted = _ekvs_coll_to_hashset(store, hash, entry);
+            if(converted == NULL) ret = EKVS_ALLOCATION_FAIL;
+            else entry = converted;
+         }
+         else
+         {
+            size_t need = _ekvs_varint_size(elem_sz) + elem_sz;
+            struct _ekvs_db_entry* resized = _ekvs_coll_resize(store, hash, entry, entry->data_sz + need);
+            if(resized == NULL)
+            {
+               ret = EKVS_ALLOCATION_FAIL;
+            }
+            else
+            {
+               entry = resized;
+               _ekvs_pack_put(&entry->key_data[entry->key_sz + EKVS_COLL_HEADER + body_sz], elem, elem_sz);
+               _ekvs_coll_set_count(entry, count + 1);
+               was_added = 1;
+            }
+         }
+      }
+   }
+
+   if(ret == EKVS_OK && was_added == 0 && _ekvs_coll_encoding(entry) == EKVS_COLL_HASHSET)
+   {
+      struct _ekvs_hashset* hs = _ekvs_coll_object(entry);
+      size_t bytes = hs->bytes;
+      ret = _ekvs_hs_add(hs, elem, elem_sz, &was_added);
+      store->mem_used = store->mem_used + hs->bytes - bytes;
+   }
+
+   if(added != NULL) *added = was_added;
+   if(ret == EKVS_OK && was_added == 0)
+   {
+      /* Already a member, nothing to log */
+      store->last_error = EKVS_OK;
+      return EKVS_OK;
+   }
+   return _ekvs_coll_finish(store, hash, entry, EKVS_BINLOG_SADD, key, key_sz, elem, elem_sz, ret);
+}
+
+int _ekvs_set_remove(ekvs store, const char* key, size_t key_sz, const void* elem, size_t elem_sz)
+{
+   struct _ekvs_db_entry* entry;
+   uint64_t hash;
+   int ret;
+
+   EKVS_VIEW_PRESERVE(store, _ekvs_hash(key, key_sz), key, key_sz);
+   ret = _ekvs_coll_lookup(store, key, key_sz, EKVS_COLL_SET, &hash, &entry);
+
+   if(ret == EKVS_OK && entry == NULL) ret = EKVS_NO_KEY;
+   if(ret != EKVS_OK)
+   {
+      store->last_error = ret;
+      return ret;
+   }
+   EKVS_MARK_DIRTY(store, hash);
+
+   ret = EKVS_NO_KEY;
+   switch(_ekvs_coll_encoding(entry))
+   {
+      case EKVS_COLL_INTSET:
+      {
+         uint64_t count = _ekvs_coll_count(entry);
+         unsigned width = (unsigned char)entry->key_data[entry->key_sz + 1];
+         char* ints = &entry->key_data[entry->key_sz + EKVS_COLL_HEADER];
+         uint64_t pos;
+         int64_t v;
+
+         if(_ekvs_elem_int(elem, elem_sz, &v) && _ekvs_intset_search(ints, width, count, v, &pos))
+         {
+            memmove(ints + pos * width, ints + (pos + 1) * width, (size_t)(count - pos - 1) * width);
+            entry = _ekvs_coll_resize(store, hash, entry, entry->data_sz - width);
+            _ekvs_coll_set_count(entry, count - 1);
+            ret = EKVS_OK;
+         }
+         break;
+      }
+      case EKVS_COLL_SETPACK:
+      {
+         char* body = &entry->key_data[entry->key_sz + EKVS_COLL_HEADER];
+         size_t body_sz = entry->data_sz - EKVS_COLL_HEADER;
+         size_t start = 0;
+         size_t end = 0;
+
+         while(start < body_sz)
+         {
+            const char* cur;
+            size_t cur_sz;
+            end = _ekvs_pack_elem(body, body_sz, start, &cur, &cur_sz);
+            if(end == 0)
+            {
+               ret = EKVS_FILE_FAIL;
+               break;
+            }
+            if(cur_sz == elem_sz && memcmp(cur, elem, elem_sz) == 0)
+            {
+               uint64_t count = _ekvs_coll_count(entry);
+               memmove(body + start, body + end, body_sz - end);
+               entry = _ekvs_coll_resize(store, hash, entry, entry->data_sz - (end - start));
+               _ekvs_coll_set_count(entry, count - 1);
+               ret = EKVS_OK;
+               break;
+            }
+            start = end;
+         }
+         break;
+      }
+      case EKVS_COLL_HASHSET:
+      {
+         struct _ekvs_hashset* hs = _ekvs_coll_object(entry);
+         size_t bytes = hs->bytes;
+         ret = _ekvs_hs_remove(hs, elem, elem_sz);
+         store->mem_used = store->mem_used + hs->bytes - bytes;
+         break;
+      }
+   }
+
+   return _ekvs_coll_finish(store, hash, entry, EKVS_BINLOG_SREM, key, key_sz, elem, elem_sz, ret);
+}
+
+/************************** Public interface **************************/
+
+static int _ekvs_coll_check(ekvs store, const char* key, const void* elem, size_t elem_sz, const char* caller)
+{
+   if(store == NULL)
+   {
+      fprintf(stderr, "ekvs: NULL store parameter passed to %s.\n", caller);
+      return EKVS_FAIL;
+   }
+
+   if(key == NULL)
+   {
+      fprintf(stderr, "ekvs: NULL key parameter passed to %s.\n", caller);
+      return EKVS_FAIL;
+   }
+
+   if(elem == NULL && elem_sz != 0)
+   {
+      fprintf(stderr, "ekvs: NULL element parameter passed to %s.\n", caller);
+      return EKVS_FAIL;
+   }
+
+   /* Images only hold the flat bytes of collections */
+   if(store->ro_map != NULL)
+   {
+      store->last_error = EKVS_READ_ONLY;
+      return EKVS_READ_ONLY;
+   }
+
+   if(store->shm_map != NULL || store->lsm != NULL)
+   {
+      store->last_error = EKVS_UNSUPPORTED;
+      return EKVS_UNSUPPORTED;
+   }
+
+   return EKVS_OK;
+}
+
+/* Followers only change through the records of their leader */
+static int _ekvs_coll_check_write(ekvs store, const char* key, const void* elem, size_t elem_sz, const char* caller)
+{
+   int ret = _ekvs_coll_check(store, key, elem, elem_sz, caller);
+   if(ret == EKVS_OK && store->follower != NULL)
+   {
+      store->last_error = EKVS_READ_ONLY;
+      return EKVS_READ_ONLY;
+   }
+   return ret;
+}
+
+int ekvs_lpush(ekvs store, const char* key, const void* elem, size_t elem_sz)
+{
+   int ret = _ekvs_coll_check_write(store, key, elem, elem_sz, "ekvs_lpush");
+   if(ret != EKVS_OK) return ret;
+   return _ekvs_list_push(store, key, strlen(key), 1 /* head */, elem, elem_sz);
+}
+
+int ekvs_rpush(ekvs store, const char* key, const void* elem, size_t elem_sz)
+{
+   int ret = _ekvs_coll_check_write(store, key, elem, elem_sz, "ekvs_rpush");
+   if(ret != EKVS_OK) return ret;
+   return _ekvs_list_push(store, key, strlen(key), 0 /* tail */, elem, elem_sz);
+}
+
+int ekvs_lpop(ekvs store, const char* key, const void** elem, size_t* elem_sz)
+{
+   int ret = _ekvs_coll_check_write(store, key, NULL, 0, "ekvs_lpop");
+   if(ret != EKVS_OK) return ret;
+   return _ekvs_list_pop(store, key, strlen(key), 1 /* head */, elem, elem_sz);
+}
+
+int ekvs_rpop(ekvs store, const char* key, const void** elem, size_t* elem_sz)
+{
+   int ret = _ekvs_coll_check_write(store, key, NULL, 0, "ekvs_rpop");
+   if(ret != EKVS_OK) return ret;
+   return _ekvs_list_pop(store, key, strlen(key), 0 /* tail */, elem, elem_sz);
+}
+
+int ekvs_llen(ekvs store, const char* key, uint64_t* len)
+{
+   struct _ekvs_db_entry* entry;
+   uint64_t hash;
+   int ret = _ekvs_coll_check(store, key, NULL, 0, "ekvs_llen");
+
+   if(ret != EKVS_OK) return ret;
+   ret = _ekvs_coll_lookup(store, key, strlen(key), EKVS_COLL_LIST, &hash, &entry);
+   *len = (ret == EKVS_OK && entry != NULL ? _ekvs_coll_count(entry) : 0);
+   store->last_error = ret;
+   return ret;
+}
+
+int ekvs_lrange(ekvs store, const char* key, int64_t start, int64_t stop, ekvs_view* views, size_t max_views,
+   size_t* count)
+{
+   struct _ekvs_db_entry* entry;
+   uint64_t hash;
+   uint64_t len;
+   uint64_t index = 0;
+   int ret = _ekvs_coll_check(store, key, NULL, 0, "ekvs_lrange");
+
+   if(ret != EKVS_OK) return ret;
+   *count = 0;
+   ret = _ekvs_coll_lookup(store, key, strlen(key), EKVS_COLL_LIST, &hash, &entry);
+   if(ret != EKVS_OK || entry == NULL)
+   {
+      store->last_error = ret;
+      return ret;
+   }
+
+   /* Negative indices count from the tail, as in Redis */
+   len = _ekvs_coll_count(entry);
+   if(start < 0) start = (-start > (int64_t)len ? 0 : (int64_t)len + start);
+   if(stop < 0) stop = (int64_t)len + stop;
+   if(stop >= (int64_t)len) stop = (int64_t)len - 1;
+   if(start > stop)
+   {
+      store->last_error = EKVS_OK;
+      return EKVS_OK;
+   }
+   *count = (size_t)(stop - start + 1);
+   entry->flags |= EKVS_ENTRY_ACCESSED;
+
+   if(_ekvs_coll_encoding(entry) == EKVS_COLL_LISTPACK)
+   {
+      const char* body = &entry->key_data[entry->key_sz + EKVS_COLL_HEADER];
+      size_t body_sz = entry->data_sz - EKVS_COLL_HEADER;
+      size_t pos = 0;
+
+      for(index = 0; index <= (uint64_t)stop; index++)
+      {
+         const char* elem;
+         size_t elem_sz;
+         pos = _ekvs_pack_elem(body, body_sz, pos, &elem, &elem_sz);
+         if(pos == 0)
+         {
+            ret = EKVS_FILE_FAIL;
+            break;
+         }
+         if(index >= (uint64_t)start && index - start < max_views)
+         {
+            ekvs_view* view = &views[index - start];
+            view->data = elem;
+            view->data_sz = elem_sz;
+            view->status = EKVS_OK;
+         }
+      }
+   }
+   else
+   {
+      const struct _ekvs_ql_node* node = ((struct _ekvs_quicklist*)_ekvs_coll_object(entry))->head;
+
+      /* Whole nodes before the range are skipped by their count */
+      while(node != NULL && index + node->count <= (uint64_t)start)
+      {
+         index += node->count;
+         node = node->next;
+      }
+      for(; node != NULL && index <= (uint64_t)stop; node = node->next)
+      {
+         size_t pos = 0;
+         while(pos < node->sz && index <= (uint64_t)stop)
+         {
+            const char* elem;
+            size_t elem_sz;
+            pos = _ekvs_pack_elem(node->body, node->sz, pos, &elem, &elem_sz);
+            if(pos == 0) break;
+            if(index >= (uint64_t)start && index - start < max_views)
+            {
+               ekvs_view* view = &views[index - start];
+               view->data = elem;
+               view->data_sz = elem_sz;
+               view->status = EKVS_OK;
+            }
+            index++;
+         }
+      }
+   }
+
+   store->last_error = ret;
+   return ret;
+}
+
+int ekvs_sadd(ekvs store, const char* key, const void* elem, size_t elem_sz, int* added)
+{
+   int ret = _ekvs_coll_check_write(store, key, elem, elem_sz, "ekvs_sadd");
+   if(ret != EKVS_OK) return ret;
+   return _ekvs_set_add(store, key, strlen(key), elem, elem_sz, added);
+}
+
+int ekvs_srem(ekvs store, const char* key, const void* elem, size_t elem_sz)
+{
+   int ret = _ekvs_coll_check_write(store, key, elem, elem_sz, "ekvs_srem");
+   if(ret != EKVS_OK) return ret;
+   return _ekvs_set_remove(store, key, strlen(key), elem, elem_sz);
+}
+
+int ekvs_sismember(ekvs store, const char* key, const void* elem, size_t elem_sz, int* is_member)
+{
+   struct _ekvs_db_entry* entry;
+   uint64_t hash;
+   int ret = _ekvs_coll_check(store, key, elem, elem_sz, "ekvs_sismember");
+
+   if(ret != EKVS_OK) return ret;
+   *is_member = 0;
+   ret = _ekvs_coll_lookup(store, key, strlen(key), EKVS_COLL_SET, &hash, &entry);
+   if(ret != EKVS_OK || entry == NULL)
+   {
+      store->last_error = ret;
+      return ret;
+   }
+
+   switch(_ekvs_coll_encoding(entry))
+   {
+      case EKVS_COLL_INTSET:
+      {
+         uint64_t pos;
+         int64_t v;
+         *is_member = _ekvs_elem_int(elem, elem_sz, &v) &&
+            _ekvs_intset_search(&entry->key_data[entry->key_sz + EKVS_COLL_HEADER],
+               (unsigned char)entry->key_data[entry->key_sz + 1], _ekvs_coll_count(entry), v, &pos);
+         break;
+      }
+      case EKVS_COLL_SETPACK:
+      {
+         const char* body = &entry->key_data[entry->key_sz + EKVS_COLL_HEADER];
+         size_t body_sz = entry->data_sz - EKVS_COLL_HEADER;
+         size_t pos = 0;
+         while(pos < body_sz && *is_member == 0)
+         {
+            const char* cur;
+            size_t cur_sz;
+            pos = _ekvs_pack_elem(body, body_sz, pos, &cur, &cur_sz);
+            if(pos == 0) break;
+            *is_member = (cur_sz == elem_sz && memcmp(cur, elem, elem_sz) == 0);
+         }
+         break;
+      }
+      case EKVS_COLL_HASHSET:
+      {
+         const struct _ekvs_hashset* hs = _ekvs_coll_object(entry);
+         *is_member = (hs->slots[_ekvs_hs_find(hs, _ekvs_elem_hash(elem, elem_sz), elem, elem_sz)] != NULL);
+         break;
+      }
+   }
+
+   entry->flags |= EKVS_ENTRY_ACCESSED;
+   store->last_error = EKVS_OK;
+   return EKVS_OK;
+}
+
+int ekvs_scard(ekvs store, const char* key, uint64_t* card)
+{
+   struct _ekvs_db_entry* entry;
+   uint64_t hash;
+   int ret = _ekvs_coll_check(store, key, NULL, 0, "ekvs_scard");
+
+   if(ret != EKVS_OK) return ret;
+   ret = _ekvs_coll_lookup(store, key, strlen(key), EKVS_COLL_SET, &hash, &entry);
+   *card = (ret == EKVS_OK && entry != NULL ? _ekvs_coll_count(entry) : 0);
+   store->last_error = ret;
+   return ret;
+}
@@ -0,0 +1,180 @@
+/* -*- Mode: C; tab-width: 3; c-basic-offset: 3; indent-tabs-mode: nil -*- */
+/* vim: set filetype=C tabstop=3 softtabstop=3 shiftwidth=3 expandtab: */
+
+/* ekvs -- Copyright (C) 2011 GameClay LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "ekvs_internal.h"
+
+/* Counters are entries flagged EKVS_ENTRY_INT, whose data is a native int64_t.
+ * Increments update the entry in place and log an EKVS_BINLOG_INCR record
+ * with only the delta. Creating a counter, or converting a decimal value
+ * to one, goes through the usual insert path. */
+
+#define EKVS_INT64_MAX ((int64_t)(((uint64_t)1 << 63) - 1))
+#define EKVS_INT64_MIN (-EKVS_INT64_MAX - 1)
+
+/* Parse a decimal value, which may be NUL-terminated */
+static int _ekvs_parse_int(const char* text, size_t text_sz, int64_t* value)
+{
+   uint64_t magnitude = 0;
+   uint64_t limit;
+   int negative = 0;
+   size_t i = 0;
+
+   if(text_sz > 0 && text[text_sz - 1] == '\0') text_sz--;
+   if(text_sz > 0 && (text[0] == '-' || text[0] == '+'))
+   {
+      negative = (text[0] == '-');
+      i++;
+   }
+   if(i == text_sz) return EKVS_WRONG_TYPE;
+
+   limit = (negative ? (uint64_t)EKVS_INT64_MAX + 1 : (uint64_t)EKVS_INT64_MAX);
+   for(; i < text_sz; i++)
+   {
+      unsigned digit = (unsigned char)text[i] - '0';
+      if(digit > 9) return EKVS_WRONG_TYPE;
+      if(magnitude > (limit - digit) / 10) return EKVS_WRONG_TYPE;
+      magnitude = magnitude * 10 + digit;
+   }
+
+   if(negative) *value = (magnitude == (uint64_t)EKVS_INT64_MAX + 1 ? EKVS_INT64_MIN : -(int64_t)magnitude);
+   else *value = (int64_t)magnitude;
+   return EKVS_OK;
+}
+
+int ekvs_incrby(ekvs store, const char* key, int64_t delta, int64_t* result)
+{
+   if(store == NULL)
+   {
+      fprintf(stderr, "ekvs: NULL store parameter passed to ekvs_incrby.\n");
+      return EKVS_FAIL;
+   }
+
+   if(key == NULL)
+   {
+      fprintf(stderr, "ekvs: NULL key parameter passed to ekvs_incrby.\n");
+      return EKVS_FAIL;
+   }
+
+   if(store->ro_map != NULL || store->follower != NULL)
+   {
+      store->last_error = EKVS_READ_ONLY;
+      return EKVS_READ_ONLY;
+   }
+
+   if(store->shm_map != NULL || store->lsm != NULL)
+   {
+      store->last_error = EKVS_UNSUPPORTED;
+      return EKVS_UNSUPPORTED;
+   }
+
+   return _ekvs_incr(store, key, strlen(key), delta, result);
+}
+
+int ekvs_decrby(ekvs store, const char* key, int64_t delta, int64_t* result)
+{
+   if(delta == EKVS_INT64_MIN)
+   {
+      if(store != NULL) store->last_error = EKVS_FAIL;
+      return EKVS_FAIL;
+   }
+   return ekvs_incrby(store, key, -delta, result);
+}
+
+int _ekvs_incr(ekvs store, const char* key, size_t key_sz, int64_t delta, int64_t* result)
+{
+   struct _ekvs_db_entry* entry;
+   uint64_t hash;
+   uint32_t pc = 0, pb = 0;
+   int64_t value = 0;
+
+   hashlittle2(key, key_sz, &pc, &pb);
+   hash = pc + (((uint64_t)pb) << 32);
+   entry = _ekvs_retrieve(store, hash, key, key_sz);
+
+   if(entry != NULL && (entry->flags & EKVS_ENTRY_INT))
+   {
+      memcpy(&value, &entry->key_data[key_sz], sizeof(value));
+   }
+   else if(entry != NULL && (entry->flags & EKVS_ENTRY_COLLECTION))
+   {
+      store->last_error = EKVS_WRONG_TYPE;
+      return EKVS_WRONG_TYPE;
+   }
+   else if(entry != NULL)
+   {
+      size_t text_sz;
+      const void* text = _ekvs_entry_value(store, entry, &text_sz);
+      if(text == NULL && text_sz != 0)
+      {
+         store->last_error = EKVS_FILE_FAIL;
+         return EKVS_FILE_FAIL;
+      }
+      store->last_error = _ekvs_parse_int(text, text_sz, &value);
+      if(store->last_error != EKVS_OK) return store->last_error;
+   }
+
+   if((delta > 0 && value > EKVS_INT64_MAX - delta) || (delta < 0 && value < EKVS_INT64_MIN - delta))
+   {
+      store->last_error = EKVS_FAIL;
+      return EKVS_FAIL;
+   }
+   value += delta;
+   if(result != NULL) *result = value;
+
+   EKVS_VIEW_PRESERVE(store, hash, key, key_sz);
+   EKVS_MARK_DIRTY(store, hash);
+
+   /* New counters are logged as a set */
+   if(entry == NULL)
+   {
+      return _ekvs_set(store, hash, key, key_sz, &value, sizeof(value), EKVS_ENTRY_INT, 0);
+   }
+
+   if((entry->flags & EKVS_ENTRY_INT) && entry->refs == 0)
+   {
+      memcpy(&entry->key_data[key_sz], &value, sizeof(value));
+      entry->flags |= EKVS_ENTRY_ACCESSED;
+   }
+   else
+   {
+      /* Converted, or pinned: install a new version */
+      entry = _ekvs_insert(store, hash, key, &value, key_sz, sizeof(value), EKVS_ENTRY_INT, 0);
+      if(entry == NULL)
+      {
+         store->last_error = EKVS_ALLOCATION_FAIL;
+         return EKVS_ALLOCATION_FAIL;
+      }
+   }
+
+   if(store->binlog_enabled)
+   {
+      store->last_error = _ekvs_binlog(store, EKVS_BINLOG_INCR, 0 /* flags */, key, key_sz, &delta, sizeof(delta));
+   }
+   else
+   {
+      store->last_error = EKVS_OK;
+   }
+
+   if(store->replaying == 0)
+   {
+      int ret = _ekvs_fit_budget(store, entry);
+      if(ret != EKVS_OK) store->last_error = ret;
+   }
+
+   return store->last_error;
+}
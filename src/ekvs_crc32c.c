@@ -0,0 +1,94 @@
+/* -*- Mode: C; tab-width: 3; c-basic-offset: 3; indent-tabs-mode: nil -*- */
+/* vim: set filetype=C tabstop=3 softtabstop=3 shiftwidth=3 expandtab: */
+
+/* ekvs -- Copyright (C) 2011 GameClay LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "ekvs_internal.h"
+
+/* CRC32C (Castagnoli). Uses the SSE4.2 crc32 instruction when the CPU has it,
+ * and a byte-wise table otherwise. Both produce identical results. */
+
+#define EKVS_CRC32C_POLY 0x82f63b78U
+
+static uint32_t _ekvs_crc32c_table[256];
+static int _ekvs_crc32c_impl = 0; /* 0 = undetermined, 1 = table, 2 = sse4.2 */
+
+static uint32_t _ekvs_crc32c_sw(uint32_t crc, const uint8_t* p, size_t len)
+{
+   while(len-- > 0)
+   {
+      crc = _ekvs_crc32c_table[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+   }
+   return crc;
+}
+
+#if defined(__GNUC__) && defined(__x86_64__)
+__attribute__((target("sse4.2")))
+static uint32_t _ekvs_crc32c_hw(uint32_t crc, const uint8_t* p, size_t len)
+{
+   uint64_t crc64 = crc;
+   uint64_t v;
+
+   while(len > 0 && ((uintptr_t)p & 7) != 0)
+   {
+      crc64 = __builtin_ia32_crc32qi((uint32_t)crc64, *p++);
+      len--;
+   }
+   while(len >= 8)
+   {
+      memcpy(&v, p, sizeof(v));
+      crc64 = __builtin_ia32_crc32di(crc64, v);
+      p += 8;
+      len -= 8;
+   }
+   while(len-- > 0)
+   {
+      crc64 = __builtin_ia32_crc32qi((uint32_t)crc64, *p++);
+   }
+   return (uint32_t)crc64;
+}
+#endif
+
+static void _ekvs_crc32c_init(void)
+{
+   uint32_t i, j, crc;
+
+   for(i = 0; i < 256; i++)
+   {
+      crc = i;
+      for(j = 0; j < 8; j++)
+      {
+         crc = (crc & 1) ? (crc >> 1) ^ EKVS_CRC32C_POLY : (crc >> 1);
+      }
+      _ekvs_crc32c_table[i] = crc;
+   }
+
+   _ekvs_crc32c_impl = 1;
+#if defined(__GNUC__) && defined(__x86_64__)
+   if(__builtin_cpu_supports("sse4.2")) _ekvs_crc32c_impl = 2;
+#endif
+}
+
+uint32_t _ekvs_crc32c(uint32_t crc, const void* data, size_t len)
+{
+   if(_ekvs_crc32c_impl == 0) _ekvs_crc32c_init();
+
+   crc = ~crc;
+#if defined(__GNUC__) && defined(__x86_64__)
+   if(_ekvs_crc32c_impl == 2) return ~_ekvs_crc32c_hw(crc, (const uint8_t*)data, len);
+#endif
+   return ~_ekvs_crc32c_sw(crc, (const uint8_t*)data, len);
+}
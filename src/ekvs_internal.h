@@ -16,24 +16,143 @@
  * limitations under the License.
  */
 
+/* Needed for mmap, fileno and friends under -std=c89 */
+#ifndef _GNU_SOURCE
+#  define _GNU_SOURCE
+#endif
+
 #include <ekvs/ekvs.h>
 #include <stdio.h>
+#include <stddef.h>
 #include <string.h>
+#include <pthread.h>
 
 struct _ekvs_db_entry {
    struct _ekvs_db_entry* chain;
    char flags;
+   uint32_t refs;            /* Outstanding ekvs_ref pins, fits in the padding after flags */
    size_t key_sz;
    size_t data_sz;
    char key_data[1];
 };
 
+/* Entry flags */
+#define EKVS_ENTRY_ACCESSED   0x01  /* Set by ekvs_get, cleared by the eviction clock. Never serialized. */
+#define EKVS_ENTRY_VLOG       0x02  /* Data is a struct _ekvs_vlog_ptr into the value log */
+#define EKVS_ENTRY_COMPRESSED 0x04  /* Data is packed with _ekvs_lz_pack */
+#define EKVS_ENTRY_RETIRED    0x08  /* No longer in the table, freed by the last ekvs_ref_release. Never serialized. */
+#define EKVS_ENTRY_GROWN      0x10  /* Allocated with _ekvs_grown_capacity(data_sz) bytes of data. Never serialized. */
+#define EKVS_ENTRY_INT        0x20  /* Data is a native int64_t counter, see ekvs_incrby */
+#define EKVS_ENTRY_SPILLED    0x40  /* With EKVS_ENTRY_VLOG, the value was moved out by the eviction clock. Written to snapshots, never to the binlog. */
+#define EKVS_ENTRY_COLLECTION ((char)0x80)  /* Data is a list or set, see ekvs_collection.c */
+
+/* Flags which are written to snapshots and the binlog */
+#define EKVS_ENTRY_PERSISTENT (EKVS_ENTRY_VLOG | EKVS_ENTRY_COMPRESSED | EKVS_ENTRY_INT | EKVS_ENTRY_COLLECTION)
+
+/* Binlog record flag: the record data was packed by _ekvs_binlog, and is unpacked before replay */
+#define EKVS_RECORD_COMPRESSED 0x40
+
+/* Allocation size of an entry holding key_sz bytes of key and data_sz bytes of data */
+#define EKVS_ENTRY_SIZE(key_sz, data_sz) (sizeof(struct _ekvs_db_entry) + (key_sz) + (data_sz) - 1)
+#define EKVS_ENTRY_ALLOC_SIZE(entry) EKVS_ENTRY_SIZE((entry)->key_sz, \
+   ((entry)->flags & EKVS_ENTRY_GROWN) ? _ekvs_grown_capacity((entry)->data_sz) : (entry)->data_sz)
+
+/* Location of a value stored out-of-line in the value log */
+struct _ekvs_vlog_ptr {
+   uint64_t offset;
+   uint64_t size;
+};
+
+/* Previous mappings of the value log, kept until the next collection so pointers handed out before the mapping grew stay valid */
+struct _ekvs_vlog_map {
+   void* base;
+   size_t size;
+   struct _ekvs_vlog_map* next;
+};
+
+#define EKVS_MAGIC            0x53564b45  /* 'EKVS' */
+#define EKVS_FORMAT_VERSION   5
+
+/* Snapshots are written as a sequence of blocks of serialized entries */
+#define EKVS_BLOCK_SIZE       (64 * 1024)
+#define EKVS_BLOCK_COMPRESSED 0x01
+
+struct _ekvs_block_header {
+   uint64_t raw_sz;
+   uint64_t stored_sz;
+   uint32_t flags;
+   uint32_t checksum;
+};
+
 struct _ekvs_db_serialized {
+   uint32_t magic;
+   uint32_t version;
    uint64_t table_sz;
    long int binlog_start;
    long int binlog_end;
+   uint64_t vlog_gen;
+   uint64_t segment_size;     /* If not 0, the binlog is in segment files of this size, see ekvs_segment.c */
+   uint64_t first_segment;    /* The first segment with records newer than the snapshot */
+   long int snapshot_end;     /* End of the snapshot blocks. Checkpoints move binlog_start past it. */
+   uint64_t checkpoints;      /* Incremental checkpoints written since the snapshot, see ekvs_checkpoint */
+};
+
+/* Incremental checkpoints are files named <db>.ckpt.<n>, holding this header, the
+ * buckets changed since checkpoint n - 1 (or the snapshot), then snapshot blocks of
+ * the entries of those buckets. */
+#define EKVS_CHECKPOINT_MAGIC 0x50434b45  /* 'EKCP' */
+
+struct _ekvs_checkpoint_header {
+   uint32_t magic;
+   uint32_t version;
+   uint64_t sequence;         /* n */
+   uint64_t table_sz;         /* Table size the bucket numbers refer to */
+   uint64_t bucket_count;
+   uint64_t blocks_sz;        /* Bytes of blocks after the bucket numbers */
+   uint32_t checksum;         /* crc32c of the bucket numbers, then the header before this field */
+   uint32_t reserved;
 };
 
+/* ekvs_snapshot_stream writes this header, snapshot blocks with values taken out of the
+ * value log, then an empty block to mark the end */
+#define EKVS_STREAM_MAGIC 0x53534b45  /* 'EKSS' */
+
+struct _ekvs_stream_header {
+   uint32_t magic;
+   uint32_t version;
+   uint64_t table_sz;
+   uint64_t population;
+   uint32_t checksum;         /* crc32c of the header before this field */
+   uint32_t reserved;
+};
+
+/* Words of the dirty bucket bitmap of a table */
+#define EKVS_DIRTY_WORDS(table_sz) ((size_t)(((table_sz) + 63) / 64))
+
+/* Counters maintained on the write paths, reported by ekvs_stats */
+struct _ekvs_stats_counters {
+   uint64_t binlog_bytes;
+   uint64_t binlog_records;
+   uint64_t binlog_flushes;
+   uint64_t binlog_write_ns;
+   uint64_t binlog_write_max_ns;
+   uint64_t grow_count;
+   uint64_t grow_ns;
+   uint64_t grow_max_ns;
+   uint64_t snapshot_count;
+   uint64_t snapshot_ns;
+   uint64_t snapshot_max_ns;
+   uint64_t checkpoint_bytes;
+};
+
+/* Background binlog writer, see ekvs_writer.c */
+struct _ekvs_binlog_writer;
+
+/* Replication state of leaders and followers, see ekvs_replica.c */
+struct _ekvs_replica_leader;
+struct _ekvs_replica_follower;
+struct _ekvs_lsm;
+
 struct _ekvs_db {
    int last_error;
    int binlog_enabled;
@@ -43,6 +162,97 @@ struct _ekvs_db {
    uint64_t table_population;
    float grow_threshold;
 
+   /* Memory accounting and eviction */
+   uint64_t mem_used;
+   uint64_t mem_budget;
+   uint64_t clock_hand;
+   int evict_stalled;            /* The last sweep found nothing to evict, see _ekvs_evict */
+   int evict_stalled_victim;     /* The entry kept from that sweep, or a later one, may be evicted now */
+   int spill_cold;
+   ekvs_evict_ptr evict_callback;
+   void* evict_ctx;
+   ekvs_cache_stats cache_stats;
+   struct _ekvs_stats_counters stats;
+
+   /* Tracing */
+   ekvs_trace_ptr trace_callback;
+   void* trace_ctx;
+
+   /* Value log */
+   size_t vlog_threshold;
+   char* vlog_prefix;
+   FILE* vlog_file;
+   uint64_t vlog_end;
+   uint64_t vlog_synced;         /* Bytes of the value log known to be on disk */
+   char* vlog_map;
+   size_t vlog_map_sz;
+   struct _ekvs_vlog_map* vlog_old_maps;
+
+   /* Compression */
+   uint32_t compression;
+   size_t compress_min_size;
+   char* scratch;
+   size_t scratch_sz;
+
+   /* Replaced or removed entries which are still pinned, linked through chain */
+   struct _ekvs_db_entry* retired;
+
+   /* Advanced whenever an entry is freed or moved, which invalidates the hints of key handles */
+   uint64_t entry_epoch;
+
+   /* Read-only mapping, see ekvs_open_readonly */
+   const char* ro_map;
+   size_t ro_map_sz;
+
+   /* Open read views, newest first, and the values they still need. See ekvs_view.c */
+   struct _ekvs_read_view* views;
+   uint64_t view_count;
+   struct _ekvs_version** versions;
+   uint64_t versions_sz;      /* Buckets, a power of two */
+   uint64_t version_count;
+   uint64_t version_bytes;
+   uint64_t version;          /* Advanced by every ekvs_view_open */
+
+   /* Shared mapping, see ekvs_open_shared */
+   char* shm_map;
+   size_t shm_map_sz;
+   uint32_t shm_slot;         /* Reader slot plus one */
+
+   /* Log-structured engine, see ekvs_lsm.c */
+   struct _ekvs_lsm* lsm;
+
+   /* Buckets changed since the last checkpoint or snapshot, one bit each, for file-backed stores */
+   uint64_t* dirty;
+   uint64_t dirty_count;
+   uint32_t max_checkpoints;
+
+   /* Placement of the table, see ekvs_pages.c. table_map_sz is 0 when it came from ekvs_malloc. */
+   uint32_t table_pages;
+   uint32_t numa_policy;
+   uint64_t numa_nodes;
+   size_t table_map_sz;
+   uint32_t table_pages_used;
+   uint32_t table_numa_used;
+
+   /* Log sequence numbers, bytes logged since open. The writer tracks durability when there is one. */
+   uint64_t lsn;
+   uint64_t durable_lsn;
+   struct _ekvs_binlog_writer* writer;
+
+   /* Segmented binlog, when serialized.segment_size is set */
+   FILE* segment_file;
+   uint64_t segment;          /* Number of the segment being appended to */
+   uint64_t segment_end;      /* Offset of the next record in it */
+   uint64_t segment_logged;   /* Bytes in the segments since the snapshot */
+
+   /* Replication. A leader has followers or a backlog; a follower applies the records of its leader. */
+   struct _ekvs_replica_leader* leader;
+   struct _ekvs_replica_follower* follower;
+
+   /* Recovery */
+   int replaying;
+   uint64_t discarded_bytes;
+
    struct _ekvs_db_serialized serialized;
 };
 
@@ -55,12 +265,263 @@ extern void hashlittle2(
 
 #define EKVS_BINLOG_SET 0
 #define EKVS_BINLOG_DEL 1
+#define EKVS_BINLOG_APPEND 2        /* Data is appended to the value */
+#define EKVS_BINLOG_SETRANGE 3      /* Data is [uint64_t offset][bytes], written over the value at offset */
+#define EKVS_BINLOG_INCR 4          /* Data is an int64_t added to the counter */
+#define EKVS_BINLOG_LPUSH 5         /* Data is an element pushed onto the head of a list */
+#define EKVS_BINLOG_RPUSH 6         /* Data is an element pushed onto the tail of a list */
+#define EKVS_BINLOG_LPOP 7          /* No data, the head element of a list is removed */
+#define EKVS_BINLOG_RPOP 8          /* No data, the tail element of a list is removed */
+#define EKVS_BINLOG_SADD 9          /* Data is an element added to a set */
+#define EKVS_BINLOG_SREM 10         /* Data is an element removed from a set */
 
-int _ekvs_replay_binlog_entry(ekvs store, char operation, const struct _ekvs_db_entry* entry);
-int _ekvs_binlog(ekvs store, char operation, char flags, const char* key, const void* data, size_t data_sz);
+/* Collections use flat encodings until they exceed these limits */
+#define EKVS_LISTPACK_MAX_COUNT    128
+#define EKVS_LISTPACK_MAX_BYTES    8192
+#define EKVS_QUICKLIST_NODE_BYTES  8192
+#define EKVS_INTSET_MAX_COUNT      512
+#define EKVS_SETPACK_MAX_COUNT     128
+#define EKVS_SETPACK_MAX_ELEMENT   64
+
+/* Binlog records are [crc32c][operation][flags][key_sz][data_sz][key][data], the checksum covering the rest of the record */
+#define EKVS_BINLOG_HEADER_SIZE (sizeof(uint32_t) + 2 * sizeof(char) + 2 * sizeof(size_t))
+
+int _ekvs_load_binlog(ekvs store);
+int _ekvs_replay_log(ekvs store, FILE* file, long int start, long int* valid_end, long int* file_end);
+int _ekvs_replay_binlog_entry(ekvs store, char operation, char flags, const char* key, size_t key_sz,
+   const void* data, size_t data_sz);
+int _ekvs_del(ekvs store, uint64_t hash, const char* key, size_t key_sz);
+int _ekvs_set(ekvs store, uint64_t hash, const char* key, size_t key_sz, const void* data, size_t data_sz,
+   char entry_flags, uint32_t set_flags);
+int _ekvs_binlog(ekvs store, char operation, char flags, const char* key, size_t key_sz, const void* data, size_t data_sz);
+size_t _ekvs_binlog_header(char* header, char operation, char flags, const char* key, size_t key_sz,
+   const void* data, size_t data_sz);
+int _ekvs_replay_records(ekvs store, const char* buf, size_t len, uint64_t* records);
 struct _ekvs_db_entry* _ekvs_insert(ekvs store, uint64_t hash, const char* key, const void* data,
-   size_t key_sz, size_t data_sz, uint32_t set_flags);
+   size_t key_sz, size_t data_sz, char entry_flags, uint32_t set_flags);
 struct _ekvs_db_entry* _ekvs_retrieve(ekvs store, uint64_t hash, const char* key, size_t key_sz);
+void _ekvs_remove(ekvs store, uint64_t hash, struct _ekvs_db_entry* entry, struct _ekvs_db_entry* prev_entry);
+int ekvs_grow_table(ekvs store, size_t new_sz);
+int _ekvs_evict(ekvs store, const struct _ekvs_db_entry* keep);
+int _ekvs_fit_budget(ekvs store, const struct _ekvs_db_entry* keep);
+int _ekvs_unspill(ekvs store, uint64_t hash, struct _ekvs_db_entry** entry);
+const void* _ekvs_entry_value(ekvs store, const struct _ekvs_db_entry* entry, size_t* data_sz);
+struct _ekvs_db_entry* _ekvs_inflate(ekvs store, uint64_t hash, struct _ekvs_db_entry* entry);
+void* _ekvs_scratch(ekvs store, size_t size);
+
+int _ekvs_vlog_append(ekvs store, const char* key, size_t key_sz, const void* data, size_t data_sz,
+   struct _ekvs_vlog_ptr* ptr);
+const void* _ekvs_vlog_read(ekvs store, const struct _ekvs_vlog_ptr* ptr);
+int _ekvs_vlog_sync(ekvs store);
+void _ekvs_vlog_close(ekvs store);
+
+FILE* _ekvs_binlog_file(ekvs store);
+int _ekvs_segment_load(ekvs store);
+int _ekvs_segment_roll(ekvs store);
+void _ekvs_segment_drop(ekvs store, uint64_t first, uint64_t last);
+void _ekvs_segment_close(ekvs store);
+
+int _ekvs_writer_start(ekvs store, size_t ring_size);
+void _ekvs_writer_stop(ekvs store);
+int _ekvs_writer_append(ekvs store, const void* data, size_t size);
+void _ekvs_writer_publish(ekvs store);
+int _ekvs_writer_drain(ekvs store);
+void _ekvs_writer_rebase(ekvs store, uint64_t offset);
+void _ekvs_writer_set_vlog(ekvs store);
+uint64_t _ekvs_writer_flushes(ekvs store);
+
+int _ekvs_replica_start(ekvs store, size_t backlog_size);
+void _ekvs_replica_feed(ekvs store, const char* header, const char* key, size_t key_sz, const void* data, size_t data_sz);
+uint64_t _ekvs_replica_pending(ekvs store, uint64_t* links);
+void _ekvs_replica_close(ekvs store);
+
+uint32_t _ekvs_crc32c(uint32_t crc, const void* data, size_t len);
+
+size_t _ekvs_lz_bound(size_t src_sz);
+size_t _ekvs_lz_compress(const void* src, size_t src_sz, void* dst, size_t dst_cap);
+size_t _ekvs_lz_decompress(const void* src, size_t src_sz, void* dst, size_t dst_sz);
+size_t _ekvs_lz_pack(const void* src, size_t src_sz, void** packed);
+size_t _ekvs_lz_packed_size(const void* packed, size_t packed_sz);
+int _ekvs_lz_unpack(const void* packed, size_t packed_sz, void* dst);
+
+/* Hint that an address will be read soon */
+#if defined(__GNUC__)
+#define EKVS_PREFETCH(addr) __builtin_prefetch((addr), 0 /* read */, 3 /* keep in all levels */)
+#else
+#define EKVS_PREFETCH(addr) ((void)(addr))
+#endif
+
+/* Atomic add returning the previous value, and a full memory barrier */
+#if defined(__GNUC__)
+#define EKVS_FETCH_ADD(ptr, n) __sync_fetch_and_add((ptr), (n))
+#define EKVS_BARRIER() __sync_synchronize()
+#else
+#define EKVS_FETCH_ADD(ptr, n) ((*(ptr) += (n)) - (n))
+#define EKVS_BARRIER() ((void)0)
+#endif
+
+/* Sequentially consistent load and store, for flags and counters shared between threads */
+#if defined(__GNUC__) && (__GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 7))
+#define EKVS_ATOMIC_LOAD(ptr) __atomic_load_n((ptr), __ATOMIC_SEQ_CST)
+#define EKVS_ATOMIC_STORE(ptr, value) __atomic_store_n((ptr), (value), __ATOMIC_SEQ_CST)
+#else
+#define EKVS_ATOMIC_LOAD(ptr) (EKVS_BARRIER(), *(volatile const uint64_t*)(ptr))
+#define EKVS_ATOMIC_STORE(ptr, value) do { EKVS_BARRIER(); *(ptr) = (value); EKVS_BARRIER(); } while(0)
+#endif
+
+#define EKVS_RO_MAGIC         0x4f524b45  /* 'EKRO' */
+#define EKVS_RO_VERSION       1
+
+/* Read-only files are a header, [key_sz][data_sz][key][data] records, and an open-addressed index */
+struct _ekvs_ro_header {
+   uint32_t magic;
+   uint32_t version;
+   uint64_t count;
+   uint64_t index_offset;
+   uint64_t index_slots;     /* Power of two */
+};
+
+/* An empty slot has an offset of 0 */
+struct _ekvs_ro_slot {
+   uint64_t hash;
+   uint64_t offset;
+};
+
+int _ekvs_ro_get(ekvs store, uint64_t hash, const char* key, size_t key_sz, const void** data, size_t* data_sz);
+void _ekvs_ro_close(ekvs store);
+
+/* Shared segments are a header followed by a heap of power-of-two blocks, see ekvs_shared.c */
+#define EKVS_SHM_MAGIC        0x4d534b45  /* 'EKSM' */
+#define EKVS_SHM_VERSION      1
+#define EKVS_SHM_SLOTS        64
+#define EKVS_SHM_CLASSES      48
+#define EKVS_SHM_MIN_CLASS    6           /* 64 byte blocks */
+
+/* Block states */
+#define EKVS_SHM_FREE         0
+#define EKVS_SHM_ALLOCATED    1           /* Being filled by a writer */
+#define EKVS_SHM_ENTRY        2
+#define EKVS_SHM_TABLE        3
+#define EKVS_SHM_LIMBO        4
+
+/* Slots get a cache line each, readers write them on every refresh */
+struct _ekvs_shm_slot {
+   uint64_t pid;                 /* 0 if the slot is free */
+   uint64_t epoch;
+   char pad[48];
+};
+
+struct _ekvs_shm_header {
+   uint64_t magic;               /* Written last when a segment is created */
+   uint64_t version;
+   uint64_t size;
+   uint64_t seq;                 /* Odd while links are being changed */
+   uint64_t epoch;               /* Advanced by every modification */
+   uint64_t table;               /* Offset of the block holding the buckets */
+   uint64_t table_sz;
+   uint64_t population;
+   uint64_t heap_start;
+   uint64_t heap_end;
+   uint64_t used;                /* Bytes of blocks holding entries and tables */
+   uint64_t limbo;
+   uint64_t free_lists[EKVS_SHM_CLASSES];
+   float grow_threshold;
+   pthread_mutex_t lock;
+   struct _ekvs_shm_slot slots[EKVS_SHM_SLOTS];
+};
+
+struct _ekvs_shm_block {
+   uint32_t state;
+   uint32_t size_class;          /* The block is 1 << size_class bytes */
+   uint64_t link;                /* Next block on a free list or in limbo */
+   uint64_t epoch;               /* Epoch of an entry's write, or at which a block was unlinked */
+};
+
+/* Follows the block header, and is followed by the key and data */
+struct _ekvs_shm_entry {
+   uint64_t chain;               /* Offset of the next block in the bucket, or 0 */
+   uint64_t hash;
+   uint64_t key_sz;
+   uint64_t data_sz;
+};
+
+/* Keep the value of a key as open read views see it, before it is changed */
+#define EKVS_VIEW_PRESERVE(store, hash, key, key_sz) \
+   do { if((store)->views != NULL) _ekvs_view_preserve((store), (hash), (key), (key_sz)); } while(0)
+
+void _ekvs_view_preserve(ekvs store, uint64_t hash, const char* key, size_t key_sz);
+
+/* Record that the bucket of a key is about to change, so the next checkpoint writes it. A bucket number may
+ * be passed instead of the hash. */
+#define EKVS_MARK_DIRTY(store, hash) \
+   do { if((store)->dirty != NULL) _ekvs_mark_dirty((store), (hash)); } while(0)
+
+void _ekvs_mark_dirty(ekvs store, uint64_t hash);
+void _ekvs_view_close_all(ekvs store);
+
+int _ekvs_shm_get(ekvs store, uint64_t hash, const char* key, size_t key_sz, const void** data, size_t* data_sz);
+int _ekvs_shm_set(ekvs store, uint64_t hash, const char* key, size_t key_sz, const void* data, size_t data_sz);
+int _ekvs_shm_del(ekvs store, uint64_t hash, const char* key, size_t key_sz);
+void _ekvs_shm_stats(ekvs store, uint64_t* population, uint64_t* table_sz, uint64_t* used);
+void _ekvs_shm_close(ekvs store);
+
+int _ekvs_lsm_exists(const char* path);
+int _ekvs_lsm_open(ekvs store, const char* path, int created, size_t memtable_size);
+int _ekvs_lsm_get(ekvs store, uint64_t hash, const char* key, size_t key_sz, const void** data, size_t* data_sz);
+int _ekvs_lsm_set(ekvs store, uint64_t hash, const char* key, size_t key_sz, const void* data, size_t data_sz);
+int _ekvs_lsm_del(ekvs store, uint64_t hash, const char* key, size_t key_sz);
+int _ekvs_lsm_flush(ekvs store);
+void _ekvs_lsm_stats(ekvs store, ekvs_runtime_stats* stats);
+void _ekvs_lsm_close(ekvs store);
+
+struct _ekvs_db_entry** _ekvs_table_alloc(ekvs store, uint64_t table_sz, size_t* map_sz, uint32_t* pages, uint32_t* numa);
+void _ekvs_table_free(struct _ekvs_db_entry** table, size_t map_sz);
+
+/* The store is single-threaded, so counters are plain adds. Define EKVS_NO_STATS to compile them out;
+ * ekvs_stats then reports only what it can derive from the table. */
+#ifndef EKVS_NO_STATS
+#define EKVS_STAT_ADD(store, counter, n) ((store)->stats.counter += (n))
+#define EKVS_STAT_START(start) ((start) = _ekvs_now_ns())
+#define EKVS_STAT_TIME(store, counter, start) \
+   _ekvs_stat_time(&(store)->stats.counter##_ns, &(store)->stats.counter##_max_ns, (start))
+#else
+#define EKVS_STAT_ADD(store, counter, n) ((void)0)
+#define EKVS_STAT_START(start) ((start) = 0)
+#define EKVS_STAT_TIME(store, counter, start) ((void)0)
+#endif
+
+uint64_t _ekvs_now_ns(void);
+void _ekvs_stat_time(uint64_t* total_ns, uint64_t* max_ns, uint64_t start);
+
+/* With no trace callback, tracing costs a predictable branch per event and the
+ * arguments of EKVS_TRACE are not evaluated */
+#define EKVS_TRACE_START(store, start) \
+   ((start) = ((store)->trace_callback != NULL ? _ekvs_ticks() : 0))
+#define EKVS_TRACE(store, type, hash, start, probes, bytes) \
+   do { if((store)->trace_callback != NULL) _ekvs_trace((store), (type), (hash), (start), (probes), (bytes)); } while(0)
+
+uint64_t _ekvs_ticks(void);
+void _ekvs_trace(ekvs store, uint32_t type, uint64_t hash, uint64_t start, uint64_t probes, uint64_t bytes);
+uint64_t _ekvs_hash(const char* key, size_t key_sz);
+uint64_t _ekvs_trace_probes(ekvs store, uint64_t hash, const char* key, size_t key_sz);
+
+int _ekvs_use_allocators(const ekvs_opts* opts);
+int _ekvs_set_value(ekvs store, uint64_t hash, const char* key, size_t key_sz, const void* data, size_t data_sz,
+   uint32_t set_flags);
+int _ekvs_write_range(ekvs store, const char* key, size_t key_sz, int append, size_t offset, const void* data, size_t data_sz);
+size_t _ekvs_grown_capacity(size_t data_sz);
+int _ekvs_incr(ekvs store, const char* key, size_t key_sz, int64_t delta, int64_t* result);
+int _ekvs_list_push(ekvs store, const char* key, size_t key_sz, int head, const void* elem, size_t elem_sz);
+int _ekvs_list_pop(ekvs store, const char* key, size_t key_sz, int head, const void** elem, size_t* elem_sz);
+int _ekvs_set_add(ekvs store, const char* key, size_t key_sz, const void* elem, size_t elem_sz, int* added);
+int _ekvs_set_remove(ekvs store, const char* key, size_t key_sz, const void* elem, size_t elem_sz);
+void _ekvs_coll_release(ekvs store, struct _ekvs_db_entry* entry);
+size_t _ekvs_coll_bytes(const struct _ekvs_db_entry* entry);
+const void* _ekvs_coll_flatten(ekvs store, const struct _ekvs_db_entry* entry, size_t* data_sz);
+/* If found points to a non-NULL entry, it is taken to be the key's entry rather than looked up */
+int _ekvs_get(ekvs store, uint64_t hash, const char* key, size_t key_sz, const void** data, size_t* data_sz,
+   struct _ekvs_db_entry** found);
+void _ekvs_free_entry(ekvs store, struct _ekvs_db_entry* entry);
 
 extern ekvs_malloc_ptr ekvs_malloc;
 extern ekvs_realloc_ptr ekvs_realloc;
@@ -0,0 +1,169 @@
+/* -*- Mode: C; tab-width: 3; c-basic-offset: 3; indent-tabs-mode: nil -*- */
+/* vim: set filetype=C tabstop=3 softtabstop=3 shiftwidth=3 expandtab: */
+
+/* ekvs -- Copyright (C) 2011 GameClay LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include "ekvs_internal.h"
+
+/* Key handles carry the hash, and a hint: the entry the key was last found in,
+ * and store->entry_epoch at the time. Entries are only freed or moved when the
+ * epoch advances, so while it has not, the hint is still the key's entry. */
+
+static struct _ekvs_db_entry* _ekvs_key_hint(ekvs store, const ekvs_key* handle)
+{
+   if(handle->store != store || handle->epoch != store->entry_epoch) return NULL;
+   return handle->hint;
+}
+
+static void _ekvs_key_remember(ekvs store, ekvs_key* handle, struct _ekvs_db_entry* entry)
+{
+   handle->store = store;
+   handle->epoch = store->entry_epoch;
+   handle->hint = entry;
+}
+
+static int _ekvs_key_check(ekvs store, const ekvs_key* handle, const char* caller)
+{
+   if(store == NULL)
+   {
+      fprintf(stderr, "ekvs: NULL store parameter passed to %s.\n", caller);
+      return EKVS_FAIL;
+   }
+
+   if(handle == NULL || handle->key == NULL)
+   {
+      fprintf(stderr, "ekvs: NULL or unprepared handle parameter passed to %s.\n", caller);
+      return EKVS_FAIL;
+   }
+
+   return EKVS_OK;
+}
+
+int ekvs_key_prepare(ekvs store, const char* key, size_t key_sz, ekvs_key* handle)
+{
+   if(store == NULL)
+   {
+      fprintf(stderr, "ekvs: NULL store parameter passed to ekvs_key_prepare.\n");
+      return EKVS_FAIL;
+   }
+
+   if(key == NULL || handle == NULL)
+   {
+      fprintf(stderr, "ekvs: NULL key or handle parameter passed to ekvs_key_prepare.\n");
+      return EKVS_FAIL;
+   }
+
+   handle->key = key;
+   handle->key_sz = key_sz;
+   handle->hash = _ekvs_hash(key, key_sz);
+   _ekvs_key_remember(store, handle, NULL);
+
+   store->last_error = EKVS_OK;
+   return EKVS_OK;
+}
+
+int ekvs_get_h(ekvs store, ekvs_key* handle, const void** data, size_t* data_sz)
+{
+   struct _ekvs_db_entry* entry;
+   uint64_t trace_start;
+   int ret = _ekvs_key_check(store, handle, "ekvs_get_h");
+   if(ret != EKVS_OK) return ret;
+
+   EKVS_TRACE_START(store, trace_start);
+   entry = _ekvs_key_hint(store, handle);
+   ret = _ekvs_get(store, handle->hash, handle->key, handle->key_sz, data, data_sz, &entry);
+   _ekvs_key_remember(store, handle, (ret == EKVS_OK ? entry : NULL));
+   EKVS_TRACE(store, ekvs_trace_get, handle->hash, trace_start,
+      _ekvs_trace_probes(store, handle->hash, handle->key, handle->key_sz), 0);
+   return ret;
+}
+
+int ekvs_set_h(ekvs store, ekvs_key* handle, const void* data, size_t data_sz, uint32_t flags)
+{
+   struct _ekvs_db_entry* entry;
+   uint64_t trace_start;
+   uint64_t lsn;
+   int ret = _ekvs_key_check(store, handle, "ekvs_set_h");
+   if(ret != EKVS_OK) return ret;
+
+   if(store->ro_map != NULL || store->follower != NULL)
+   {
+      store->last_error = EKVS_READ_ONLY;
+      return EKVS_READ_ONLY;
+   }
+
+   if(store->shm_map != NULL)
+   {
+      return _ekvs_shm_set(store, handle->hash, handle->key, handle->key_sz, data, data_sz);
+   }
+
+   EKVS_TRACE_START(store, trace_start);
+   lsn = store->lsn;
+
+   /* A plain value of the same size, which nothing pins, is overwritten where it is */
+   entry = _ekvs_key_hint(store, handle);
+   if(entry != NULL && entry->data_sz == data_sz && entry->refs == 0 && flags == 0 &&
+      (entry->flags & EKVS_ENTRY_PERSISTENT) == 0 &&
+      (store->vlog_threshold == 0 || data_sz < store->vlog_threshold || store->vlog_prefix == NULL))
+   {
+      EKVS_VIEW_PRESERVE(store, handle->hash, handle->key, handle->key_sz);
+      EKVS_MARK_DIRTY(store, handle->hash);
+      if(data_sz > 0) memcpy(&entry->key_data[entry->key_sz], data, data_sz);
+      entry->flags |= EKVS_ENTRY_ACCESSED;
+      store->last_error = EKVS_OK;
+      if(store->binlog_enabled)
+      {
+         store->last_error = _ekvs_binlog(store, EKVS_BINLOG_SET, 0 /* flags */, handle->key, handle->key_sz,
+            data, data_sz);
+      }
+      ret = store->last_error;
+   }
+   else
+   {
+      ret = _ekvs_set_value(store, handle->hash, handle->key, handle->key_sz, data, data_sz, flags);
+   }
+
+   EKVS_TRACE(store, ekvs_trace_set, handle->hash, trace_start,
+      _ekvs_trace_probes(store, handle->hash, handle->key, handle->key_sz), store->lsn - lsn);
+   return ret;
+}
+
+int ekvs_del_h(ekvs store, ekvs_key* handle)
+{
+   uint64_t trace_start;
+   uint64_t lsn;
+   int ret = _ekvs_key_check(store, handle, "ekvs_del_h");
+   if(ret != EKVS_OK) return ret;
+
+   if(store->ro_map != NULL || store->follower != NULL)
+   {
+      store->last_error = EKVS_READ_ONLY;
+      return EKVS_READ_ONLY;
+   }
+
+   if(store->shm_map != NULL)
+   {
+      return _ekvs_shm_del(store, handle->hash, handle->key, handle->key_sz);
+   }
+
+   EKVS_TRACE_START(store, trace_start);
+   lsn = store->lsn;
+   ret = _ekvs_del(store, handle->hash, handle->key, handle->key_sz);
+   _ekvs_key_remember(store, handle, NULL);
+   EKVS_TRACE(store, ekvs_trace_del, handle->hash, trace_start, 0, store->lsn - lsn);
+   return ret;
+}
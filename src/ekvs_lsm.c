@@ -0,0 +1,1234 @@
+/* -*- Mode: C; tab-width: 3; c-basic-offset: 3; indent-tabs-mode: nil -*- */
+/* vim: set filetype=C tabstop=3 softtabstop=3 shiftwidth=3 expandtab: */
+
+/* ekvs -- Copyright (C) 2011 GameClay LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "ekvs_internal.h"
+
+#include <fcntl.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/* The log-structured engine keeps recent writes in a memtable, a hash of
+ * records which deletes mark with a tombstone. Every write is logged to the
+ * binlog of the database file as usual, and ekvs_snapshot flushes the memtable
+ * to a new SSTable, then writes the (empty) table to reset the binlog.
+ *
+ * SSTables are immutable files named <path>.sst.<number>, listed by level in
+ * the manifest <path>.lsm. Level 0 holds flushed memtables, which overlap and
+ * are searched newest first. Every deeper level is a single sorted run, each
+ * EKVS_LSM_LEVEL_RATIO times larger than the last. Once level 0 has
+ * EKVS_LSM_L0_TRIGGER files, or a level outgrows its capacity, a thread merges
+ * it into the next level. The thread only reads its inputs and writes the new
+ * file; the store installs it, rewrites the manifest and removes the inputs on
+ * its next write, so lookups never wait for a compaction.
+ *
+ * User allocators need not be thread-safe, so the thread never calls them. Its
+ * cursors are allocated when the job is scheduled, and the buffers of the
+ * SSTable writer, which never outlive it, come from the C library. */
+
+#define EKVS_LSM_MAGIC        0x4d534c45  /* 'ELSM' */
+#define EKVS_SST_MAGIC        0x54534b45  /* 'EKST' */
+#define EKVS_LSM_VERSION      1
+#define EKVS_LSM_LEVELS       7
+#define EKVS_LSM_L0_TRIGGER   4
+#define EKVS_LSM_LEVEL_RATIO  10
+#define EKVS_LSM_BLOCK_SIZE   4096
+#define EKVS_LSM_BLOOM_BITS   10          /* Per key, about 1% false positives */
+#define EKVS_LSM_BLOOM_HASHES 7
+
+/* Data size of a deleted key */
+#define EKVS_LSM_TOMBSTONE    ((uint64_t)-1)
+#define EKVS_LSM_VALUE_BYTES(data_sz) ((data_sz) == EKVS_LSM_TOMBSTONE ? 0 : (size_t)(data_sz))
+
+/* SSTables are blocks of sorted [key_sz][data_sz][key][data] records, an index of
+ * [offset][size][crc32c][first key_sz][first key] per block, a Bloom filter of the
+ * key hashes, and this footer. Blocks are only checked when compacted. */
+struct _ekvs_sst_footer {
+   uint64_t count;
+   uint64_t block_count;
+   uint64_t index_offset;
+   uint64_t index_sz;            /* The Bloom filter follows the index */
+   uint64_t bloom_bits;
+   uint32_t bloom_hashes;
+   uint32_t checksum;            /* crc32c of the index and Bloom filter */
+   uint32_t magic;
+   uint32_t version;
+};
+
+#define EKVS_SST_RECORD_HEADER (sizeof(uint64_t) * 2)
+#define EKVS_SST_INDEX_HEADER  (sizeof(uint64_t) * 4)
+
+struct _ekvs_sst_block {
+   uint64_t offset;
+   uint64_t size;
+   uint32_t crc;
+   const char* first_key;
+   size_t first_key_sz;
+};
+
+struct _ekvs_sst {
+   uint64_t number;
+   char* map;
+   size_t map_sz;
+   uint64_t count;
+   uint64_t block_count;
+   struct _ekvs_sst_block* blocks;
+   const unsigned char* bloom;
+   uint64_t bloom_bits;
+   uint32_t bloom_hashes;
+};
+
+struct _ekvs_sst_record {
+   const char* key;
+   size_t key_sz;
+   const char* data;
+   uint64_t data_sz;
+   uint64_t next;                /* Position of the following record in the block */
+};
+
+struct _ekvs_lsm_record {
+   struct _ekvs_lsm_record* chain;
+   uint64_t hash;
+   size_t key_sz;
+   uint64_t data_sz;
+   char key_data[1];
+};
+
+#define EKVS_LSM_RECORD_SIZE(key_sz, data_sz) \
+   (sizeof(struct _ekvs_lsm_record) + (key_sz) + EKVS_LSM_VALUE_BYTES(data_sz) - 1)
+
+struct _ekvs_lsm_level {
+   struct _ekvs_sst** files;     /* Oldest first */
+   uint64_t count;
+   uint64_t capacity;
+   uint64_t bytes;
+};
+
+/* A compaction merges the oldest source_count files of level source, and the
+ * run of the next level, into a new run for that level */
+struct _ekvs_lsm_job {
+   pthread_t thread;
+   int running;
+   int threaded;
+   uint64_t done;                /* Set by the thread once it has finished */
+   int ret;
+   int source;
+   uint64_t source_count;
+   struct _ekvs_sst** inputs;    /* Newest first, so the first of equal keys wins */
+   uint64_t input_count;
+   struct _ekvs_sst_cursor* cursors; /* One per input */
+   int drop_tombstones;          /* Nothing older lies below the output */
+   uint64_t number;
+   char* fname;
+   uint64_t count;
+   uint64_t bytes;
+};
+
+struct _ekvs_lsm {
+   char* prefix;
+   size_t memtable_size;
+   struct _ekvs_lsm_record** buckets;
+   uint64_t bucket_count;        /* A power of two */
+   uint64_t population;
+   uint64_t bytes;
+   struct _ekvs_lsm_level levels[EKVS_LSM_LEVELS];
+   uint64_t next_file;
+   struct _ekvs_lsm_job job;
+   uint64_t flushes;
+   uint64_t compactions;
+   uint64_t bytes_written;
+};
+
+/* Growable buffers of the SSTable writer, from malloc since compactions fill them on their own thread */
+struct _ekvs_lsm_buf {
+   char* data;
+   size_t sz;
+   size_t cap;
+};
+
+struct _ekvs_sst_writer {
+   FILE* file;
+   uint64_t offset;
+   struct _ekvs_lsm_buf block;
+   struct _ekvs_lsm_buf index;
+   uint64_t* hashes;
+   uint64_t count;
+   uint64_t hashes_cap;
+   uint64_t block_count;
+};
+
+static int _ekvs_lsm_compare(const char* a, size_t a_sz, const char* b, size_t b_sz)
+{
+   int cmp = memcmp(a, b, a_sz < b_sz ? a_sz : b_sz);
+   if(cmp != 0) return cmp;
+   return (a_sz < b_sz ? -1 : (a_sz > b_sz ? 1 : 0));
+}
+
+static char* _ekvs_lsm_fname(const char* prefix, const char* suffix, uint64_t number)
+{
+   char* fname = ekvs_malloc(strlen(prefix) + strlen(suffix) + 22);
+   if(fname != NULL) sprintf(fname, "%s%s%lu", prefix, suffix, (unsigned long)number);
+   return fname;
+}
+
+static int _ekvs_lsm_buf_put(struct _ekvs_lsm_buf* buf, const void* data, size_t n)
+{
+   if(buf->cap - buf->sz < n)
+   {
+      size_t new_cap = (buf->cap != 0 ? buf->cap * 2 : EKVS_LSM_BLOCK_SIZE);
+      char* grown;
+      while(new_cap - buf->sz < n) new_cap *= 2;
+      grown = realloc(buf->data, new_cap);
+      if(grown == NULL) return EKVS_ALLOCATION_FAIL;
+      buf->data = grown;
+      buf->cap = new_cap;
+   }
+   memcpy(buf->data + buf->sz, data, n);
+   buf->sz += n;
+   return EKVS_OK;
+}
+
+/* Double hashing of the 64-bit key hash, see Kirsch and Mitzenmacher */
+static int _ekvs_bloom_test(const unsigned char* bloom, uint64_t bits, uint32_t hashes, uint64_t hash)
+{
+   uint64_t delta = (hash >> 33) | 1;
+   uint32_t i;
+
+   if(bits == 0) return 1;
+   for(i = 0; i < hashes; i++, hash += delta)
+   {
+      uint64_t bit = hash % bits;
+      if((bloom[bit / 8] & (1 << (bit % 8))) == 0) return 0;
+   }
+   return 1;
+}
+
+static void _ekvs_bloom_add(unsigned char* bloom, uint64_t bits, uint32_t hashes, uint64_t hash)
+{
+   uint64_t delta = (hash >> 33) | 1;
+   uint32_t i;
+
+   for(i = 0; i < hashes; i++, hash += delta)
+   {
+      uint64_t bit = hash % bits;
+      bloom[bit / 8] |= (unsigned char)(1 << (bit % 8));
+   }
+}
+
+/************************* SSTable writing *************************/
+
+static int _ekvs_sst_create(struct _ekvs_sst_writer* writer, const char* fname)
+{
+   memset(writer, 0, sizeof(struct _ekvs_sst_writer));
+   writer->file = fopen(fname, "wb");
+   if(writer->file == NULL)
+   {
+      fprintf(stderr, "ekvs: failed to create SSTable (%s).\n", fname);
+      return EKVS_FILE_FAIL;
+   }
+   return EKVS_OK;
+}
+
+static void _ekvs_sst_discard(struct _ekvs_sst_writer* writer)
+{
+   if(writer->file != NULL) fclose(writer->file);
+   writer->file = NULL;
+   free(writer->block.data);
+   free(writer->index.data);
+   free(writer->hashes);
+   writer->block.data = writer->index.data = NULL;
+   writer->hashes = NULL;
+}
+
+static int _ekvs_sst_flush_block(struct _ekvs_sst_writer* writer)
+{
+   uint64_t entry[4];
+
+   if(writer->block.sz == 0) return EKVS_OK;
+
+   /* The block starts with its first record */
+   memcpy(&entry[3], writer->block.data, sizeof(uint64_t));
+   entry[0] = writer->offset;
+   entry[1] = writer->block.sz;
+   entry[2] = _ekvs_crc32c(0, writer->block.data, writer->block.sz);
+   if(_ekvs_lsm_buf_put(&writer->index, entry, sizeof(entry)) != EKVS_OK ||
+      _ekvs_lsm_buf_put(&writer->index, writer->block.data + EKVS_SST_RECORD_HEADER, (size_t)entry[3]) != EKVS_OK)
+   {
+      return EKVS_ALLOCATION_FAIL;
+   }
+
+   if(fwrite(writer->block.data, 1, writer->block.sz, writer->file) != writer->block.sz) return EKVS_FILE_FAIL;
+   writer->offset += writer->block.sz;
+   writer->block.sz = 0;
+   writer->block_count++;
+   return EKVS_OK;
+}
+
+/* Records must be added in key order, without duplicates */
+static int _ekvs_sst_add(struct _ekvs_sst_writer* writer, uint64_t hash, const char* key, size_t key_sz,
+   const void* data, uint64_t data_sz)
+{
+   uint64_t header[2];
+
+   if(writer->count == writer->hashes_cap)
+   {
+      uint64_t new_cap = (writer->hashes_cap != 0 ? writer->hashes_cap * 2 : 1024);
+      uint64_t* hashes = realloc(writer->hashes, (size_t)new_cap * sizeof(uint64_t));
+      if(hashes == NULL) return EKVS_ALLOCATION_FAIL;
+      writer->hashes = hashes;
+      writer->hashes_cap = new_cap;
+   }
+   writer->hashes[writer->count++] = hash;
+
+   header[0] = key_sz;
+   header[1] = data_sz;
+   if(_ekvs_lsm_buf_put(&writer->block, header, sizeof(header)) != EKVS_OK ||
+      _ekvs_lsm_buf_put(&writer->block, key, key_sz) != EKVS_OK ||
+      _ekvs_lsm_buf_put(&writer->block, data, EKVS_LSM_VALUE_BYTES(data_sz)) != EKVS_OK)
+   {
+      return EKVS_ALLOCATION_FAIL;
+   }
+
+   if(writer->block.sz >= EKVS_LSM_BLOCK_SIZE) return _ekvs_sst_flush_block(writer);
+   return EKVS_OK;
+}
+
+/* Write the index, Bloom filter and footer, and make the file durable */
+static int _ekvs_sst_finish(struct _ekvs_sst_writer* writer, uint64_t* bytes)
+{
+   struct _ekvs_sst_footer footer;
+   unsigned char* bloom;
+   size_t bloom_sz;
+   uint64_t i;
+   int ret = _ekvs_sst_flush_block(writer);
+   if(ret != EKVS_OK) return ret;
+
+   memset(&footer, 0, sizeof(footer));
+   footer.count = writer->count;
+   footer.block_count = writer->block_count;
+   footer.index_offset = writer->offset;
+   footer.index_sz = writer->index.sz;
+   footer.bloom_bits = ((writer->count * EKVS_LSM_BLOOM_BITS + 63) / 64) * 64;
+   footer.bloom_hashes = EKVS_LSM_BLOOM_HASHES;
+   footer.magic = EKVS_SST_MAGIC;
+   footer.version = EKVS_LSM_VERSION;
+
+   bloom_sz = (size_t)(footer.bloom_bits / 8);
+   bloom = malloc(bloom_sz != 0 ? bloom_sz : 1);
+   if(bloom == NULL) return EKVS_ALLOCATION_FAIL;
+   memset(bloom, 0, bloom_sz);
+   for(i = 0; i < writer->count; i++) _ekvs_bloom_add(bloom, footer.bloom_bits, footer.bloom_hashes, writer->hashes[i]);
+   footer.checksum = _ekvs_crc32c(_ekvs_crc32c(0, writer->index.data, writer->index.sz), bloom, bloom_sz);
+
+   ret = EKVS_FILE_FAIL;
+   if(fwrite(writer->index.data, 1, writer->index.sz, writer->file) == writer->index.sz &&
+      fwrite(bloom, 1, bloom_sz, writer->file) == bloom_sz &&
+      fwrite(&footer, sizeof(footer), 1, writer->file) == 1 &&
+      fflush(writer->file) == 0 && fsync(fileno(writer->file)) == 0)
+   {
+      *bytes = writer->offset + writer->index.sz + bloom_sz + sizeof(footer);
+      ret = EKVS_OK;
+   }
+   free(bloom);
+   return ret;
+}
+
+/************************* SSTable reading *************************/
+
+/* Parse the record at pos of a block, or return 0 if it does not fit in the block */
+static int _ekvs_sst_parse(const char* block, uint64_t block_sz, uint64_t pos, struct _ekvs_sst_record* rec)
+{
+   uint64_t header[2];
+
+   if(pos > block_sz || block_sz - pos < EKVS_SST_RECORD_HEADER) return 0;
+   memcpy(header, block + pos, sizeof(header));
+   if(header[0] > block_sz - pos - EKVS_SST_RECORD_HEADER) return 0;
+   if(EKVS_LSM_VALUE_BYTES(header[1]) > block_sz - pos - EKVS_SST_RECORD_HEADER - header[0]) return 0;
+
+   rec->key = block + pos + EKVS_SST_RECORD_HEADER;
+   rec->key_sz = (size_t)header[0];
+   rec->data = rec->key + rec->key_sz;
+   rec->data_sz = header[1];
+   rec->next = pos + EKVS_SST_RECORD_HEADER + header[0] + EKVS_LSM_VALUE_BYTES(header[1]);
+   return 1;
+}
+
+static void _ekvs_sst_close(struct _ekvs_sst* sst, const char* prefix, int remove_file)
+{
+   if(remove_file)
+   {
+      char* fname = _ekvs_lsm_fname(prefix, ".sst.", sst->number);
+      if(fname != NULL) remove(fname);
+      ekvs_free(fname);
+   }
+   munmap(sst->map, sst->map_sz);
+   ekvs_free(sst->blocks);
+   ekvs_free(sst);
+}
+
+static int _ekvs_sst_open(const char* prefix, uint64_t number, struct _ekvs_sst** opened)
+{
+   struct _ekvs_sst_footer footer;
+   struct _ekvs_sst* sst;
+   struct stat st;
+   char* fname;
+   void* map;
+   uint64_t end;
+   uint64_t pos;
+   uint64_t i;
+   int fd;
+
+   fname = _ekvs_lsm_fname(prefix, ".sst.", number);
+   if(fname == NULL) return EKVS_ALLOCATION_FAIL;
+   fd = open(fname, O_RDONLY);
+   if(fd < 0 || fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(footer))
+   {
+      fprintf(stderr, "ekvs: failed to open SSTable (%s).\n", fname);
+      if(fd >= 0) close(fd);
+      ekvs_free(fname);
+      return EKVS_FILE_FAIL;
+   }
+   map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+   close(fd);
+   if(map == MAP_FAILED)
+   {
+      ekvs_free(fname);
+      return EKVS_FILE_FAIL;
+   }
+
+   /* Validate the footer, index and filter bounds; lookups trust them afterwards */
+   end = (uint64_t)st.st_size - sizeof(footer);
+   memcpy(&footer, (char*)map + end, sizeof(footer));
+   if(footer.magic != EKVS_SST_MAGIC || footer.version != EKVS_LSM_VERSION || footer.bloom_bits % 8 != 0 ||
+      footer.index_offset > end || footer.index_sz > end - footer.index_offset ||
+      footer.bloom_bits / 8 != end - footer.index_offset - footer.index_sz ||
+      _ekvs_crc32c(0, (char*)map + footer.index_offset, (size_t)(end - footer.index_offset)) != footer.checksum ||
+      footer.block_count > footer.index_sz / EKVS_SST_INDEX_HEADER)
+   {
+      fprintf(stderr, "ekvs: %s is not an SSTable, or is damaged.\n", fname);
+      munmap(map, (size_t)st.st_size);
+      ekvs_free(fname);
+      return EKVS_FILE_FAIL;
+   }
+   ekvs_free(fname);
+
+   sst = ekvs_malloc(sizeof(struct _ekvs_sst));
+   if(sst == NULL)
+   {
+      munmap(map, (size_t)st.st_size);
+      return EKVS_ALLOCATION_FAIL;
+   }
+   sst->number = number;
+   sst->map = map;
+   sst->map_sz = (size_t)st.st_size;
+   sst->count = footer.count;
+   sst->block_count = footer.block_count;
+   sst->bloom = (const unsigned char*)map + footer.index_offset + footer.index_sz;
+   sst->bloom_bits = footer.bloom_bits;
+   sst->bloom_hashes = footer.bloom_hashes;
+   sst->blocks = ekvs_malloc((size_t)(footer.block_count != 0 ? footer.block_count : 1) * sizeof(struct _ekvs_sst_block));
+   if(sst->blocks == NULL)
+   {
+      munmap(map, (size_t)st.st_size);
+      ekvs_free(sst);
+      return EKVS_ALLOCATION_FAIL;
+   }
+
+   for(i = 0, pos = footer.index_offset; i < footer.block_count; i++)
+   {
+      uint64_t entry[4];
+      if(footer.index_offset + footer.index_sz - pos < EKVS_SST_INDEX_HEADER) break;
+      memcpy(entry, (char*)map + pos, sizeof(entry));
+      pos += EKVS_SST_INDEX_HEADER;
+      if(entry[3] > footer.index_offset + footer.index_sz - pos) break;
+      if(entry[0] > footer.index_offset || entry[1] > footer.index_offset - entry[0]) break;
+      sst->blocks[i].offset = entry[0];
+      sst->blocks[i].size = entry[1];
+      sst->blocks[i].crc = (uint32_t)entry[2];
+      sst->blocks[i].first_key = (char*)map + pos;
+      sst->blocks[i].first_key_sz = (size_t)entry[3];
+      pos += entry[3];
+   }
+   if(i != footer.block_count)
+   {
+      _ekvs_sst_close(sst, prefix, 0);
+      return EKVS_FILE_FAIL;
+   }
+
+   *opened = sst;
+   return EKVS_OK;
+}
+
+/* Return 1 if the table holds the key, and assign its record. data_sz is EKVS_LSM_TOMBSTONE if it was deleted. */
+static int _ekvs_sst_find(const struct _ekvs_sst* sst, uint64_t hash, const char* key, size_t key_sz,
+   struct _ekvs_sst_record* rec)
+{
+   const struct _ekvs_sst_block* block;
+   uint64_t lo = 0, hi = sst->block_count;
+   uint64_t pos;
+
+   if(sst->block_count == 0 || !_ekvs_bloom_test(sst->bloom, sst->bloom_bits, sst->bloom_hashes, hash)) return 0;
+
+   /* Find the last block which starts at or before the key */
+   while(hi - lo > 1)
+   {
+      uint64_t mid = lo + (hi - lo) / 2;
+      if(_ekvs_lsm_compare(sst->blocks[mid].first_key, sst->blocks[mid].first_key_sz, key, key_sz) <= 0) lo = mid;
+      else hi = mid;
+   }
+   block = &sst->blocks[lo];
+   if(_ekvs_lsm_compare(block->first_key, block->first_key_sz, key, key_sz) > 0) return 0;
+
+   for(pos = 0; _ekvs_sst_parse(sst->map + block->offset, block->size, pos, rec); pos = rec->next)
+   {
+      int cmp = _ekvs_lsm_compare(rec->key, rec->key_sz, key, key_sz);
+      if(cmp == 0) return 1;
+      if(cmp > 0) break;
+   }
+   return 0;
+}
+
+/************************* Manifest *************************/
+
+/* The manifest is [magic][version][next file][file count], a [level][number] pair
+ * per file with level 0 oldest first, and a crc32c of everything before it */
+static int _ekvs_lsm_write_manifest(struct _ekvs_lsm* lsm)
+{
+   struct _ekvs_lsm_buf buf;
+   uint64_t header[4];
+   uint32_t crc;
+   char* fname = _ekvs_lsm_fname(lsm->prefix, ".lsm", 0);
+   char* tmp_fname = _ekvs_lsm_fname(lsm->prefix, ".lsm.tmp", 0);
+   FILE* file = NULL;
+   uint64_t i, j;
+   int ret = EKVS_ALLOCATION_FAIL;
+
+   memset(&buf, 0, sizeof(buf));
+   if(fname == NULL || tmp_fname == NULL) goto ekvs_lsm_write_manifest_done;
+
+   /* Names end in the number, which is not wanted here */
+   fname[strlen(fname) - 1] = '\0';
+   tmp_fname[strlen(tmp_fname) - 1] = '\0';
+
+   header[0] = EKVS_LSM_MAGIC;
+   header[1] = EKVS_LSM_VERSION;
+   header[2] = lsm->next_file;
+   header[3] = 0;
+   for(i = 0; i < EKVS_LSM_LEVELS; i++) header[3] += lsm->levels[i].count;
+   if(_ekvs_lsm_buf_put(&buf, header, sizeof(header)) != EKVS_OK) goto ekvs_lsm_write_manifest_done;
+   for(i = 0; i < EKVS_LSM_LEVELS; i++)
+   {
+      for(j = 0; j < lsm->levels[i].count; j++)
+      {
+         uint64_t file_entry[2];
+         file_entry[0] = i;
+         file_entry[1] = lsm->levels[i].files[j]->number;
+         if(_ekvs_lsm_buf_put(&buf, file_entry, sizeof(file_entry)) != EKVS_OK) goto ekvs_lsm_write_manifest_done;
+      }
+   }
+   crc = _ekvs_crc32c(0, buf.data, buf.sz);
+   if(_ekvs_lsm_buf_put(&buf, &crc, sizeof(crc)) != EKVS_OK) goto ekvs_lsm_write_manifest_done;
+
+   ret = EKVS_FILE_FAIL;
+   file = fopen(tmp_fname, "wb");
+   if(file == NULL) goto ekvs_lsm_write_manifest_done;
+   if(fwrite(buf.data, 1, buf.sz, file) != buf.sz || fflush(file) != 0 || fsync(fileno(file)) != 0)
+   {
+      fclose(file);
+      remove(tmp_fname);
+      goto ekvs_lsm_write_manifest_done;
+   }
+   fclose(file);
+   if(rename(tmp_fname, fname) == 0) ret = EKVS_OK;
+
+ekvs_lsm_write_manifest_done:
+   if(ret != EKVS_OK) fprintf(stderr, "ekvs: failed to write the LSM manifest of %s.\n", lsm->prefix);
+   free(buf.data);
+   ekvs_free(tmp_fname);
+   ekvs_free(fname);
+   return ret;
+}
+
+static int _ekvs_lsm_level_push(struct _ekvs_lsm_level* level, struct _ekvs_sst* sst)
+{
+   if(level->count == level->capacity)
+   {
+      uint64_t new_capacity = (level->capacity != 0 ? level->capacity * 2 : EKVS_LSM_L0_TRIGGER);
+      struct _ekvs_sst** files = ekvs_realloc(level->files, (size_t)new_capacity * sizeof(struct _ekvs_sst*));
+      if(files == NULL) return EKVS_ALLOCATION_FAIL;
+      level->files = files;
+      level->capacity = new_capacity;
+   }
+   level->files[level->count++] = sst;
+   level->bytes += sst->map_sz;
+   return EKVS_OK;
+}
+
+static int _ekvs_lsm_read_manifest(struct _ekvs_lsm* lsm, const char* fname)
+{
+   FILE* file = fopen(fname, "rb");
+   uint64_t header[4];
+   uint32_t crc;
+   char* buf = NULL;
+   long size;
+   uint64_t i;
+   int ret = EKVS_FILE_FAIL;
+
+   if(file == NULL) return EKVS_FILE_FAIL;
+   if(fseek(file, 0, SEEK_END) != 0 || (size = ftell(file)) < (long)(sizeof(header) + sizeof(crc)) ||
+      fseek(file, 0, SEEK_SET) != 0)
+   {
+      goto ekvs_lsm_read_manifest_done;
+   }
+   buf = ekvs_malloc((size_t)size);
+   if(buf == NULL)
+   {
+      ret = EKVS_ALLOCATION_FAIL;
+      goto ekvs_lsm_read_manifest_done;
+   }
+   if(fread(buf, 1, (size_t)size, file) != (size_t)size) goto ekvs_lsm_read_manifest_done;
+
+   memcpy(header, buf, sizeof(header));
+   memcpy(&crc, buf + size - sizeof(crc), sizeof(crc));
+   if(header[0] != EKVS_LSM_MAGIC || header[1] != EKVS_LSM_VERSION ||
+      header[3] != ((uint64_t)size - sizeof(header) - sizeof(crc)) / (2 * sizeof(uint64_t)) ||
+      _ekvs_crc32c(0, buf, (size_t)size - sizeof(crc)) != crc)
+   {
+      goto ekvs_lsm_read_manifest_done;
+   }
+
+   lsm->next_file = header[2];
+   ret = EKVS_OK;
+   for(i = 0; i < header[3] && ret == EKVS_OK; i++)
+   {
+      uint64_t file_entry[2];
+      struct _ekvs_sst* sst;
+      memcpy(file_entry, buf + sizeof(header) + i * sizeof(file_entry), sizeof(file_entry));
+      if(file_entry[0] >= EKVS_LSM_LEVELS)
+      {
+         ret = EKVS_FILE_FAIL;
+         break;
+      }
+      ret = _ekvs_sst_open(lsm->prefix, file_entry[1], &sst);
+      if(ret == EKVS_OK)
+      {
+         ret = _ekvs_lsm_level_push(&lsm->levels[file_entry[0]], sst);
+         if(ret != EKVS_OK) _ekvs_sst_close(sst, lsm->prefix, 0);
+      }
+   }
+
+ekvs_lsm_read_manifest_done:
+   if(ret != EKVS_OK) fprintf(stderr, "ekvs: failed to read the LSM manifest %s.\n", fname);
+   ekvs_free(buf);
+   fclose(file);
+   return ret;
+}
+
+/************************* Compaction *************************/
+
+struct _ekvs_sst_cursor {
+   const struct _ekvs_sst* sst;
+   uint64_t block;
+   struct _ekvs_sst_record rec;
+   int valid;
+};
+
+/* Move to the record at pos of the cursor's block, or the first record of the next one */
+static int _ekvs_sst_seek(struct _ekvs_sst_cursor* cursor, uint64_t pos)
+{
+   const struct _ekvs_sst* sst = cursor->sst;
+
+   cursor->valid = 0;
+   while(cursor->block < sst->block_count)
+   {
+      const struct _ekvs_sst_block* block = &sst->blocks[cursor->block];
+      if(pos < block->size)
+      {
+         if(pos == 0 && _ekvs_crc32c(0, sst->map + block->offset, (size_t)block->size) != block->crc) return EKVS_FILE_FAIL;
+         if(!_ekvs_sst_parse(sst->map + block->offset, block->size, pos, &cursor->rec)) return EKVS_FILE_FAIL;
+         cursor->valid = 1;
+         return EKVS_OK;
+      }
+      cursor->block++;
+      pos = 0;
+   }
+   return EKVS_OK;
+}
+
+static int _ekvs_lsm_merge(struct _ekvs_lsm_job* job, struct _ekvs_sst_cursor* cursors)
+{
+   struct _ekvs_sst_writer writer;
+   uint64_t i;
+   int ret;
+
+   for(i = 0; i < job->input_count; i++)
+   {
+      cursors[i].sst = job->inputs[i];
+      cursors[i].block = 0;
+      ret = _ekvs_sst_seek(&cursors[i], 0);
+      if(ret != EKVS_OK) return ret;
+   }
+
+   ret = _ekvs_sst_create(&writer, job->fname);
+   if(ret != EKVS_OK) return ret;
+   for(;;)
+   {
+      struct _ekvs_sst_record min;
+      uint64_t min_input = job->input_count;
+
+      memset(&min, 0, sizeof(min));
+      /* Inputs are newest first, so the first of equal keys is the live one */
+      for(i = 0; i < job->input_count; i++)
+      {
+         if(cursors[i].valid && (min_input == job->input_count ||
+            _ekvs_lsm_compare(cursors[i].rec.key, cursors[i].rec.key_sz, min.key, min.key_sz) < 0))
+         {
+            min = cursors[i].rec;
+            min_input = i;
+         }
+      }
+      if(min_input == job->input_count) break;
+
+      if(min.data_sz != EKVS_LSM_TOMBSTONE || !job->drop_tombstones)
+      {
+         ret = _ekvs_sst_add(&writer, _ekvs_hash(min.key, min.key_sz), min.key, min.key_sz, min.data, min.data_sz);
+         if(ret != EKVS_OK) break;
+      }
+
+      for(i = 0; i < job->input_count && ret == EKVS_OK; i++)
+      {
+         if(cursors[i].valid && _ekvs_lsm_compare(cursors[i].rec.key, cursors[i].rec.key_sz, min.key, min.key_sz) == 0)
+         {
+            ret = _ekvs_sst_seek(&cursors[i], cursors[i].rec.next);
+         }
+      }
+      if(ret != EKVS_OK) break;
+   }
+
+   job->count = writer.count;
+   if(ret == EKVS_OK) ret = _ekvs_sst_finish(&writer, &job->bytes);
+   _ekvs_sst_discard(&writer);
+   if(ret != EKVS_OK || job->count == 0) remove(job->fname);
+   return ret;
+}
+
+static void* _ekvs_lsm_compact_main(void* arg)
+{
+   struct _ekvs_lsm_job* job = arg;
+
+   job->ret = _ekvs_lsm_merge(job, job->cursors);
+   EKVS_ATOMIC_STORE(&job->done, 1);
+   return NULL;
+}
+
+/* Install a finished compaction, waiting for it if asked to */
+static int _ekvs_lsm_install(ekvs store, int wait)
+{
+   struct _ekvs_lsm* lsm = store->lsm;
+   struct _ekvs_lsm_job* job = &lsm->job;
+   struct _ekvs_lsm_level* source;
+   struct _ekvs_lsm_level* target;
+   struct _ekvs_sst* output = NULL;
+   uint64_t i;
+   int ret;
+
+   if(!job->running) return EKVS_OK;
+   if(!wait && EKVS_ATOMIC_LOAD(&job->done) == 0) return EKVS_OK;
+   if(job->threaded) pthread_join(job->thread, NULL);
+   job->running = 0;
+
+   ret = job->ret;
+   if(ret == EKVS_OK && job->count != 0) ret = _ekvs_sst_open(lsm->prefix, job->number, &output);
+   if(ret != EKVS_OK)
+   {
+      /* The inputs are still in place, and are merged again after the next flush */
+      fprintf(stderr, "ekvs: compaction into %s failed.\n", job->fname);
+      remove(job->fname);
+      goto ekvs_lsm_install_done;
+   }
+
+   source = &lsm->levels[job->source];
+   target = &lsm->levels[job->source + 1];
+   for(i = 0; i < job->source_count; i++) source->bytes -= source->files[i]->map_sz;
+   memmove(source->files, source->files + job->source_count,
+      (size_t)(source->count - job->source_count) * sizeof(struct _ekvs_sst*));
+   source->count -= job->source_count;
+   target->count = 0;
+   target->bytes = 0;
+   if(output != NULL && _ekvs_lsm_level_push(target, output) != EKVS_OK)
+   {
+      /* Pushing to an emptied level only allocates for its first file */
+      _ekvs_sst_close(output, lsm->prefix, 1);
+      ret = EKVS_ALLOCATION_FAIL;
+   }
+
+   /* Until the manifest is written, the inputs are what a reopen would find */
+   if(ret == EKVS_OK) ret = _ekvs_lsm_write_manifest(lsm);
+   for(i = 0; i < job->input_count; i++) _ekvs_sst_close(job->inputs[i], lsm->prefix, ret == EKVS_OK);
+   lsm->compactions++;
+   lsm->bytes_written += job->bytes;
+
+ekvs_lsm_install_done:
+   ekvs_free(job->inputs);
+   ekvs_free(job->cursors);
+   ekvs_free(job->fname);
+   job->inputs = NULL;
+   job->cursors = NULL;
+   job->fname = NULL;
+   return ret;
+}
+
+/* Start merging level 0 once it has enough files, or a deeper level once it outgrows its capacity.
+ * A full compaction merges the shallowest level down while there is more than one file. */
+static int _ekvs_lsm_schedule(ekvs store, int full)
+{
+   struct _ekvs_lsm* lsm = store->lsm;
+   struct _ekvs_lsm_job* job = &lsm->job;
+   uint64_t capacity = (uint64_t)lsm->memtable_size;
+   uint64_t files = 0;
+   uint64_t i;
+   int source = -1;
+
+   if(job->running) return EKVS_OK;
+   for(i = 0; i < EKVS_LSM_LEVELS; i++) files += lsm->levels[i].count;
+   if(full)
+   {
+      for(i = 0; i < EKVS_LSM_LEVELS - 1 && source < 0 && files > 1; i++)
+      {
+         if(lsm->levels[i].count != 0) source = (int)i;
+      }
+   }
+   else if(lsm->levels[0].count >= EKVS_LSM_L0_TRIGGER)
+   {
+      source = 0;
+   }
+   else
+   {
+      for(i = 1; i < EKVS_LSM_LEVELS - 1 && source < 0; i++)
+      {
+         capacity *= EKVS_LSM_LEVEL_RATIO;
+         if(lsm->levels[i].bytes > capacity) source = (int)i;
+      }
+   }
+   if(source < 0) return EKVS_OK;
+
+   job->inputs = ekvs_malloc((size_t)(lsm->levels[source].count + 1) * sizeof(struct _ekvs_sst*));
+   job->cursors = ekvs_malloc((size_t)(lsm->levels[source].count + 1) * sizeof(struct _ekvs_sst_cursor));
+   job->fname = _ekvs_lsm_fname(lsm->prefix, ".sst.", lsm->next_file);
+   if(job->inputs == NULL || job->cursors == NULL || job->fname == NULL)
+   {
+      ekvs_free(job->inputs);
+      ekvs_free(job->cursors);
+      ekvs_free(job->fname);
+      job->inputs = NULL;
+      job->cursors = NULL;
+      job->fname = NULL;
+      return EKVS_ALLOCATION_FAIL;
+   }
+
+   job->source = source;
+   job->source_count = lsm->levels[source].count;
+   job->input_count = 0;
+   for(i = lsm->levels[source].count; i > 0; i--) job->inputs[job->input_count++] = lsm->levels[source].files[i - 1];
+   if(lsm->levels[source + 1].count != 0) job->inputs[job->input_count++] = lsm->levels[source + 1].files[0];
+   job->drop_tombstones = 1;
+   for(i = (uint64_t)source + 2; i < EKVS_LSM_LEVELS; i++)
+   {
+      if(lsm->levels[i].count != 0) job->drop_tombstones = 0;
+   }
+   job->number = lsm->next_file++;
+   job->count = 0;
+   job->bytes = 0;
+   job->ret = EKVS_OK;
+   job->done = 0;
+   job->running = 1;
+
+   /* Without a thread, merge right away */
+   job->threaded = (pthread_create(&job->thread, NULL, _ekvs_lsm_compact_main, job) == 0);
+   if(!job->threaded) _ekvs_lsm_compact_main(job);
+   return EKVS_OK;
+}
+
+/************************* Memtable *************************/
+
+static struct _ekvs_lsm_record** _ekvs_lsm_link(struct _ekvs_lsm* lsm, uint64_t hash, const char* key, size_t key_sz)
+{
+   struct _ekvs_lsm_record** link = &lsm->buckets[hash & (lsm->bucket_count - 1)];
+   while(*link != NULL && ((*link)->hash != hash || (*link)->key_sz != key_sz || memcmp((*link)->key_data, key, key_sz) != 0))
+   {
+      link = &(*link)->chain;
+   }
+   return link;
+}
+
+static void _ekvs_lsm_clear(struct _ekvs_lsm* lsm)
+{
+   uint64_t i;
+   struct _ekvs_lsm_record* rec;
+
+   for(i = 0; i < lsm->bucket_count; i++)
+   {
+      while(lsm->buckets[i] != NULL)
+      {
+         rec = lsm->buckets[i];
+         lsm->buckets[i] = rec->chain;
+         ekvs_free(rec);
+      }
+   }
+   lsm->population = 0;
+   lsm->bytes = 0;
+}
+
+static int _ekvs_lsm_put(struct _ekvs_lsm* lsm, uint64_t hash, const char* key, size_t key_sz,
+   const void* data, uint64_t data_sz)
+{
+   struct _ekvs_lsm_record** link = _ekvs_lsm_link(lsm, hash, key, key_sz);
+   struct _ekvs_lsm_record* rec = *link;
+   size_t rec_sz = EKVS_LSM_RECORD_SIZE(key_sz, data_sz);
+
+   if(rec != NULL)
+   {
+      size_t old_sz = EKVS_LSM_RECORD_SIZE(rec->key_sz, rec->data_sz);
+      rec = ekvs_realloc(rec, rec_sz);
+      if(rec == NULL) return EKVS_ALLOCATION_FAIL;
+      lsm->bytes -= old_sz;
+   }
+   else
+   {
+      rec = ekvs_malloc(rec_sz);
+      if(rec == NULL) return EKVS_ALLOCATION_FAIL;
+      rec->chain = NULL;
+      rec->hash = hash;
+      rec->key_sz = key_sz;
+      memcpy(rec->key_data, key, key_sz);
+      lsm->population++;
+   }
+   rec->data_sz = data_sz;
+   memcpy(&rec->key_data[key_sz], data, EKVS_LSM_VALUE_BYTES(data_sz));
+   *link = rec;
+   lsm->bytes += rec_sz;
+
+   /* Keep chains short by doubling the buckets */
+   if(lsm->population > lsm->bucket_count)
+   {
+      struct _ekvs_lsm_record** buckets = ekvs_malloc((size_t)lsm->bucket_count * 2 * sizeof(struct _ekvs_lsm_record*));
+      uint64_t i;
+      if(buckets == NULL) return EKVS_OK;
+      memset(buckets, 0, (size_t)lsm->bucket_count * 2 * sizeof(struct _ekvs_lsm_record*));
+      for(i = 0; i < lsm->bucket_count; i++)
+      {
+         while(lsm->buckets[i] != NULL)
+         {
+            rec = lsm->buckets[i];
+            lsm->buckets[i] = rec->chain;
+            rec->chain = buckets[rec->hash & (lsm->bucket_count * 2 - 1)];
+            buckets[rec->hash & (lsm->bucket_count * 2 - 1)] = rec;
+         }
+      }
+      ekvs_free(lsm->buckets);
+      lsm->buckets = buckets;
+      lsm->bucket_count *= 2;
+   }
+   return EKVS_OK;
+}
+
+static int _ekvs_lsm_record_order(const void* a, const void* b)
+{
+   const struct _ekvs_lsm_record* rec_a = *(const struct _ekvs_lsm_record* const*)a;
+   const struct _ekvs_lsm_record* rec_b = *(const struct _ekvs_lsm_record* const*)b;
+   return _ekvs_lsm_compare(rec_a->key_data, rec_a->key_sz, rec_b->key_data, rec_b->key_sz);
+}
+
+/* Return 1 if the key has a live value, searching the memtable, then level 0 newest first, then each deeper level */
+static int _ekvs_lsm_lookup(struct _ekvs_lsm* lsm, uint64_t hash, const char* key, size_t key_sz,
+   const void** data, size_t* data_sz)
+{
+   struct _ekvs_lsm_record* rec = *_ekvs_lsm_link(lsm, hash, key, key_sz);
+   struct _ekvs_sst_record found;
+   uint64_t i, j;
+
+   if(rec != NULL)
+   {
+      if(rec->data_sz == EKVS_LSM_TOMBSTONE) return 0;
+      *data = &rec->key_data[rec->key_sz];
+      *data_sz = (size_t)rec->data_sz;
+      return 1;
+   }
+
+   for(i = 0; i < EKVS_LSM_LEVELS; i++)
+   {
+      for(j = lsm->levels[i].count; j > 0; j--)
+      {
+         if(_ekvs_sst_find(lsm->levels[i].files[j - 1], hash, key, key_sz, &found))
+         {
+            if(found.data_sz == EKVS_LSM_TOMBSTONE) return 0;
+            *data = found.data;
+            *data_sz = (size_t)found.data_sz;
+            return 1;
+         }
+      }
+   }
+   return 0;
+}
+
+/* Install finished compactions, and flush the memtable once it is full */
+static int _ekvs_lsm_maintain(ekvs store)
+{
+   int ret;
+
+   if(store->replaying) return EKVS_OK;
+   ret = _ekvs_lsm_install(store, 0);
+   if(ret == EKVS_OK && !store->lsm->job.running) ret = _ekvs_lsm_schedule(store, 0);
+   if(ret == EKVS_OK && store->lsm->bytes >= store->lsm->memtable_size) ret = ekvs_snapshot(store, NULL);
+   store->last_error = ret;
+   return ret;
+}
+
+/************************* Engine *************************/
+
+int _ekvs_lsm_exists(const char* path)
+{
+   char* fname = _ekvs_lsm_fname(path, ".lsm", 0);
+   FILE* file;
+
+   if(fname == NULL) return 0;
+   fname[strlen(fname) - 1] = '\0';
+   file = fopen(fname, "rb");
+   ekvs_free(fname);
+   if(file == NULL) return 0;
+   fclose(file);
+   return 1;
+}
+
+int _ekvs_lsm_open(ekvs store, const char* path, int created, size_t memtable_size)
+{
+   struct _ekvs_lsm* lsm;
+   char* fname;
+   int ret;
+
+   lsm = ekvs_malloc(sizeof(struct _ekvs_lsm));
+   if(lsm == NULL) return EKVS_ALLOCATION_FAIL;
+   memset(lsm, 0, sizeof(struct _ekvs_lsm));
+   lsm->memtable_size = (memtable_size != 0 ? memtable_size : EKVS_LSM_MEMTABLE_SIZE);
+   lsm->next_file = 1;
+   lsm->bucket_count = 256;
+   lsm->buckets = ekvs_malloc((size_t)lsm->bucket_count * sizeof(struct _ekvs_lsm_record*));
+   lsm->prefix = ekvs_malloc(strlen(path) + 1);
+   fname = _ekvs_lsm_fname(path, ".lsm", 0);
+   store->lsm = lsm;
+   if(lsm->buckets == NULL || lsm->prefix == NULL || fname == NULL)
+   {
+      ekvs_free(fname);
+      return EKVS_ALLOCATION_FAIL;
+   }
+   memset(lsm->buckets, 0, (size_t)lsm->bucket_count * sizeof(struct _ekvs_lsm_record*));
+   strcpy(lsm->prefix, path);
+   fname[strlen(fname) - 1] = '\0';
+
+   ret = (created ? _ekvs_lsm_write_manifest(lsm) : _ekvs_lsm_read_manifest(lsm, fname));
+   ekvs_free(fname);
+   return ret;
+}
+
+int _ekvs_lsm_get(ekvs store, uint64_t hash, const char* key, size_t key_sz, const void** data, size_t* data_sz)
+{
+   if(_ekvs_lsm_lookup(store->lsm, hash, key, key_sz, data, data_sz))
+   {
+      store->cache_stats.hits++;
+      store->last_error = EKVS_OK;
+   }
+   else
+   {
+      *data = NULL;
+      *data_sz = 0;
+      store->cache_stats.misses++;
+      store->last_error = EKVS_NO_KEY;
+   }
+   return store->last_error;
+}
+
+int _ekvs_lsm_set(ekvs store, uint64_t hash, const char* key, size_t key_sz, const void* data, size_t data_sz)
+{
+   int ret = _ekvs_lsm_put(store->lsm, hash, key, key_sz, data, data_sz);
+
+   if(ret == EKVS_OK && store->binlog_enabled)
+   {
+      ret = _ekvs_binlog(store, EKVS_BINLOG_SET, 0 /* flags */, key, key_sz, data, data_sz);
+   }
+   store->last_error = ret;
+   if(ret != EKVS_OK) return ret;
+   return _ekvs_lsm_maintain(store);
+}
+
+int _ekvs_lsm_del(ekvs store, uint64_t hash, const char* key, size_t key_sz)
+{
+   const void* data;
+   size_t data_sz;
+   int ret;
+
+   if(!_ekvs_lsm_lookup(store->lsm, hash, key, key_sz, &data, &data_sz))
+   {
+      store->last_error = EKVS_NO_KEY;
+      return EKVS_NO_KEY;
+   }
+
+   ret = _ekvs_lsm_put(store->lsm, hash, key, key_sz, NULL, EKVS_LSM_TOMBSTONE);
+   if(ret == EKVS_OK && store->binlog_enabled)
+   {
+      ret = _ekvs_binlog(store, EKVS_BINLOG_DEL, 0 /* flags */, key, key_sz, NULL, 0);
+   }
+   store->last_error = ret;
+   if(ret != EKVS_OK) return ret;
+   return _ekvs_lsm_maintain(store);
+}
+
+/* Write the memtable to a new level 0 SSTable. The caller resets the binlog afterwards. */
+int _ekvs_lsm_flush(ekvs store)
+{
+   struct _ekvs_lsm* lsm = store->lsm;
+   struct _ekvs_lsm_record** records;
+   struct _ekvs_lsm_record* rec;
+   struct _ekvs_sst_writer writer;
+   struct _ekvs_sst* sst;
+   uint64_t bytes = 0;
+   uint64_t number;
+   uint64_t i, n = 0;
+   char* fname;
+   int ret;
+
+   ret = _ekvs_lsm_install(store, 0);
+   if(ret != EKVS_OK) return ret;
+   if(lsm->population == 0) return EKVS_OK;
+
+   records = ekvs_malloc((size_t)lsm->population * sizeof(struct _ekvs_lsm_record*));
+   if(records == NULL) return EKVS_ALLOCATION_FAIL;
+   for(i = 0; i < lsm->bucket_count; i++)
+   {
+      for(rec = lsm->buckets[i]; rec != NULL; rec = rec->chain) records[n++] = rec;
+   }
+   qsort(records, (size_t)n, sizeof(struct _ekvs_lsm_record*), _ekvs_lsm_record_order);
+
+   number = lsm->next_file++;
+   fname = _ekvs_lsm_fname(lsm->prefix, ".sst.", number);
+   if(fname == NULL)
+   {
+      ekvs_free(records);
+      return EKVS_ALLOCATION_FAIL;
+   }
+   ret = _ekvs_sst_create(&writer, fname);
+   for(i = 0; i < n && ret == EKVS_OK; i++)
+   {
+      rec = records[i];
+      ret = _ekvs_sst_add(&writer, rec->hash, rec->key_data, rec->key_sz, &rec->key_data[rec->key_sz], rec->data_sz);
+   }
+   if(ret == EKVS_OK) ret = _ekvs_sst_finish(&writer, &bytes);
+   _ekvs_sst_discard(&writer);
+   ekvs_free(records);
+
+   if(ret == EKVS_OK) ret = _ekvs_sst_open(lsm->prefix, number, &sst);
+   if(ret != EKVS_OK)
+   {
+      remove(fname);
+      ekvs_free(fname);
+      return ret;
+   }
+   ekvs_free(fname);
+
+   ret = _ekvs_lsm_level_push(&lsm->levels[0], sst);
+   if(ret == EKVS_OK)
+   {
+      ret = _ekvs_lsm_write_manifest(lsm);
+      if(ret != EKVS_OK) lsm->levels[0].bytes -= lsm->levels[0].files[--lsm->levels[0].count]->map_sz;
+   }
+   if(ret != EKVS_OK)
+   {
+      _ekvs_sst_close(sst, lsm->prefix, 1);
+      return ret;
+   }
+
+   _ekvs_lsm_clear(lsm);
+   lsm->flushes++;
+   lsm->bytes_written += bytes;
+   return _ekvs_lsm_schedule(store, 0);
+}
+
+int ekvs_compact(ekvs store)
+{
+   int ret;
+
+   if(store == NULL)
+   {
+      fprintf(stderr, "ekvs: NULL store parameter passed to ekvs_compact.\n");
+      return EKVS_FAIL;
+   }
+
+   if(store->lsm == NULL)
+   {
+      store->last_error = EKVS_UNSUPPORTED;
+      return EKVS_UNSUPPORTED;
+   }
+
+   ret = ekvs_snapshot(store, NULL);
+   while(ret == EKVS_OK)
+   {
+      ret = _ekvs_lsm_install(store, 1);
+      if(ret == EKVS_OK) ret = _ekvs_lsm_schedule(store, 1);
+      if(!store->lsm->job.running) break;
+   }
+
+   store->last_error = ret;
+   return ret;
+}
+
+void _ekvs_lsm_stats(ekvs store, ekvs_runtime_stats* stats)
+{
+   struct _ekvs_lsm* lsm = store->lsm;
+   uint64_t i, j;
+
+   stats->population = lsm->population;
+   stats->lsm_memtable_bytes = lsm->bytes;
+   for(i = 0; i < EKVS_LSM_LEVELS; i++)
+   {
+      for(j = 0; j < lsm->levels[i].count; j++) stats->population += lsm->levels[i].files[j]->count;
+      stats->lsm_tables += lsm->levels[i].count;
+      stats->lsm_table_bytes += lsm->levels[i].bytes;
+   }
+   stats->lsm_flushes = lsm->flushes;
+   stats->lsm_compactions = lsm->compactions;
+   stats->lsm_bytes_written = lsm->bytes_written;
+}
+
+void _ekvs_lsm_close(ekvs store)
+{
+   struct _ekvs_lsm* lsm = store->lsm;
+   uint64_t i, j;
+
+   if(lsm == NULL) return;
+   if(lsm->buckets != NULL && lsm->prefix != NULL) _ekvs_lsm_install(store, 1);
+   if(lsm->buckets != NULL) _ekvs_lsm_clear(lsm);
+   for(i = 0; i < EKVS_LSM_LEVELS; i++)
+   {
+      for(j = 0; j < lsm->levels[i].count; j++) _ekvs_sst_close(lsm->levels[i].files[j], lsm->prefix, 0);
+      ekvs_free(lsm->levels[i].files);
+   }
+   ekvs_free(lsm->buckets);
+   ekvs_free(lsm->prefix);
+   ekvs_free(lsm);
+   store->lsm = NULL;
+}
@@ -0,0 +1,251 @@
+/* -*- Mode: C; tab-width: 3; c-basic-offset: 3; indent-tabs-mode: nil -*- */
+/* vim: set filetype=C tabstop=3 softtabstop=3 shiftwidth=3 expandtab: */
+
+/* ekvs -- Copyright (C) 2011 GameClay LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "ekvs_internal.h"
+
+/* A small LZ77 codec using the LZ4 block layout: each sequence is a token
+ * (literal length in the high nibble, match length - 4 in the low nibble),
+ * optional length extension bytes, the literals, a 16-bit little-endian match
+ * offset and optional match length extension bytes. The final sequence holds
+ * only literals. */
+
+#define EKVS_LZ_HASH_LOG      12
+#define EKVS_LZ_MIN_MATCH     4
+#define EKVS_LZ_LAST_LITERALS 5
+#define EKVS_LZ_MF_LIMIT      12
+#define EKVS_LZ_MAX_OFFSET    65535
+
+static uint32_t _ekvs_lz_read32(const uint8_t* p)
+{
+   uint32_t v;
+   memcpy(&v, p, sizeof(v));
+   return v;
+}
+
+static uint32_t _ekvs_lz_hash(uint32_t v)
+{
+   return (v * 2654435761U) >> (32 - EKVS_LZ_HASH_LOG);
+}
+
+static uint8_t* _ekvs_lz_write_len(uint8_t* op, size_t len)
+{
+   while(len >= 255)
+   {
+      *op++ = 255;
+      len -= 255;
+   }
+   *op++ = (uint8_t)len;
+   return op;
+}
+
+/* Emit one sequence; match_len of 0 means literals only. Returns NULL if it does not fit. */
+static uint8_t* _ekvs_lz_sequence(uint8_t* op, const uint8_t* oend, const uint8_t* literals,
+   size_t lit_len, size_t offset, size_t match_len)
+{
+   uint8_t* token = op;
+   size_t worst = 1 + lit_len / 255 + 1 + lit_len + 2 + match_len / 255 + 1;
+
+   if(worst > (size_t)(oend - op)) return NULL;
+
+   op++;
+   *token = (uint8_t)((lit_len >= 15 ? 15 : lit_len) << 4);
+   if(lit_len >= 15) op = _ekvs_lz_write_len(op, lit_len - 15);
+   memcpy(op, literals, lit_len);
+   op += lit_len;
+
+   if(match_len != 0)
+   {
+      match_len -= EKVS_LZ_MIN_MATCH;
+      *op++ = (uint8_t)(offset & 0xff);
+      *op++ = (uint8_t)(offset >> 8);
+      *token |= (uint8_t)(match_len >= 15 ? 15 : match_len);
+      if(match_len >= 15) op = _ekvs_lz_write_len(op, match_len - 15);
+   }
+
+   return op;
+}
+
+size_t _ekvs_lz_bound(size_t src_sz)
+{
+   return src_sz + src_sz / 255 + 16;
+}
+
+size_t _ekvs_lz_compress(const void* src, size_t src_sz, void* dst, size_t dst_cap)
+{
+   uint32_t table[1 << EKVS_LZ_HASH_LOG];
+   const uint8_t* in = (const uint8_t*)src;
+   const uint8_t* ip = in;
+   const uint8_t* anchor = in;
+   const uint8_t* end = in + src_sz;
+   uint8_t* op = (uint8_t*)dst;
+   const uint8_t* oend = op + dst_cap;
+
+   /* Offsets in the hash table are 32-bit */
+   if(src_sz > 0xffffffffUL) return 0;
+
+   memset(table, 0, sizeof(table));
+
+   if(src_sz >= EKVS_LZ_MF_LIMIT)
+   {
+      const uint8_t* mflimit = end - EKVS_LZ_MF_LIMIT;
+      const uint8_t* matchlimit = end - EKVS_LZ_LAST_LITERALS;
+
+      ip++;
+      while(ip < mflimit)
+      {
+         uint32_t h = _ekvs_lz_hash(_ekvs_lz_read32(ip));
+         const uint8_t* ref = in + table[h];
+         table[h] = (uint32_t)(ip - in);
+
+         if(ref < ip && (size_t)(ip - ref) <= EKVS_LZ_MAX_OFFSET && _ekvs_lz_read32(ref) == _ekvs_lz_read32(ip))
+         {
+            const uint8_t* mp = ip + EKVS_LZ_MIN_MATCH;
+            const uint8_t* rp = ref + EKVS_LZ_MIN_MATCH;
+            while(mp < matchlimit && *mp == *rp)
+            {
+               mp++;
+               rp++;
+            }
+            while(ip > anchor && ref > in && ip[-1] == ref[-1])
+            {
+               ip--;
+               ref--;
+            }
+
+            op = _ekvs_lz_sequence(op, oend, anchor, (size_t)(ip - anchor), (size_t)(ip - ref), (size_t)(mp - ip));
+            if(op == NULL) return 0;
+
+            anchor = ip = mp;
+         }
+         else
+         {
+            ip++;
+         }
+      }
+   }
+
+   op = _ekvs_lz_sequence(op, oend, anchor, (size_t)(end - anchor), 0, 0);
+   if(op == NULL) return 0;
+
+   return (size_t)(op - (uint8_t*)dst);
+}
+
+size_t _ekvs_lz_decompress(const void* src, size_t src_sz, void* dst, size_t dst_sz)
+{
+   const uint8_t* ip = (const uint8_t*)src;
+   const uint8_t* iend = ip + src_sz;
+   uint8_t* op = (uint8_t*)dst;
+   const uint8_t* oend = op + dst_sz;
+   size_t len;
+   size_t offset;
+   uint8_t token;
+   uint8_t b;
+   const uint8_t* match;
+
+   while(ip < iend)
+   {
+      token = *ip++;
+
+      /* Literals */
+      len = token >> 4;
+      if(len == 15)
+      {
+         do
+         {
+            if(ip >= iend) return 0;
+            b = *ip++;
+            len += b;
+         } while(b == 255);
+      }
+      if(len > (size_t)(iend - ip) || len > (size_t)(oend - op)) return 0;
+      memcpy(op, ip, len);
+      op += len;
+      ip += len;
+
+      /* The last sequence has no match */
+      if(ip == iend) break;
+
+      if(iend - ip < 2) return 0;
+      offset = (size_t)ip[0] | ((size_t)ip[1] << 8);
+      ip += 2;
+      if(offset == 0 || offset > (size_t)(op - (uint8_t*)dst)) return 0;
+
+      len = token & 15;
+      if(len == 15)
+      {
+         do
+         {
+            if(ip >= iend) return 0;
+            b = *ip++;
+            len += b;
+         } while(b == 255);
+      }
+      len += EKVS_LZ_MIN_MATCH;
+      if(len > (size_t)(oend - op)) return 0;
+
+      /* Byte copy, the match may overlap the output */
+      match = op - offset;
+      while(len-- > 0) *op++ = *match++;
+   }
+
+   return (size_t)(op - (uint8_t*)dst);
+}
+
+size_t _ekvs_lz_pack(const void* src, size_t src_sz, void** packed)
+{
+   uint64_t raw_sz = src_sz;
+   size_t bound = _ekvs_lz_bound(src_sz);
+   size_t packed_sz;
+   char* buf;
+
+   *packed = NULL;
+   buf = ekvs_malloc(sizeof(raw_sz) + bound);
+   if(buf == NULL) return 0;
+
+   packed_sz = _ekvs_lz_compress(src, src_sz, buf + sizeof(raw_sz), bound);
+
+   /* Not worth it */
+   if(packed_sz == 0 || packed_sz + sizeof(raw_sz) >= src_sz)
+   {
+      ekvs_free(buf);
+      return 0;
+   }
+
+   memcpy(buf, &raw_sz, sizeof(raw_sz));
+   *packed = buf;
+   return packed_sz + sizeof(raw_sz);
+}
+
+size_t _ekvs_lz_packed_size(const void* packed, size_t packed_sz)
+{
+   uint64_t raw_sz;
+   if(packed_sz < sizeof(raw_sz)) return 0;
+   memcpy(&raw_sz, packed, sizeof(raw_sz));
+   return (size_t)raw_sz;
+}
+
+int _ekvs_lz_unpack(const void* packed, size_t packed_sz, void* dst)
+{
+   size_t raw_sz = _ekvs_lz_packed_size(packed, packed_sz);
+   if(packed_sz < sizeof(uint64_t)) return EKVS_FAIL;
+   if(_ekvs_lz_decompress((const char*)packed + sizeof(uint64_t), packed_sz - sizeof(uint64_t), dst, raw_sz) != raw_sz)
+   {
+      return EKVS_FAIL;
+   }
+   return EKVS_OK;
+}
@@ -0,0 +1,115 @@
+/* -*- Mode: C; tab-width: 3; c-basic-offset: 3; indent-tabs-mode: nil -*- */
+/* vim: set filetype=C tabstop=3 softtabstop=3 shiftwidth=3 expandtab: */
+
+/* ekvs -- Copyright (C) 2011 GameClay LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "ekvs_internal.h"
+
+/* Lookups are done in groups. Every key of a group is hashed and its bucket
+ * prefetched, then every chain head is prefetched, and only then are keys
+ * compared; by the time a stage reaches a key, the loads issued for it by the
+ * previous stage have had the rest of the group to complete. */
+
+#define EKVS_MGET_GROUP 16
+
+int ekvs_mget(ekvs store, const char** keys, size_t n, ekvs_view* views)
+{
+   uint64_t hashes[EKVS_MGET_GROUP];
+   size_t key_szs[EKVS_MGET_GROUP];
+   struct _ekvs_ro_header ro_header;
+   const struct _ekvs_ro_slot* ro_index = NULL;
+   size_t base;
+   size_t group_n;
+   size_t i;
+
+   if(store == NULL)
+   {
+      fprintf(stderr, "ekvs: NULL store parameter passed to ekvs_mget.\n");
+      return EKVS_FAIL;
+   }
+
+   if((keys == NULL || views == NULL) && n > 0)
+   {
+      fprintf(stderr, "ekvs: NULL keys or views parameter passed to ekvs_mget.\n");
+      return EKVS_FAIL;
+   }
+
+   if(store->ro_map != NULL)
+   {
+      memcpy(&ro_header, store->ro_map, sizeof(ro_header));
+      ro_index = (const struct _ekvs_ro_slot*)(store->ro_map + ro_header.index_offset);
+   }
+
+   for(base = 0; base < n; base += group_n)
+   {
+      group_n = (n - base < EKVS_MGET_GROUP ? n - base : EKVS_MGET_GROUP);
+
+      /* Hash, and prefetch the bucket (or index slot) */
+      for(i = 0; i < group_n; i++)
+      {
+         uint32_t pc = 0, pb = 0;
+         const char* key = keys[base + i];
+
+         views[base + i].data = NULL;
+         views[base + i].data_sz = 0;
+         views[base + i].status = EKVS_OK;
+         if(key == NULL)
+         {
+            views[base + i].status = EKVS_FAIL;
+            continue;
+         }
+
+         key_szs[i] = strlen(key);
+         hashlittle2(key, key_szs[i], &pc, &pb);
+         hashes[i] = pc + (((uint64_t)pb) << 32);
+         if(ro_index != NULL)
+         {
+            EKVS_PREFETCH(&ro_index[hashes[i] & (ro_header.index_slots - 1)]);
+         }
+         else if(store->shm_map == NULL)
+         {
+            EKVS_PREFETCH(&store->table[hashes[i] % store->serialized.table_sz]);
+         }
+      }
+
+      /* Prefetch the first entry (or record) each key will be compared with */
+      for(i = 0; i < group_n; i++)
+      {
+         if(views[base + i].status != EKVS_OK) continue;
+         if(ro_index != NULL)
+         {
+            const struct _ekvs_ro_slot* slot = &ro_index[hashes[i] & (ro_header.index_slots - 1)];
+            if(slot->offset != 0 && slot->offset < store->ro_map_sz) EKVS_PREFETCH(store->ro_map + slot->offset);
+         }
+         else if(store->shm_map == NULL)
+         {
+            const struct _ekvs_db_entry* head = store->table[hashes[i] % store->serialized.table_sz];
+            if(head != NULL) EKVS_PREFETCH(head);
+         }
+      }
+
+      /* Compare */
+      for(i = 0; i < group_n; i++)
+      {
+         ekvs_view* view = &views[base + i];
+         if(view->status != EKVS_OK) continue;
+         view->status = _ekvs_get(store, hashes[i], keys[base + i], key_szs[i], &view->data, &view->data_sz, NULL);
+      }
+   }
+
+   store->last_error = EKVS_OK;
+   return EKVS_OK;
+}
@@ -0,0 +1,158 @@
+/* -*- Mode: C; tab-width: 3; c-basic-offset: 3; indent-tabs-mode: nil -*- */
+/* vim: set filetype=C tabstop=3 softtabstop=3 shiftwidth=3 expandtab: */
+
+/* ekvs -- Copyright (C) 2011 GameClay LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include "ekvs_internal.h"
+
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+/* Large tables are probed at random, so with 4KB pages nearly every lookup misses
+ * the TLB. Tables of at least one huge page may be mapped instead of allocated,
+ * from the hugetlb pool or with a transparent huge page hint, and placed with a
+ * NUMA policy before anything touches them. */
+
+#define EKVS_HUGE_2MB ((size_t)1 << 21)
+#define EKVS_HUGE_1GB ((size_t)1 << 30)
+
+#ifndef MAP_HUGE_SHIFT
+#  define MAP_HUGE_SHIFT 26
+#endif
+
+/* From linux/mempolicy.h, which is not always installed */
+#define EKVS_MPOL_BIND        2
+#define EKVS_MPOL_INTERLEAVE  3
+
+/* Nodes listed in /sys/devices/system/node/online, such as "0-1" or "0,2-3" */
+static uint64_t _ekvs_numa_online(void)
+{
+   FILE* file = fopen("/sys/devices/system/node/online", "r");
+   uint64_t nodes = 0;
+   unsigned long first, last;
+   int c = ',';
+
+   if(file == NULL) return 1;
+   while(c == ',' && fscanf(file, "%lu", &first) == 1)
+   {
+      last = first;
+      c = fgetc(file);
+      if(c == '-')
+      {
+         if(fscanf(file, "%lu", &last) != 1) break;
+         c = fgetc(file);
+      }
+      for(; first <= last && first < 64; first++) nodes |= (uint64_t)1 << first;
+   }
+   fclose(file);
+   return (nodes != 0 ? nodes : 1);
+}
+
+static int _ekvs_numa_apply(void* map, size_t size, uint32_t policy, uint64_t nodes)
+{
+#ifdef SYS_mbind
+   unsigned long mask = (unsigned long)(nodes != 0 ? nodes : _ekvs_numa_online());
+   int mode = (policy == ekvs_numa_bind ? EKVS_MPOL_BIND : EKVS_MPOL_INTERLEAVE);
+
+   /* The pages are not faulted in yet, so there is nothing to move */
+   return (syscall(SYS_mbind, map, (unsigned long)size, mode, &mask, (unsigned long)(sizeof(mask) * 8 + 1), 0) == 0);
+#else
+   (void)map; (void)size; (void)policy; (void)nodes;
+   return 0;
+#endif
+}
+
+static void* _ekvs_map_table(size_t size, uint32_t pages, size_t* map_sz, uint32_t* pages_used)
+{
+   void* map;
+
+#ifdef MAP_HUGETLB
+   /* Explicit huge pages come from a pool the administrator sets aside, and may not be there */
+   while(pages == ekvs_pages_1gb || pages == ekvs_pages_2mb)
+   {
+      size_t huge = (pages == ekvs_pages_1gb ? EKVS_HUGE_1GB : EKVS_HUGE_2MB);
+      int shift = (pages == ekvs_pages_1gb ? 30 : 21);
+
+      if(size >= huge)
+      {
+         *map_sz = (size + huge - 1) & ~(huge - 1);
+         map = mmap(NULL, *map_sz, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | (shift << MAP_HUGE_SHIFT), -1, 0);
+         if(map != MAP_FAILED)
+         {
+            *pages_used = pages;
+            return map;
+         }
+      }
+      pages = (pages == ekvs_pages_1gb ? ekvs_pages_2mb : ekvs_pages_transparent);
+   }
+#endif
+
+   *map_sz = (size + EKVS_HUGE_2MB - 1) & ~(EKVS_HUGE_2MB - 1);
+   map = mmap(NULL, *map_sz, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+   if(map == MAP_FAILED) return NULL;
+   *pages_used = ekvs_pages_default;
+#ifdef MADV_HUGEPAGE
+   if(pages != ekvs_pages_default && madvise(map, *map_sz, MADV_HUGEPAGE) == 0) *pages_used = ekvs_pages_transparent;
+#endif
+   return map;
+}
+
+struct _ekvs_db_entry** _ekvs_table_alloc(ekvs store, uint64_t table_sz, size_t* map_sz, uint32_t* pages, uint32_t* numa)
+{
+   struct _ekvs_db_entry** table;
+   size_t size = (size_t)table_sz * sizeof(struct _ekvs_db_entry*);
+
+   *map_sz = 0;
+   *pages = ekvs_pages_default;
+   *numa = ekvs_numa_default;
+
+   /* Mapping a whole huge page for a small table would only waste it */
+   if((store->table_pages != ekvs_pages_default || store->numa_policy != ekvs_numa_default) &&
+      size >= EKVS_HUGE_2MB && ekvs_malloc == malloc)
+   {
+      table = _ekvs_map_table(size, store->table_pages, map_sz, pages);
+      if(table != NULL)
+      {
+         if(store->numa_policy != ekvs_numa_default && _ekvs_numa_apply(table, *map_sz, store->numa_policy, store->numa_nodes))
+         {
+            *numa = store->numa_policy;
+         }
+
+         /* Anonymous mappings are already zeroed */
+         return table;
+      }
+      *map_sz = 0;
+   }
+
+   table = ekvs_malloc(size);
+   if(table != NULL) memset(table, 0, size);
+   return table;
+}
+
+void _ekvs_table_free(struct _ekvs_db_entry** table, size_t map_sz)
+{
+   if(map_sz != 0)
+   {
+      munmap(table, map_sz);
+   }
+   else
+   {
+      ekvs_free(table);
+   }
+}
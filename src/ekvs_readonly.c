@@ -0,0 +1,292 @@
+/* -*- Mode: C; tab-width: 3; c-basic-offset: 3; indent-tabs-mode: nil -*- */
+/* vim: set filetype=C tabstop=3 softtabstop=3 shiftwidth=3 expandtab: */
+
+/* ekvs -- Copyright (C) 2011 GameClay LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "ekvs_internal.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/* Read-only images are built once and then only mapped. Lookups hash the key,
+ * probe the index linearly from (hash & (slots - 1)), and compare keys only for
+ * slots whose full hash matches, so a hit usually touches two pages. */
+
+#define EKVS_RO_RECORD_HEADER (sizeof(uint64_t) * 2)
+
+static int _ekvs_ro_write_record(FILE* file, const char* key, uint64_t key_sz, const void* data, uint64_t data_sz)
+{
+   if(fwrite(&key_sz, sizeof(key_sz), 1, file) != 1) return EKVS_FILE_FAIL;
+   if(fwrite(&data_sz, sizeof(data_sz), 1, file) != 1) return EKVS_FILE_FAIL;
+   if(key_sz > 0 && fwrite(key, (size_t)key_sz, 1, file) != 1) return EKVS_FILE_FAIL;
+   if(data_sz > 0 && fwrite(data, (size_t)data_sz, 1, file) != 1) return EKVS_FILE_FAIL;
+   return EKVS_OK;
+}
+
+int ekvs_build_readonly(ekvs store, const char* path)
+{
+   struct _ekvs_ro_header header;
+   struct _ekvs_ro_slot* index = NULL;
+   struct _ekvs_db_entry* entry;
+   char* tmp_fname = NULL;
+   FILE* file = NULL;
+   uint64_t offset;
+   uint64_t i;
+   int ret = EKVS_FILE_FAIL;
+
+   if(store == NULL)
+   {
+      fprintf(stderr, "ekvs: NULL store parameter passed to ekvs_build_readonly.\n");
+      return EKVS_FAIL;
+   }
+
+   if(path == NULL)
+   {
+      fprintf(stderr, "ekvs: NULL path parameter passed to ekvs_build_readonly.\n");
+      return EKVS_FAIL;
+   }
+
+   if(store->ro_map != NULL)
+   {
+      store->last_error = EKVS_READ_ONLY;
+      return EKVS_READ_ONLY;
+   }
+
+   if(store->shm_map != NULL || store->lsm != NULL)
+   {
+      store->last_error = EKVS_UNSUPPORTED;
+      return EKVS_UNSUPPORTED;
+   }
+
+   /* Keep the load factor at or below one half */
+   memset(&header, 0, sizeof(header));
+   header.magic = EKVS_RO_MAGIC;
+   header.version = EKVS_RO_VERSION;
+   /* Images only hold plain values; lists and sets have no read-only form and are left out */
+   header.count = 0;
+   for(i = 0; i < store->serialized.table_sz; i++)
+   {
+      for(entry = store->table[i]; entry != NULL; entry = entry->chain)
+      {
+         if((entry->flags & EKVS_ENTRY_COLLECTION) == 0) header.count++;
+      }
+   }
+   header.index_slots = 1;
+   while(header.index_slots < header.count * 2) header.index_slots <<= 1;
+
+   index = ekvs_malloc((size_t)header.index_slots * sizeof(struct _ekvs_ro_slot));
+   tmp_fname = ekvs_malloc(strlen(path) + 5);
+   if(index == NULL || tmp_fname == NULL)
+   {
+      ret = EKVS_ALLOCATION_FAIL;
+      goto ekvs_build_readonly_err;
+   }
+   memset(index, 0, (size_t)header.index_slots * sizeof(struct _ekvs_ro_slot));
+   sprintf(tmp_fname, "%s.tmp", path);
+
+   file = fopen(tmp_fname, "wb");
+   if(file == NULL)
+   {
+      fprintf(stderr, "ekvs: failed to create read-only image (%s).\n", tmp_fname);
+      goto ekvs_build_readonly_err;
+   }
+
+   /* Records follow the header; the header is rewritten once the index location is known */
+   if(fwrite(&header, sizeof(header), 1, file) != 1) goto ekvs_build_readonly_err;
+   offset = sizeof(header);
+   for(i = 0; i < store->serialized.table_sz; i++)
+   {
+      for(entry = store->table[i]; entry != NULL; entry = entry->chain)
+      {
+         uint32_t pc = 0, pb = 0;
+         uint64_t hash;
+         uint64_t slot;
+         size_t data_sz;
+         const void* data;
+
+         if(entry->flags & EKVS_ENTRY_COLLECTION) continue;
+         data = _ekvs_entry_value(store, entry, &data_sz);
+         if(data == NULL && data_sz != 0) goto ekvs_build_readonly_err;
+         ret = _ekvs_ro_write_record(file, entry->key_data, entry->key_sz, data, data_sz);
+         if(ret != EKVS_OK) goto ekvs_build_readonly_err;
+         ret = EKVS_FILE_FAIL;
+
+         hashlittle2(entry->key_data, entry->key_sz, &pc, &pb);
+         hash = pc + (((uint64_t)pb) << 32);
+         slot = hash & (header.index_slots - 1);
+         while(index[slot].offset != 0) slot = (slot + 1) & (header.index_slots - 1);
+         index[slot].hash = hash;
+         index[slot].offset = offset;
+
+         offset += EKVS_RO_RECORD_HEADER + entry->key_sz + data_sz;
+      }
+   }
+
+   /* Align the index so slots can be read in place */
+   while(offset % sizeof(uint64_t) != 0)
+   {
+      if(fputc(0, file) == EOF) goto ekvs_build_readonly_err;
+      offset++;
+   }
+   header.index_offset = offset;
+   if(fwrite(index, sizeof(struct _ekvs_ro_slot), (size_t)header.index_slots, file) != header.index_slots) goto ekvs_build_readonly_err;
+   if(fseek(file, 0, SEEK_SET) != 0) goto ekvs_build_readonly_err;
+   if(fwrite(&header, sizeof(header), 1, file) != 1) goto ekvs_build_readonly_err;
+   if(fflush(file) != 0 || fsync(fileno(file)) != 0) goto ekvs_build_readonly_err;
+   fclose(file);
+   file = NULL;
+
+   if(rename(tmp_fname, path) != 0)
+   {
+      fprintf(stderr, "ekvs: failed to move read-only image into place (%s).\n", path);
+      goto ekvs_build_readonly_err;
+   }
+
+   ekvs_free(tmp_fname);
+   ekvs_free(index);
+   store->last_error = EKVS_OK;
+   return EKVS_OK;
+
+ekvs_build_readonly_err:
+   if(file != NULL)
+   {
+      fclose(file);
+      remove(tmp_fname);
+   }
+   ekvs_free(tmp_fname);
+   ekvs_free(index);
+   store->last_error = ret;
+   return ret;
+}
+
+int ekvs_open_readonly(ekvs* store, const char* path, const ekvs_opts* opts)
+{
+   struct _ekvs_ro_header header;
+   struct stat st;
+   void* map;
+   int fd;
+   ekvs db;
+
+   if(store == NULL)
+   {
+      fprintf(stderr, "ekvs: NULL store parameter passed to ekvs_open_readonly.\n");
+      return EKVS_FAIL;
+   }
+   *store = NULL;
+
+   if(path == NULL)
+   {
+      fprintf(stderr, "ekvs: NULL path parameter passed to ekvs_open_readonly.\n");
+      return EKVS_FAIL;
+   }
+
+   if(_ekvs_use_allocators(opts) != EKVS_OK) return EKVS_FAIL;
+
+   fd = open(path, O_RDONLY);
+   if(fd < 0)
+   {
+      fprintf(stderr, "ekvs: failed to open read-only image (%s).\n", path);
+      return EKVS_FILE_FAIL;
+   }
+   if(fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(header))
+   {
+      close(fd);
+      return EKVS_FILE_FAIL;
+   }
+
+   map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+   close(fd);
+   if(map == MAP_FAILED) return EKVS_FILE_FAIL;
+
+   /* Validate the header and index bounds, lookups trust them afterwards */
+   memcpy(&header, map, sizeof(header));
+   if(header.magic != EKVS_RO_MAGIC || header.version != EKVS_RO_VERSION ||
+      header.index_slots == 0 || (header.index_slots & (header.index_slots - 1)) != 0 ||
+      header.index_offset % sizeof(uint64_t) != 0 || header.index_offset > (uint64_t)st.st_size ||
+      header.index_slots > ((uint64_t)st.st_size - header.index_offset) / sizeof(struct _ekvs_ro_slot))
+   {
+      fprintf(stderr, "ekvs: %s is not a read-only image.\n", path);
+      munmap(map, (size_t)st.st_size);
+      return EKVS_FILE_FAIL;
+   }
+   madvise(map, (size_t)st.st_size, MADV_RANDOM);
+
+   db = ekvs_malloc(sizeof(struct _ekvs_db));
+   if(db == NULL)
+   {
+      munmap(map, (size_t)st.st_size);
+      return EKVS_ALLOCATION_FAIL;
+   }
+   memset(db, 0, sizeof(struct _ekvs_db));
+   db->ro_map = map;
+   db->ro_map_sz = (size_t)st.st_size;
+   db->table_population = header.count;
+   db->last_error = EKVS_OK;
+
+   *store = db;
+   return EKVS_OK;
+}
+
+int _ekvs_ro_get(ekvs store, uint64_t hash, const char* key, size_t key_sz, const void** data, size_t* data_sz)
+{
+   struct _ekvs_ro_header header;
+   const struct _ekvs_ro_slot* index;
+   uint64_t mask;
+   uint64_t slot;
+   uint64_t probes;
+
+   memcpy(&header, store->ro_map, sizeof(header));
+   index = (const struct _ekvs_ro_slot*)(store->ro_map + header.index_offset);
+   mask = header.index_slots - 1;
+
+   for(slot = hash & mask, probes = 0; probes < header.index_slots; slot = (slot + 1) & mask, probes++)
+   {
+      uint64_t record[2];
+      uint64_t offset = index[slot].offset;
+
+      if(offset == 0) break;
+      if(index[slot].hash != hash) continue;
+
+      /* Records are not aligned, and a corrupt offset must not read past the map */
+      if(offset > header.index_offset || header.index_offset - offset < EKVS_RO_RECORD_HEADER) break;
+      memcpy(record, store->ro_map + offset, sizeof(record));
+      if(record[0] > header.index_offset - offset - EKVS_RO_RECORD_HEADER ||
+         record[1] > header.index_offset - offset - EKVS_RO_RECORD_HEADER - record[0]) break;
+
+      if(record[0] == key_sz && memcmp(store->ro_map + offset + EKVS_RO_RECORD_HEADER, key, key_sz) == 0)
+      {
+         *data = store->ro_map + offset + EKVS_RO_RECORD_HEADER + key_sz;
+         *data_sz = (size_t)record[1];
+         store->cache_stats.hits++;
+         store->last_error = EKVS_OK;
+         return EKVS_OK;
+      }
+   }
+
+   *data = NULL;
+   *data_sz = 0;
+   store->cache_stats.misses++;
+   store->last_error = EKVS_NO_KEY;
+   return EKVS_NO_KEY;
+}
+
+void _ekvs_ro_close(ekvs store)
+{
+   munmap((void*)store->ro_map, store->ro_map_sz);
+   ekvs_free(store);
+}
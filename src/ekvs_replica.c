@@ -0,0 +1,865 @@
+/* -*- Mode: C; tab-width: 3; c-basic-offset: 3; indent-tabs-mode: nil -*- */
+/* vim: set filetype=C tabstop=3 softtabstop=3 shiftwidth=3 expandtab: */
+
+/* ekvs -- Copyright (C) 2011 GameClay LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include "ekvs_internal.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+/* A leader streams its binlog records to followers over file descriptors, as a
+ * sequence of frames, each a struct _ekvs_replica_frame followed by size bytes:
+ *
+ *   full     The follower's copy is replaced. The payload is the leader's run
+ *            id, and lsn the LSN of the copy which follows as records frames.
+ *   resume   The follower's copy is current up to lsn, and records follow from
+ *            there. The payload is the leader's run id.
+ *   records  Binlog records, in the same format as in the file. lsn is the leader
+ *            LSN after the last of them, or during a full copy the LSN of the copy.
+ *   synced   A full copy is complete.
+ *
+ * LSNs count from open, so the run id tells apart the LSNs of different opens of
+ * the leader. Sends never block the leader: each follower has an output buffer,
+ * written with non-blocking writes as records are logged and by
+ * ekvs_replicate_flush. A follower which falls EKVS_REPLICA_MAX_PENDING bytes
+ * behind is detached, and catches up again when it is reattached. */
+
+#define EKVS_REPLICA_MAGIC       0x50524b45  /* 'EKRP' */
+#define EKVS_REPLICA_FULL        1
+#define EKVS_REPLICA_RESUME      2
+#define EKVS_REPLICA_RECORDS     3
+#define EKVS_REPLICA_SYNCED      4
+
+#define EKVS_REPLICA_MAX_PENDING (64 * 1024 * 1024)
+#define EKVS_REPLICA_READ_CHUNK  (64 * 1024)
+#define EKVS_REPLICA_NO_FRAME    ((size_t)-1)
+
+struct _ekvs_replica_frame {
+   uint32_t magic;
+   uint32_t type;
+   uint64_t lsn;
+   uint64_t time_ns;          /* Leader clock when the frame was started */
+   uint64_t size;
+};
+
+struct _ekvs_replica_link {
+   int fd;
+   char* buf;
+   size_t len;
+   size_t sent;
+   size_t cap;
+   size_t frame;              /* Offset of the last records frame while none of it has been sent, which can be extended */
+   size_t limit;              /* Pending bytes at which the follower is detached */
+   struct _ekvs_replica_link* next;
+};
+
+/* The backlog keeps the most recent records as [lsn after][size][record] entries in a byte ring */
+struct _ekvs_replica_leader {
+   uint64_t run_id;
+   struct _ekvs_replica_link* links;
+   char* backlog;
+   uint64_t backlog_cap;
+   uint64_t head;             /* Byte counts, the entries lie between head and tail */
+   uint64_t tail;
+   uint64_t backlog_lsn;      /* LSN before the oldest entry */
+};
+
+struct _ekvs_replica_follower {
+   int fd;
+   int eof;
+   char* buf;
+   size_t len;
+   size_t cap;
+   ekvs_replica_status status;
+};
+
+int _ekvs_replica_start(ekvs store, size_t backlog_size)
+{
+   struct _ekvs_replica_leader* leader = ekvs_malloc(sizeof(struct _ekvs_replica_leader));
+   if(leader == NULL) return EKVS_ALLOCATION_FAIL;
+   memset(leader, 0, sizeof(struct _ekvs_replica_leader));
+
+   if(backlog_size != 0)
+   {
+      leader->backlog = ekvs_malloc(backlog_size);
+      if(leader->backlog == NULL)
+      {
+         ekvs_free(leader);
+         return EKVS_ALLOCATION_FAIL;
+      }
+      leader->backlog_cap = backlog_size;
+   }
+   leader->backlog_lsn = store->lsn;
+
+   /* 0 is kept for followers which have never been synced */
+   leader->run_id = _ekvs_now_ns() ^ ((uint64_t)getpid() << 32);
+   if(leader->run_id == 0) leader->run_id = 1;
+
+   store->leader = leader;
+
+   /* In-memory stores only log while they have followers to send records to */
+   store->binlog_enabled = 1;
+   return EKVS_OK;
+}
+
+static void _ekvs_link_free(struct _ekvs_replica_link* link)
+{
+   ekvs_free(link->buf);
+   ekvs_free(link);
+}
+
+void _ekvs_replica_close(ekvs store)
+{
+   struct _ekvs_replica_link* link;
+
+   if(store->leader != NULL)
+   {
+      while(store->leader->links != NULL)
+      {
+         link = store->leader->links;
+         store->leader->links = link->next;
+         _ekvs_link_free(link);
+      }
+      ekvs_free(store->leader->backlog);
+      ekvs_free(store->leader);
+      store->leader = NULL;
+   }
+
+   if(store->follower != NULL)
+   {
+      ekvs_free(store->follower->buf);
+      ekvs_free(store->follower);
+      store->follower = NULL;
+   }
+}
+
+uint64_t _ekvs_replica_pending(ekvs store, uint64_t* links)
+{
+   struct _ekvs_replica_link* link;
+   uint64_t pending = 0;
+
+   *links = 0;
+   if(store->leader == NULL) return 0;
+   for(link = store->leader->links; link != NULL; link = link->next)
+   {
+      pending += link->len - link->sent;
+      (*links)++;
+   }
+   return pending;
+}
+
+static int _ekvs_link_reserve(struct _ekvs_replica_link* link, size_t size)
+{
+   /* Drop what has been sent before growing */
+   if(link->cap - link->len < size && link->sent > 0)
+   {
+      memmove(link->buf, link->buf + link->sent, link->len - link->sent);
+      link->len -= link->sent;
+      link->frame = (link->frame != EKVS_REPLICA_NO_FRAME ? link->frame - link->sent : EKVS_REPLICA_NO_FRAME);
+      link->sent = 0;
+   }
+
+   if(link->cap - link->len < size)
+   {
+      size_t cap = (link->cap > 0 ? link->cap * 2 : EKVS_REPLICA_READ_CHUNK);
+      char* buf;
+      while(cap - link->len < size) cap *= 2;
+      buf = ekvs_realloc(link->buf, cap);
+      if(buf == NULL) return EKVS_ALLOCATION_FAIL;
+      link->buf = buf;
+      link->cap = cap;
+   }
+   return EKVS_OK;
+}
+
+static int _ekvs_link_frame(struct _ekvs_replica_link* link, uint32_t type, uint64_t lsn, const void* payload,
+   size_t payload_sz)
+{
+   struct _ekvs_replica_frame frame;
+
+   if(_ekvs_link_reserve(link, sizeof(frame) + payload_sz) != EKVS_OK) return EKVS_ALLOCATION_FAIL;
+   frame.magic = EKVS_REPLICA_MAGIC;
+   frame.type = type;
+   frame.lsn = lsn;
+   frame.time_ns = _ekvs_now_ns();
+   frame.size = payload_sz;
+   memcpy(link->buf + link->len, &frame, sizeof(frame));
+   if(payload_sz > 0) memcpy(link->buf + link->len + sizeof(frame), payload, payload_sz);
+
+   /* Records which follow a control frame must not be moved ahead of it */
+   link->frame = (type == EKVS_REPLICA_RECORDS ? link->len : EKVS_REPLICA_NO_FRAME);
+   link->len += sizeof(frame) + payload_sz;
+   return EKVS_OK;
+}
+
+/* Append one record, extending the last records frame while it is unsent and not too large */
+static int _ekvs_link_record(struct _ekvs_replica_link* link, uint64_t lsn, const char* header,
+   const char* key, size_t key_sz, const void* data, size_t data_sz)
+{
+   struct _ekvs_replica_frame frame;
+   size_t record_sz = EKVS_BINLOG_HEADER_SIZE + key_sz + data_sz;
+
+   if(_ekvs_link_reserve(link, sizeof(frame) + record_sz) != EKVS_OK) return EKVS_ALLOCATION_FAIL;
+
+   if(link->frame != EKVS_REPLICA_NO_FRAME)
+   {
+      memcpy(&frame, link->buf + link->frame, sizeof(frame));
+      if(frame.size >= EKVS_BLOCK_SIZE) link->frame = EKVS_REPLICA_NO_FRAME;
+   }
+   if(link->frame == EKVS_REPLICA_NO_FRAME)
+   {
+      if(_ekvs_link_frame(link, EKVS_REPLICA_RECORDS, lsn, NULL, 0) != EKVS_OK) return EKVS_ALLOCATION_FAIL;
+      memcpy(&frame, link->buf + link->frame, sizeof(frame));
+   }
+
+   frame.lsn = lsn;
+   frame.size += record_sz;
+   memcpy(link->buf + link->frame, &frame, sizeof(frame));
+   memcpy(link->buf + link->len, header, EKVS_BINLOG_HEADER_SIZE);
+   memcpy(link->buf + link->len + EKVS_BINLOG_HEADER_SIZE, key, key_sz);
+   if(data_sz > 0) memcpy(link->buf + link->len + EKVS_BINLOG_HEADER_SIZE + key_sz, data, data_sz);
+   link->len += record_sz;
+   return EKVS_OK;
+}
+
+/* Write as much as the follower will take without blocking */
+static int _ekvs_link_send(struct _ekvs_replica_link* link)
+{
+   while(link->sent < link->len)
+   {
+      ssize_t written = send(link->fd, link->buf + link->sent, link->len - link->sent, MSG_NOSIGNAL);
+      if(written < 0 && errno == ENOTSOCK) written = write(link->fd, link->buf + link->sent, link->len - link->sent);
+      if(written < 0 && errno == EINTR) continue;
+      if(written < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) break;
+      if(written <= 0) return EKVS_FILE_FAIL;
+      link->sent += (size_t)written;
+   }
+
+   if(link->frame != EKVS_REPLICA_NO_FRAME && link->frame < link->sent) link->frame = EKVS_REPLICA_NO_FRAME;
+   if(link->sent == link->len)
+   {
+      link->sent = link->len = 0;
+      link->frame = EKVS_REPLICA_NO_FRAME;
+   }
+   return EKVS_OK;
+}
+
+/* Remove a follower from the list, where prev is the link before it or NULL */
+static void _ekvs_link_detach(ekvs store, struct _ekvs_replica_link* link, struct _ekvs_replica_link* prev)
+{
+   if(prev != NULL) prev->next = link->next;
+   else store->leader->links = link->next;
+   _ekvs_link_free(link);
+}
+
+static void _ekvs_backlog_copy(struct _ekvs_replica_leader* leader, uint64_t pos, void* dst, const void* src, size_t size)
+{
+   size_t offset = (size_t)(pos % leader->backlog_cap);
+   size_t first = (size < leader->backlog_cap - offset ? size : (size_t)(leader->backlog_cap - offset));
+
+   if(size == 0) return;
+   if(src != NULL)
+   {
+      memcpy(leader->backlog + offset, src, first);
+      memcpy(leader->backlog, (const char*)src + first, size - first);
+   }
+   else
+   {
+      memcpy(dst, leader->backlog + offset, first);
+      memcpy((char*)dst + first, leader->backlog, size - first);
+   }
+}
+
+static void _ekvs_backlog_add(struct _ekvs_replica_leader* leader, uint64_t lsn, const char* header,
+   const char* key, size_t key_sz, const void* data, size_t data_sz)
+{
+   uint64_t entry[2];
+   uint64_t entry_sz = sizeof(entry) + EKVS_BINLOG_HEADER_SIZE + key_sz + data_sz;
+
+   if(entry_sz > leader->backlog_cap)
+   {
+      leader->head = leader->tail;
+      leader->backlog_lsn = lsn;
+      return;
+   }
+
+   /* Forget the oldest entries to make room */
+   while(leader->backlog_cap - (leader->tail - leader->head) < entry_sz)
+   {
+      _ekvs_backlog_copy(leader, leader->head, entry, NULL, sizeof(entry));
+      leader->backlog_lsn = entry[0];
+      leader->head += sizeof(entry) + entry[1];
+   }
+
+   entry[0] = lsn;
+   entry[1] = EKVS_BINLOG_HEADER_SIZE + key_sz + data_sz;
+   _ekvs_backlog_copy(leader, leader->tail, NULL, entry, sizeof(entry));
+   _ekvs_backlog_copy(leader, leader->tail + sizeof(entry), NULL, header, EKVS_BINLOG_HEADER_SIZE);
+   _ekvs_backlog_copy(leader, leader->tail + sizeof(entry) + EKVS_BINLOG_HEADER_SIZE, NULL, key, key_sz);
+   _ekvs_backlog_copy(leader, leader->tail + sizeof(entry) + EKVS_BINLOG_HEADER_SIZE + key_sz, NULL, data, data_sz);
+   leader->tail += entry_sz;
+}
+
+void _ekvs_replica_feed(ekvs store, const char* header, const char* key, size_t key_sz, const void* data, size_t data_sz)
+{
+   struct _ekvs_replica_leader* leader = store->leader;
+   struct _ekvs_replica_link* link;
+   struct _ekvs_replica_link* prev = NULL;
+   char vlog_header[EKVS_BINLOG_HEADER_SIZE];
+   char operation;
+   char flags;
+
+   /* Followers have no access to the value log, so they are sent the value itself */
+   memcpy(&operation, header + sizeof(uint32_t), sizeof(operation));
+   memcpy(&flags, header + sizeof(uint32_t) + sizeof(operation), sizeof(flags));
+   if(flags & EKVS_ENTRY_VLOG)
+   {
+      struct _ekvs_vlog_ptr ptr;
+      memcpy(&ptr, data, sizeof(ptr));
+      data = _ekvs_vlog_read(store, &ptr);
+      data_sz = (size_t)ptr.size;
+      if(data == NULL)
+      {
+         /* The stream cannot continue without this record, so every follower starts over */
+         while(leader->links != NULL) _ekvs_link_detach(store, leader->links, NULL);
+         leader->head = leader->tail;
+         leader->backlog_lsn = store->lsn;
+         return;
+      }
+      _ekvs_binlog_header(vlog_header, operation, (char)(flags & ~EKVS_ENTRY_VLOG), key, key_sz, data, data_sz);
+      header = vlog_header;
+   }
+
+   if(leader->backlog_cap != 0) _ekvs_backlog_add(leader, store->lsn, header, key, key_sz, data, data_sz);
+
+   link = leader->links;
+   while(link != NULL)
+   {
+      struct _ekvs_replica_link* next = link->next;
+      if(_ekvs_link_record(link, store->lsn, header, key, key_sz, data, data_sz) != EKVS_OK ||
+         _ekvs_link_send(link) != EKVS_OK || link->len - link->sent > link->limit)
+      {
+         _ekvs_link_detach(store, link, prev);
+      }
+      else
+      {
+         prev = link;
+      }
+      link = next;
+   }
+}
+
+/* Queue the records logged after from_lsn, if the backlog still holds all of them */
+static int _ekvs_replica_resume(ekvs store, struct _ekvs_replica_link* link, uint64_t from_lsn)
+{
+   struct _ekvs_replica_leader* leader = store->leader;
+   struct _ekvs_replica_frame frame;
+   uint64_t entry[2];
+   uint64_t pos = leader->head;
+   uint64_t lsn = leader->backlog_lsn;
+   size_t size;
+
+   if(from_lsn < leader->backlog_lsn || from_lsn > store->lsn) return EKVS_NO_KEY;
+
+   /* Find the entry boundary at from_lsn */
+   while(lsn < from_lsn && pos < leader->tail)
+   {
+      _ekvs_backlog_copy(leader, pos, entry, NULL, sizeof(entry));
+      lsn = entry[0];
+      pos += sizeof(entry) + entry[1];
+   }
+   if(lsn != from_lsn) return EKVS_NO_KEY;
+
+   if(_ekvs_link_frame(link, EKVS_REPLICA_RESUME, from_lsn, &leader->run_id, sizeof(leader->run_id)) != EKVS_OK)
+   {
+      return EKVS_ALLOCATION_FAIL;
+   }
+   if(pos == leader->tail) return EKVS_OK;
+
+   /* The rest of the backlog goes out as one records frame */
+   if(_ekvs_link_frame(link, EKVS_REPLICA_RECORDS, store->lsn, NULL, 0) != EKVS_OK) return EKVS_ALLOCATION_FAIL;
+   memcpy(&frame, link->buf + link->frame, sizeof(frame));
+   while(pos < leader->tail)
+   {
+      _ekvs_backlog_copy(leader, pos, entry, NULL, sizeof(entry));
+      size = (size_t)entry[1];
+      if(_ekvs_link_reserve(link, size) != EKVS_OK) return EKVS_ALLOCATION_FAIL;
+      _ekvs_backlog_copy(leader, pos + sizeof(entry), link->buf + link->len, NULL, size);
+      link->len += size;
+      frame.size += size;
+      pos += sizeof(entry) + size;
+   }
+   memcpy(link->buf + link->frame, &frame, sizeof(frame));
+   return EKVS_OK;
+}
+
+/* Queue a copy of every entry, as they would be written to a snapshot */
+static int _ekvs_replica_copy(ekvs store, struct _ekvs_replica_link* link)
+{
+   struct _ekvs_replica_leader* leader = store->leader;
+   struct _ekvs_db_entry* entry;
+   char header[EKVS_BINLOG_HEADER_SIZE];
+   uint64_t i;
+
+   if(_ekvs_link_frame(link, EKVS_REPLICA_FULL, store->lsn, &leader->run_id, sizeof(leader->run_id)) != EKVS_OK)
+   {
+      return EKVS_ALLOCATION_FAIL;
+   }
+
+   for(i = 0; i < store->serialized.table_sz; i++)
+   {
+      for(entry = store->table[i]; entry != NULL; entry = entry->chain)
+      {
+         const void* data = &entry->key_data[entry->key_sz];
+         size_t data_sz = entry->data_sz;
+         char flags = entry->flags & EKVS_ENTRY_PERSISTENT;
+
+         if(entry->flags & (EKVS_ENTRY_COLLECTION | EKVS_ENTRY_VLOG))
+         {
+            data = _ekvs_entry_value(store, entry, &data_sz);
+            if(data == NULL) return EKVS_FILE_FAIL;
+            flags &= ~EKVS_ENTRY_VLOG;
+         }
+
+         _ekvs_binlog_header(header, EKVS_BINLOG_SET, flags, entry->key_data, entry->key_sz, data, data_sz);
+         if(_ekvs_link_record(link, store->lsn, header, entry->key_data, entry->key_sz, data, data_sz) != EKVS_OK)
+         {
+            return EKVS_ALLOCATION_FAIL;
+         }
+      }
+   }
+
+   return _ekvs_link_frame(link, EKVS_REPLICA_SYNCED, store->lsn, NULL, 0);
+}
+
+int ekvs_replicate(ekvs store, int fd, uint64_t run_id, uint64_t from_lsn)
+{
+   struct _ekvs_replica_link* link;
+   int flags;
+   int ret;
+
+   if(store == NULL)
+   {
+      fprintf(stderr, "ekvs: NULL store parameter passed to ekvs_replicate.\n");
+      return EKVS_FAIL;
+   }
+
+   if(store->ro_map != NULL || store->follower != NULL)
+   {
+      store->last_error = EKVS_READ_ONLY;
+      return EKVS_READ_ONLY;
+   }
+
+   if(store->shm_map != NULL || store->lsm != NULL)
+   {
+      store->last_error = EKVS_UNSUPPORTED;
+      return EKVS_UNSUPPORTED;
+   }
+
+   flags = fcntl(fd, F_GETFL);
+   if(flags == -1 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) == -1)
+   {
+      store->last_error = EKVS_FILE_FAIL;
+      return EKVS_FILE_FAIL;
+   }
+
+   if(store->leader == NULL)
+   {
+      ret = _ekvs_replica_start(store, 0);
+      if(ret != EKVS_OK)
+      {
+         store->last_error = ret;
+         return ret;
+      }
+   }
+
+   link = ekvs_malloc(sizeof(struct _ekvs_replica_link));
+   if(link == NULL)
+   {
+      store->last_error = EKVS_ALLOCATION_FAIL;
+      return EKVS_ALLOCATION_FAIL;
+   }
+   memset(link, 0, sizeof(struct _ekvs_replica_link));
+   link->fd = fd;
+   link->frame = EKVS_REPLICA_NO_FRAME;
+
+   /* Resume from the backlog if it reaches back far enough, otherwise send a full copy */
+   ret = EKVS_NO_KEY;
+   if(run_id == store->leader->run_id) ret = _ekvs_replica_resume(store, link, from_lsn);
+   if(ret == EKVS_NO_KEY)
+   {
+      link->len = 0;
+      link->frame = EKVS_REPLICA_NO_FRAME;
+      ret = _ekvs_replica_copy(store, link);
+   }
+   if(ret == EKVS_OK) ret = _ekvs_link_send(link);
+   if(ret != EKVS_OK)
+   {
+      _ekvs_link_free(link);
+      store->last_error = ret;
+      return ret;
+   }
+
+   link->limit = link->len - link->sent + EKVS_REPLICA_MAX_PENDING;
+   link->next = store->leader->links;
+   store->leader->links = link;
+
+   store->last_error = EKVS_OK;
+   return EKVS_OK;
+}
+
+int ekvs_replicate_flush(ekvs store)
+{
+   struct _ekvs_replica_link* link;
+   struct _ekvs_replica_link* prev = NULL;
+   int ret = EKVS_OK;
+
+   if(store == NULL)
+   {
+      fprintf(stderr, "ekvs: NULL store parameter passed to ekvs_replicate_flush.\n");
+      return EKVS_FAIL;
+   }
+
+   link = (store->leader != NULL ? store->leader->links : NULL);
+   while(link != NULL)
+   {
+      struct _ekvs_replica_link* next = link->next;
+      if(_ekvs_link_send(link) != EKVS_OK)
+      {
+         _ekvs_link_detach(store, link, prev);
+         ret = EKVS_FILE_FAIL;
+      }
+      else
+      {
+         prev = link;
+      }
+      link = next;
+   }
+
+   store->last_error = ret;
+   return ret;
+}
+
+int ekvs_replicate_stop(ekvs store, int fd)
+{
+   struct _ekvs_replica_link* link;
+   struct _ekvs_replica_link* prev = NULL;
+
+   if(store == NULL)
+   {
+      fprintf(stderr, "ekvs: NULL store parameter passed to ekvs_replicate_stop.\n");
+      return EKVS_FAIL;
+   }
+
+   for(link = (store->leader != NULL ? store->leader->links : NULL); link != NULL; prev = link, link = link->next)
+   {
+      if(link->fd == fd)
+      {
+         _ekvs_link_detach(store, link, prev);
+         store->last_error = EKVS_OK;
+         return EKVS_OK;
+      }
+   }
+
+   store->last_error = EKVS_NO_KEY;
+   return EKVS_NO_KEY;
+}
+
+int ekvs_open_replica(ekvs* store, int fd, const ekvs_opts* opts)
+{
+   int ret;
+
+   if(store == NULL)
+   {
+      fprintf(stderr, "ekvs: NULL store parameter passed to ekvs_open_replica.\n");
+      return EKVS_FAIL;
+   }
+
+   ret = ekvs_open(store, NULL, opts);
+   if(ret != EKVS_OK) return ret;
+
+   /* Followers never log, and never lead */
+   _ekvs_replica_close(*store);
+   (*store)->binlog_enabled = 0;
+
+   (*store)->follower = ekvs_malloc(sizeof(struct _ekvs_replica_follower));
+   if((*store)->follower == NULL)
+   {
+      ekvs_close(*store);
+      *store = NULL;
+      return EKVS_ALLOCATION_FAIL;
+   }
+   memset((*store)->follower, 0, sizeof(struct _ekvs_replica_follower));
+
+   ret = ekvs_replica_attach(*store, fd);
+   if(ret != EKVS_OK)
+   {
+      ekvs_close(*store);
+      *store = NULL;
+   }
+   return ret;
+}
+
+int ekvs_replica_attach(ekvs store, int fd)
+{
+   struct _ekvs_replica_follower* follower;
+   int flags;
+
+   if(store == NULL)
+   {
+      fprintf(stderr, "ekvs: NULL store parameter passed to ekvs_replica_attach.\n");
+      return EKVS_FAIL;
+   }
+
+   follower = store->follower;
+   if(follower == NULL)
+   {
+      store->last_error = EKVS_FAIL;
+      return EKVS_FAIL;
+   }
+
+   flags = fcntl(fd, F_GETFL);
+   if(flags == -1 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) == -1)
+   {
+      store->last_error = EKVS_FILE_FAIL;
+      return EKVS_FILE_FAIL;
+   }
+
+   /* The copy and its position are kept, so the leader can resume from them */
+   follower->fd = fd;
+   follower->eof = 0;
+   follower->len = 0;
+   follower->status.synced = 0;
+
+   store->last_error = EKVS_OK;
+   return EKVS_OK;
+}
+
+static void _ekvs_replica_clear(ekvs store)
+{
+   uint64_t i;
+
+   for(i = 0; i < store->serialized.table_sz; i++)
+   {
+      while(store->table[i] != NULL) _ekvs_remove(store, i, store->table[i], NULL);
+   }
+}
+
+/* Apply the complete frames at the front of the buffer */
+static int _ekvs_replica_apply(ekvs store)
+{
+   struct _ekvs_replica_follower* follower = store->follower;
+   struct _ekvs_replica_frame frame;
+   const char* payload;
+   size_t pos = 0;
+   int ret = EKVS_OK;
+
+   while(ret == EKVS_OK && follower->len - pos >= sizeof(frame))
+   {
+      memcpy(&frame, follower->buf + pos, sizeof(frame));
+      if(frame.magic != EKVS_REPLICA_MAGIC)
+      {
+         ret = EKVS_FILE_FAIL;
+         break;
+      }
+
+      /* The LSN is known as soon as the header arrives */
+      if(frame.type == EKVS_REPLICA_RECORDS && frame.lsn > follower->status.leader_lsn)
+      {
+         follower->status.leader_lsn = frame.lsn;
+      }
+      if(follower->len - pos - sizeof(frame) < frame.size) break;
+      payload = follower->buf + pos + sizeof(frame);
+
+      switch(frame.type)
+      {
+         case EKVS_REPLICA_FULL:
+         {
+            if(frame.size != sizeof(uint64_t))
+            {
+               ret = EKVS_FILE_FAIL;
+               break;
+            }
+            _ekvs_replica_clear(store);
+            memcpy(&follower->status.run_id, payload, sizeof(uint64_t));
+            follower->status.leader_lsn = frame.lsn;
+            follower->status.synced = 0;
+            follower->status.full_syncs++;
+            store->lsn = 0;
+            break;
+         }
+         case EKVS_REPLICA_RESUME:
+         {
+            uint64_t run_id;
+            if(frame.size != sizeof(run_id))
+            {
+               ret = EKVS_FILE_FAIL;
+               break;
+            }
+            memcpy(&run_id, payload, sizeof(run_id));
+            if(run_id != follower->status.run_id || frame.lsn != store->lsn)
+            {
+               ret = EKVS_FILE_FAIL;
+               break;
+            }
+            follower->status.synced = 1;
+            break;
+         }
+         case EKVS_REPLICA_RECORDS:
+         {
+            ret = _ekvs_replay_records(store, payload, (size_t)frame.size, &follower->status.records);
+            if(ret == EKVS_OK && follower->status.synced)
+            {
+               store->lsn = frame.lsn;
+               follower->status.lag_ns = _ekvs_now_ns() - frame.time_ns;
+            }
+            break;
+         }
+         case EKVS_REPLICA_SYNCED:
+         {
+            store->lsn = frame.lsn;
+            follower->status.synced = 1;
+            break;
+         }
+         default:
+         {
+            ret = EKVS_FILE_FAIL;
+            break;
+         }
+      }
+      pos += sizeof(frame) + (size_t)frame.size;
+   }
+
+   if(ret != EKVS_OK)
+   {
+      /* The stream is unusable past this point; the follower must be reattached */
+      follower->eof = 1;
+      follower->len = 0;
+      return ret;
+   }
+
+   memmove(follower->buf, follower->buf + pos, follower->len - pos);
+   follower->len -= pos;
+
+   /* Make room for the rest of a large frame */
+   if(follower->len >= sizeof(frame))
+   {
+      size_t need;
+      memcpy(&frame, follower->buf, sizeof(frame));
+      need = sizeof(frame) + (size_t)frame.size;
+      if(need > follower->cap)
+      {
+         char* buf = ekvs_realloc(follower->buf, need);
+         if(buf == NULL) return EKVS_ALLOCATION_FAIL;
+         follower->buf = buf;
+         follower->cap = need;
+      }
+   }
+   return EKVS_OK;
+}
+
+int ekvs_replica_poll(ekvs store, int timeout_ms)
+{
+   struct _ekvs_replica_follower* follower;
+   ssize_t got;
+   int ret = EKVS_OK;
+
+   if(store == NULL)
+   {
+      fprintf(stderr, "ekvs: NULL store parameter passed to ekvs_replica_poll.\n");
+      return EKVS_FAIL;
+   }
+
+   follower = store->follower;
+   if(follower == NULL)
+   {
+      store->last_error = EKVS_FAIL;
+      return EKVS_FAIL;
+   }
+
+   if(follower->eof == 0 && timeout_ms != 0)
+   {
+      struct pollfd pfd;
+      pfd.fd = follower->fd;
+      pfd.events = POLLIN;
+      pfd.revents = 0;
+      poll(&pfd, 1, timeout_ms);
+   }
+
+   /* Read and apply a chunk at a time until the leader has nothing more */
+   while(follower->eof == 0 && ret == EKVS_OK)
+   {
+      if(follower->cap - follower->len < EKVS_REPLICA_READ_CHUNK)
+      {
+         char* buf = ekvs_realloc(follower->buf, follower->len + EKVS_REPLICA_READ_CHUNK);
+         if(buf == NULL)
+         {
+            ret = EKVS_ALLOCATION_FAIL;
+            break;
+         }
+         follower->buf = buf;
+         follower->cap = follower->len + EKVS_REPLICA_READ_CHUNK;
+      }
+
+      got = read(follower->fd, follower->buf + follower->len, follower->cap - follower->len);
+      if(got < 0 && errno == EINTR) continue;
+      if(got < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) break;
+      if(got <= 0)
+      {
+         follower->eof = 1;
+         break;
+      }
+      follower->len += (size_t)got;
+      ret = _ekvs_replica_apply(store);
+   }
+
+   if(ret == EKVS_OK && follower->eof) ret = EKVS_FILE_FAIL;
+   store->last_error = ret;
+   return ret;
+}
+
+int ekvs_get_replica_status(ekvs store, ekvs_replica_status* status)
+{
+   if(store == NULL)
+   {
+      fprintf(stderr, "ekvs: NULL store parameter passed to ekvs_get_replica_status.\n");
+      return EKVS_FAIL;
+   }
+
+   if(status == NULL)
+   {
+      fprintf(stderr, "ekvs: NULL status parameter passed to ekvs_get_replica_status.\n");
+      return EKVS_FAIL;
+   }
+
+   if(store->follower == NULL)
+   {
+      store->last_error = EKVS_FAIL;
+      return EKVS_FAIL;
+   }
+
+   *status = store->follower->status;
+   status->applied_lsn = store->lsn;
+   status->lag_bytes = (status->leader_lsn > store->lsn ? status->leader_lsn - store->lsn : 0);
+
+   store->last_error = EKVS_OK;
+   return EKVS_OK;
+}
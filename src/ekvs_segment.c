@@ -0,0 +1,194 @@
+/* -*- Mode: C; tab-width: 3; c-basic-offset: 3; indent-tabs-mode: nil -*- */
+/* vim: set filetype=C tabstop=3 softtabstop=3 shiftwidth=3 expandtab: */
+
+/* ekvs -- Copyright (C) 2011 GameClay LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "ekvs_internal.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+
+/* A segmented binlog keeps records in files named <db>.log.<number>, each
+ * preallocated to segment_size so appends never extend the file. The database
+ * file then only holds the snapshot, and records which first_segment and later
+ * segments are newer than it. A snapshot starts a new segment, and the segments
+ * before it are simply unlinked.
+ *
+ * Records never span segments. The previous segment is flushed to disk before
+ * the next one is started, so only the last segment can have a torn tail. A
+ * damaged record anywhere else ends replay, and the segments after it are dropped. */
+
+static char* _ekvs_segment_name(ekvs store, uint64_t segment)
+{
+   char* name = ekvs_malloc(strlen(store->db_fname) + 32);
+   if(name != NULL) sprintf(name, "%s.log.%08lu", store->db_fname, (unsigned long)segment);
+   return name;
+}
+
+/* Open a segment for appending at offset end, discarding anything after it and reserving the rest */
+static int _ekvs_segment_open(ekvs store, uint64_t segment, uint64_t end)
+{
+   char* name = _ekvs_segment_name(store, segment);
+   FILE* file;
+
+   if(name == NULL) return EKVS_ALLOCATION_FAIL;
+   file = fopen(name, "rb+");
+   if(file == NULL) file = fopen(name, "wb+");
+   if(file == NULL)
+   {
+      fprintf(stderr, "ekvs: failed to open binlog segment (%s).\n", name);
+      ekvs_free(name);
+      return EKVS_FILE_FAIL;
+   }
+   ekvs_free(name);
+
+   /* Truncating first turns stale bytes past end back into zeros when the space is reserved again */
+   if(ftruncate(fileno(file), (off_t)end) != 0 ||
+      posix_fallocate(fileno(file), 0, (off_t)store->serialized.segment_size) != 0)
+   {
+      fclose(file);
+      return EKVS_FILE_FAIL;
+   }
+
+   store->segment_file = file;
+   store->segment = segment;
+   store->segment_end = end;
+   return EKVS_OK;
+}
+
+FILE* _ekvs_binlog_file(ekvs store)
+{
+   return (store->segment_file != NULL ? store->segment_file : store->db_file);
+}
+
+int _ekvs_segment_load(ekvs store)
+{
+   uint64_t segment = store->serialized.first_segment;
+   uint64_t later;
+   uint64_t last_end = 0;
+   long int valid_end;
+   long int file_end;
+   char header[EKVS_BINLOG_HEADER_SIZE];
+   char* name;
+   FILE* file;
+   size_t i;
+   int damaged = 0;
+   int ret;
+
+   store->segment_logged = 0;
+   for(;;)
+   {
+      name = _ekvs_segment_name(store, segment);
+      if(name == NULL) return EKVS_ALLOCATION_FAIL;
+      file = fopen(name, "rb");
+      ekvs_free(name);
+      if(file == NULL) break;
+
+      ret = _ekvs_replay_log(store, file, 0, &valid_end, &file_end);
+      if(ret == EKVS_OK && valid_end < file_end)
+      {
+         /* Reserved space reads as zeros, anything else is a damaged record */
+         memset(header, 0, sizeof(header));
+         if(fseek(file, valid_end, SEEK_SET) == 0) fread(header, 1, sizeof(header), file);
+         for(i = 0; i < sizeof(header) && header[i] == 0; i++);
+         if(i != sizeof(header))
+         {
+            store->discarded_bytes += (uint64_t)(file_end - valid_end);
+            damaged = 1;
+         }
+      }
+      fclose(file);
+      if(ret != EKVS_OK) return ret;
+
+      store->segment_logged += (uint64_t)valid_end;
+      last_end = (uint64_t)valid_end;
+      if(damaged) break;
+      segment++;
+   }
+
+   /* Records after a damaged one may depend on what was lost, so later segments are discarded with it.
+    * They are unlinked last first, so a crash part way through never leaves a gap. */
+   if(damaged)
+   {
+      for(later = segment + 1; ; later++)
+      {
+         name = _ekvs_segment_name(store, later);
+         if(name == NULL) return EKVS_ALLOCATION_FAIL;
+         file = fopen(name, "rb");
+         ekvs_free(name);
+         if(file == NULL) break;
+         if(fseek(file, 0, SEEK_END) == 0 && (file_end = ftell(file)) > 0) store->discarded_bytes += (uint64_t)file_end;
+         fclose(file);
+      }
+      fprintf(stderr, "ekvs: discarded damaged tail of binlog segment %lu, and %lu later segments.\n",
+         (unsigned long)segment, (unsigned long)(later - segment - 1));
+      while(--later > segment)
+      {
+         name = _ekvs_segment_name(store, later);
+         if(name == NULL) return EKVS_ALLOCATION_FAIL;
+         remove(name);
+         ekvs_free(name);
+      }
+   }
+
+   /* Append to the last segment found, or start the first one */
+   if(!damaged && segment != store->serialized.first_segment) segment--;
+   return _ekvs_segment_open(store, segment, last_end);
+}
+
+int _ekvs_segment_roll(ekvs store)
+{
+   int ret;
+
+   if(store->writer != NULL)
+   {
+      ret = _ekvs_writer_drain(store);
+      if(ret != EKVS_OK) return ret;
+   }
+
+   if(_ekvs_vlog_sync(store) != EKVS_OK) return EKVS_FILE_FAIL;
+   if(fflush(store->segment_file) != 0 || fdatasync(fileno(store->segment_file)) != 0) return EKVS_FILE_FAIL;
+   fclose(store->segment_file);
+   store->segment_file = NULL;
+
+   ret = _ekvs_segment_open(store, store->segment + 1, 0);
+   if(ret != EKVS_OK) return ret;
+
+   if(store->writer != NULL) _ekvs_writer_rebase(store, 0);
+   return EKVS_OK;
+}
+
+/* Unlink segments first through last, whose records are all in a snapshot */
+void _ekvs_segment_drop(ekvs store, uint64_t first, uint64_t last)
+{
+   uint64_t segment;
+   char* name;
+
+   for(segment = first; segment <= last; segment++)
+   {
+      name = _ekvs_segment_name(store, segment);
+      if(name == NULL) return;
+      remove(name);
+      ekvs_free(name);
+   }
+}
+
+void _ekvs_segment_close(ekvs store)
+{
+   if(store->segment_file == NULL) return;
+   fclose(store->segment_file);
+   store->segment_file = NULL;
+}
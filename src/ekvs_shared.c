@@ -0,0 +1,699 @@
+/* -*- Mode: C; tab-width: 3; c-basic-offset: 3; indent-tabs-mode: nil -*- */
+/* vim: set filetype=C tabstop=3 softtabstop=3 shiftwidth=3 expandtab: */
+
+/* ekvs -- Copyright (C) 2011 GameClay LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include "ekvs_internal.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/* Shared stores keep their table and entries in one file-backed mapping, which
+ * every attached process maps, so entries link to each other by offset.
+ *
+ * Writers serialize on a robust, process-shared mutex. Readers take no lock:
+ * writers make the sequence number odd while they change links, and a reader
+ * retries a lookup if the sequence number was odd or changed meanwhile.
+ *
+ * Memory which a reader may still be using is not reused until it is safe. Each
+ * handle has a slot holding the epoch at which it last released the values it
+ * was given (at ekvs_shared_refresh and at each of its modifications). Unlinked
+ * blocks wait in limbo, stamped with the epoch at which they were unlinked, until
+ * every slot has reached that epoch. Slots of processes which have exited are
+ * reaped.
+ *
+ * The heap is a bump allocator with power-of-two size classes, and larger free
+ * blocks are split to satisfy smaller requests. Every block records its state,
+ * so if a writer dies while holding the lock, the next to take it rebuilds the free
+ * lists, limbo and table by scanning the heap. Of the entries for one key, the
+ * one with the newest epoch wins. */
+
+#define EKVS_SHM_ENTRY_OFFSET (sizeof(struct _ekvs_shm_block) + sizeof(struct _ekvs_shm_entry))
+
+#define EKVS_SHM_HEADER(store) ((struct _ekvs_shm_header*)(store)->shm_map)
+#define EKVS_SHM_BLOCK_AT(store, off) ((struct _ekvs_shm_block*)((store)->shm_map + (off)))
+#define EKVS_SHM_ENTRY_AT(store, off) ((struct _ekvs_shm_entry*)((store)->shm_map + (off) + sizeof(struct _ekvs_shm_block)))
+#define EKVS_SHM_BUCKETS_AT(store, off) ((uint64_t*)((store)->shm_map + (off) + sizeof(struct _ekvs_shm_block)))
+
+static uint32_t _ekvs_shm_class(uint64_t size)
+{
+   uint32_t size_class = EKVS_SHM_MIN_CLASS;
+   while(size_class < EKVS_SHM_CLASSES && ((uint64_t)1 << size_class) < size) size_class++;
+   return size_class;
+}
+
+static void _ekvs_shm_push(ekvs store, uint64_t* list, uint64_t off, uint32_t state)
+{
+   struct _ekvs_shm_block* block = EKVS_SHM_BLOCK_AT(store, off);
+   block->link = *list;
+   block->state = state;
+   *list = off;
+}
+
+/* Move blocks no slot can still be using from limbo to the free lists */
+static int _ekvs_shm_reclaim(ekvs store)
+{
+   struct _ekvs_shm_header* header = EKVS_SHM_HEADER(store);
+   uint64_t oldest = header->epoch;
+   uint64_t* link = &header->limbo;
+   uint32_t i;
+   int reclaimed = 0;
+
+   for(i = 0; i < EKVS_SHM_SLOTS; i++)
+   {
+      uint64_t pid = EKVS_ATOMIC_LOAD(&header->slots[i].pid);
+      if(pid == 0) continue;
+      if(kill((pid_t)pid, 0) == -1 && errno == ESRCH)
+      {
+         /* The process exited without closing its handle */
+         EKVS_ATOMIC_STORE(&header->slots[i].pid, 0);
+         continue;
+      }
+      if(EKVS_ATOMIC_LOAD(&header->slots[i].epoch) < oldest) oldest = EKVS_ATOMIC_LOAD(&header->slots[i].epoch);
+   }
+
+   while(*link != 0)
+   {
+      struct _ekvs_shm_block* block = EKVS_SHM_BLOCK_AT(store, *link);
+      if(block->epoch <= oldest)
+      {
+         uint64_t off = *link;
+         *link = block->link;
+         header->used -= (uint64_t)1 << block->size_class;
+         _ekvs_shm_push(store, &header->free_lists[block->size_class], off, EKVS_SHM_FREE);
+         reclaimed = 1;
+      }
+      else
+      {
+         link = &block->link;
+      }
+   }
+   return reclaimed;
+}
+
+static uint64_t _ekvs_shm_alloc(ekvs store, uint64_t size)
+{
+   struct _ekvs_shm_header* header = EKVS_SHM_HEADER(store);
+   uint32_t size_class = _ekvs_shm_class(size);
+   uint32_t larger;
+   uint64_t off;
+   int reclaimed = 0;
+
+   if(size_class >= EKVS_SHM_CLASSES) return 0;
+
+   for(;;)
+   {
+      /* The smallest free block which is large enough, halved until it fits */
+      for(larger = size_class; larger < EKVS_SHM_CLASSES && header->free_lists[larger] == 0; larger++);
+      if(larger < EKVS_SHM_CLASSES)
+      {
+         struct _ekvs_shm_block* block;
+         off = header->free_lists[larger];
+         block = EKVS_SHM_BLOCK_AT(store, off);
+         header->free_lists[larger] = block->link;
+         block->state = EKVS_SHM_ALLOCATED;
+         while(block->size_class > size_class)
+         {
+            /* The upper half is complete before the block shrinks, so a scan sees one or the other */
+            uint64_t half = off + ((uint64_t)1 << (block->size_class - 1));
+            EKVS_SHM_BLOCK_AT(store, half)->size_class = block->size_class - 1;
+            _ekvs_shm_push(store, &header->free_lists[block->size_class - 1], half, EKVS_SHM_FREE);
+            EKVS_BARRIER();
+            block->size_class--;
+         }
+         break;
+      }
+
+      /* Then fresh space */
+      if(header->size - header->heap_end >= ((uint64_t)1 << size_class))
+      {
+         off = header->heap_end;
+         EKVS_SHM_BLOCK_AT(store, off)->state = EKVS_SHM_ALLOCATED;
+         EKVS_SHM_BLOCK_AT(store, off)->size_class = size_class;
+         EKVS_BARRIER();
+         header->heap_end += (uint64_t)1 << size_class;
+         break;
+      }
+
+      if(reclaimed || _ekvs_shm_reclaim(store) == 0) return 0;
+      reclaimed = 1;
+   }
+
+   header->used += (uint64_t)1 << size_class;
+   return off;
+}
+
+/* Unlinked blocks wait for every slot to pass the epoch at which they were unlinked */
+static void _ekvs_shm_retire(ekvs store, uint64_t off)
+{
+   struct _ekvs_shm_header* header = EKVS_SHM_HEADER(store);
+   EKVS_SHM_BLOCK_AT(store, off)->epoch = header->epoch;
+   _ekvs_shm_push(store, &header->limbo, off, EKVS_SHM_LIMBO);
+}
+
+static int _ekvs_shm_same_key(ekvs store, uint64_t a, uint64_t b)
+{
+   struct _ekvs_shm_entry* first = EKVS_SHM_ENTRY_AT(store, a);
+   struct _ekvs_shm_entry* second = EKVS_SHM_ENTRY_AT(store, b);
+   return first->hash == second->hash && first->key_sz == second->key_sz &&
+      memcmp(store->shm_map + a + EKVS_SHM_ENTRY_OFFSET, store->shm_map + b + EKVS_SHM_ENTRY_OFFSET,
+         (size_t)first->key_sz) == 0;
+}
+
+/* Rebuild everything derived from the block states, after a writer died holding the lock */
+static void _ekvs_shm_recover(ekvs store)
+{
+   struct _ekvs_shm_header* header = EKVS_SHM_HEADER(store);
+   uint64_t* buckets = EKVS_SHM_BUCKETS_AT(store, header->table);
+   uint64_t off;
+   uint32_t i;
+
+   fprintf(stderr, "ekvs: recovering shared store after a writer exited while modifying it.\n");
+   if((header->seq & 1) == 0) EKVS_ATOMIC_STORE(&header->seq, header->seq + 1);
+
+   header->limbo = 0;
+   header->used = 0;
+   header->population = 0;
+   for(i = 0; i < EKVS_SHM_CLASSES; i++) header->free_lists[i] = 0;
+   memset(buckets, 0, (size_t)header->table_sz * sizeof(uint64_t));
+   EKVS_SHM_BLOCK_AT(store, header->table)->state = EKVS_SHM_TABLE;
+
+   header->epoch++;
+   for(off = header->heap_start; off < header->heap_end; off += (uint64_t)1 << EKVS_SHM_BLOCK_AT(store, off)->size_class)
+   {
+      struct _ekvs_shm_block* block = EKVS_SHM_BLOCK_AT(store, off);
+      uint64_t* link;
+
+      switch(block->state)
+      {
+         case EKVS_SHM_ENTRY:
+         {
+            /* Keep the newest entry for each key */
+            link = &buckets[EKVS_SHM_ENTRY_AT(store, off)->hash % header->table_sz];
+            while(*link != 0 && !_ekvs_shm_same_key(store, *link, off)) link = &EKVS_SHM_ENTRY_AT(store, *link)->chain;
+            if(*link == 0)
+            {
+               EKVS_SHM_ENTRY_AT(store, off)->chain = buckets[EKVS_SHM_ENTRY_AT(store, off)->hash % header->table_sz];
+               buckets[EKVS_SHM_ENTRY_AT(store, off)->hash % header->table_sz] = off;
+               header->population++;
+            }
+            else if(EKVS_SHM_BLOCK_AT(store, *link)->epoch < block->epoch)
+            {
+               uint64_t older = *link;
+               EKVS_SHM_ENTRY_AT(store, off)->chain = EKVS_SHM_ENTRY_AT(store, older)->chain;
+               *link = off;
+               _ekvs_shm_retire(store, older);
+            }
+            else
+            {
+               _ekvs_shm_retire(store, off);
+            }
+            header->used += (uint64_t)1 << block->size_class;
+            break;
+         }
+         case EKVS_SHM_TABLE:
+         {
+            /* A table which was being grown */
+            header->used += (uint64_t)1 << block->size_class;
+            if(off != header->table) _ekvs_shm_retire(store, off);
+            break;
+         }
+         case EKVS_SHM_LIMBO:
+         {
+            header->used += (uint64_t)1 << block->size_class;
+            block->link = header->limbo;
+            header->limbo = off;
+            break;
+         }
+         default:
+         {
+            _ekvs_shm_push(store, &header->free_lists[block->size_class], off, EKVS_SHM_FREE);
+            break;
+         }
+      }
+   }
+
+   EKVS_ATOMIC_STORE(&header->seq, header->seq + 1);
+}
+
+static int _ekvs_shm_lock(ekvs store)
+{
+   struct _ekvs_shm_header* header = EKVS_SHM_HEADER(store);
+   int err = pthread_mutex_lock(&header->lock);
+
+   if(err == EOWNERDEAD)
+   {
+      _ekvs_shm_recover(store);
+      pthread_mutex_consistent(&header->lock);
+      err = 0;
+   }
+   return (err == 0 ? EKVS_OK : EKVS_FAIL);
+}
+
+/* Values this handle was given are no longer used */
+static void _ekvs_shm_refresh(ekvs store)
+{
+   struct _ekvs_shm_header* header = EKVS_SHM_HEADER(store);
+   EKVS_ATOMIC_STORE(&header->slots[store->shm_slot - 1].epoch, EKVS_ATOMIC_LOAD(&header->epoch));
+}
+
+static void _ekvs_shm_grow(ekvs store)
+{
+   struct _ekvs_shm_header* header = EKVS_SHM_HEADER(store);
+   uint64_t new_sz = header->table_sz * 2;
+   uint64_t new_table = _ekvs_shm_alloc(store, sizeof(struct _ekvs_shm_block) + new_sz * sizeof(uint64_t));
+   uint64_t* old_buckets = EKVS_SHM_BUCKETS_AT(store, header->table);
+   uint64_t* new_buckets;
+   uint64_t old_table = header->table;
+   uint64_t i;
+
+   /* A full heap leaves the table as it is */
+   if(new_table == 0) return;
+   new_buckets = EKVS_SHM_BUCKETS_AT(store, new_table);
+   memset(new_buckets, 0, (size_t)new_sz * sizeof(uint64_t));
+   EKVS_SHM_BLOCK_AT(store, new_table)->state = EKVS_SHM_TABLE;
+
+   EKVS_ATOMIC_STORE(&header->seq, header->seq + 1);
+   for(i = 0; i < header->table_sz; i++)
+   {
+      while(old_buckets[i] != 0)
+      {
+         uint64_t off = old_buckets[i];
+         struct _ekvs_shm_entry* entry = EKVS_SHM_ENTRY_AT(store, off);
+         old_buckets[i] = entry->chain;
+         entry->chain = new_buckets[entry->hash % new_sz];
+         new_buckets[entry->hash % new_sz] = off;
+      }
+   }
+   header->table = new_table;
+   header->table_sz = new_sz;
+   EKVS_ATOMIC_STORE(&header->seq, header->seq + 1);
+
+   header->epoch++;
+   _ekvs_shm_retire(store, old_table);
+}
+
+int _ekvs_shm_set(ekvs store, uint64_t hash, const char* key, size_t key_sz, const void* data, size_t data_sz)
+{
+   struct _ekvs_shm_header* header = EKVS_SHM_HEADER(store);
+   struct _ekvs_shm_entry* entry;
+   uint64_t* buckets;
+   uint64_t* link;
+   uint64_t off;
+   uint64_t old;
+
+   _ekvs_shm_refresh(store);
+   if(_ekvs_shm_lock(store) != EKVS_OK)
+   {
+      store->last_error = EKVS_FAIL;
+      return EKVS_FAIL;
+   }
+
+   off = _ekvs_shm_alloc(store, EKVS_SHM_ENTRY_OFFSET + key_sz + data_sz);
+   if(off == 0)
+   {
+      pthread_mutex_unlock(&header->lock);
+      store->last_error = EKVS_ALLOCATION_FAIL;
+      return EKVS_ALLOCATION_FAIL;
+   }
+
+   /* Fill the entry before it is linked; its epoch is the one this write ends at */
+   entry = EKVS_SHM_ENTRY_AT(store, off);
+   entry->hash = hash;
+   entry->key_sz = key_sz;
+   entry->data_sz = data_sz;
+   memcpy(store->shm_map + off + EKVS_SHM_ENTRY_OFFSET, key, key_sz);
+   if(data_sz > 0) memcpy(store->shm_map + off + EKVS_SHM_ENTRY_OFFSET + key_sz, data, data_sz);
+   EKVS_SHM_BLOCK_AT(store, off)->epoch = header->epoch + 1;
+
+   buckets = EKVS_SHM_BUCKETS_AT(store, header->table);
+   link = &buckets[hash % header->table_sz];
+   while(*link != 0 && !_ekvs_shm_same_key(store, *link, off)) link = &EKVS_SHM_ENTRY_AT(store, *link)->chain;
+   old = *link;
+
+   EKVS_ATOMIC_STORE(&header->seq, header->seq + 1);
+   EKVS_SHM_BLOCK_AT(store, off)->state = EKVS_SHM_ENTRY;
+   if(old != 0)
+   {
+      entry->chain = EKVS_SHM_ENTRY_AT(store, old)->chain;
+      *link = off;
+   }
+   else
+   {
+      entry->chain = buckets[hash % header->table_sz];
+      buckets[hash % header->table_sz] = off;
+      header->population++;
+   }
+   EKVS_ATOMIC_STORE(&header->seq, header->seq + 1);
+
+   header->epoch++;
+   if(old != 0) _ekvs_shm_retire(store, old);
+
+   if(header->population > (uint64_t)(header->table_sz * header->grow_threshold)) _ekvs_shm_grow(store);
+
+   pthread_mutex_unlock(&header->lock);
+   store->last_error = EKVS_OK;
+   return EKVS_OK;
+}
+
+int _ekvs_shm_del(ekvs store, uint64_t hash, const char* key, size_t key_sz)
+{
+   struct _ekvs_shm_header* header = EKVS_SHM_HEADER(store);
+   uint64_t* link;
+   uint64_t old;
+
+   _ekvs_shm_refresh(store);
+   if(_ekvs_shm_lock(store) != EKVS_OK)
+   {
+      store->last_error = EKVS_FAIL;
+      return EKVS_FAIL;
+   }
+
+   link = &EKVS_SHM_BUCKETS_AT(store, header->table)[hash % header->table_sz];
+   while(*link != 0)
+   {
+      struct _ekvs_shm_entry* entry = EKVS_SHM_ENTRY_AT(store, *link);
+      if(entry->hash == hash && entry->key_sz == key_sz &&
+         memcmp(store->shm_map + *link + EKVS_SHM_ENTRY_OFFSET, key, key_sz) == 0) break;
+      link = &entry->chain;
+   }
+
+   old = *link;
+   if(old == 0)
+   {
+      pthread_mutex_unlock(&header->lock);
+      store->last_error = EKVS_NO_KEY;
+      return EKVS_NO_KEY;
+   }
+
+   EKVS_ATOMIC_STORE(&header->seq, header->seq + 1);
+   *link = EKVS_SHM_ENTRY_AT(store, old)->chain;
+   header->population--;
+   EKVS_ATOMIC_STORE(&header->seq, header->seq + 1);
+
+   header->epoch++;
+   _ekvs_shm_retire(store, old);
+
+   pthread_mutex_unlock(&header->lock);
+   store->last_error = EKVS_OK;
+   return EKVS_OK;
+}
+
+int _ekvs_shm_get(ekvs store, uint64_t hash, const char* key, size_t key_sz, const void** data, size_t* data_sz)
+{
+   struct _ekvs_shm_header* header = EKVS_SHM_HEADER(store);
+   const uint64_t size = store->shm_map_sz;
+   uint64_t seq;
+   uint64_t spins = 0;
+   uint64_t off;
+
+   for(;;)
+   {
+      uint64_t table;
+      uint64_t table_sz;
+      uint64_t probes = 0;
+
+      off = 0;
+      seq = EKVS_ATOMIC_LOAD(&header->seq);
+      if(seq & 1)
+      {
+         /* A writer which stays busy may have exited, the lock tells */
+         if(++spins > 100) sched_yield();
+         if(spins % 1000 == 0)
+         {
+            int err = pthread_mutex_trylock(&header->lock);
+            if(err == EOWNERDEAD)
+            {
+               _ekvs_shm_recover(store);
+               pthread_mutex_consistent(&header->lock);
+            }
+            if(err == 0 || err == EOWNERDEAD) pthread_mutex_unlock(&header->lock);
+         }
+         continue;
+      }
+
+      /* Offsets read while a writer is active may be stale, so every one is bounded by the mapping */
+      table = EKVS_ATOMIC_LOAD(&header->table);
+      table_sz = EKVS_ATOMIC_LOAD(&header->table_sz);
+      if(table_sz != 0 && table >= header->heap_start && table <= size - sizeof(struct _ekvs_shm_block) &&
+         (size - table - sizeof(struct _ekvs_shm_block)) / sizeof(uint64_t) >= table_sz)
+      {
+         off = EKVS_SHM_BUCKETS_AT(store, table)[hash % table_sz];
+      }
+
+      while(off != 0 && probes++ < size / EKVS_SHM_ENTRY_OFFSET)
+      {
+         const struct _ekvs_shm_entry* entry;
+         if(off < header->heap_start || off > size - EKVS_SHM_ENTRY_OFFSET)
+         {
+            off = 0;
+            break;
+         }
+         entry = EKVS_SHM_ENTRY_AT(store, off);
+         if(entry->hash == hash && entry->key_sz == key_sz && key_sz <= size - off - EKVS_SHM_ENTRY_OFFSET &&
+            entry->data_sz <= size - off - EKVS_SHM_ENTRY_OFFSET - key_sz &&
+            memcmp(store->shm_map + off + EKVS_SHM_ENTRY_OFFSET, key, key_sz) == 0)
+         {
+            *data = store->shm_map + off + EKVS_SHM_ENTRY_OFFSET + key_sz;
+            *data_sz = (size_t)entry->data_sz;
+            break;
+         }
+         off = entry->chain;
+      }
+
+      EKVS_BARRIER();
+      if(EKVS_ATOMIC_LOAD(&header->seq) == seq) break;
+   }
+
+   if(off == 0)
+   {
+      *data = NULL;
+      *data_sz = 0;
+      store->cache_stats.misses++;
+      store->last_error = EKVS_NO_KEY;
+      return EKVS_NO_KEY;
+   }
+
+   store->cache_stats.hits++;
+   store->last_error = EKVS_OK;
+   return EKVS_OK;
+}
+
+static int _ekvs_shm_create(char* map, uint64_t size, const ekvs_opts* opts)
+{
+   struct _ekvs_shm_header* header = (struct _ekvs_shm_header*)map;
+   struct _ekvs_shm_block* table;
+   pthread_mutexattr_t attr;
+   uint64_t table_sz = (opts != NULL && opts->initial_table_size != 0 ? opts->initial_table_size : EKVS_INITIAL_TABLE_SIZE);
+   uint32_t size_class = _ekvs_shm_class(sizeof(struct _ekvs_shm_block) + table_sz * sizeof(uint64_t));
+
+   header->version = EKVS_SHM_VERSION;
+   header->size = size;
+   header->grow_threshold = (opts != NULL && opts->grow_threshold > 0.0f ? opts->grow_threshold : EKVS_GROW_THRESHOLD);
+   header->heap_start = (sizeof(struct _ekvs_shm_header) + 63) & ~(uint64_t)63;
+
+   /* The table is the first block, and the new file is already zeroed */
+   if(size_class >= EKVS_SHM_CLASSES || size < header->heap_start || size - header->heap_start < ((uint64_t)1 << size_class))
+   {
+      return EKVS_ALLOCATION_FAIL;
+   }
+   table = (struct _ekvs_shm_block*)(map + header->heap_start);
+   table->state = EKVS_SHM_TABLE;
+   table->size_class = size_class;
+   header->table = header->heap_start;
+   header->table_sz = table_sz;
+   header->heap_end = header->heap_start + ((uint64_t)1 << size_class);
+   header->used = (uint64_t)1 << size_class;
+
+   if(pthread_mutexattr_init(&attr) != 0) return EKVS_FAIL;
+   if(pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED) != 0 ||
+      pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST) != 0 ||
+      pthread_mutex_init(&header->lock, &attr) != 0)
+   {
+      pthread_mutexattr_destroy(&attr);
+      return EKVS_FAIL;
+   }
+   pthread_mutexattr_destroy(&attr);
+
+   /* Processes attaching wait for the magic */
+   EKVS_BARRIER();
+   EKVS_ATOMIC_STORE(&header->magic, EKVS_SHM_MAGIC);
+   return EKVS_OK;
+}
+
+int ekvs_open_shared(ekvs* store, const char* path, uint64_t size, const ekvs_opts* opts)
+{
+   struct _ekvs_shm_header* header;
+   struct stat st;
+   char* map;
+   uint32_t slot;
+   int created = 0;
+   int tries;
+   int fd;
+   int ret;
+   ekvs db;
+
+   if(store == NULL)
+   {
+      fprintf(stderr, "ekvs: NULL store parameter passed to ekvs_open_shared.\n");
+      return EKVS_FAIL;
+   }
+   *store = NULL;
+
+   if(path == NULL)
+   {
+      fprintf(stderr, "ekvs: NULL path parameter passed to ekvs_open_shared.\n");
+      return EKVS_FAIL;
+   }
+
+   if(_ekvs_use_allocators(opts) != EKVS_OK) return EKVS_FAIL;
+
+   /* Only one process creates the segment, the others attach to it */
+   fd = (size != 0 ? open(path, O_RDWR | O_CREAT | O_EXCL, 0600) : -1);
+   if(fd >= 0)
+   {
+      created = 1;
+      if(size < sizeof(struct _ekvs_shm_header) || ftruncate(fd, (off_t)size) != 0)
+      {
+         close(fd);
+         unlink(path);
+         return EKVS_FILE_FAIL;
+      }
+   }
+   else
+   {
+      fd = open(path, O_RDWR);
+      if(fd < 0)
+      {
+         fprintf(stderr, "ekvs: failed to open shared store (%s).\n", path);
+         return EKVS_FILE_FAIL;
+      }
+   }
+
+   if(fstat(fd, &st) != 0 || (uint64_t)st.st_size < sizeof(struct _ekvs_shm_header))
+   {
+      close(fd);
+      return EKVS_FILE_FAIL;
+   }
+
+   map = mmap(NULL, (size_t)st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+   close(fd);
+   if(map == MAP_FAILED) return EKVS_FILE_FAIL;
+   header = (struct _ekvs_shm_header*)map;
+
+   if(created)
+   {
+      ret = _ekvs_shm_create(map, (uint64_t)st.st_size, opts);
+      if(ret != EKVS_OK)
+      {
+         munmap(map, (size_t)st.st_size);
+         unlink(path);
+         return ret;
+      }
+   }
+
+   /* The creator may still be initializing */
+   for(tries = 0; EKVS_ATOMIC_LOAD(&header->magic) != EKVS_SHM_MAGIC && tries < 1000; tries++) usleep(1000);
+   if(EKVS_ATOMIC_LOAD(&header->magic) != EKVS_SHM_MAGIC || header->version != EKVS_SHM_VERSION ||
+      header->size != (uint64_t)st.st_size)
+   {
+      fprintf(stderr, "ekvs: %s is not a shared store.\n", path);
+      munmap(map, (size_t)st.st_size);
+      return EKVS_FILE_FAIL;
+   }
+
+   db = ekvs_malloc(sizeof(struct _ekvs_db));
+   if(db == NULL)
+   {
+      munmap(map, (size_t)st.st_size);
+      return EKVS_ALLOCATION_FAIL;
+   }
+   memset(db, 0, sizeof(struct _ekvs_db));
+   db->shm_map = map;
+   db->shm_map_sz = (size_t)st.st_size;
+
+   /* Claim a slot; slots of exited processes are reaped under the lock */
+   if(_ekvs_shm_lock(db) != EKVS_OK)
+   {
+      _ekvs_shm_close(db);
+      return EKVS_FAIL;
+   }
+   for(slot = 0; slot < EKVS_SHM_SLOTS && header->slots[slot].pid != 0; slot++);
+   if(slot == EKVS_SHM_SLOTS)
+   {
+      _ekvs_shm_reclaim(db);
+      for(slot = 0; slot < EKVS_SHM_SLOTS && header->slots[slot].pid != 0; slot++);
+   }
+   if(slot < EKVS_SHM_SLOTS)
+   {
+      EKVS_ATOMIC_STORE(&header->slots[slot].epoch, header->epoch);
+      EKVS_ATOMIC_STORE(&header->slots[slot].pid, (uint64_t)getpid());
+   }
+   pthread_mutex_unlock(&header->lock);
+
+   if(slot == EKVS_SHM_SLOTS)
+   {
+      fprintf(stderr, "ekvs: too many handles attached to shared store (%s).\n", path);
+      _ekvs_shm_close(db);
+      return EKVS_FAIL;
+   }
+   db->shm_slot = slot + 1;
+   db->last_error = EKVS_OK;
+
+   *store = db;
+   return EKVS_OK;
+}
+
+int ekvs_shared_refresh(ekvs store)
+{
+   if(store == NULL)
+   {
+      fprintf(stderr, "ekvs: NULL store parameter passed to ekvs_shared_refresh.\n");
+      return EKVS_FAIL;
+   }
+
+   if(store->shm_map == NULL)
+   {
+      store->last_error = EKVS_UNSUPPORTED;
+      return EKVS_UNSUPPORTED;
+   }
+
+   _ekvs_shm_refresh(store);
+   store->last_error = EKVS_OK;
+   return EKVS_OK;
+}
+
+void _ekvs_shm_stats(ekvs store, uint64_t* population, uint64_t* table_sz, uint64_t* used)
+{
+   struct _ekvs_shm_header* header = EKVS_SHM_HEADER(store);
+   *population = EKVS_ATOMIC_LOAD(&header->population);
+   *table_sz = EKVS_ATOMIC_LOAD(&header->table_sz);
+   *used = EKVS_ATOMIC_LOAD(&header->used);
+}
+
+void _ekvs_shm_close(ekvs store)
+{
+   struct _ekvs_shm_header* header = EKVS_SHM_HEADER(store);
+   if(store->shm_slot != 0) EKVS_ATOMIC_STORE(&header->slots[store->shm_slot - 1].pid, 0);
+   munmap(store->shm_map, store->shm_map_sz);
+   ekvs_free(store);
+}
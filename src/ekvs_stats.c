@@ -0,0 +1,127 @@
+/* -*- Mode: C; tab-width: 3; c-basic-offset: 3; indent-tabs-mode: nil -*- */
+/* vim: set filetype=C tabstop=3 softtabstop=3 shiftwidth=3 expandtab: */
+
+/* ekvs -- Copyright (C) 2011 GameClay LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "ekvs_internal.h"
+
+#include <time.h>
+
+uint64_t _ekvs_now_ns(void)
+{
+   struct timespec ts;
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+}
+
+void _ekvs_stat_time(uint64_t* total_ns, uint64_t* max_ns, uint64_t start)
+{
+   uint64_t elapsed = _ekvs_now_ns() - start;
+   *total_ns += elapsed;
+   if(elapsed > *max_ns) *max_ns = elapsed;
+}
+
+int ekvs_stats(ekvs store, ekvs_runtime_stats* stats)
+{
+   struct _ekvs_db_entry* entry;
+   uint64_t length;
+   uint64_t i;
+
+   if(store == NULL)
+   {
+      fprintf(stderr, "ekvs: NULL store parameter passed to ekvs_stats.\n");
+      return EKVS_FAIL;
+   }
+
+   if(stats == NULL)
+   {
+      fprintf(stderr, "ekvs: NULL stats parameter passed to ekvs_stats.\n");
+      return EKVS_FAIL;
+   }
+
+   memset(stats, 0, sizeof(ekvs_runtime_stats));
+   stats->population = store->table_population;
+
+   /* Images have no table or write path to report on */
+   if(store->ro_map != NULL)
+   {
+      store->last_error = EKVS_OK;
+      return EKVS_OK;
+   }
+
+   /* Shared stores report the segment, the counters of other handles are not visible */
+   if(store->shm_map != NULL)
+   {
+      uint64_t used;
+      _ekvs_shm_stats(store, &stats->population, &stats->table_size, &used);
+      store->last_error = EKVS_OK;
+      return EKVS_OK;
+   }
+
+   stats->table_size = store->serialized.table_sz;
+   for(i = 0; i < store->serialized.table_sz; i++)
+   {
+      length = 0;
+      for(entry = store->table[i]; entry != NULL; entry = entry->chain)
+      {
+         length++;
+         stats->key_bytes += entry->key_sz;
+         stats->value_bytes += entry->data_sz;
+         if(entry->flags & EKVS_ENTRY_COLLECTION) stats->value_bytes += _ekvs_coll_bytes(entry);
+      }
+      stats->chain_lengths[length < EKVS_STATS_CHAIN_LENGTHS ? length : EKVS_STATS_CHAIN_LENGTHS - 1]++;
+      if(length > stats->max_chain_length) stats->max_chain_length = length;
+   }
+
+   /* Everything else accounted to the store is bookkeeping */
+   if(store->mem_used > stats->key_bytes + stats->value_bytes)
+   {
+      stats->overhead_bytes = store->mem_used - stats->key_bytes - stats->value_bytes;
+   }
+
+   if(store->segment_file != NULL)
+   {
+      stats->binlog_size = store->segment_logged;
+   }
+   else if(store->db_file != NULL)
+   {
+      stats->binlog_size = (uint64_t)(store->serialized.binlog_end - store->serialized.binlog_start);
+   }
+   stats->binlog_bytes = store->stats.binlog_bytes;
+   stats->binlog_records = store->stats.binlog_records;
+   stats->binlog_flushes = store->stats.binlog_flushes;
+   if(store->writer != NULL) stats->binlog_flushes = _ekvs_writer_flushes(store);
+   stats->binlog_write_ns = store->stats.binlog_write_ns;
+   stats->binlog_write_max_ns = store->stats.binlog_write_max_ns;
+   stats->grow_count = store->stats.grow_count;
+   stats->grow_ns = store->stats.grow_ns;
+   stats->grow_max_ns = store->stats.grow_max_ns;
+   stats->snapshot_count = store->stats.snapshot_count;
+   stats->snapshot_ns = store->stats.snapshot_ns;
+   stats->snapshot_max_ns = store->stats.snapshot_max_ns;
+   stats->replica_pending_bytes = _ekvs_replica_pending(store, &stats->replicas);
+   stats->read_view_bytes = store->version_bytes;
+   stats->read_views = store->view_count;
+   stats->checkpoints = store->serialized.checkpoints;
+   stats->dirty_buckets = store->dirty_count;
+   stats->checkpoint_bytes = store->stats.checkpoint_bytes;
+   stats->table_pages = store->table_pages_used;
+   stats->table_numa_policy = store->table_numa_used;
+   if(store->lsm != NULL) _ekvs_lsm_stats(store, stats);
+
+   store->last_error = EKVS_OK;
+   return EKVS_OK;
+}
@@ -0,0 +1,223 @@
+/* -*- Mode: C; tab-width: 3; c-basic-offset: 3; indent-tabs-mode: nil -*- */
+/* vim: set filetype=C tabstop=3 softtabstop=3 shiftwidth=3 expandtab: */
+
+/* ekvs -- Copyright (C) 2011 GameClay LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "ekvs_internal.h"
+
+#include <time.h>
+
+/* The ring is written by any number of stores without locks. A writer claims
+ * a sequence number, clears the slot's stamp, copies the event, and then stamps
+ * the slot with sequence + 1. Readers only take slots whose stamp matches the
+ * sequence they expect, before and after copying. */
+struct _ekvs_trace_slot {
+   volatile uint64_t stamp;
+   ekvs_trace_event event;
+};
+
+struct _ekvs_trace_ring {
+   volatile uint64_t next;
+   uint64_t mask;
+   struct _ekvs_trace_slot* slots;
+};
+
+static const char* _ekvs_trace_names[ekvs_trace_event_types] = {
+   "get", "set", "del", "binlog_write", "binlog_flush", "grow", "snapshot", "evict"
+};
+
+uint64_t _ekvs_ticks(void)
+{
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+   uint32_t lo, hi;
+   __asm__ __volatile__("rdtsc" : "=a"(lo), "=d"(hi));
+   return ((uint64_t)hi << 32) | lo;
+#else
+   return _ekvs_now_ns();
+#endif
+}
+
+double ekvs_trace_ticks_per_us(void)
+{
+   static double ticks_per_us = 0;
+   uint64_t start_ns, start_ticks, end_ns;
+
+   if(ticks_per_us == 0)
+   {
+      /* Spin for a millisecond against the monotonic clock */
+      start_ns = _ekvs_now_ns();
+      start_ticks = _ekvs_ticks();
+      do { end_ns = _ekvs_now_ns(); } while(end_ns - start_ns < 1000000);
+      ticks_per_us = (double)(_ekvs_ticks() - start_ticks) * 1000.0 / (double)(end_ns - start_ns);
+   }
+   return ticks_per_us;
+}
+
+uint64_t _ekvs_hash(const char* key, size_t key_sz)
+{
+   uint32_t pc = 0, pb = 0;
+   hashlittle2(key, key_sz, &pc, &pb);
+   return pc + (((uint64_t)pb) << 32);
+}
+
+/* Entries compared to find the key, or the whole chain if it is missing */
+uint64_t _ekvs_trace_probes(ekvs store, uint64_t hash, const char* key, size_t key_sz)
+{
+   struct _ekvs_db_entry* entry;
+   uint64_t probes = 0;
+
+   if(store->table == NULL) return 0;
+   for(entry = store->table[hash % store->serialized.table_sz]; entry != NULL; entry = entry->chain)
+   {
+      probes++;
+      if(entry->key_sz == key_sz && memcmp(entry->key_data, key, key_sz) == 0) break;
+   }
+   return probes;
+}
+
+void _ekvs_trace(ekvs store, uint32_t type, uint64_t hash, uint64_t start, uint64_t probes, uint64_t bytes)
+{
+   ekvs_trace_event event;
+
+   event.type = type;
+   event.hash = hash;
+   event.start = start;
+   event.duration = _ekvs_ticks() - start;
+   event.probes = probes;
+   event.bytes = bytes;
+   store->trace_callback(store->trace_ctx, &event);
+}
+
+int ekvs_trace_ring_create(ekvs_trace_ring* ring, size_t capacity)
+{
+   ekvs_trace_ring new_ring;
+   uint64_t slots = 1;
+
+   if(ring == NULL)
+   {
+      fprintf(stderr, "ekvs: NULL ring parameter passed to ekvs_trace_ring_create.\n");
+      return EKVS_FAIL;
+   }
+   *ring = NULL;
+
+   while(slots < capacity) slots <<= 1;
+
+   new_ring = ekvs_malloc(sizeof(struct _ekvs_trace_ring));
+   if(new_ring == NULL) return EKVS_ALLOCATION_FAIL;
+   new_ring->slots = ekvs_malloc((size_t)slots * sizeof(struct _ekvs_trace_slot));
+   if(new_ring->slots == NULL)
+   {
+      ekvs_free(new_ring);
+      return EKVS_ALLOCATION_FAIL;
+   }
+   memset(new_ring->slots, 0, (size_t)slots * sizeof(struct _ekvs_trace_slot));
+   new_ring->next = 0;
+   new_ring->mask = slots - 1;
+
+   /* Calibrate now rather than during a dump */
+   ekvs_trace_ticks_per_us();
+
+   *ring = new_ring;
+   return EKVS_OK;
+}
+
+void ekvs_trace_ring_destroy(ekvs_trace_ring ring)
+{
+   if(ring == NULL) return;
+   ekvs_free(ring->slots);
+   ekvs_free(ring);
+}
+
+void ekvs_trace_ring_record(void* ctx, const ekvs_trace_event* event)
+{
+   ekvs_trace_ring ring = ctx;
+   uint64_t seq = EKVS_FETCH_ADD(&ring->next, 1);
+   struct _ekvs_trace_slot* slot = &ring->slots[seq & ring->mask];
+
+   slot->stamp = 0;
+   EKVS_BARRIER();
+   memcpy(&slot->event, event, sizeof(ekvs_trace_event));
+   EKVS_BARRIER();
+   slot->stamp = seq + 1;
+}
+
+/* Copy out the event with sequence number seq, unless it was overwritten or is being written */
+static int _ekvs_trace_ring_read(ekvs_trace_ring ring, uint64_t seq, ekvs_trace_event* event)
+{
+   struct _ekvs_trace_slot* slot = &ring->slots[seq & ring->mask];
+   uint64_t stamp = slot->stamp;
+
+   EKVS_BARRIER();
+   memcpy(event, &slot->event, sizeof(ekvs_trace_event));
+   EKVS_BARRIER();
+   return (stamp == seq + 1 && slot->stamp == stamp && event->type < ekvs_trace_event_types);
+}
+
+int ekvs_trace_ring_dump(ekvs_trace_ring ring, const char* path)
+{
+   FILE* out;
+   ekvs_trace_event event;
+   uint64_t first_seq, next, seq;
+   uint64_t origin = 0;
+   double ticks_per_us = ekvs_trace_ticks_per_us();
+   int first = 1;
+
+   if(ring == NULL)
+   {
+      fprintf(stderr, "ekvs: NULL ring parameter passed to ekvs_trace_ring_dump.\n");
+      return EKVS_FAIL;
+   }
+
+   if(path == NULL)
+   {
+      fprintf(stderr, "ekvs: NULL path parameter passed to ekvs_trace_ring_dump.\n");
+      return EKVS_FAIL;
+   }
+
+   out = fopen(path, "w");
+   if(out == NULL)
+   {
+      fprintf(stderr, "ekvs: failed to create trace file (%s).\n", path);
+      return EKVS_FILE_FAIL;
+   }
+
+   /* Operations are recorded after the events they enclose, so find the earliest start first */
+   next = ring->next;
+   first_seq = (next > ring->mask ? next - ring->mask - 1 : 0);
+   for(seq = first_seq; seq < next; seq++)
+   {
+      if(!_ekvs_trace_ring_read(ring, seq, &event)) continue;
+      if(origin == 0 || event.start < origin) origin = event.start;
+   }
+
+   /* Complete ("X") events nest by time on one track, so an operation encloses its internal events */
+   fprintf(out, "{\"displayTimeUnit\": \"ns\", \"traceEvents\": [");
+   for(seq = first_seq; seq < next; seq++)
+   {
+      if(!_ekvs_trace_ring_read(ring, seq, &event)) continue;
+      fprintf(out, "%s\n{\"name\": \"%s\", \"cat\": \"ekvs\", \"ph\": \"X\", \"pid\": 1, \"tid\": 1, "
+         "\"ts\": %.3f, \"dur\": %.3f, \"args\": {\"hash\": \"%08lx%08lx\", \"probes\": %lu, \"bytes\": %lu}}",
+         (first ? "" : ","), _ekvs_trace_names[event.type],
+         (double)(event.start > origin ? event.start - origin : 0) / ticks_per_us, (double)event.duration / ticks_per_us,
+         (unsigned long)(event.hash >> 32), (unsigned long)(event.hash & 0xffffffff),
+         (unsigned long)event.probes, (unsigned long)event.bytes);
+      first = 0;
+   }
+   fprintf(out, "\n]}\n");
+
+   if(fclose(out) != 0) return EKVS_FILE_FAIL;
+   return EKVS_OK;
+}
@@ -0,0 +1,432 @@
+/* -*- Mode: C; tab-width: 3; c-basic-offset: 3; indent-tabs-mode: nil -*- */
+/* vim: set filetype=C tabstop=3 softtabstop=3 shiftwidth=3 expandtab: */
+
+/* ekvs -- Copyright (C) 2011 GameClay LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include "ekvs_internal.h"
+
+/* Read views see the database as it was when they were opened. Entries carry no
+ * version; instead, the first time a key is changed after the newest view was
+ * opened, its value (or its absence) is copied into a version record stamped
+ * with store->version, which is advanced by every ekvs_view_open. A view opened
+ * at version v reads a key from the oldest record stamped after v, or from the
+ * table if there is none. Records no open view can need are freed as views
+ * close, and all of them once the last one does. */
+
+#define EKVS_VIEW_INITIAL_BUCKETS 64
+
+struct _ekvs_read_view {
+   ekvs store;
+   uint64_t version;
+   int broken;                   /* A value this view needed could not be kept */
+   struct _ekvs_read_view* next; /* Next older view */
+};
+
+/* A value as it was before store->version reached superseded */
+struct _ekvs_version {
+   struct _ekvs_version* chain;
+   uint64_t hash;
+   uint64_t superseded;
+   char present;                 /* 0 if the key did not exist */
+   char collection;              /* The data is a flattened list or set */
+   size_t key_sz;
+   size_t data_sz;
+   char key_data[1];
+};
+
+#define EKVS_VERSION_SIZE(key_sz, data_sz) (sizeof(struct _ekvs_version) + (key_sz) + (data_sz) - 1)
+
+static int _ekvs_version_is(const struct _ekvs_version* version, uint64_t hash, const char* key, size_t key_sz)
+{
+   return version->hash == hash && version->key_sz == key_sz && memcmp(version->key_data, key, key_sz) == 0;
+}
+
+/* The record a view opened at the given version reads the key from, or NULL to read the table */
+static const struct _ekvs_version* _ekvs_version_find(ekvs store, uint64_t view_version, uint64_t hash,
+   const char* key, size_t key_sz)
+{
+   const struct _ekvs_version* found = NULL;
+   const struct _ekvs_version* version;
+
+   for(version = store->versions[hash & (store->versions_sz - 1)]; version != NULL; version = version->chain)
+   {
+      if(version->superseded > view_version && (found == NULL || version->superseded < found->superseded) &&
+         _ekvs_version_is(version, hash, key, key_sz))
+      {
+         found = version;
+      }
+   }
+   return found;
+}
+
+static void _ekvs_version_grow(ekvs store)
+{
+   uint64_t new_sz = store->versions_sz * 2;
+   struct _ekvs_version** buckets = ekvs_malloc((size_t)new_sz * sizeof(struct _ekvs_version*));
+   uint64_t i;
+
+   /* Longer chains are only slower */
+   if(buckets == NULL) return;
+   memset(buckets, 0, (size_t)new_sz * sizeof(struct _ekvs_version*));
+   for(i = 0; i < store->versions_sz; i++)
+   {
+      while(store->versions[i] != NULL)
+      {
+         struct _ekvs_version* version = store->versions[i];
+         store->versions[i] = version->chain;
+         version->chain = buckets[version->hash & (new_sz - 1)];
+         buckets[version->hash & (new_sz - 1)] = version;
+      }
+   }
+   ekvs_free(store->versions);
+   store->versions = buckets;
+   store->versions_sz = new_sz;
+}
+
+void _ekvs_view_preserve(ekvs store, uint64_t hash, const char* key, size_t key_sz)
+{
+   struct _ekvs_version* version;
+   struct _ekvs_db_entry* entry;
+   struct _ekvs_read_view* view;
+   const void* data = NULL;
+   size_t data_sz = 0;
+   char* scratch = store->scratch;
+   size_t scratch_sz = store->scratch_sz;
+
+   /* Only the first change since the newest view was opened is kept */
+   for(version = store->versions[hash & (store->versions_sz - 1)]; version != NULL; version = version->chain)
+   {
+      if(version->superseded > store->views->version && _ekvs_version_is(version, hash, key, key_sz)) return;
+   }
+
+   /* Resolving the value may need the scratch buffer, which the caller may be using */
+   entry = _ekvs_retrieve(store, hash, key, key_sz);
+   if(entry != NULL)
+   {
+      store->scratch = NULL;
+      store->scratch_sz = 0;
+      data = _ekvs_entry_value(store, entry, &data_sz);
+   }
+
+   version = (entry == NULL || data != NULL || data_sz == 0 ? ekvs_malloc(EKVS_VERSION_SIZE(key_sz, data_sz)) : NULL);
+   if(version != NULL)
+   {
+      version->hash = hash;
+      version->superseded = store->version;
+      version->present = (entry != NULL);
+      version->collection = (entry != NULL && (entry->flags & EKVS_ENTRY_COLLECTION) ? 1 : 0);
+      version->key_sz = key_sz;
+      version->data_sz = data_sz;
+      memcpy(version->key_data, key, key_sz);
+      if(data_sz > 0) memcpy(&version->key_data[key_sz], data, data_sz);
+      version->chain = store->versions[hash & (store->versions_sz - 1)];
+      store->versions[hash & (store->versions_sz - 1)] = version;
+      store->version_bytes += EKVS_VERSION_SIZE(key_sz, data_sz);
+      if(++store->version_count > store->versions_sz) _ekvs_version_grow(store);
+   }
+   else
+   {
+      /* Every open view predates the change, none of them can be answered correctly now */
+      for(view = store->views; view != NULL; view = view->next) view->broken = 1;
+   }
+
+   if(entry != NULL)
+   {
+      ekvs_free(store->scratch);
+      store->scratch = scratch;
+      store->scratch_sz = scratch_sz;
+   }
+}
+
+/* Free the records no view opened after oldest could read */
+static void _ekvs_version_collect(ekvs store, uint64_t oldest)
+{
+   uint64_t i;
+   for(i = 0; i < store->versions_sz; i++)
+   {
+      struct _ekvs_version** link = &store->versions[i];
+      while(*link != NULL)
+      {
+         struct _ekvs_version* version = *link;
+         if(version->superseded <= oldest)
+         {
+            *link = version->chain;
+            store->version_bytes -= EKVS_VERSION_SIZE(version->key_sz, version->data_sz);
+            store->version_count--;
+            ekvs_free(version);
+         }
+         else
+         {
+            link = &version->chain;
+         }
+      }
+   }
+}
+
+int ekvs_view_open(ekvs store, ekvs_read_view* view)
+{
+   struct _ekvs_read_view* new_view;
+
+   if(store == NULL)
+   {
+      fprintf(stderr, "ekvs: NULL store parameter passed to ekvs_view_open.\n");
+      return EKVS_FAIL;
+   }
+
+   if(view == NULL)
+   {
+      fprintf(stderr, "ekvs: NULL view parameter passed to ekvs_view_open.\n");
+      return EKVS_FAIL;
+   }
+   *view = NULL;
+
+   /* Images never change, and shared stores are changed by other processes */
+   if(store->ro_map != NULL || store->shm_map != NULL || store->lsm != NULL)
+   {
+      store->last_error = EKVS_UNSUPPORTED;
+      return EKVS_UNSUPPORTED;
+   }
+
+   if(store->versions == NULL)
+   {
+      store->versions = ekvs_malloc(EKVS_VIEW_INITIAL_BUCKETS * sizeof(struct _ekvs_version*));
+      if(store->versions == NULL)
+      {
+         store->last_error = EKVS_ALLOCATION_FAIL;
+         return EKVS_ALLOCATION_FAIL;
+      }
+      memset(store->versions, 0, EKVS_VIEW_INITIAL_BUCKETS * sizeof(struct _ekvs_version*));
+      store->versions_sz = EKVS_VIEW_INITIAL_BUCKETS;
+   }
+
+   new_view = ekvs_malloc(sizeof(struct _ekvs_read_view));
+   if(new_view == NULL)
+   {
+      store->last_error = EKVS_ALLOCATION_FAIL;
+      return EKVS_ALLOCATION_FAIL;
+   }
+
+   /* Changes from here on are stamped after this view */
+   new_view->store = store;
+   new_view->version = store->version++;
+   new_view->broken = 0;
+   new_view->next = store->views;
+   store->views = new_view;
+   store->view_count++;
+
+   *view = new_view;
+   store->last_error = EKVS_OK;
+   return EKVS_OK;
+}
+
+int ekvs_view_get(ekvs_read_view view, const char* key, const void** data, size_t* data_sz)
+{
+   const struct _ekvs_version* version;
+   ekvs store;
+   uint64_t hash;
+   size_t key_sz;
+
+   if(view == NULL)
+   {
+      fprintf(stderr, "ekvs: NULL view parameter passed to ekvs_view_get.\n");
+      return EKVS_FAIL;
+   }
+
+   if(key == NULL)
+   {
+      fprintf(stderr, "ekvs: NULL key parameter passed to ekvs_view_get.\n");
+      return EKVS_FAIL;
+   }
+
+   if(data == NULL || data_sz == NULL)
+   {
+      fprintf(stderr, "ekvs: NULL data or data_sz parameter passed to ekvs_view_get.\n");
+      return EKVS_FAIL;
+   }
+
+   store = view->store;
+   if(view->broken)
+   {
+      store->last_error = EKVS_ALLOCATION_FAIL;
+      return EKVS_ALLOCATION_FAIL;
+   }
+
+   key_sz = strlen(key);
+   hash = _ekvs_hash(key, key_sz);
+   version = _ekvs_version_find(store, view->version, hash, key, key_sz);
+   if(version == NULL) return _ekvs_get(store, hash, key, key_sz, data, data_sz, NULL);
+
+   if(!version->present)
+   {
+      *data = NULL;
+      *data_sz = 0;
+      store->last_error = EKVS_NO_KEY;
+      return EKVS_NO_KEY;
+   }
+
+   /* As ekvs_get */
+   if(version->collection)
+   {
+      *data = NULL;
+      *data_sz = 0;
+      store->last_error = EKVS_WRONG_TYPE;
+      return EKVS_WRONG_TYPE;
+   }
+
+   *data = &version->key_data[key_sz];
+   *data_sz = version->data_sz;
+   store->last_error = EKVS_OK;
+   return EKVS_OK;
+}
+
+int ekvs_view_iterate(ekvs_read_view view, ekvs_view_iter_ptr callback, void* ctx)
+{
+   const struct _ekvs_version* version;
+   struct _ekvs_db_entry* entry;
+   ekvs store;
+   uint64_t i;
+
+   if(view == NULL)
+   {
+      fprintf(stderr, "ekvs: NULL view parameter passed to ekvs_view_iterate.\n");
+      return EKVS_FAIL;
+   }
+
+   if(callback == NULL)
+   {
+      fprintf(stderr, "ekvs: NULL callback parameter passed to ekvs_view_iterate.\n");
+      return EKVS_FAIL;
+   }
+
+   store = view->store;
+   if(view->broken)
+   {
+      store->last_error = EKVS_ALLOCATION_FAIL;
+      return EKVS_ALLOCATION_FAIL;
+   }
+
+   /* Keys in the table, as they were */
+   for(i = 0; i < store->serialized.table_sz; i++)
+   {
+      for(entry = store->table[i]; entry != NULL; entry = entry->chain)
+      {
+         const void* data;
+         size_t data_sz;
+         uint64_t hash = _ekvs_hash(entry->key_data, entry->key_sz);
+
+         version = _ekvs_version_find(store, view->version, hash, entry->key_data, entry->key_sz);
+         if(version != NULL)
+         {
+            if(!version->present) continue;
+            data = &version->key_data[version->key_sz];
+            data_sz = version->data_sz;
+         }
+         else
+         {
+            data = _ekvs_entry_value(store, entry, &data_sz);
+            if(data == NULL && data_sz != 0)
+            {
+               store->last_error = EKVS_FILE_FAIL;
+               return EKVS_FILE_FAIL;
+            }
+         }
+
+         if(callback(ctx, entry->key_data, entry->key_sz, data, data_sz) != 0)
+         {
+            store->last_error = EKVS_OK;
+            return EKVS_OK;
+         }
+      }
+   }
+
+   /* Then keys which have been deleted since */
+   for(i = 0; i < store->versions_sz; i++)
+   {
+      for(version = store->versions[i]; version != NULL; version = version->chain)
+      {
+         if(!version->present || version->superseded <= view->version ||
+            _ekvs_version_find(store, view->version, version->hash, version->key_data, version->key_sz) != version ||
+            _ekvs_retrieve(store, version->hash, version->key_data, version->key_sz) != NULL)
+         {
+            continue;
+         }
+
+         if(callback(ctx, version->key_data, version->key_sz, &version->key_data[version->key_sz], version->data_sz) != 0)
+         {
+            store->last_error = EKVS_OK;
+            return EKVS_OK;
+         }
+      }
+   }
+
+   store->last_error = EKVS_OK;
+   return EKVS_OK;
+}
+
+void ekvs_view_close(ekvs_read_view view)
+{
+   struct _ekvs_read_view** link;
+   ekvs store;
+
+   if(view == NULL) return;
+
+   store = view->store;
+   link = &store->views;
+   while(*link != view) link = &(*link)->next;
+   *link = view->next;
+   store->view_count--;
+   ekvs_free(view);
+
+   /* The oldest view left is the last one */
+   if(store->views == NULL)
+   {
+      _ekvs_view_close_all(store);
+   }
+   else
+   {
+      for(view = store->views; view->next != NULL; view = view->next);
+      _ekvs_version_collect(store, view->version);
+   }
+}
+
+void _ekvs_view_close_all(ekvs store)
+{
+   uint64_t i;
+
+   while(store->views != NULL)
+   {
+      struct _ekvs_read_view* view = store->views;
+      store->views = view->next;
+      ekvs_free(view);
+   }
+   store->view_count = 0;
+
+   for(i = 0; i < store->versions_sz; i++)
+   {
+      while(store->versions[i] != NULL)
+      {
+         struct _ekvs_version* version = store->versions[i];
+         store->versions[i] = version->chain;
+         ekvs_free(version);
+      }
+   }
+   ekvs_free(store->versions);
+   store->versions = NULL;
+   store->versions_sz = 0;
+   store->version_count = 0;
+   store->version_bytes = 0;
+}
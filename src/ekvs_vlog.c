@@ -0,0 +1,370 @@
+/* -*- Mode: C; tab-width: 3; c-basic-offset: 3; indent-tabs-mode: nil -*- */
+/* vim: set filetype=C tabstop=3 softtabstop=3 shiftwidth=3 expandtab: */
+
+/* ekvs -- Copyright (C) 2011 GameClay LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "ekvs_internal.h"
+
+#include <sys/mman.h>
+#include <unistd.h>
+
+/* The value log is an append-only file of [key_sz][data_sz][key][data] records.
+ * Table entries reference the data of a record by offset, and the key is kept
+ * so that garbage collection can be done by walking the table. Each collection
+ * writes a new generation, named <prefix>.<generation>. */
+
+static char* _ekvs_vlog_fname(ekvs store, uint64_t gen)
+{
+   char* fname = ekvs_malloc(strlen(store->vlog_prefix) + 22);
+   if(fname != NULL) sprintf(fname, "%s.%lu", store->vlog_prefix, (unsigned long)gen);
+   return fname;
+}
+
+static int _ekvs_vlog_open(ekvs store)
+{
+   char* fname;
+
+   if(store->vlog_file != NULL) return EKVS_OK;
+   if(store->vlog_prefix == NULL) return EKVS_FILE_FAIL;
+
+   fname = _ekvs_vlog_fname(store, store->serialized.vlog_gen);
+   if(fname == NULL) return EKVS_ALLOCATION_FAIL;
+
+   store->vlog_file = fopen(fname, "rb+");
+   if(store->vlog_file == NULL) store->vlog_file = fopen(fname, "wb+");
+   ekvs_free(fname);
+
+   if(store->vlog_file == NULL)
+   {
+      fprintf(stderr, "ekvs: failed to open value log (%s).\n", store->vlog_prefix);
+      return EKVS_FILE_FAIL;
+   }
+
+   if(fseek(store->vlog_file, 0, SEEK_END) != 0) return EKVS_FILE_FAIL;
+   store->vlog_end = (uint64_t)ftell(store->vlog_file);
+   store->vlog_synced = 0;
+   if(store->writer != NULL) _ekvs_writer_set_vlog(store);
+   return EKVS_OK;
+}
+
+/* Retire the current mapping; pointers into it stay valid until _ekvs_vlog_release_maps */
+static void _ekvs_vlog_retire_map(ekvs store)
+{
+   struct _ekvs_vlog_map* old_map;
+
+   if(store->vlog_map == NULL) return;
+
+   old_map = ekvs_malloc(sizeof(struct _ekvs_vlog_map));
+   if(old_map == NULL)
+   {
+      /* Leaking the mapping is preferable to invalidating a caller's pointer */
+      store->vlog_map = NULL;
+      store->vlog_map_sz = 0;
+      return;
+   }
+   old_map->base = store->vlog_map;
+   old_map->size = store->vlog_map_sz;
+   old_map->next = store->vlog_old_maps;
+   store->vlog_old_maps = old_map;
+   store->vlog_map = NULL;
+   store->vlog_map_sz = 0;
+}
+
+int _ekvs_vlog_append(ekvs store, const char* key, size_t key_sz, const void* data, size_t data_sz,
+   struct _ekvs_vlog_ptr* ptr)
+{
+   uint64_t header[2];
+   int ret = _ekvs_vlog_open(store);
+   if(ret != EKVS_OK) return ret;
+
+   header[0] = key_sz;
+   header[1] = data_sz;
+
+   if(fseek(store->vlog_file, (long)store->vlog_end, SEEK_SET) != 0) return EKVS_FILE_FAIL;
+   if(fwrite(header, sizeof(header), 1, store->vlog_file) != 1) return EKVS_FILE_FAIL;
+   if(fwrite(key, 1, key_sz, store->vlog_file) != key_sz) return EKVS_FILE_FAIL;
+   if(fwrite(data, 1, data_sz, store->vlog_file) != data_sz) return EKVS_FILE_FAIL;
+
+   /* The value must be readable before anything can reference it. It is only on disk
+    * once _ekvs_vlog_sync (or the binlog writer) has synced it. */
+   if(fflush(store->vlog_file) != 0) return EKVS_FILE_FAIL;
+
+   ptr->offset = store->vlog_end + sizeof(header) + key_sz;
+   ptr->size = data_sz;
+   store->vlog_end = ptr->offset + data_sz;
+   return EKVS_OK;
+}
+
+/* Values must be on disk before binlog records or snapshots which point at them */
+int _ekvs_vlog_sync(ekvs store)
+{
+   if(store->vlog_file == NULL || store->vlog_synced == store->vlog_end) return EKVS_OK;
+   if(fdatasync(fileno(store->vlog_file)) != 0) return EKVS_FILE_FAIL;
+   store->vlog_synced = store->vlog_end;
+   return EKVS_OK;
+}
+
+const void* _ekvs_vlog_read(ekvs store, const struct _ekvs_vlog_ptr* ptr)
+{
+   uint64_t needed = ptr->offset + ptr->size;
+
+   if(ptr->size == 0) return NULL;
+   if(_ekvs_vlog_open(store) != EKVS_OK) return NULL;
+   if(needed > store->vlog_end) return NULL;
+
+   if(needed > store->vlog_map_sz)
+   {
+      /* Grow the mapping geometrically, it is allowed to extend past the end of the file */
+      size_t page_sz = (size_t)sysconf(_SC_PAGESIZE);
+      size_t map_sz = (store->vlog_map_sz != 0 ? store->vlog_map_sz : page_sz);
+      void* map;
+      while(map_sz < needed) map_sz *= 2;
+
+      map = mmap(NULL, map_sz, PROT_READ, MAP_SHARED, fileno(store->vlog_file), 0);
+      if(map == MAP_FAILED) return NULL;
+
+      _ekvs_vlog_retire_map(store);
+      store->vlog_map = map;
+      store->vlog_map_sz = map_sz;
+   }
+
+   return store->vlog_map + ptr->offset;
+}
+
+/* Pinned values may point into any mapping, current or retired */
+static int _ekvs_vlog_pinned(ekvs store)
+{
+   uint64_t i;
+   struct _ekvs_db_entry* entry;
+
+   for(entry = store->retired; entry != NULL; entry = entry->chain)
+   {
+      if(entry->flags & EKVS_ENTRY_VLOG) return 1;
+   }
+
+   for(i = 0; i < store->serialized.table_sz; i++)
+   {
+      for(entry = store->table[i]; entry != NULL; entry = entry->chain)
+      {
+         if((entry->flags & EKVS_ENTRY_VLOG) && entry->refs > 0) return 1;
+      }
+   }
+   return 0;
+}
+
+static void _ekvs_vlog_release_maps(ekvs store)
+{
+   struct _ekvs_vlog_map* old_map;
+
+   while(store->vlog_old_maps != NULL)
+   {
+      old_map = store->vlog_old_maps;
+      store->vlog_old_maps = old_map->next;
+      munmap(old_map->base, old_map->size);
+      ekvs_free(old_map);
+   }
+}
+
+void _ekvs_vlog_close(ekvs store)
+{
+   _ekvs_vlog_retire_map(store);
+   _ekvs_vlog_release_maps(store);
+
+   if(store->vlog_file != NULL) fclose(store->vlog_file);
+   store->vlog_file = NULL;
+   store->vlog_end = 0;
+   store->vlog_synced = 0;
+}
+
+int ekvs_vlog_gc(ekvs store)
+{
+   uint64_t i;
+   uint64_t old_gen;
+   uint64_t new_end = 0;
+   uint64_t old_end;
+   uint64_t count = 0;
+   uint64_t* old_offsets = NULL;
+   uint64_t header[2];
+   struct _ekvs_db_entry* entry;
+   struct _ekvs_vlog_ptr ptr;
+   const void* data;
+   char* new_fname = NULL;
+   char* old_fname = NULL;
+   FILE* new_file = NULL;
+   FILE* old_file;
+   int ret;
+
+   if(store == NULL)
+   {
+      fprintf(stderr, "ekvs: NULL store parameter passed to ekvs_vlog_gc.\n");
+      return EKVS_FAIL;
+   }
+
+   if(store->ro_map != NULL)
+   {
+      store->last_error = EKVS_READ_ONLY;
+      return EKVS_READ_ONLY;
+   }
+
+   if(store->shm_map != NULL || store->lsm != NULL)
+   {
+      store->last_error = EKVS_UNSUPPORTED;
+      return EKVS_UNSUPPORTED;
+   }
+
+   if(store->vlog_prefix == NULL)
+   {
+      fprintf(stderr, "ekvs: ekvs_vlog_gc requires a value log.\n");
+      store->last_error = EKVS_FAIL;
+      return EKVS_FAIL;
+   }
+
+   old_gen = store->serialized.vlog_gen;
+   new_fname = _ekvs_vlog_fname(store, old_gen + 1);
+   old_fname = _ekvs_vlog_fname(store, old_gen);
+   if(new_fname == NULL || old_fname == NULL) goto ekvs_vlog_gc_alloc_err;
+
+   new_file = fopen(new_fname, "wb+");
+   if(new_file == NULL) goto ekvs_vlog_gc_err;
+
+   /* Copy live values. The table is not modified until everything has been written. */
+   for(i = 0; i < store->serialized.table_sz; i++)
+   {
+      for(entry = store->table[i]; entry != NULL; entry = entry->chain)
+      {
+         if((entry->flags & EKVS_ENTRY_VLOG) == 0) continue;
+
+         memcpy(&ptr, &entry->key_data[entry->key_sz], sizeof(ptr));
+         data = _ekvs_vlog_read(store, &ptr);
+         if(data == NULL) goto ekvs_vlog_gc_err;
+
+         header[0] = entry->key_sz;
+         header[1] = ptr.size;
+         if(fwrite(header, sizeof(header), 1, new_file) != 1) goto ekvs_vlog_gc_err;
+         if(fwrite(entry->key_data, 1, entry->key_sz, new_file) != entry->key_sz) goto ekvs_vlog_gc_err;
+         if(fwrite(data, 1, (size_t)ptr.size, new_file) != ptr.size) goto ekvs_vlog_gc_err;
+         new_end += sizeof(header) + entry->key_sz + ptr.size;
+         count++;
+      }
+   }
+   /* The snapshot below will reference the new generation, so it must be on disk first */
+   if(fflush(new_file) != 0 || fdatasync(fileno(new_file)) != 0) goto ekvs_vlog_gc_err;
+
+   /* Keep the old offsets, in table order, to put back if the snapshot fails */
+   if(count != 0)
+   {
+      old_offsets = ekvs_malloc((size_t)count * sizeof(uint64_t));
+      if(old_offsets == NULL) goto ekvs_vlog_gc_alloc_err;
+   }
+
+   /* The writer syncs the value log with each batch, so it must be idle while the file changes */
+   if(store->writer != NULL && _ekvs_writer_drain(store) != EKVS_OK) goto ekvs_vlog_gc_err;
+
+   /* Point the table at the new generation */
+   new_end = 0;
+   count = 0;
+   for(i = 0; i < store->serialized.table_sz; i++)
+   {
+      for(entry = store->table[i]; entry != NULL; entry = entry->chain)
+      {
+         if((entry->flags & EKVS_ENTRY_VLOG) == 0) continue;
+
+         memcpy(&ptr, &entry->key_data[entry->key_sz], sizeof(ptr));
+         old_offsets[count++] = ptr.offset;
+         ptr.offset = new_end + sizeof(header) + entry->key_sz;
+         memcpy(&entry->key_data[entry->key_sz], &ptr, sizeof(ptr));
+         new_end = ptr.offset + ptr.size;
+      }
+   }
+
+   /* Old mappings stay alive (and valid) until the collection has succeeded */
+   _ekvs_vlog_retire_map(store);
+   old_file = store->vlog_file;
+   old_end = store->vlog_end;
+   store->vlog_file = new_file;
+   store->vlog_end = store->vlog_synced = new_end;
+   store->serialized.vlog_gen = old_gen + 1;
+   if(store->writer != NULL) _ekvs_writer_set_vlog(store);
+
+   /* The binlog references the old generation; replace it with a snapshot before removing the old file */
+   ret = (store->db_fname != NULL ? ekvs_snapshot(store, NULL) : EKVS_OK);
+   if(ret != EKVS_OK)
+   {
+      /* Go back to the old generation, which the database still references */
+      count = 0;
+      for(i = 0; i < store->serialized.table_sz; i++)
+      {
+         for(entry = store->table[i]; entry != NULL; entry = entry->chain)
+         {
+            if((entry->flags & EKVS_ENTRY_VLOG) == 0) continue;
+
+            memcpy(&ptr, &entry->key_data[entry->key_sz], sizeof(ptr));
+            ptr.offset = old_offsets[count++];
+            memcpy(&entry->key_data[entry->key_sz], &ptr, sizeof(ptr));
+         }
+      }
+      _ekvs_vlog_retire_map(store);
+      store->vlog_file = old_file;
+      store->vlog_end = old_end;
+      store->vlog_synced = 0;
+      store->serialized.vlog_gen = old_gen;
+      if(store->writer != NULL) _ekvs_writer_set_vlog(store);
+      fclose(new_file);
+      remove(new_fname);
+
+      ekvs_free(old_offsets);
+      ekvs_free(new_fname);
+      ekvs_free(old_fname);
+      store->last_error = ret;
+      return ret;
+   }
+   if(old_file != NULL) fclose(old_file);
+   remove(old_fname);
+
+   /* Unmapping returns the old generation's disk space and address space. Values pinned by
+    * ekvs_get_ref may still point into it, in which case it is left to a later collection. */
+   if(!_ekvs_vlog_pinned(store)) _ekvs_vlog_release_maps(store);
+
+   ekvs_free(old_offsets);
+   ekvs_free(new_fname);
+   ekvs_free(old_fname);
+   store->last_error = EKVS_OK;
+   return EKVS_OK;
+
+ekvs_vlog_gc_err:
+   if(new_file != NULL)
+   {
+      fclose(new_file);
+      remove(new_fname);
+   }
+   ekvs_free(old_offsets);
+   ekvs_free(new_fname);
+   ekvs_free(old_fname);
+   store->last_error = EKVS_FILE_FAIL;
+   return EKVS_FILE_FAIL;
+
+ekvs_vlog_gc_alloc_err:
+   if(new_file != NULL)
+   {
+      fclose(new_file);
+      remove(new_fname);
+   }
+   ekvs_free(old_offsets);
+   ekvs_free(new_fname);
+   ekvs_free(old_fname);
+   store->last_error = EKVS_ALLOCATION_FAIL;
+   return EKVS_ALLOCATION_FAIL;
+}
@@ -0,0 +1,361 @@
+/* -*- Mode: C; tab-width: 3; c-basic-offset: 3; indent-tabs-mode: nil -*- */
+/* vim: set filetype=C tabstop=3 softtabstop=3 shiftwidth=3 expandtab: */
+
+/* ekvs -- Copyright (C) 2011 GameClay LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "ekvs_internal.h"
+
+#include <pthread.h>
+#include <unistd.h>
+
+/* With an asynchronous binlog, _ekvs_binlog copies framed records into a byte
+ * ring, and a writer thread writes everything queued with as few pwrite calls
+ * as the ring wrap allows, then flushes it to disk with fdatasync.
+ *
+ * The store is single-threaded, so there is exactly one producer. head and tail
+ * are byte counts since open, so head is also the LSN of the last record queued.
+ * The producer only writes head and the writer only writes tail; the mutex is
+ * only taken to sleep and wake. Before sleeping the writer sets sleeping and
+ * re-checks head, and the producer checks sleeping after publishing head, so
+ * one of them always sees the other. */
+struct _ekvs_binlog_writer {
+   pthread_t thread;
+   pthread_mutex_t lock;
+   pthread_cond_t wake;          /* Signalled when records are queued, or to stop */
+   pthread_cond_t done;          /* Broadcast when a batch is durable, or has failed */
+   char* ring;
+   uint64_t size;                /* Power of two */
+   uint64_t head;                /* Published by the producer */
+   uint64_t tail;                /* Published by the writer */
+   uint64_t sleeping;
+   uint64_t pending;             /* Producer only, bytes copied but not yet published */
+   int fd;
+   int vlog_fd;                  /* Value log to sync before each batch, or -1 */
+   uint64_t base;                /* File offset of ring byte 0, so a byte at count n goes to base + n */
+
+   /* Protected by lock */
+   uint64_t durable;
+   uint64_t flushes;
+   int stop;
+   int error;
+};
+
+static int _ekvs_pwrite_all(int fd, const char* data, size_t size, uint64_t offset)
+{
+   while(size > 0)
+   {
+      ssize_t written = pwrite(fd, data, size, (off_t)offset);
+      if(written <= 0) return EKVS_FILE_FAIL;
+      data += written;
+      size -= (size_t)written;
+      offset += (uint64_t)written;
+   }
+   return EKVS_OK;
+}
+
+static void* _ekvs_writer_main(void* arg)
+{
+   ekvs store = arg;
+   struct _ekvs_binlog_writer* writer = store->writer;
+   uint64_t start, end, pos, base;
+   uint64_t trace_start;
+   size_t chunk;
+   int error;
+   int fd, vlog_fd;
+
+   pthread_mutex_lock(&writer->lock);
+   for(;;)
+   {
+      while(EKVS_ATOMIC_LOAD(&writer->head) == writer->tail && !writer->stop)
+      {
+         EKVS_ATOMIC_STORE(&writer->sleeping, 1);
+         if(EKVS_ATOMIC_LOAD(&writer->head) != writer->tail) break;
+         pthread_cond_wait(&writer->wake, &writer->lock);
+      }
+      EKVS_ATOMIC_STORE(&writer->sleeping, 0);
+      start = writer->tail;
+      end = EKVS_ATOMIC_LOAD(&writer->head);
+      if(end == start) break; /* Stopped, with nothing left */
+
+      fd = writer->fd;
+      vlog_fd = writer->vlog_fd;
+      base = writer->base;
+      pthread_mutex_unlock(&writer->lock);
+
+      /* One write per contiguous run of the ring, then one flush for the batch. Values the
+       * records point at were flushed to the value log before the records were queued, and
+       * must reach the disk before the records can. */
+      EKVS_TRACE_START(store, trace_start);
+      error = EKVS_OK;
+      if(vlog_fd != -1 && fdatasync(vlog_fd) != 0) error = EKVS_FILE_FAIL;
+      for(pos = start; pos < end && error == EKVS_OK; pos += chunk)
+      {
+         chunk = (size_t)(end - pos);
+         if(chunk > writer->size - (pos & (writer->size - 1))) chunk = (size_t)(writer->size - (pos & (writer->size - 1)));
+         error = _ekvs_pwrite_all(fd, writer->ring + (pos & (writer->size - 1)), chunk, base + pos);
+      }
+      if(error == EKVS_OK && fdatasync(fd) != 0) error = EKVS_FILE_FAIL;
+      EKVS_TRACE(store, ekvs_trace_binlog_flush, 0, trace_start, 0, end - start);
+
+      pthread_mutex_lock(&writer->lock);
+      if(error == EKVS_OK)
+      {
+         writer->durable = end;
+         writer->flushes++;
+      }
+      else
+      {
+         /* Keep draining so the producer never blocks, but nothing is durable past the failure */
+         writer->error = error;
+      }
+      EKVS_ATOMIC_STORE(&writer->tail, end);
+      pthread_cond_broadcast(&writer->done);
+   }
+   pthread_mutex_unlock(&writer->lock);
+
+   return NULL;
+}
+
+int _ekvs_writer_start(ekvs store, size_t ring_size)
+{
+   struct _ekvs_binlog_writer* writer;
+   uint64_t size = 4096;
+
+   while(size < ring_size) size <<= 1;
+
+   writer = ekvs_malloc(sizeof(struct _ekvs_binlog_writer));
+   if(writer == NULL) return EKVS_ALLOCATION_FAIL;
+   memset(writer, 0, sizeof(struct _ekvs_binlog_writer));
+   writer->ring = ekvs_malloc((size_t)size);
+   if(writer->ring == NULL)
+   {
+      ekvs_free(writer);
+      return EKVS_ALLOCATION_FAIL;
+   }
+   writer->size = size;
+   writer->head = writer->tail = writer->pending = store->lsn;
+   writer->durable = store->lsn;
+
+   /* Records are written after the current end of the binlog */
+   writer->fd = fileno(_ekvs_binlog_file(store));
+   writer->vlog_fd = (store->vlog_file != NULL ? fileno(store->vlog_file) : -1);
+   writer->base = (store->segment_file != NULL ? store->segment_end : (uint64_t)store->serialized.binlog_end) - store->lsn;
+
+   pthread_mutex_init(&writer->lock, NULL);
+   pthread_cond_init(&writer->wake, NULL);
+   pthread_cond_init(&writer->done, NULL);
+   store->writer = writer;
+   if(pthread_create(&writer->thread, NULL, _ekvs_writer_main, store) != 0)
+   {
+      store->writer = NULL;
+      pthread_cond_destroy(&writer->done);
+      pthread_cond_destroy(&writer->wake);
+      pthread_mutex_destroy(&writer->lock);
+      ekvs_free(writer->ring);
+      ekvs_free(writer);
+      return EKVS_FAIL;
+   }
+
+   return EKVS_OK;
+}
+
+void _ekvs_writer_stop(ekvs store)
+{
+   struct _ekvs_binlog_writer* writer = store->writer;
+
+   /* The writer drains the ring before it notices stop */
+   _ekvs_writer_publish(store);
+   pthread_mutex_lock(&writer->lock);
+   writer->stop = 1;
+   pthread_cond_signal(&writer->wake);
+   pthread_mutex_unlock(&writer->lock);
+   pthread_join(writer->thread, NULL);
+
+   store->durable_lsn = writer->durable;
+   store->writer = NULL;
+   pthread_cond_destroy(&writer->done);
+   pthread_cond_destroy(&writer->wake);
+   pthread_mutex_destroy(&writer->lock);
+   ekvs_free(writer->ring);
+   ekvs_free(writer);
+}
+
+/* Copy bytes into the ring, publishing what is queued and waiting for the writer whenever it is full */
+int _ekvs_writer_append(ekvs store, const void* data, size_t size)
+{
+   struct _ekvs_binlog_writer* writer = store->writer;
+   const char* bytes = data;
+   uint64_t space;
+   size_t chunk;
+   int error = EKVS_OK;
+
+   while(size > 0)
+   {
+      space = writer->size - (writer->pending - EKVS_ATOMIC_LOAD(&writer->tail));
+      if(space == 0)
+      {
+         _ekvs_writer_publish(store);
+         pthread_mutex_lock(&writer->lock);
+         while(writer->pending == writer->tail + writer->size && writer->error == EKVS_OK)
+         {
+            pthread_cond_signal(&writer->wake);
+            pthread_cond_wait(&writer->done, &writer->lock);
+         }
+         error = writer->error;
+         pthread_mutex_unlock(&writer->lock);
+         if(error != EKVS_OK) return error;
+         continue;
+      }
+
+      chunk = (size < space ? size : (size_t)space);
+      if(chunk > writer->size - (writer->pending & (writer->size - 1)))
+      {
+         chunk = (size_t)(writer->size - (writer->pending & (writer->size - 1)));
+      }
+      memcpy(writer->ring + (writer->pending & (writer->size - 1)), bytes, chunk);
+      writer->pending += chunk;
+      bytes += chunk;
+      size -= chunk;
+   }
+
+   return EKVS_OK;
+}
+
+void _ekvs_writer_publish(ekvs store)
+{
+   struct _ekvs_binlog_writer* writer = store->writer;
+
+   if(writer->head == writer->pending) return;
+   EKVS_ATOMIC_STORE(&writer->head, writer->pending);
+   if(EKVS_ATOMIC_LOAD(&writer->sleeping))
+   {
+      pthread_mutex_lock(&writer->lock);
+      pthread_cond_signal(&writer->wake);
+      pthread_mutex_unlock(&writer->lock);
+   }
+}
+
+/* Wait until everything queued is on disk, after which the writer is idle until more is queued */
+int _ekvs_writer_drain(ekvs store)
+{
+   return ekvs_wait_durable(store, store->writer->pending);
+}
+
+/* The binlog moved to offset of another file, after a snapshot or a new segment. Only valid while drained. */
+void _ekvs_writer_rebase(ekvs store, uint64_t offset)
+{
+   struct _ekvs_binlog_writer* writer = store->writer;
+
+   pthread_mutex_lock(&writer->lock);
+   writer->fd = fileno(_ekvs_binlog_file(store));
+   writer->base = offset - writer->pending;
+   pthread_mutex_unlock(&writer->lock);
+}
+
+/* The value log was opened or replaced. Only valid while drained. */
+void _ekvs_writer_set_vlog(ekvs store)
+{
+   struct _ekvs_binlog_writer* writer = store->writer;
+
+   pthread_mutex_lock(&writer->lock);
+   writer->vlog_fd = (store->vlog_file != NULL ? fileno(store->vlog_file) : -1);
+   pthread_mutex_unlock(&writer->lock);
+}
+
+uint64_t _ekvs_writer_flushes(ekvs store)
+{
+   uint64_t flushes;
+
+   pthread_mutex_lock(&store->writer->lock);
+   flushes = store->writer->flushes;
+   pthread_mutex_unlock(&store->writer->lock);
+   return flushes;
+}
+
+uint64_t ekvs_lsn(ekvs store)
+{
+   if(store == NULL)
+   {
+      fprintf(stderr, "ekvs: NULL store parameter passed to ekvs_lsn.\n");
+      return 0;
+   }
+
+   return store->lsn;
+}
+
+uint64_t ekvs_durable_lsn(ekvs store)
+{
+   uint64_t durable;
+
+   if(store == NULL)
+   {
+      fprintf(stderr, "ekvs: NULL store parameter passed to ekvs_durable_lsn.\n");
+      return 0;
+   }
+
+   if(store->writer == NULL) return store->durable_lsn;
+
+   pthread_mutex_lock(&store->writer->lock);
+   durable = store->writer->durable;
+   pthread_mutex_unlock(&store->writer->lock);
+   return durable;
+}
+
+int ekvs_wait_durable(ekvs store, uint64_t lsn)
+{
+   struct _ekvs_binlog_writer* writer;
+   int error = EKVS_OK;
+
+   if(store == NULL)
+   {
+      fprintf(stderr, "ekvs: NULL store parameter passed to ekvs_wait_durable.\n");
+      return EKVS_FAIL;
+   }
+
+   if(lsn > store->lsn) lsn = store->lsn;
+   writer = store->writer;
+
+   if(writer == NULL)
+   {
+      /* Records are already written and flushed from stdio, but not necessarily on disk.
+       * In-memory stores which log for followers have nothing to flush. */
+      if(store->durable_lsn < lsn && store->db_file != NULL)
+      {
+         FILE* binlog = _ekvs_binlog_file(store);
+         if(_ekvs_vlog_sync(store) != EKVS_OK || fflush(binlog) != 0 || fdatasync(fileno(binlog)) != 0)
+         {
+            store->last_error = EKVS_FILE_FAIL;
+            return EKVS_FILE_FAIL;
+         }
+         store->durable_lsn = store->lsn;
+      }
+      store->last_error = EKVS_OK;
+      return EKVS_OK;
+   }
+
+   _ekvs_writer_publish(store);
+   pthread_mutex_lock(&writer->lock);
+   while(writer->durable < lsn && writer->error == EKVS_OK)
+   {
+      pthread_cond_signal(&writer->wake);
+      pthread_cond_wait(&writer->done, &writer->lock);
+   }
+   error = writer->error;
+   pthread_mutex_unlock(&writer->lock);
+
+   store->last_error = error;
+   return error;
+}
@@ -0,0 +1,132 @@
+#include <ekvs/ekvs.h>
+#include "../src/ekvs_internal.h"
+
+#include <cspec.h>
+#include <cspec_output_verbose.h>
+
+DESCRIBE(ekvs_append, "ekvs_append and ekvs_setrange")
+   IT("appends to existing and new keys")
+      ekvs teststore;
+      const void* get_ptr;
+      size_t get_sz = 0;
+      ekvs_open(&teststore, NULL, NULL);
+      SHOULD_EQUAL(ekvs_append(teststore, "key", "hello", 5), EKVS_OK)
+      SHOULD_EQUAL(ekvs_append(teststore, "key", ", world", 8), EKVS_OK)
+      SHOULD_EQUAL(ekvs_get(teststore, "key", &get_ptr, &get_sz), EKVS_OK)
+      SHOULD_EQUAL(get_sz, 13)
+      SHOULD_MATCH(get_ptr, "hello, world")
+      ekvs_close(teststore);
+   END_IT
+
+   IT("grows entries geometrically, and accounts for their capacity")
+      ekvs teststore;
+      ekvs_cache_stats stats;
+      const void* get_ptr;
+      size_t get_sz = 0;
+      char chunk[16];
+      int i;
+      memset(chunk, 'a', sizeof(chunk));
+      ekvs_open(&teststore, NULL, NULL);
+      ekvs_get_cache_stats(teststore, &stats);
+      for(i = 0; i < 4096; i++)
+      {
+         ekvs_append(teststore, "key", chunk, sizeof(chunk));
+      }
+      ekvs_get(teststore, "key", &get_ptr, &get_sz);
+      SHOULD_EQUAL(get_sz, 4096 * sizeof(chunk))
+      SHOULD_EQUAL(_ekvs_grown_capacity(get_sz), 65536)
+      SHOULD_EQUAL(_ekvs_grown_capacity(get_sz + 1), 131072)
+      SHOULD_EQUAL(_ekvs_grown_capacity(3), 16)
+      ekvs_del(teststore, "key");
+      ekvs_get_cache_stats(teststore, &stats);
+      SHOULD_EQUAL(stats.mem_used, sizeof(struct _ekvs_db_entry*) * EKVS_INITIAL_TABLE_SIZE)
+      ekvs_close(teststore);
+   END_IT
+
+   IT("overwrites ranges, zero-filling any gap")
+      ekvs teststore;
+      const void* get_ptr;
+      size_t get_sz = 0;
+      ekvs_open(&teststore, NULL, NULL);
+      ekvs_set(teststore, "key", "abcdef", 6);
+      SHOULD_EQUAL(ekvs_setrange(teststore, "key", 2, "XY", 2), EKVS_OK)
+      ekvs_get(teststore, "key", &get_ptr, &get_sz);
+      SHOULD_EQUAL(get_sz, 6)
+      SHOULD_EQUAL(memcmp(get_ptr, "abXYef", 6), 0)
+      SHOULD_EQUAL(ekvs_setrange(teststore, "key", 8, "Z", 2), EKVS_OK)
+      ekvs_get(teststore, "key", &get_ptr, &get_sz);
+      SHOULD_EQUAL(get_sz, 10)
+      SHOULD_EQUAL(memcmp(get_ptr, "abXYef\0\0Z\0", 10), 0)
+      SHOULD_EQUAL(ekvs_setrange(teststore, "new", 3, "x", 2), EKVS_OK)
+      ekvs_get(teststore, "new", &get_ptr, &get_sz);
+      SHOULD_EQUAL(get_sz, 5)
+      SHOULD_EQUAL(memcmp(get_ptr, "\0\0\0x\0", 5), 0)
+      ekvs_close(teststore);
+   END_IT
+
+   IT("logs only the delta, and replays it")
+      ekvs teststore;
+      const void* get_ptr;
+      size_t get_sz = 0;
+      char big[4096];
+      long binlog_end;
+      const char* testfile = "append_test";
+      memset(big, 'b', sizeof(big));
+      ekvs_open(&teststore, testfile, NULL);
+      ekvs_set(teststore, "key", big, sizeof(big));
+      binlog_end = teststore->serialized.binlog_end;
+      ekvs_append(teststore, "key", "tail", 4);
+      SHOULD_EQUAL(teststore->serialized.binlog_end - binlog_end, EKVS_BINLOG_HEADER_SIZE + 3 + 4)
+      binlog_end = teststore->serialized.binlog_end;
+      ekvs_setrange(teststore, "key", 0, "head", 4);
+      SHOULD_EQUAL(teststore->serialized.binlog_end - binlog_end, EKVS_BINLOG_HEADER_SIZE + 3 + 8 + 4)
+      ekvs_setrange(teststore, "key", 5000, "!", 1);
+      ekvs_close(teststore);
+
+      ekvs_open(&teststore, testfile, NULL);
+      SHOULD_EQUAL(ekvs_get(teststore, "key", &get_ptr, &get_sz), EKVS_OK)
+      SHOULD_EQUAL(get_sz, 5001)
+      SHOULD_EQUAL(memcmp(get_ptr, "headbbbb", 8), 0)
+      SHOULD_EQUAL(memcmp((const char*)get_ptr + 4096, "tail\0", 5), 0)
+      SHOULD_EQUAL(((const char*)get_ptr)[5000], '!')
+      ekvs_close(teststore);
+      remove(testfile);
+   END_IT
+
+   IT("rewrites values which are in the value log")
+      ekvs teststore;
+      ekvs_opts testopts;
+      const void* get_ptr;
+      size_t get_sz = 0;
+      const char* testfile = "append_test";
+      memset(&testopts, 0, sizeof(ekvs_opts));
+      testopts.vlog_threshold = 16;
+      ekvs_open(&teststore, testfile, &testopts);
+      ekvs_set(teststore, "key", "short", 5);
+      ekvs_append(teststore, "key", " value, now long enough", 24);
+      ekvs_append(teststore, "key", "", 0);
+      ekvs_close(teststore);
+      ekvs_open(&teststore, testfile, &testopts);
+      SHOULD_EQUAL(ekvs_get(teststore, "key", &get_ptr, &get_sz), EKVS_OK)
+      SHOULD_MATCH(get_ptr, "short value, now long enough")
+      ekvs_close(teststore);
+      remove(testfile);
+      remove("append_test.vlog.0");
+   END_IT
+
+   IT("leaves pinned values unchanged")
+      ekvs teststore;
+      ekvs_ref ref;
+      const void* get_ptr;
+      size_t get_sz = 0;
+      ekvs_open(&teststore, NULL, NULL);
+      ekvs_set(teststore, "key", "value", 6);
+      ekvs_get_ref(teststore, "key", &ref);
+      ekvs_setrange(teststore, "key", 0, "V", 1);
+      SHOULD_MATCH(ref.data, "value")
+      ekvs_get(teststore, "key", &get_ptr, &get_sz);
+      SHOULD_MATCH(get_ptr, "Value")
+      ekvs_ref_release(teststore, &ref);
+      ekvs_close(teststore);
+   END_IT
+END_DESCRIBE
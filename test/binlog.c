@@ -49,4 +49,56 @@ DESCRIBE(ekvs_binlog, "ekvs binlog functionality for set/del instructions")
       ekvs_close(teststore);
       remove(testfile);
    END_IT
+
+   IT("discards a torn record at the end of the binlog")
+      ekvs teststore;
+      const void* get_ptr;
+      size_t get_sz = 0;
+      const char* testfile = "binlog_test";
+      char garbage[32];
+      FILE* f;
+      ekvs_open(&teststore, testfile, NULL);
+      ekvs_set(teststore, "key1", "value1", 7);
+      ekvs_close(teststore);
+      memset(garbage, 0xff, sizeof(garbage));
+      f = fopen(testfile, "ab");
+      fwrite(garbage, 1, sizeof(garbage), f);
+      fclose(f);
+      SHOULD_EQUAL(ekvs_open(&teststore, testfile, NULL), EKVS_OK)
+      SHOULD_EQUAL(ekvs_discarded_bytes(teststore), sizeof(garbage))
+      SHOULD_EQUAL(ekvs_get(teststore, "key1", &get_ptr, &get_sz), EKVS_OK)
+      SHOULD_MATCH(get_ptr, "value1")
+      SHOULD_EQUAL(ekvs_set(teststore, "key2", "value2", 7), EKVS_OK)
+      ekvs_close(teststore);
+      ekvs_open(&teststore, testfile, NULL);
+      SHOULD_EQUAL(ekvs_discarded_bytes(teststore), 0)
+      SHOULD_EQUAL(ekvs_get(teststore, "key2", &get_ptr, &get_sz), EKVS_OK)
+      SHOULD_MATCH(get_ptr, "value2")
+      ekvs_close(teststore);
+      remove(testfile);
+   END_IT
+
+   IT("discards records whose checksum does not match")
+      ekvs teststore;
+      const void* get_ptr;
+      size_t get_sz = 0;
+      const char* testfile = "binlog_test";
+      long int second_record;
+      FILE* f;
+      ekvs_open(&teststore, testfile, NULL);
+      ekvs_set(teststore, "key1", "value1", 7);
+      second_record = teststore->serialized.binlog_end;
+      ekvs_set(teststore, "key2", "value2", 7);
+      ekvs_close(teststore);
+      f = fopen(testfile, "rb+");
+      fseek(f, -2, SEEK_END);
+      fputc('X', f);
+      fclose(f);
+      SHOULD_EQUAL(ekvs_open(&teststore, testfile, NULL), EKVS_OK)
+      SHOULD_EQUAL(teststore->serialized.binlog_end, second_record)
+      SHOULD_EQUAL(ekvs_get(teststore, "key1", &get_ptr, &get_sz), EKVS_OK)
+      SHOULD_EQUAL(ekvs_get(teststore, "key2", &get_ptr, &get_sz), EKVS_NO_KEY)
+      ekvs_close(teststore);
+      remove(testfile);
+   END_IT
 END_DESCRIBE
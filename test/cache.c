@@ -0,0 +1,140 @@
+#include <ekvs/ekvs.h>
+#include "../src/ekvs_internal.h"
+
+#include <cspec.h>
+#include <cspec_output_verbose.h>
+
+int test_evict_count = 0;
+void test_evict(void* ctx, const char* key, size_t key_sz, const void* data, size_t data_sz)
+{
+   test_evict_count++;
+}
+
+DESCRIBE(ekvs_cache, "int ekvs_get_cache_stats(ekvs store, ekvs_cache_stats* stats)")
+   IT("returns EKVS_FAIL if store is NULL")
+      ekvs_cache_stats stats;
+      SHOULD_EQUAL(ekvs_get_cache_stats(NULL, &stats), EKVS_FAIL)
+   END_IT
+
+   IT("accounts for the table, entry headers, keys and values")
+      ekvs teststore;
+      ekvs_cache_stats stats;
+      ekvs_opts testopts;
+      memset(&testopts, 0, sizeof(ekvs_opts));
+      testopts.initial_table_size = 16;
+      ekvs_open(&teststore, NULL, &testopts);
+      ekvs_get_cache_stats(teststore, &stats);
+      SHOULD_EQUAL(stats.mem_used, 16 * sizeof(struct _ekvs_db_entry*))
+      ekvs_set(teststore, "key", "value", 6);
+      ekvs_get_cache_stats(teststore, &stats);
+      SHOULD_EQUAL(stats.mem_used, 16 * sizeof(struct _ekvs_db_entry*) + EKVS_ENTRY_SIZE(3, 6))
+      ekvs_del(teststore, "key");
+      ekvs_get_cache_stats(teststore, &stats);
+      SHOULD_EQUAL(stats.mem_used, 16 * sizeof(struct _ekvs_db_entry*))
+      ekvs_close(teststore);
+   END_IT
+
+   IT("counts hits and misses")
+      ekvs teststore;
+      ekvs_cache_stats stats;
+      const void* get_ptr;
+      size_t get_sz = 0;
+      ekvs_open(&teststore, NULL, NULL);
+      ekvs_set(teststore, "key", "value", 6);
+      ekvs_get(teststore, "key", &get_ptr, &get_sz);
+      ekvs_get(teststore, "key", &get_ptr, &get_sz);
+      ekvs_get(teststore, "nokey", &get_ptr, &get_sz);
+      ekvs_get_cache_stats(teststore, &stats);
+      SHOULD_EQUAL(stats.hits, 2)
+      SHOULD_EQUAL(stats.misses, 1)
+      ekvs_close(teststore);
+   END_IT
+
+   IT("evicts keys to stay within the memory budget, and notifies the evict callback")
+      ekvs teststore;
+      ekvs_cache_stats stats;
+      ekvs_opts testopts;
+      char key[16];
+      char value[100];
+      int i;
+      memset(&testopts, 0, sizeof(ekvs_opts));
+      testopts.initial_table_size = 16;
+      testopts.max_memory = 16 * sizeof(struct _ekvs_db_entry*) + 4 * EKVS_ENTRY_SIZE(5, 100);
+      testopts.evict_callback = test_evict;
+      memset(value, 0, sizeof(value));
+      ekvs_open(&teststore, NULL, &testopts);
+      for(i = 0; i < 10; i++)
+      {
+         sprintf(key, "key%02d", i);
+         SHOULD_EQUAL(ekvs_set_ex(teststore, key, value, sizeof(value), ekvs_set_no_grow), EKVS_OK)
+      }
+      ekvs_get_cache_stats(teststore, &stats);
+      SHOULD_EQUAL(stats.evictions, 6)
+      SHOULD_EQUAL(test_evict_count, 6)
+      SHOULD_EQUAL(teststore->table_population, 4)
+      SHOULD_EQUAL(stats.mem_used <= stats.mem_budget, 1)
+      ekvs_close(teststore);
+   END_IT
+
+   IT("gives recently read keys a second chance")
+      ekvs teststore;
+      ekvs_opts testopts;
+      const void* get_ptr;
+      size_t get_sz = 0;
+      memset(&testopts, 0, sizeof(ekvs_opts));
+      testopts.initial_table_size = 1;
+      testopts.max_memory = sizeof(struct _ekvs_db_entry*) + 2 * EKVS_ENTRY_SIZE(4, 7);
+      ekvs_open(&teststore, NULL, &testopts);
+      ekvs_set_ex(teststore, "key1", "value1", 7, ekvs_set_no_grow);
+      ekvs_set_ex(teststore, "key2", "value2", 7, ekvs_set_no_grow);
+      ekvs_set_ex(teststore, "key3", "value3", 7, ekvs_set_no_grow);
+      ekvs_get(teststore, "key3", &get_ptr, &get_sz);
+      ekvs_set_ex(teststore, "key4", "value4", 7, ekvs_set_no_grow);
+      SHOULD_EQUAL(ekvs_get(teststore, "key3", &get_ptr, &get_sz), EKVS_OK)
+      SHOULD_EQUAL(ekvs_get(teststore, "key4", &get_ptr, &get_sz), EKVS_OK)
+      ekvs_close(teststore);
+   END_IT
+   IT("remembers a sweep which found nothing to evict until something may be evicted")
+      ekvs teststore;
+      ekvs_opts testopts;
+      ekvs_cache_stats stats;
+      ekvs_ref ref1;
+      ekvs_ref ref2;
+      const void* get_ptr;
+      size_t get_sz = 0;
+      memset(&testopts, 0, sizeof(ekvs_opts));
+      testopts.initial_table_size = 4;
+      testopts.max_memory = 4 * sizeof(struct _ekvs_db_entry*) + 2 * EKVS_ENTRY_SIZE(4, 7);
+      ekvs_open(&teststore, NULL, &testopts);
+      ekvs_set_ex(teststore, "key1", "value1", 7, ekvs_set_no_grow);
+      ekvs_set_ex(teststore, "key2", "value2", 7, ekvs_set_no_grow);
+      ekvs_get_ref(teststore, "key1", &ref1);
+      ekvs_get_ref(teststore, "key2", &ref2);
+
+      /* Everything else is pinned, so the store goes over its budget */
+      SHOULD_EQUAL(ekvs_set_ex(teststore, "key3", "value3", 7, ekvs_set_no_grow), EKVS_OK)
+      SHOULD_EQUAL(teststore->evict_stalled, 1)
+      SHOULD_EQUAL(ekvs_get(teststore, "key3", &get_ptr, &get_sz), EKVS_OK)
+
+      /* Without a victim left from the last sweep, writes give up at once, noting what they keep */
+      teststore->evict_stalled_victim = 0;
+      SHOULD_EQUAL(ekvs_set_ex(teststore, "key3", "value3", 7, ekvs_set_no_grow), EKVS_OK)
+      SHOULD_EQUAL(teststore->evict_stalled, 1)
+      SHOULD_EQUAL(teststore->evict_stalled_victim, 1)
+
+      /* The next write may evict the entry kept before it */
+      SHOULD_EQUAL(ekvs_set_ex(teststore, "key4", "value4", 7, ekvs_set_no_grow), EKVS_OK)
+      SHOULD_EQUAL(ekvs_get(teststore, "key3", &get_ptr, &get_sz), EKVS_NO_KEY)
+      ekvs_get_cache_stats(teststore, &stats);
+      SHOULD_EQUAL(stats.evictions, 1)
+
+      /* Releasing a pin forgets the sweep */
+      ekvs_ref_release(teststore, &ref1);
+      SHOULD_EQUAL(teststore->evict_stalled, 0)
+      SHOULD_EQUAL(ekvs_set_ex(teststore, "key5", "value5", 7, ekvs_set_no_grow), EKVS_OK)
+      SHOULD_EQUAL(ekvs_get(teststore, "key1", &get_ptr, &get_sz), EKVS_NO_KEY)
+      SHOULD_EQUAL(ekvs_get(teststore, "key5", &get_ptr, &get_sz), EKVS_OK)
+      ekvs_ref_release(teststore, &ref2);
+      ekvs_close(teststore);
+   END_IT
+END_DESCRIBE
@@ -0,0 +1,274 @@
+#include <ekvs/ekvs.h>
+#include "../src/ekvs_internal.h"
+
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cspec.h>
+#include <cspec_output_verbose.h>
+
+static void checkpoint_test_remove(const char* path)
+{
+   char fname[64];
+   int i;
+   remove(path);
+   for(i = 0; i < 100; i++)
+   {
+      sprintf(fname, "%s.ckpt.%d", path, i);
+      remove(fname);
+      sprintf(fname, "%s.log.%08d", path, i);
+      remove(fname);
+   }
+}
+
+static int checkpoint_test_exists(const char* path, int sequence)
+{
+   char fname[64];
+   FILE* file;
+   sprintf(fname, "%s.ckpt.%d", path, sequence);
+   file = fopen(fname, "rb");
+   if(file == NULL) return 0;
+   fclose(file);
+   return 1;
+}
+
+/* Writes across two checkpoints and the binlog, then checks all of it survives a reopen */
+static int checkpoint_test_roundtrip(const char* path, const ekvs_opts* opts)
+{
+   ekvs teststore;
+   ekvs_runtime_stats stats;
+   const void* get_ptr;
+   size_t get_sz = 0;
+   char key[16];
+   char value[32];
+   uint64_t len = 0;
+   int is_member = 0;
+   int i, matched = 0;
+
+   checkpoint_test_remove(path);
+   if(ekvs_open(&teststore, path, opts) != EKVS_OK) return 0;
+   for(i = 0; i < 200; i++)
+   {
+      sprintf(key, "key%03d", i);
+      sprintf(value, "value %d", i);
+      ekvs_set(teststore, key, value, strlen(value) + 1);
+   }
+   if(ekvs_snapshot(teststore, NULL) != EKVS_OK) return 0;
+
+   ekvs_set(teststore, "key001", "first", 6);
+   ekvs_del(teststore, "key002");
+   ekvs_rpush(teststore, "list", "a", 1);
+   ekvs_sadd(teststore, "set", "x", 1, NULL);
+   if(ekvs_checkpoint(teststore) != EKVS_OK) return 0;
+   ekvs_stats(teststore, &stats);
+   if(stats.checkpoints != 1 || stats.dirty_buckets != 0) return 0;
+#ifndef EKVS_NO_STATS
+   if(stats.checkpoint_bytes == 0) return 0;
+#endif
+
+   ekvs_set(teststore, "key001", "second", 7);
+   ekvs_set(teststore, "key002", "back", 5);
+   ekvs_del(teststore, "key003");
+   ekvs_append(teststore, "key004", "!", 1);
+   ekvs_rpush(teststore, "list", "b", 1);
+   if(ekvs_checkpoint(teststore) != EKVS_OK) return 0;
+
+   /* Left to the binlog */
+   ekvs_set(teststore, "key005", "logged", 7);
+   ekvs_del(teststore, "key006");
+   ekvs_close(teststore);
+
+   if(ekvs_open(&teststore, path, opts) != EKVS_OK) return 0;
+   ekvs_stats(teststore, &stats);
+   if(stats.checkpoints != 2 || stats.population != 200) return 0;
+   for(i = 7; i < 200; i++)
+   {
+      sprintf(key, "key%03d", i);
+      sprintf(value, "value %d", i);
+      if(ekvs_get(teststore, key, &get_ptr, &get_sz) == EKVS_OK && memcmp(get_ptr, value, get_sz) == 0) matched++;
+   }
+   if(matched != 193) return 0;
+   if(ekvs_get(teststore, "key001", &get_ptr, &get_sz) != EKVS_OK || strcmp(get_ptr, "second") != 0) return 0;
+   if(ekvs_get(teststore, "key002", &get_ptr, &get_sz) != EKVS_OK || strcmp(get_ptr, "back") != 0) return 0;
+   if(ekvs_get(teststore, "key003", &get_ptr, &get_sz) != EKVS_NO_KEY) return 0;
+   if(ekvs_get(teststore, "key004", &get_ptr, &get_sz) != EKVS_OK || get_sz != 9 || memcmp(get_ptr, "value 4\0!", 9) != 0) return 0;
+   if(ekvs_get(teststore, "key005", &get_ptr, &get_sz) != EKVS_OK || strcmp(get_ptr, "logged") != 0) return 0;
+   if(ekvs_get(teststore, "key006", &get_ptr, &get_sz) != EKVS_NO_KEY) return 0;
+   if(ekvs_llen(teststore, "list", &len) != EKVS_OK || len != 2) return 0;
+   if(ekvs_sismember(teststore, "set", "x", 1, &is_member) != EKVS_OK || is_member != 1) return 0;
+
+   /* A snapshot folds the checkpoints in and removes them */
+   if(ekvs_snapshot(teststore, NULL) != EKVS_OK) return 0;
+   ekvs_stats(teststore, &stats);
+   if(stats.checkpoints != 0 || checkpoint_test_exists(path, 1) || checkpoint_test_exists(path, 2)) return 0;
+   ekvs_close(teststore);
+
+   if(ekvs_open(&teststore, path, opts) != EKVS_OK) return 0;
+   ekvs_stats(teststore, &stats);
+   if(stats.population != 200) return 0;
+   ekvs_close(teststore);
+   checkpoint_test_remove(path);
+   return 1;
+}
+
+DESCRIBE(ekvs_checkpoint, "int ekvs_checkpoint(ekvs store)")
+   IT("requires a hash store with a database file")
+      ekvs teststore;
+      ekvs_opts testopts;
+      const char* testfile = "checkpoint_test";
+      SHOULD_EQUAL(ekvs_checkpoint(NULL), EKVS_FAIL)
+      SHOULD_EQUAL(ekvs_open(&teststore, NULL, NULL), EKVS_OK)
+      SHOULD_EQUAL(ekvs_checkpoint(teststore), EKVS_FILE_FAIL)
+      ekvs_close(teststore);
+
+      checkpoint_test_remove(testfile);
+      remove("checkpoint_test.lsm");
+      memset(&testopts, 0, sizeof(ekvs_opts));
+      testopts.engine = ekvs_engine_lsm;
+      SHOULD_EQUAL(ekvs_open(&teststore, testfile, &testopts), EKVS_OK)
+      SHOULD_EQUAL(ekvs_checkpoint(teststore), EKVS_UNSUPPORTED)
+      ekvs_close(teststore);
+      checkpoint_test_remove(testfile);
+      remove("checkpoint_test.lsm");
+   END_IT
+
+   IT("restores changed buckets on top of the snapshot, then replays the binlog")
+      ekvs_opts testopts;
+      memset(&testopts, 0, sizeof(ekvs_opts));
+      testopts.initial_table_size = 1024;
+      SHOULD_EQUAL(checkpoint_test_roundtrip("checkpoint_test", &testopts), 1)
+   END_IT
+
+   IT("works with a segmented binlog and the background writer")
+      ekvs_opts testopts;
+      memset(&testopts, 0, sizeof(ekvs_opts));
+      testopts.initial_table_size = 1024;
+      testopts.binlog_segment_size = 4096;
+      SHOULD_EQUAL(checkpoint_test_roundtrip("checkpoint_test", &testopts), 1)
+      testopts.binlog_segment_size = 0;
+      testopts.async_binlog_size = 4096;
+      SHOULD_EQUAL(checkpoint_test_roundtrip("checkpoint_test", &testopts), 1)
+   END_IT
+
+   IT("writes a snapshot instead once max_checkpoints are kept")
+      ekvs teststore;
+      ekvs_opts testopts;
+      ekvs_runtime_stats stats;
+      const void* get_ptr;
+      size_t get_sz = 0;
+      const char* testfile = "checkpoint_test";
+      checkpoint_test_remove(testfile);
+      memset(&testopts, 0, sizeof(ekvs_opts));
+      testopts.initial_table_size = 1024;
+      testopts.max_checkpoints = 2;
+      SHOULD_EQUAL(ekvs_open(&teststore, testfile, &testopts), EKVS_OK)
+      ekvs_set(teststore, "a", "1", 2);
+      SHOULD_EQUAL(ekvs_checkpoint(teststore), EKVS_OK)
+      ekvs_set(teststore, "b", "2", 2);
+      SHOULD_EQUAL(ekvs_checkpoint(teststore), EKVS_OK)
+      SHOULD_EQUAL(checkpoint_test_exists(testfile, 2), 1)
+      ekvs_set(teststore, "c", "3", 2);
+      SHOULD_EQUAL(ekvs_checkpoint(teststore), EKVS_OK)
+      ekvs_stats(teststore, &stats);
+      SHOULD_EQUAL(stats.checkpoints, 0)
+      SHOULD_EQUAL(checkpoint_test_exists(testfile, 1), 0)
+      SHOULD_EQUAL(checkpoint_test_exists(testfile, 2), 0)
+      ekvs_close(teststore);
+
+      SHOULD_EQUAL(ekvs_open(&teststore, testfile, NULL), EKVS_OK)
+      SHOULD_EQUAL(ekvs_get(teststore, "c", &get_ptr, &get_sz), EKVS_OK)
+      SHOULD_MATCH(get_ptr, "3")
+      ekvs_close(teststore);
+      checkpoint_test_remove(testfile);
+   END_IT
+
+   IT("loads checkpoints written before the table grew")
+      ekvs teststore;
+      ekvs_opts testopts;
+      ekvs_runtime_stats stats;
+      const void* get_ptr;
+      size_t get_sz = 0;
+      char key[16];
+      int i, matched = 0;
+      const char* testfile = "checkpoint_test";
+      checkpoint_test_remove(testfile);
+      memset(&testopts, 0, sizeof(ekvs_opts));
+      testopts.initial_table_size = 64;
+      SHOULD_EQUAL(ekvs_open(&teststore, testfile, &testopts), EKVS_OK)
+      for(i = 0; i < 20; i++)
+      {
+         sprintf(key, "key%03d", i);
+         ekvs_set(teststore, key, key, strlen(key) + 1);
+      }
+      SHOULD_EQUAL(ekvs_checkpoint(teststore), EKVS_OK)
+      ekvs_del(teststore, "key000");
+      SHOULD_EQUAL(ekvs_checkpoint(teststore), EKVS_OK)
+      for(i = 20; i < 200; i++)
+      {
+         sprintf(key, "key%03d", i);
+         ekvs_set(teststore, key, key, strlen(key) + 1);
+      }
+      ekvs_stats(teststore, &stats);
+      SHOULD_NOT_EQUAL(stats.table_size, 64)
+      SHOULD_EQUAL(stats.checkpoints, 2)
+      ekvs_close(teststore);
+
+      SHOULD_EQUAL(ekvs_open(&teststore, testfile, NULL), EKVS_OK)
+      for(i = 1; i < 200; i++)
+      {
+         sprintf(key, "key%03d", i);
+         if(ekvs_get(teststore, key, &get_ptr, &get_sz) == EKVS_OK && strcmp(get_ptr, key) == 0) matched++;
+      }
+      SHOULD_EQUAL(matched, 199)
+      SHOULD_EQUAL(ekvs_get(teststore, "key000", &get_ptr, &get_sz), EKVS_NO_KEY)
+
+      /* Every bucket moves when the table grows, so the next checkpoint is a snapshot */
+      ekvs_stats(teststore, &stats);
+      SHOULD_EQUAL(stats.checkpoints, 2)
+      for(i = 200; i < 1000; i++)
+      {
+         sprintf(key, "key%03d", i);
+         ekvs_set(teststore, key, key, strlen(key) + 1);
+      }
+      ekvs_stats(teststore, &stats);
+      SHOULD_EQUAL(stats.dirty_buckets, stats.table_size)
+      SHOULD_EQUAL(ekvs_checkpoint(teststore), EKVS_OK)
+      ekvs_close(teststore);
+      SHOULD_EQUAL(ekvs_open(&teststore, testfile, NULL), EKVS_OK)
+      ekvs_stats(teststore, &stats);
+      SHOULD_EQUAL(stats.checkpoints, 0)
+      SHOULD_EQUAL(stats.population, 999)
+      ekvs_close(teststore);
+      checkpoint_test_remove(testfile);
+   END_IT
+   IT("fails cleanly when the checkpoint file cannot be created")
+      ekvs teststore;
+      ekvs_opts testopts;
+      ekvs_runtime_stats stats;
+      const void* get_ptr;
+      size_t get_sz = 0;
+      const char* testfile = "checkpoint_test";
+      checkpoint_test_remove(testfile);
+      memset(&testopts, 0, sizeof(ekvs_opts));
+      testopts.initial_table_size = 1024;
+      SHOULD_EQUAL(ekvs_open(&teststore, testfile, &testopts), EKVS_OK)
+      ekvs_set(teststore, "a", "1", 2);
+
+      /* A directory where the temporary file goes */
+      mkdir("checkpoint_test.ckpt.1.tmp", 0700);
+      SHOULD_EQUAL(ekvs_checkpoint(teststore), EKVS_FILE_FAIL)
+      SHOULD_EQUAL(ekvs_last_error(teststore), EKVS_FILE_FAIL)
+      SHOULD_EQUAL(rmdir("checkpoint_test.ckpt.1.tmp"), 0)
+      ekvs_stats(teststore, &stats);
+      SHOULD_EQUAL(stats.checkpoints, 0)
+
+      ekvs_set(teststore, "b", "2", 2);
+      SHOULD_EQUAL(ekvs_checkpoint(teststore), EKVS_OK)
+      ekvs_close(teststore);
+      SHOULD_EQUAL(ekvs_open(&teststore, testfile, NULL), EKVS_OK)
+      SHOULD_EQUAL(ekvs_get(teststore, "a", &get_ptr, &get_sz), EKVS_OK)
+      SHOULD_EQUAL(ekvs_get(teststore, "b", &get_ptr, &get_sz), EKVS_OK)
+      ekvs_close(teststore);
+      checkpoint_test_remove(testfile);
+   END_IT
+END_DESCRIBE
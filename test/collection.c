@@ -0,0 +1,304 @@
+#include <ekvs/ekvs.h>
+#include "../src/ekvs_internal.h"
+
+#include <cspec.h>
+#include <cspec_output_verbose.h>
+
+/* A realloc which can be told to fail once */
+static int coll_test_fail_realloc = 0;
+
+static void* coll_test_realloc(void* ptr, size_t size)
+{
+   if(coll_test_fail_realloc)
+   {
+      coll_test_fail_realloc = 0;
+      return NULL;
+   }
+   return realloc(ptr, size);
+}
+
+static void* coll_test_malloc(size_t size) { return malloc(size); }
+static void coll_test_free(void* ptr) { free(ptr); }
+
+DESCRIBE(ekvs_collection, "ekvs lists and sets")
+   IT("pushes and pops at both ends of a list")
+      ekvs teststore;
+      const void* elem;
+      size_t elem_sz = 0;
+      uint64_t len = 0;
+      ekvs_open(&teststore, NULL, NULL);
+      SHOULD_EQUAL(ekvs_rpush(teststore, "list", "b", 2), EKVS_OK)
+      SHOULD_EQUAL(ekvs_rpush(teststore, "list", "c", 2), EKVS_OK)
+      SHOULD_EQUAL(ekvs_lpush(teststore, "list", "a", 2), EKVS_OK)
+      ekvs_llen(teststore, "list", &len);
+      SHOULD_EQUAL(len, 3)
+      SHOULD_EQUAL(ekvs_lpop(teststore, "list", &elem, &elem_sz), EKVS_OK)
+      SHOULD_MATCH(elem, "a")
+      SHOULD_EQUAL(ekvs_rpop(teststore, "list", &elem, &elem_sz), EKVS_OK)
+      SHOULD_MATCH(elem, "c")
+      SHOULD_EQUAL(ekvs_rpop(teststore, "list", &elem, &elem_sz), EKVS_OK)
+      SHOULD_MATCH(elem, "b")
+      SHOULD_EQUAL(ekvs_lpop(teststore, "list", &elem, &elem_sz), EKVS_NO_KEY)
+      SHOULD_EQUAL(ekvs_get(teststore, "list", &elem, &elem_sz), EKVS_NO_KEY)
+      ekvs_close(teststore);
+   END_IT
+
+   IT("moves large lists to a quicklist, and ranges over them")
+      ekvs teststore;
+      ekvs_view views[8];
+      size_t count = 0;
+      const void* elem;
+      size_t elem_sz = 0;
+      uint64_t len = 0;
+      char text[16];
+      int i;
+      ekvs_open(&teststore, NULL, NULL);
+      for(i = 0; i < 1000; i++)
+      {
+         sprintf(text, "%d", i);
+         ekvs_rpush(teststore, "list", text, strlen(text) + 1);
+      }
+      ekvs_lpush(teststore, "list", "head", 5);
+      ekvs_llen(teststore, "list", &len);
+      SHOULD_EQUAL(len, 1001)
+      SHOULD_EQUAL(ekvs_lrange(teststore, "list", 500, 507, views, 8, &count), EKVS_OK)
+      SHOULD_EQUAL(count, 8)
+      SHOULD_MATCH(views[0].data, "499")
+      SHOULD_MATCH(views[7].data, "506")
+      SHOULD_EQUAL(ekvs_lrange(teststore, "list", -2, 5000, views, 8, &count), EKVS_OK)
+      SHOULD_EQUAL(count, 2)
+      SHOULD_MATCH(views[0].data, "998")
+      SHOULD_MATCH(views[1].data, "999")
+      SHOULD_EQUAL(ekvs_lrange(teststore, "list", 0, -1, views, 1, &count), EKVS_OK)
+      SHOULD_EQUAL(count, 1001)
+      SHOULD_MATCH(views[0].data, "head")
+      ekvs_lpop(teststore, "list", &elem, &elem_sz);
+      SHOULD_MATCH(elem, "head")
+      for(i = 999; i >= 0; i--)
+      {
+         sprintf(text, "%d", i);
+         ekvs_rpop(teststore, "list", &elem, &elem_sz);
+         if(strcmp(elem, text) != 0) break;
+      }
+      SHOULD_EQUAL(i, -1)
+      ekvs_llen(teststore, "list", &len);
+      SHOULD_EQUAL(len, 0)
+      ekvs_close(teststore);
+   END_IT
+
+   IT("keeps small integer sets sorted and widens them")
+      ekvs teststore;
+      struct _ekvs_db_entry* entry;
+      uint32_t pc = 0, pb = 0;
+      int added = 0;
+      int is_member = 0;
+      uint64_t card = 0;
+      ekvs_open(&teststore, NULL, NULL);
+      SHOULD_EQUAL(ekvs_sadd(teststore, "set", "5", 1, &added), EKVS_OK)
+      SHOULD_EQUAL(added, 1)
+      ekvs_sadd(teststore, "set", "-3", 2, &added);
+      ekvs_sadd(teststore, "set", "5", 1, &added);
+      SHOULD_EQUAL(added, 0)
+      ekvs_sadd(teststore, "set", "100000", 6, &added);
+      ekvs_sadd(teststore, "set", "-9223372036854775808", 20, &added);
+      hashlittle2("set", 3, &pc, &pb);
+      entry = _ekvs_retrieve(teststore, pc + (((uint64_t)pb) << 32), "set", 3);
+      SHOULD_EQUAL(entry->key_data[3], 3 /* intset */)
+      SHOULD_EQUAL(entry->key_data[4], 8 /* width */)
+      ekvs_scard(teststore, "set", &card);
+      SHOULD_EQUAL(card, 4)
+      ekvs_sismember(teststore, "set", "100000", 6, &is_member);
+      SHOULD_EQUAL(is_member, 1)
+      ekvs_sismember(teststore, "set", "05", 2, &is_member);
+      SHOULD_EQUAL(is_member, 0)
+      SHOULD_EQUAL(ekvs_srem(teststore, "set", "-3", 2), EKVS_OK)
+      SHOULD_EQUAL(ekvs_srem(teststore, "set", "-3", 2), EKVS_NO_KEY)
+      ekvs_sismember(teststore, "set", "-9223372036854775808", 20, &is_member);
+      SHOULD_EQUAL(is_member, 1)
+
+      /* Members keep their exact text when the set moves out of the intset */
+      ekvs_sadd(teststore, "set", "9223372036854775807", 19, &added);
+      ekvs_sadd(teststore, "set", "text", 4, &added);
+      entry = _ekvs_retrieve(teststore, pc + (((uint64_t)pb) << 32), "set", 3);
+      SHOULD_NOT_EQUAL(entry->key_data[3], 3 /* intset */)
+      ekvs_sismember(teststore, "set", "-9223372036854775808", 20, &is_member);
+      SHOULD_EQUAL(is_member, 1)
+      ekvs_sismember(teststore, "set", "9223372036854775807", 19, &is_member);
+      SHOULD_EQUAL(is_member, 1)
+      ekvs_sismember(teststore, "set", "100000", 6, &is_member);
+      SHOULD_EQUAL(is_member, 1)
+      ekvs_close(teststore);
+   END_IT
+
+   IT("moves sets to a packed form and then a hash set")
+      ekvs teststore;
+      int added = 0;
+      int is_member = 0;
+      uint64_t card = 0;
+      char text[16];
+      int i;
+      ekvs_open(&teststore, NULL, NULL);
+      ekvs_sadd(teststore, "set", "1", 1, &added);
+      ekvs_sadd(teststore, "set", "one", 3, &added);
+      ekvs_sismember(teststore, "set", "1", 1, &is_member);
+      SHOULD_EQUAL(is_member, 1)
+      for(i = 0; i < 1000; i++)
+      {
+         sprintf(text, "m%d", i);
+         ekvs_sadd(teststore, "set", text, strlen(text), &added);
+      }
+      ekvs_scard(teststore, "set", &card);
+      SHOULD_EQUAL(card, 1002)
+      ekvs_sismember(teststore, "set", "m999", 4, &is_member);
+      SHOULD_EQUAL(is_member, 1)
+      ekvs_sismember(teststore, "set", "m1000", 5, &is_member);
+      SHOULD_EQUAL(is_member, 0)
+      for(i = 0; i < 1000; i += 2)
+      {
+         sprintf(text, "m%d", i);
+         ekvs_srem(teststore, "set", text, strlen(text));
+      }
+      ekvs_scard(teststore, "set", &card);
+      SHOULD_EQUAL(card, 502)
+      ekvs_sismember(teststore, "set", "m998", 4, &is_member);
+      SHOULD_EQUAL(is_member, 0)
+      ekvs_sismember(teststore, "set", "m997", 4, &is_member);
+      SHOULD_EQUAL(is_member, 1)
+      ekvs_close(teststore);
+   END_IT
+
+   IT("refuses to mix types")
+      ekvs teststore;
+      const void* get_ptr;
+      size_t get_sz = 0;
+      int added = 0;
+      ekvs_open(&teststore, NULL, NULL);
+      ekvs_set(teststore, "value", "text", 5);
+      ekvs_rpush(teststore, "list", "a", 1);
+      ekvs_sadd(teststore, "set", "a", 1, &added);
+      SHOULD_EQUAL(ekvs_rpush(teststore, "value", "a", 1), EKVS_WRONG_TYPE)
+      SHOULD_EQUAL(ekvs_sadd(teststore, "list", "a", 1, &added), EKVS_WRONG_TYPE)
+      SHOULD_EQUAL(ekvs_lpush(teststore, "set", "a", 1), EKVS_WRONG_TYPE)
+      SHOULD_EQUAL(ekvs_get(teststore, "list", &get_ptr, &get_sz), EKVS_WRONG_TYPE)
+      SHOULD_EQUAL(ekvs_append(teststore, "set", "a", 1), EKVS_WRONG_TYPE)
+      SHOULD_EQUAL(ekvs_incrby(teststore, "set", 1, NULL), EKVS_WRONG_TYPE)
+      SHOULD_EQUAL(ekvs_set(teststore, "list", "replaced", 9), EKVS_OK)
+      SHOULD_EQUAL(ekvs_get(teststore, "list", &get_ptr, &get_sz), EKVS_OK)
+      ekvs_close(teststore);
+   END_IT
+
+   IT("logs element changes, and restores collections from the binlog and snapshots")
+      ekvs teststore;
+      ekvs_view views[4];
+      size_t count = 0;
+      const void* elem;
+      size_t elem_sz = 0;
+      long binlog_end;
+      int added = 0;
+      int is_member = 0;
+      uint64_t len = 0;
+      char text[16];
+      int i;
+      const char* testfile = "collection_test";
+      ekvs_open(&teststore, testfile, NULL);
+      for(i = 0; i < 300; i++)
+      {
+         sprintf(text, "%d", i);
+         ekvs_rpush(teststore, "list", text, strlen(text) + 1);
+         sprintf(text, "s%d", i);
+         ekvs_sadd(teststore, "set", text, strlen(text), &added);
+      }
+      binlog_end = teststore->serialized.binlog_end;
+      ekvs_rpush(teststore, "list", "x", 2);
+      SHOULD_EQUAL(teststore->serialized.binlog_end - binlog_end, EKVS_BINLOG_HEADER_SIZE + 4 + 2)
+      ekvs_lpop(teststore, "list", &elem, &elem_sz);
+      ekvs_srem(teststore, "set", "s7", 2);
+      ekvs_sadd(teststore, "small", "1", 1, &added);
+      ekvs_close(teststore);
+
+      ekvs_open(&teststore, testfile, NULL);
+      ekvs_llen(teststore, "list", &len);
+      SHOULD_EQUAL(len, 300)
+      ekvs_lrange(teststore, "list", 0, 0, views, 4, &count);
+      SHOULD_MATCH(views[0].data, "1")
+      ekvs_sismember(teststore, "set", "s7", 2, &is_member);
+      SHOULD_EQUAL(is_member, 0)
+      SHOULD_EQUAL(ekvs_snapshot(teststore, NULL), EKVS_OK)
+      ekvs_close(teststore);
+
+      ekvs_open(&teststore, testfile, NULL);
+      ekvs_lrange(teststore, "list", -1, -1, views, 4, &count);
+      SHOULD_MATCH(views[0].data, "x")
+      ekvs_sismember(teststore, "set", "s299", 4, &is_member);
+      SHOULD_EQUAL(is_member, 1)
+      ekvs_sismember(teststore, "small", "1", 1, &is_member);
+      SHOULD_EQUAL(is_member, 1)
+      ekvs_rpush(teststore, "list", "y", 2);
+      ekvs_rpop(teststore, "list", &elem, &elem_sz);
+      SHOULD_MATCH(elem, "y")
+      ekvs_close(teststore);
+      remove(testfile);
+   END_IT
+
+   IT("accounts for collection memory")
+      ekvs teststore;
+      ekvs_cache_stats stats;
+      uint64_t empty_mem;
+      int added = 0;
+      char text[16];
+      int i;
+      ekvs_open(&teststore, NULL, NULL);
+      ekvs_get_cache_stats(teststore, &stats);
+      empty_mem = stats.mem_used;
+      for(i = 0; i < 500; i++)
+      {
+         sprintf(text, "%d", i);
+         ekvs_rpush(teststore, "list", text, strlen(text));
+         sprintf(text, "s%d", i);
+         ekvs_sadd(teststore, "set", text, strlen(text), &added);
+      }
+      ekvs_get_cache_stats(teststore, &stats);
+      SHOULD_NOT_EQUAL(stats.mem_used < empty_mem + 500 * 4, 1)
+      ekvs_del(teststore, "list");
+      ekvs_del(teststore, "set");
+      ekvs_get_cache_stats(teststore, &stats);
+      SHOULD_EQUAL(stats.mem_used, empty_mem)
+      ekvs_close(teststore);
+   END_IT
+
+   IT("keeps a collection when the value replacing it cannot be allocated")
+      ekvs teststore;
+      ekvs_opts testopts;
+      ekvs_cache_stats stats;
+      const void* get_ptr;
+      size_t get_sz = 0;
+      uint64_t empty_mem;
+      uint64_t len = 0;
+      char text[16];
+      int i;
+      memset(&testopts, 0, sizeof(ekvs_opts));
+      testopts.user_malloc = coll_test_malloc;
+      testopts.user_realloc = coll_test_realloc;
+      testopts.user_free = coll_test_free;
+      SHOULD_EQUAL(ekvs_open(&teststore, NULL, &testopts), EKVS_OK)
+      ekvs_get_cache_stats(teststore, &stats);
+      empty_mem = stats.mem_used;
+      for(i = 0; i < 2000; i++)
+      {
+         sprintf(text, "%d", i);
+         ekvs_rpush(teststore, "list", text, strlen(text) + 1);
+      }
+      coll_test_fail_realloc = 1;
+      SHOULD_EQUAL(ekvs_set(teststore, "list", "flat", 5), EKVS_ALLOCATION_FAIL)
+      coll_test_fail_realloc = 0;
+      ekvs_llen(teststore, "list", &len);
+      SHOULD_EQUAL(len, 2000)
+      SHOULD_EQUAL(ekvs_set(teststore, "list", "flat", 5), EKVS_OK)
+      SHOULD_EQUAL(ekvs_get(teststore, "list", &get_ptr, &get_sz), EKVS_OK)
+      SHOULD_MATCH(get_ptr, "flat")
+      ekvs_del(teststore, "list");
+      ekvs_get_cache_stats(teststore, &stats);
+      SHOULD_EQUAL(stats.mem_used, empty_mem)
+      ekvs_close(teststore);
+   END_IT
+END_DESCRIBE
@@ -0,0 +1,132 @@
+#include <ekvs/ekvs.h>
+#include "../src/ekvs_internal.h"
+
+#include <cspec.h>
+#include <cspec_output_verbose.h>
+
+static void fill_json(char* buf, size_t sz)
+{
+   size_t i;
+   const char* pattern = "{\"name\":\"player\",\"score\":1234,\"tags\":[\"a\",\"b\"]},";
+   for(i = 0; i < sz - 1; i++)
+   {
+      buf[i] = pattern[i % strlen(pattern)];
+   }
+   buf[sz - 1] = '\0';
+}
+
+static long file_size(const char* fname)
+{
+   long sz;
+   FILE* f = fopen(fname, "rb");
+   fseek(f, 0, SEEK_END);
+   sz = ftell(f);
+   fclose(f);
+   return sz;
+}
+
+DESCRIBE(ekvs_compress, "ekvs compression of snapshots, binlog records and cold values")
+   IT("round-trips data through the bundled codec")
+      char src[4096];
+      char packed[4096 + 64];
+      char unpacked[4096];
+      size_t packed_sz;
+      fill_json(src, sizeof(src));
+      packed_sz = _ekvs_lz_compress(src, sizeof(src), packed, sizeof(packed));
+      SHOULD_NOT_EQUAL(packed_sz, 0)
+      SHOULD_EQUAL(packed_sz < sizeof(src) / 4, 1)
+      SHOULD_EQUAL(_ekvs_lz_decompress(packed, packed_sz, unpacked, sizeof(unpacked)), sizeof(src))
+      SHOULD_EQUAL(memcmp(src, unpacked, sizeof(src)), 0)
+   END_IT
+
+   IT("rejects truncated compressed data")
+      char src[4096];
+      char packed[4096 + 64];
+      char unpacked[4096];
+      size_t packed_sz;
+      fill_json(src, sizeof(src));
+      packed_sz = _ekvs_lz_compress(src, sizeof(src), packed, sizeof(packed));
+      SHOULD_NOT_EQUAL(_ekvs_lz_decompress(packed, packed_sz / 2, unpacked, sizeof(unpacked)), sizeof(src))
+   END_IT
+
+   IT("writes compressed snapshot blocks which can be loaded properly")
+      ekvs teststore;
+      ekvs_opts testopts;
+      const void* get_ptr;
+      size_t get_sz = 0;
+      char value[2048];
+      char key[16];
+      int i;
+      long raw_sz;
+      fill_json(value, sizeof(value));
+      ekvs_open(&teststore, NULL, NULL);
+      for(i = 0; i < 64; i++)
+      {
+         sprintf(key, "key%d", i);
+         ekvs_set(teststore, key, value, sizeof(value));
+      }
+      SHOULD_EQUAL(ekvs_snapshot(teststore, "compress_raw_test"), EKVS_OK)
+      ekvs_close(teststore);
+      raw_sz = file_size("compress_raw_test");
+
+      memset(&testopts, 0, sizeof(ekvs_opts));
+      testopts.compression = ekvs_compress_lz;
+      ekvs_open(&teststore, "compress_raw_test", &testopts);
+      SHOULD_EQUAL(ekvs_snapshot(teststore, "compress_test"), EKVS_OK)
+      ekvs_close(teststore);
+      SHOULD_EQUAL(file_size("compress_test") < raw_sz / 4, 1)
+
+      SHOULD_EQUAL(ekvs_open(&teststore, "compress_test", NULL), EKVS_OK)
+      SHOULD_EQUAL(teststore->table_population, 64)
+      SHOULD_EQUAL(ekvs_get(teststore, "key42", &get_ptr, &get_sz), EKVS_OK)
+      SHOULD_EQUAL(get_sz, sizeof(value))
+      SHOULD_MATCH(get_ptr, value)
+      ekvs_close(teststore);
+      remove("compress_raw_test");
+      remove("compress_test");
+   END_IT
+
+   IT("replays compressed binlog records")
+      ekvs teststore;
+      ekvs_opts testopts;
+      const void* get_ptr;
+      size_t get_sz = 0;
+      char value[2048];
+      const char* testfile = "compress_test";
+      fill_json(value, sizeof(value));
+      memset(&testopts, 0, sizeof(ekvs_opts));
+      testopts.compression = ekvs_compress_lz;
+      ekvs_open(&teststore, testfile, &testopts);
+      ekvs_set(teststore, "key1", value, sizeof(value));
+      ekvs_set(teststore, "key2", "short", 6);
+      SHOULD_EQUAL(teststore->serialized.binlog_end - teststore->serialized.binlog_start < (long)sizeof(value) / 2, 1)
+      ekvs_close(teststore);
+      ekvs_open(&teststore, testfile, NULL);
+      SHOULD_EQUAL(ekvs_get(teststore, "key1", &get_ptr, &get_sz), EKVS_OK)
+      SHOULD_EQUAL(get_sz, sizeof(value))
+      SHOULD_MATCH(get_ptr, value)
+      SHOULD_EQUAL(ekvs_get(teststore, "key2", &get_ptr, &get_sz), EKVS_OK)
+      SHOULD_MATCH(get_ptr, "short")
+      ekvs_close(teststore);
+      remove(testfile);
+   END_IT
+
+   IT("keeps values set with ekvs_set_compress packed until they are read")
+      ekvs teststore;
+      ekvs_cache_stats stats;
+      const void* get_ptr;
+      size_t get_sz = 0;
+      char value[2048];
+      fill_json(value, sizeof(value));
+      ekvs_open(&teststore, NULL, NULL);
+      SHOULD_EQUAL(ekvs_set_ex(teststore, "cold", value, sizeof(value), ekvs_set_compress), EKVS_OK)
+      ekvs_get_cache_stats(teststore, &stats);
+      SHOULD_EQUAL(stats.mem_used < sizeof(value), 1)
+      SHOULD_EQUAL(ekvs_get(teststore, "cold", &get_ptr, &get_sz), EKVS_OK)
+      SHOULD_EQUAL(get_sz, sizeof(value))
+      SHOULD_MATCH(get_ptr, value)
+      ekvs_get_cache_stats(teststore, &stats);
+      SHOULD_EQUAL(stats.mem_used > sizeof(value), 1)
+      ekvs_close(teststore);
+   END_IT
+END_DESCRIBE
@@ -0,0 +1,89 @@
+#include <ekvs/ekvs.h>
+#include "../src/ekvs_internal.h"
+
+#include <cspec.h>
+#include <cspec_output_verbose.h>
+
+DESCRIBE(ekvs_counter, "ekvs_incrby and ekvs_decrby")
+   IT("creates counters, and adds to them")
+      ekvs teststore;
+      const void* get_ptr;
+      size_t get_sz = 0;
+      int64_t result = 0;
+      ekvs_open(&teststore, NULL, NULL);
+      SHOULD_EQUAL(ekvs_incrby(teststore, "hits", 5, &result), EKVS_OK)
+      SHOULD_EQUAL(result, 5)
+      SHOULD_EQUAL(ekvs_incrby(teststore, "hits", 10, &result), EKVS_OK)
+      SHOULD_EQUAL(result, 15)
+      SHOULD_EQUAL(ekvs_decrby(teststore, "hits", 20, NULL), EKVS_OK)
+      SHOULD_EQUAL(ekvs_get(teststore, "hits", &get_ptr, &get_sz), EKVS_OK)
+      SHOULD_EQUAL(get_sz, sizeof(int64_t))
+      memcpy(&result, get_ptr, sizeof(result));
+      SHOULD_EQUAL(result, -5)
+      ekvs_close(teststore);
+   END_IT
+
+   IT("converts decimal values, and rejects anything else")
+      ekvs teststore;
+      int64_t result = 0;
+      ekvs_open(&teststore, NULL, NULL);
+      ekvs_set(teststore, "text", "41", 3);
+      ekvs_set(teststore, "negative", "-9223372036854775808", 20);
+      ekvs_set(teststore, "word", "forty", 6);
+      ekvs_set(teststore, "huge", "9223372036854775808", 19);
+      SHOULD_EQUAL(ekvs_incrby(teststore, "text", 1, &result), EKVS_OK)
+      SHOULD_EQUAL(result, 42)
+      SHOULD_EQUAL(ekvs_incrby(teststore, "negative", 1, &result), EKVS_OK)
+      SHOULD_EQUAL(result, -(int64_t)9223372036854775807L)
+      SHOULD_EQUAL(ekvs_incrby(teststore, "word", 1, &result), EKVS_WRONG_TYPE)
+      SHOULD_EQUAL(ekvs_incrby(teststore, "huge", 1, &result), EKVS_WRONG_TYPE)
+      SHOULD_EQUAL(ekvs_append(teststore, "text", "0", 1), EKVS_WRONG_TYPE)
+      ekvs_close(teststore);
+   END_IT
+
+   IT("refuses to overflow")
+      ekvs teststore;
+      int64_t result = 0;
+      ekvs_open(&teststore, NULL, NULL);
+      ekvs_incrby(teststore, "key", 9223372036854775807L, &result);
+      SHOULD_EQUAL(ekvs_incrby(teststore, "key", 1, &result), EKVS_FAIL)
+      SHOULD_EQUAL(ekvs_incrby(teststore, "key", 0, &result), EKVS_OK)
+      SHOULD_EQUAL(result, 9223372036854775807L)
+      ekvs_close(teststore);
+   END_IT
+
+   IT("logs increments compactly, and replays them")
+      ekvs teststore;
+      const void* get_ptr;
+      size_t get_sz = 0;
+      int64_t result = 0;
+      long binlog_end;
+      int i;
+      const char* testfile = "counter_test";
+      ekvs_open(&teststore, testfile, NULL);
+      ekvs_set(teststore, "key", "100", 4);
+      for(i = 0; i < 10; i++)
+      {
+         binlog_end = teststore->serialized.binlog_end;
+         ekvs_incrby(teststore, "key", 3, NULL);
+         SHOULD_EQUAL(teststore->serialized.binlog_end - binlog_end, EKVS_BINLOG_HEADER_SIZE + 3 + sizeof(int64_t))
+      }
+      ekvs_incrby(teststore, "new", 7, NULL);
+      ekvs_close(teststore);
+
+      ekvs_open(&teststore, testfile, NULL);
+      SHOULD_EQUAL(ekvs_incrby(teststore, "key", 0, &result), EKVS_OK)
+      SHOULD_EQUAL(result, 130)
+      SHOULD_EQUAL(ekvs_snapshot(teststore, NULL), EKVS_OK)
+      ekvs_close(teststore);
+
+      ekvs_open(&teststore, testfile, NULL);
+      SHOULD_EQUAL(ekvs_get(teststore, "new", &get_ptr, &get_sz), EKVS_OK)
+      memcpy(&result, get_ptr, sizeof(result));
+      SHOULD_EQUAL(result, 7)
+      SHOULD_EQUAL(ekvs_incrby(teststore, "key", -30, &result), EKVS_OK)
+      SHOULD_EQUAL(result, 100)
+      ekvs_close(teststore);
+      remove(testfile);
+   END_IT
+END_DESCRIBE
@@ -10,6 +10,28 @@ DEFINE_DESCRIPTION(ekvs_get)
 DEFINE_DESCRIPTION(ekvs_del)
 DEFINE_DESCRIPTION(ekvs_binlog)
 DEFINE_DESCRIPTION(ekvs_snapshot)
+DEFINE_DESCRIPTION(ekvs_cache)
+DEFINE_DESCRIPTION(ekvs_vlog)
+DEFINE_DESCRIPTION(ekvs_compress)
+DEFINE_DESCRIPTION(ekvs_readonly)
+DEFINE_DESCRIPTION(ekvs_ref)
+DEFINE_DESCRIPTION(ekvs_mget)
+DEFINE_DESCRIPTION(ekvs_append)
+DEFINE_DESCRIPTION(ekvs_counter)
+DEFINE_DESCRIPTION(ekvs_collection)
+DEFINE_DESCRIPTION(ekvs_stats)
+DEFINE_DESCRIPTION(ekvs_trace)
+DEFINE_DESCRIPTION(ekvs_writer)
+DEFINE_DESCRIPTION(ekvs_segment)
+DEFINE_DESCRIPTION(ekvs_replica)
+DEFINE_DESCRIPTION(ekvs_shared)
+DEFINE_DESCRIPTION(ekvs_read_view)
+DEFINE_DESCRIPTION(ekvs_key)
+DEFINE_DESCRIPTION(ekvs_spill)
+DEFINE_DESCRIPTION(ekvs_lsm)
+DEFINE_DESCRIPTION(ekvs_checkpoint)
+DEFINE_DESCRIPTION(ekvs_snapshot_stream)
+DEFINE_DESCRIPTION(ekvs_table_pages)
 
 int main()
 {
@@ -19,5 +41,27 @@ int main()
    CSpec_Run(DESCRIPTION(ekvs_del), CSpec_NewOutputVerbose());
    CSpec_Run(DESCRIPTION(ekvs_binlog), CSpec_NewOutputVerbose());
    CSpec_Run(DESCRIPTION(ekvs_snapshot), CSpec_NewOutputVerbose());
+   CSpec_Run(DESCRIPTION(ekvs_cache), CSpec_NewOutputVerbose());
+   CSpec_Run(DESCRIPTION(ekvs_vlog), CSpec_NewOutputVerbose());
+   CSpec_Run(DESCRIPTION(ekvs_compress), CSpec_NewOutputVerbose());
+   CSpec_Run(DESCRIPTION(ekvs_readonly), CSpec_NewOutputVerbose());
+   CSpec_Run(DESCRIPTION(ekvs_ref), CSpec_NewOutputVerbose());
+   CSpec_Run(DESCRIPTION(ekvs_mget), CSpec_NewOutputVerbose());
+   CSpec_Run(DESCRIPTION(ekvs_append), CSpec_NewOutputVerbose());
+   CSpec_Run(DESCRIPTION(ekvs_counter), CSpec_NewOutputVerbose());
+   CSpec_Run(DESCRIPTION(ekvs_collection), CSpec_NewOutputVerbose());
+   CSpec_Run(DESCRIPTION(ekvs_stats), CSpec_NewOutputVerbose());
+   CSpec_Run(DESCRIPTION(ekvs_trace), CSpec_NewOutputVerbose());
+   CSpec_Run(DESCRIPTION(ekvs_writer), CSpec_NewOutputVerbose());
+   CSpec_Run(DESCRIPTION(ekvs_segment), CSpec_NewOutputVerbose());
+   CSpec_Run(DESCRIPTION(ekvs_replica), CSpec_NewOutputVerbose());
+   CSpec_Run(DESCRIPTION(ekvs_shared), CSpec_NewOutputVerbose());
+   CSpec_Run(DESCRIPTION(ekvs_read_view), CSpec_NewOutputVerbose());
+   CSpec_Run(DESCRIPTION(ekvs_key), CSpec_NewOutputVerbose());
+   CSpec_Run(DESCRIPTION(ekvs_spill), CSpec_NewOutputVerbose());
+   CSpec_Run(DESCRIPTION(ekvs_lsm), CSpec_NewOutputVerbose());
+   CSpec_Run(DESCRIPTION(ekvs_checkpoint), CSpec_NewOutputVerbose());
+   CSpec_Run(DESCRIPTION(ekvs_snapshot_stream), CSpec_NewOutputVerbose());
+   CSpec_Run(DESCRIPTION(ekvs_table_pages), CSpec_NewOutputVerbose());
    return 0;
 }
@@ -0,0 +1,116 @@
+#include <ekvs/ekvs.h>
+#include "../src/ekvs_internal.h"
+
+#include <cspec.h>
+#include <cspec_output_verbose.h>
+
+DESCRIBE(ekvs_key, "ekvs prepared key handles")
+   IT("gets, sets and deletes through a handle")
+      ekvs teststore;
+      ekvs_key handle;
+      const void* get_ptr;
+      size_t get_sz = 0;
+      ekvs_open(&teststore, NULL, NULL);
+
+      /* Only the first six bytes are the key */
+      SHOULD_EQUAL(ekvs_key_prepare(teststore, "hotkeyXYZ", 6, &handle), EKVS_OK)
+      SHOULD_EQUAL(ekvs_get_h(teststore, &handle, &get_ptr, &get_sz), EKVS_NO_KEY)
+      SHOULD_EQUAL(ekvs_set_h(teststore, &handle, "value1", 7, 0), EKVS_OK)
+      SHOULD_EQUAL(ekvs_get(teststore, "hotkey", &get_ptr, &get_sz), EKVS_OK)
+      SHOULD_MATCH(get_ptr, "value1")
+      SHOULD_EQUAL(ekvs_get_h(teststore, &handle, &get_ptr, &get_sz), EKVS_OK)
+      SHOULD_MATCH(get_ptr, "value1")
+
+      SHOULD_EQUAL(ekvs_set_h(teststore, &handle, "a longer value", 15, 0), EKVS_OK)
+      SHOULD_EQUAL(ekvs_get_h(teststore, &handle, &get_ptr, &get_sz), EKVS_OK)
+      SHOULD_MATCH(get_ptr, "a longer value")
+      SHOULD_EQUAL(ekvs_set_h(teststore, &handle, "packed packed packed", 21, ekvs_set_compress), EKVS_OK)
+      SHOULD_EQUAL(ekvs_get_h(teststore, &handle, &get_ptr, &get_sz), EKVS_OK)
+      SHOULD_MATCH(get_ptr, "packed packed packed")
+
+      SHOULD_EQUAL(ekvs_del_h(teststore, &handle), EKVS_OK)
+      SHOULD_EQUAL(ekvs_get_h(teststore, &handle, &get_ptr, &get_sz), EKVS_NO_KEY)
+      SHOULD_EQUAL(ekvs_get(teststore, "hotkey", &get_ptr, &get_sz), EKVS_NO_KEY)
+      SHOULD_EQUAL(ekvs_del_h(teststore, &handle), EKVS_NO_KEY)
+      ekvs_close(teststore);
+   END_IT
+
+   IT("goes straight to the entry until entries are freed or moved")
+      ekvs teststore;
+      ekvs otherstore;
+      ekvs_key handle;
+      const void* get_ptr;
+      const void* first_ptr;
+      size_t get_sz = 0;
+      ekvs_open(&teststore, NULL, NULL);
+      ekvs_open(&otherstore, NULL, NULL);
+      ekvs_set(teststore, "other", "x", 2);
+      ekvs_key_prepare(teststore, "hot", 3, &handle);
+      ekvs_set_h(teststore, &handle, "aaaa", 5, 0);
+      SHOULD_EQUAL(ekvs_get_h(teststore, &handle, &first_ptr, &get_sz), EKVS_OK)
+      SHOULD_NOT_BE_NULL(handle.hint)
+
+      /* Values of the same size are written in place */
+      SHOULD_EQUAL(ekvs_set_h(teststore, &handle, "bbbb", 5, 0), EKVS_OK)
+      SHOULD_NOT_BE_NULL(handle.hint)
+      SHOULD_EQUAL(ekvs_get_h(teststore, &handle, &get_ptr, &get_sz), EKVS_OK)
+      SHOULD_EQUAL(get_ptr, first_ptr)
+      SHOULD_MATCH(get_ptr, "bbbb")
+
+      /* Freeing any entry makes the hint stale */
+      ekvs_del(teststore, "other");
+      SHOULD_NOT_EQUAL(handle.epoch, teststore->entry_epoch)
+      ekvs_set(teststore, "hot", "cc", 3);
+      SHOULD_EQUAL(ekvs_get_h(teststore, &handle, &get_ptr, &get_sz), EKVS_OK)
+      SHOULD_MATCH(get_ptr, "cc")
+      SHOULD_EQUAL(handle.epoch, teststore->entry_epoch)
+
+      /* And so does using the handle with another database */
+      ekvs_set(otherstore, "hot", "other store", 12);
+      SHOULD_EQUAL(ekvs_get_h(otherstore, &handle, &get_ptr, &get_sz), EKVS_OK)
+      SHOULD_MATCH(get_ptr, "other store")
+      SHOULD_EQUAL(ekvs_set_h(teststore, &handle, "dd", 3, 0), EKVS_OK)
+      SHOULD_EQUAL(ekvs_get(teststore, "hot", &get_ptr, &get_sz), EKVS_OK)
+      SHOULD_MATCH(get_ptr, "dd")
+      SHOULD_EQUAL(ekvs_get(otherstore, "hot", &get_ptr, &get_sz), EKVS_OK)
+      SHOULD_MATCH(get_ptr, "other store")
+
+      ekvs_close(otherstore);
+      ekvs_close(teststore);
+   END_IT
+
+   IT("logs and preserves values written in place")
+      ekvs teststore;
+      ekvs_read_view view;
+      ekvs_ref ref;
+      ekvs_key handle;
+      const void* get_ptr;
+      size_t get_sz = 0;
+      const char* testfile = "key_test";
+      remove(testfile);
+      ekvs_open(&teststore, testfile, NULL);
+      ekvs_key_prepare(teststore, "hot", 3, &handle);
+      ekvs_set_h(teststore, &handle, "1111", 5, 0);
+      ekvs_get_h(teststore, &handle, &get_ptr, &get_sz);
+
+      SHOULD_EQUAL(ekvs_view_open(teststore, &view), EKVS_OK)
+      SHOULD_EQUAL(ekvs_set_h(teststore, &handle, "2222", 5, 0), EKVS_OK)
+      SHOULD_EQUAL(ekvs_view_get(view, "hot", &get_ptr, &get_sz), EKVS_OK)
+      SHOULD_MATCH(get_ptr, "1111")
+      ekvs_view_close(view);
+
+      /* Pinned values are not overwritten */
+      SHOULD_EQUAL(ekvs_get_ref(teststore, "hot", &ref), EKVS_OK)
+      SHOULD_EQUAL(ekvs_get_h(teststore, &handle, &get_ptr, &get_sz), EKVS_OK)
+      SHOULD_EQUAL(ekvs_set_h(teststore, &handle, "3333", 5, 0), EKVS_OK)
+      SHOULD_MATCH(ref.data, "2222")
+      ekvs_ref_release(teststore, &ref);
+      ekvs_close(teststore);
+
+      SHOULD_EQUAL(ekvs_open(&teststore, testfile, NULL), EKVS_OK)
+      SHOULD_EQUAL(ekvs_get(teststore, "hot", &get_ptr, &get_sz), EKVS_OK)
+      SHOULD_MATCH(get_ptr, "3333")
+      ekvs_close(teststore);
+      remove(testfile);
+   END_IT
+END_DESCRIBE
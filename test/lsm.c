@@ -0,0 +1,221 @@
+#include <ekvs/ekvs.h>
+#include "../src/ekvs_internal.h"
+
+#include <pthread.h>
+
+#include <cspec.h>
+#include <cspec_output_verbose.h>
+
+static void lsm_test_remove(const char* path)
+{
+   char fname[64];
+   int i;
+   remove(path);
+   sprintf(fname, "%s.lsm", path);
+   remove(fname);
+   for(i = 0; i < 1000; i++)
+   {
+      sprintf(fname, "%s.sst.%d", path, i);
+      remove(fname);
+   }
+}
+
+/* User allocators which note any call from a thread other than the store's */
+static pthread_t lsm_test_owner;
+static int lsm_test_foreign_calls = 0;
+
+static void lsm_test_check_thread(void)
+{
+   if(!pthread_equal(pthread_self(), lsm_test_owner)) lsm_test_foreign_calls++;
+}
+
+static void* lsm_test_malloc(size_t size) { lsm_test_check_thread(); return malloc(size); }
+static void* lsm_test_realloc(void* ptr, size_t size) { lsm_test_check_thread(); return realloc(ptr, size); }
+static void lsm_test_free(void* ptr) { lsm_test_check_thread(); free(ptr); }
+
+DESCRIBE(ekvs_lsm, "ekvs_opts.engine = ekvs_engine_lsm")
+   IT("requires a database file")
+      ekvs teststore;
+      ekvs_opts testopts;
+      memset(&testopts, 0, sizeof(ekvs_opts));
+      testopts.engine = ekvs_engine_lsm;
+      SHOULD_EQUAL(ekvs_open(&teststore, NULL, &testopts), EKVS_FAIL)
+   END_IT
+
+   IT("keeps sets, replacements and deletes across flushes and compactions")
+      ekvs teststore;
+      ekvs_opts testopts;
+      ekvs_runtime_stats stats;
+      const void* get_ptr;
+      size_t get_sz = 0;
+      char key[16];
+      char value[64];
+      int i, matched = 0, missing = 0;
+      const char* testfile = "lsm_test";
+      lsm_test_remove(testfile);
+      memset(&testopts, 0, sizeof(ekvs_opts));
+      testopts.engine = ekvs_engine_lsm;
+      testopts.lsm_memtable_size = 4096;
+      SHOULD_EQUAL(ekvs_open(&teststore, testfile, &testopts), EKVS_OK)
+
+      /* Enough writes for several level 0 tables, then replace every other key and delete every third */
+      for(i = 0; i < 500; i++)
+      {
+         sprintf(key, "key%04d", i);
+         sprintf(value, "first %d", i);
+         ekvs_set(teststore, key, value, strlen(value) + 1);
+      }
+      for(i = 0; i < 500; i += 2)
+      {
+         sprintf(key, "key%04d", i);
+         sprintf(value, "second %d", i);
+         ekvs_set(teststore, key, value, strlen(value) + 1);
+      }
+      for(i = 0; i < 500; i += 3)
+      {
+         sprintf(key, "key%04d", i);
+         SHOULD_EQUAL(ekvs_del(teststore, key), EKVS_OK)
+         SHOULD_EQUAL(ekvs_del(teststore, key), EKVS_NO_KEY)
+      }
+      ekvs_stats(teststore, &stats);
+      SHOULD_NOT_EQUAL(stats.lsm_flushes, 0)
+      SHOULD_NOT_EQUAL(stats.lsm_tables, 0)
+
+      for(i = 0; i < 500; i++)
+      {
+         sprintf(key, "key%04d", i);
+         sprintf(value, (i % 2 == 0 ? "second %d" : "first %d"), i);
+         if(i % 3 == 0)
+         {
+            if(ekvs_get(teststore, key, &get_ptr, &get_sz) == EKVS_NO_KEY) missing++;
+         }
+         else if(ekvs_get(teststore, key, &get_ptr, &get_sz) == EKVS_OK && get_sz == strlen(value) + 1 &&
+            memcmp(get_ptr, value, get_sz) == 0)
+         {
+            matched++;
+         }
+      }
+      SHOULD_EQUAL(missing, 167)
+      SHOULD_EQUAL(matched, 333)
+
+      /* Compaction leaves one table, without the deleted keys */
+      SHOULD_EQUAL(ekvs_compact(teststore), EKVS_OK)
+      ekvs_stats(teststore, &stats);
+      SHOULD_NOT_EQUAL(stats.lsm_compactions, 0)
+      SHOULD_EQUAL(stats.lsm_tables, 1)
+      SHOULD_EQUAL(stats.lsm_memtable_bytes, 0)
+      SHOULD_EQUAL(stats.population, 333)
+      SHOULD_EQUAL(ekvs_get(teststore, "key0001", &get_ptr, &get_sz), EKVS_OK)
+      SHOULD_MATCH(get_ptr, "first 1")
+      SHOULD_EQUAL(ekvs_get(teststore, "key0003", &get_ptr, &get_sz), EKVS_NO_KEY)
+      ekvs_close(teststore);
+      lsm_test_remove(testfile);
+   END_IT
+
+   IT("only calls user allocators from the thread which owns the store")
+      ekvs teststore;
+      ekvs_opts testopts;
+      ekvs_runtime_stats stats;
+      char key[16];
+      int i;
+      const char* testfile = "lsm_test";
+      lsm_test_remove(testfile);
+      lsm_test_owner = pthread_self();
+      lsm_test_foreign_calls = 0;
+      memset(&testopts, 0, sizeof(ekvs_opts));
+      testopts.engine = ekvs_engine_lsm;
+      testopts.lsm_memtable_size = 2048;
+      testopts.user_malloc = lsm_test_malloc;
+      testopts.user_realloc = lsm_test_realloc;
+      testopts.user_free = lsm_test_free;
+      SHOULD_EQUAL(ekvs_open(&teststore, testfile, &testopts), EKVS_OK)
+      for(i = 0; i < 2000; i++)
+      {
+         sprintf(key, "key%04d", i);
+         ekvs_set(teststore, key, key, strlen(key) + 1);
+      }
+      SHOULD_EQUAL(ekvs_compact(teststore), EKVS_OK)
+      ekvs_stats(teststore, &stats);
+      SHOULD_NOT_EQUAL(stats.lsm_compactions, 0)
+      ekvs_close(teststore);
+      SHOULD_EQUAL(lsm_test_foreign_calls, 0)
+
+      /* Later stores go back to the default allocators */
+      memset(&testopts, 0, sizeof(ekvs_opts));
+      SHOULD_EQUAL(ekvs_open(&teststore, NULL, &testopts), EKVS_OK)
+      ekvs_close(teststore);
+      lsm_test_remove(testfile);
+   END_IT
+
+   IT("recovers tables and the binlog when reopened")
+      ekvs teststore;
+      ekvs_opts testopts;
+      ekvs_key handle;
+      const void* get_ptr;
+      size_t get_sz = 0;
+      char key[16];
+      char value[64];
+      int i, matched = 0;
+      const char* testfile = "lsm_test";
+      lsm_test_remove(testfile);
+      memset(&testopts, 0, sizeof(ekvs_opts));
+      testopts.engine = ekvs_engine_lsm;
+      testopts.lsm_memtable_size = 2048;
+      SHOULD_EQUAL(ekvs_open(&teststore, testfile, &testopts), EKVS_OK)
+      for(i = 0; i < 200; i++)
+      {
+         sprintf(key, "key%04d", i);
+         sprintf(value, "value %d", i);
+         ekvs_set(teststore, key, value, strlen(value) + 1);
+      }
+      ekvs_del(teststore, "key0007");
+      ekvs_close(teststore);
+
+      /* The engine is kept with the database, and the last writes are replayed from the binlog */
+      SHOULD_EQUAL(ekvs_open(&teststore, testfile, NULL), EKVS_OK)
+      for(i = 0; i < 200; i++)
+      {
+         sprintf(key, "key%04d", i);
+         sprintf(value, "value %d", i);
+         if(ekvs_get(teststore, key, &get_ptr, &get_sz) == EKVS_OK && memcmp(get_ptr, value, get_sz) == 0) matched++;
+      }
+      SHOULD_EQUAL(matched, 199)
+      SHOULD_EQUAL(ekvs_get(teststore, "key0007", &get_ptr, &get_sz), EKVS_NO_KEY)
+
+      /* Prepared keys go through the same engine */
+      ekvs_key_prepare(teststore, "key0010", 7, &handle);
+      SHOULD_EQUAL(ekvs_set_h(teststore, &handle, "handle", 7, 0), EKVS_OK)
+      SHOULD_EQUAL(ekvs_get_h(teststore, &handle, &get_ptr, &get_sz), EKVS_OK)
+      SHOULD_MATCH(get_ptr, "handle")
+      SHOULD_EQUAL(ekvs_del_h(teststore, &handle), EKVS_OK)
+      SHOULD_EQUAL(ekvs_get_h(teststore, &handle, &get_ptr, &get_sz), EKVS_NO_KEY)
+      ekvs_close(teststore);
+      lsm_test_remove(testfile);
+   END_IT
+
+   IT("rejects operations the engine does not support")
+      ekvs teststore;
+      ekvs_opts testopts;
+      ekvs_ref ref;
+      int64_t count;
+      const char* testfile = "lsm_test";
+      lsm_test_remove(testfile);
+      memset(&testopts, 0, sizeof(ekvs_opts));
+      testopts.engine = ekvs_engine_lsm;
+      SHOULD_EQUAL(ekvs_open(&teststore, testfile, &testopts), EKVS_OK)
+      ekvs_set(teststore, "key", "value", 6);
+      SHOULD_EQUAL(ekvs_get_ref(teststore, "key", &ref), EKVS_UNSUPPORTED)
+      SHOULD_EQUAL(ekvs_append(teststore, "key", "more", 5), EKVS_UNSUPPORTED)
+      SHOULD_EQUAL(ekvs_incrby(teststore, "count", 1, &count), EKVS_UNSUPPORTED)
+      SHOULD_EQUAL(ekvs_snapshot(teststore, "lsm_test.copy"), EKVS_UNSUPPORTED)
+      SHOULD_EQUAL(ekvs_build_readonly(teststore, "lsm_test.ro"), EKVS_UNSUPPORTED)
+      SHOULD_EQUAL(ekvs_snapshot(teststore, NULL), EKVS_OK)
+      ekvs_close(teststore);
+
+      /* Hash stores have nothing to compact */
+      lsm_test_remove(testfile);
+      SHOULD_EQUAL(ekvs_open(&teststore, NULL, NULL), EKVS_OK)
+      SHOULD_EQUAL(ekvs_compact(teststore), EKVS_UNSUPPORTED)
+      ekvs_close(teststore);
+   END_IT
+END_DESCRIBE
@@ -0,0 +1,73 @@
+#include <ekvs/ekvs.h>
+#include "../src/ekvs_internal.h"
+
+#include <cspec.h>
+#include <cspec_output_verbose.h>
+
+DESCRIBE(ekvs_mget, "ekvs_mget( ekvs store, const char** keys, size_t n, ekvs_view* views )")
+   IT("returns the same values as ekvs_get, across several groups")
+      ekvs teststore;
+      char keybuf[100][16];
+      const char* keys[100];
+      ekvs_view views[100];
+      const void* get_ptr;
+      size_t get_sz = 0;
+      int i;
+      ekvs_open(&teststore, NULL, NULL);
+      for(i = 0; i < 100; i++)
+      {
+         sprintf(keybuf[i], "key%d", i);
+         keys[i] = keybuf[i];
+         if(i % 3 != 0) ekvs_set(teststore, keys[i], &i, sizeof(i));
+      }
+      SHOULD_EQUAL(ekvs_mget(teststore, keys, 100, views), EKVS_OK)
+      for(i = 0; i < 100; i++)
+      {
+         SHOULD_EQUAL(views[i].status, ekvs_get(teststore, keys[i], &get_ptr, &get_sz))
+         SHOULD_EQUAL(views[i].data, get_ptr)
+         SHOULD_EQUAL(views[i].data_sz, get_sz)
+      }
+      SHOULD_EQUAL(views[0].status, EKVS_NO_KEY)
+      SHOULD_EQUAL(*(const int*)views[1].data, 1)
+      ekvs_close(teststore);
+   END_IT
+
+   IT("reports NULL keys in their view, and accepts an empty batch")
+      ekvs teststore;
+      const char* keys[2];
+      ekvs_view views[2];
+      ekvs_open(&teststore, NULL, NULL);
+      ekvs_set(teststore, "key", "value", 6);
+      keys[0] = NULL;
+      keys[1] = "key";
+      SHOULD_EQUAL(ekvs_mget(teststore, keys, 2, views), EKVS_OK)
+      SHOULD_EQUAL(views[0].status, EKVS_FAIL)
+      SHOULD_EQUAL(views[1].status, EKVS_OK)
+      SHOULD_MATCH(views[1].data, "value")
+      SHOULD_EQUAL(ekvs_mget(teststore, NULL, 0, NULL), EKVS_OK)
+      ekvs_close(teststore);
+   END_IT
+
+   IT("works with read-only images")
+      ekvs teststore;
+      ekvs rostore;
+      const char* keys[3];
+      ekvs_view views[3];
+      const char* testfile = "mget_test.ro";
+      ekvs_open(&teststore, NULL, NULL);
+      ekvs_set(teststore, "a", "1", 2);
+      ekvs_set(teststore, "b", "2", 2);
+      ekvs_build_readonly(teststore, testfile);
+      ekvs_close(teststore);
+      keys[0] = "a";
+      keys[1] = "missing";
+      keys[2] = "b";
+      ekvs_open_readonly(&rostore, testfile, NULL);
+      SHOULD_EQUAL(ekvs_mget(rostore, keys, 3, views), EKVS_OK)
+      SHOULD_MATCH(views[0].data, "1")
+      SHOULD_EQUAL(views[1].status, EKVS_NO_KEY)
+      SHOULD_MATCH(views[2].data, "2")
+      ekvs_close(rostore);
+      remove(testfile);
+   END_IT
+END_DESCRIBE
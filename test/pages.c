@@ -0,0 +1,122 @@
+#include <ekvs/ekvs.h>
+#include "../src/ekvs_internal.h"
+
+#include <cspec.h>
+#include <cspec_output_verbose.h>
+
+/* 2MB of bucket pointers, the smallest table which is mapped */
+#define PAGES_TEST_TABLE_SIZE ((uint64_t)1 << 18)
+
+static void* pages_test_malloc(size_t size) { return malloc(size); }
+static void* pages_test_realloc(void* ptr, size_t size) { return realloc(ptr, size); }
+static void pages_test_free(void* ptr) { free(ptr); }
+
+static int pages_test_fill(ekvs store, int count)
+{
+   const void* get_ptr;
+   size_t get_sz = 0;
+   char key[16];
+   int i, matched = 0;
+   for(i = 0; i < count; i++)
+   {
+      sprintf(key, "key%05d", i);
+      ekvs_set(store, key, key, strlen(key) + 1);
+   }
+   for(i = 0; i < count; i++)
+   {
+      sprintf(key, "key%05d", i);
+      if(ekvs_get(store, key, &get_ptr, &get_sz) == EKVS_OK && strcmp(get_ptr, key) == 0) matched++;
+   }
+   return matched;
+}
+
+DESCRIBE(ekvs_table_pages, "ekvs_opts.table_pages and ekvs_opts.numa_policy")
+   IT("allocates small tables with ekvs_malloc")
+      ekvs teststore;
+      ekvs_opts testopts;
+      ekvs_runtime_stats stats;
+      memset(&testopts, 0, sizeof(ekvs_opts));
+      testopts.table_pages = ekvs_pages_2mb;
+      testopts.numa_policy = ekvs_numa_interleave;
+      SHOULD_EQUAL(ekvs_open(&teststore, NULL, &testopts), EKVS_OK)
+      SHOULD_EQUAL(teststore->table_map_sz, 0)
+      ekvs_stats(teststore, &stats);
+      SHOULD_EQUAL(stats.table_pages, ekvs_pages_default)
+      SHOULD_EQUAL(stats.table_numa_policy, ekvs_numa_default)
+      SHOULD_EQUAL(pages_test_fill(teststore, 100), 100)
+      ekvs_close(teststore);
+   END_IT
+
+   IT("maps large tables, and keeps them mapped when the table grows")
+      ekvs teststore;
+      ekvs_opts testopts;
+      ekvs_runtime_stats stats;
+      memset(&testopts, 0, sizeof(ekvs_opts));
+      testopts.initial_table_size = PAGES_TEST_TABLE_SIZE;
+      testopts.table_pages = ekvs_pages_transparent;
+      SHOULD_EQUAL(ekvs_open(&teststore, NULL, &testopts), EKVS_OK)
+      SHOULD_EQUAL(teststore->table_map_sz, PAGES_TEST_TABLE_SIZE * sizeof(struct _ekvs_db_entry*))
+      ekvs_stats(teststore, &stats);
+
+      /* Kernels without transparent huge pages leave the hint unused */
+      SHOULD_EQUAL(stats.table_pages == ekvs_pages_transparent || stats.table_pages == ekvs_pages_default, 1)
+      SHOULD_EQUAL(pages_test_fill(teststore, 1000), 1000)
+
+      SHOULD_EQUAL(ekvs_grow_table(teststore, PAGES_TEST_TABLE_SIZE * 2), EKVS_OK)
+      SHOULD_EQUAL(teststore->table_map_sz, PAGES_TEST_TABLE_SIZE * 2 * sizeof(struct _ekvs_db_entry*))
+      SHOULD_EQUAL(pages_test_fill(teststore, 1000), 1000)
+      ekvs_stats(teststore, &stats);
+      SHOULD_EQUAL(stats.population, 1000)
+      ekvs_close(teststore);
+   END_IT
+
+   IT("falls back from huge page pools which are empty, and applies NUMA policies where it can")
+      ekvs teststore;
+      ekvs_opts testopts;
+      ekvs_runtime_stats stats;
+      memset(&testopts, 0, sizeof(ekvs_opts));
+      testopts.initial_table_size = PAGES_TEST_TABLE_SIZE;
+      testopts.table_pages = ekvs_pages_1gb;
+      testopts.numa_policy = ekvs_numa_interleave;
+      SHOULD_EQUAL(ekvs_open(&teststore, NULL, &testopts), EKVS_OK)
+      SHOULD_NOT_EQUAL(teststore->table_map_sz, 0)
+      ekvs_stats(teststore, &stats);
+
+      /* The table is smaller than a 1GB page, so 2MB pages are the most it may get */
+      SHOULD_NOT_EQUAL(stats.table_pages, ekvs_pages_1gb)
+      SHOULD_EQUAL(stats.table_numa_policy == ekvs_numa_interleave || stats.table_numa_policy == ekvs_numa_default, 1)
+      SHOULD_EQUAL(pages_test_fill(teststore, 1000), 1000)
+      ekvs_close(teststore);
+
+      testopts.table_pages = ekvs_pages_default;
+      testopts.numa_policy = ekvs_numa_bind;
+      testopts.numa_nodes = 1;
+      SHOULD_EQUAL(ekvs_open(&teststore, NULL, &testopts), EKVS_OK)
+      SHOULD_NOT_EQUAL(teststore->table_map_sz, 0)
+      ekvs_stats(teststore, &stats);
+      SHOULD_EQUAL(stats.table_pages, ekvs_pages_default)
+      SHOULD_EQUAL(stats.table_numa_policy == ekvs_numa_bind || stats.table_numa_policy == ekvs_numa_default, 1)
+      SHOULD_EQUAL(pages_test_fill(teststore, 1000), 1000)
+      ekvs_close(teststore);
+   END_IT
+
+   IT("leaves tables to user allocators")
+      ekvs teststore;
+      ekvs_opts testopts;
+      memset(&testopts, 0, sizeof(ekvs_opts));
+      testopts.initial_table_size = PAGES_TEST_TABLE_SIZE;
+      testopts.table_pages = ekvs_pages_transparent;
+      testopts.user_malloc = pages_test_malloc;
+      testopts.user_realloc = pages_test_realloc;
+      testopts.user_free = pages_test_free;
+      SHOULD_EQUAL(ekvs_open(&teststore, NULL, &testopts), EKVS_OK)
+      SHOULD_EQUAL(teststore->table_map_sz, 0)
+      SHOULD_EQUAL(pages_test_fill(teststore, 100), 100)
+      ekvs_close(teststore);
+
+      /* Later stores go back to the default allocators */
+      memset(&testopts, 0, sizeof(ekvs_opts));
+      SHOULD_EQUAL(ekvs_open(&teststore, NULL, &testopts), EKVS_OK)
+      ekvs_close(teststore);
+   END_IT
+END_DESCRIBE
@@ -0,0 +1,129 @@
+#include <ekvs/ekvs.h>
+#include "../src/ekvs_internal.h"
+
+#include <cspec.h>
+#include <cspec_output_verbose.h>
+
+DESCRIBE(ekvs_readonly, "ekvs read-only images")
+   IT("builds an image which can be opened and queried")
+      ekvs teststore;
+      ekvs rostore;
+      const void* get_ptr;
+      size_t get_sz = 0;
+      char key[16];
+      int i;
+      const char* testfile = "readonly_test.ro";
+      ekvs_open(&teststore, NULL, NULL);
+      for(i = 0; i < 100; i++)
+      {
+         sprintf(key, "key%d", i);
+         ekvs_set(teststore, key, &i, sizeof(i));
+      }
+      ekvs_set(teststore, "empty", NULL, 0);
+      SHOULD_EQUAL(ekvs_build_readonly(teststore, testfile), EKVS_OK)
+      ekvs_close(teststore);
+
+      SHOULD_EQUAL(ekvs_open_readonly(&rostore, testfile, NULL), EKVS_OK)
+      for(i = 0; i < 100; i++)
+      {
+         sprintf(key, "key%d", i);
+         SHOULD_EQUAL(ekvs_get(rostore, key, &get_ptr, &get_sz), EKVS_OK)
+         SHOULD_EQUAL(get_sz, sizeof(i))
+         SHOULD_EQUAL(memcmp(get_ptr, &i, sizeof(i)), 0)
+      }
+      SHOULD_EQUAL(ekvs_get(rostore, "empty", &get_ptr, &get_sz), EKVS_OK)
+      SHOULD_EQUAL(get_sz, 0)
+      SHOULD_EQUAL(ekvs_get(rostore, "missing", &get_ptr, &get_sz), EKVS_NO_KEY)
+      SHOULD_BE_NULL(get_ptr)
+      ekvs_close(rostore);
+      remove(testfile);
+   END_IT
+
+   IT("resolves value log and compressed values into the image")
+      ekvs teststore;
+      ekvs rostore;
+      ekvs_opts testopts;
+      const void* get_ptr;
+      size_t get_sz = 0;
+      char big[1024];
+      const char* testfile = "readonly_test.ro";
+      memset(big, 'x', sizeof(big));
+      memset(&testopts, 0, sizeof(ekvs_opts));
+      testopts.vlog_threshold = 16;
+      testopts.vlog_path = "readonly_test.vlog";
+      ekvs_open(&teststore, NULL, &testopts);
+      ekvs_set(teststore, "vlog", "a value in the value log", 25);
+      ekvs_set_ex(teststore, "packed", big, sizeof(big), ekvs_set_compress);
+      SHOULD_EQUAL(ekvs_build_readonly(teststore, testfile), EKVS_OK)
+      ekvs_close(teststore);
+      remove("readonly_test.vlog.0");
+
+      SHOULD_EQUAL(ekvs_open_readonly(&rostore, testfile, NULL), EKVS_OK)
+      SHOULD_EQUAL(ekvs_get(rostore, "vlog", &get_ptr, &get_sz), EKVS_OK)
+      SHOULD_MATCH(get_ptr, "a value in the value log")
+      SHOULD_EQUAL(ekvs_get(rostore, "packed", &get_ptr, &get_sz), EKVS_OK)
+      SHOULD_EQUAL(get_sz, sizeof(big))
+      SHOULD_EQUAL(memcmp(get_ptr, big, sizeof(big)), 0)
+      ekvs_close(rostore);
+      remove(testfile);
+   END_IT
+
+   IT("leaves lists and sets out of the image")
+      ekvs teststore;
+      ekvs rostore;
+      ekvs_runtime_stats stats;
+      const void* get_ptr;
+      size_t get_sz = 0;
+      int64_t count = 0;
+      const char* testfile = "readonly_test.ro";
+      ekvs_open(&teststore, NULL, NULL);
+      ekvs_set(teststore, "plain", "value", 6);
+      ekvs_incrby(teststore, "counter", 42, &count);
+      ekvs_rpush(teststore, "list", "a", 1);
+      ekvs_sadd(teststore, "set", "x", 1, NULL);
+      SHOULD_EQUAL(ekvs_build_readonly(teststore, testfile), EKVS_OK)
+      ekvs_close(teststore);
+
+      SHOULD_EQUAL(ekvs_open_readonly(&rostore, testfile, NULL), EKVS_OK)
+      SHOULD_EQUAL(ekvs_get(rostore, "plain", &get_ptr, &get_sz), EKVS_OK)
+      SHOULD_MATCH(get_ptr, "value")
+      SHOULD_EQUAL(ekvs_get(rostore, "counter", &get_ptr, &get_sz), EKVS_OK)
+      SHOULD_EQUAL(ekvs_get(rostore, "list", &get_ptr, &get_sz), EKVS_NO_KEY)
+      SHOULD_EQUAL(ekvs_get(rostore, "set", &get_ptr, &get_sz), EKVS_NO_KEY)
+      ekvs_stats(rostore, &stats);
+      SHOULD_EQUAL(stats.population, 2)
+      ekvs_close(rostore);
+      remove(testfile);
+   END_IT
+
+   IT("rejects modification")
+      ekvs teststore;
+      ekvs rostore;
+      const char* testfile = "readonly_test.ro";
+      ekvs_open(&teststore, NULL, NULL);
+      ekvs_set(teststore, "key", "value", 6);
+      ekvs_build_readonly(teststore, testfile);
+      ekvs_close(teststore);
+
+      ekvs_open_readonly(&rostore, testfile, NULL);
+      SHOULD_EQUAL(ekvs_set(rostore, "key", "other", 6), EKVS_READ_ONLY)
+      SHOULD_EQUAL(ekvs_del(rostore, "key"), EKVS_READ_ONLY)
+      SHOULD_EQUAL(ekvs_snapshot(rostore, "readonly_test.snap"), EKVS_READ_ONLY)
+      SHOULD_EQUAL(ekvs_build_readonly(rostore, "readonly_test.copy"), EKVS_READ_ONLY)
+      ekvs_close(rostore);
+      remove(testfile);
+   END_IT
+
+   IT("refuses files which are not images")
+      ekvs teststore;
+      ekvs rostore;
+      const char* testfile = "readonly_test.db";
+      ekvs_open(&teststore, testfile, NULL);
+      ekvs_set(teststore, "key", "value", 6);
+      ekvs_close(teststore);
+      SHOULD_EQUAL(ekvs_open_readonly(&rostore, testfile, NULL), EKVS_FILE_FAIL)
+      SHOULD_BE_NULL(rostore)
+      SHOULD_EQUAL(ekvs_open_readonly(&rostore, "readonly_test.missing", NULL), EKVS_FILE_FAIL)
+      remove(testfile);
+   END_IT
+END_DESCRIBE
@@ -0,0 +1,104 @@
+#include <ekvs/ekvs.h>
+#include "../src/ekvs_internal.h"
+
+#include <cspec.h>
+#include <cspec_output_verbose.h>
+
+DESCRIBE(ekvs_ref, "ekvs_get_ref( ekvs store, const char* key, ekvs_ref* ref )")
+   IT("keeps the pinned value while the key is set again")
+      ekvs teststore;
+      ekvs_ref ref;
+      const void* get_ptr;
+      size_t get_sz = 0;
+      char big[4096];
+      memset(big, 'b', sizeof(big));
+      ekvs_open(&teststore, NULL, NULL);
+      ekvs_set(teststore, "key", "first", 6);
+      SHOULD_EQUAL(ekvs_get_ref(teststore, "key", &ref), EKVS_OK)
+      SHOULD_EQUAL(ref.data_sz, 6)
+      SHOULD_EQUAL(ekvs_set(teststore, "key", big, sizeof(big)), EKVS_OK)
+      SHOULD_MATCH(ref.data, "first")
+      SHOULD_EQUAL(ekvs_get(teststore, "key", &get_ptr, &get_sz), EKVS_OK)
+      SHOULD_EQUAL(get_sz, sizeof(big))
+      SHOULD_EQUAL(memcmp(get_ptr, big, sizeof(big)), 0)
+      ekvs_ref_release(teststore, &ref);
+      SHOULD_BE_NULL(teststore->retired)
+      ekvs_ref_release(teststore, &ref);
+      ekvs_close(teststore);
+   END_IT
+
+   IT("keeps the pinned value while the key is deleted")
+      ekvs teststore;
+      ekvs_ref ref1;
+      ekvs_ref ref2;
+      const void* get_ptr;
+      size_t get_sz = 0;
+      ekvs_open(&teststore, NULL, NULL);
+      ekvs_set(teststore, "key", "value", 6);
+      ekvs_get_ref(teststore, "key", &ref1);
+      ekvs_get_ref(teststore, "key", &ref2);
+      SHOULD_EQUAL(ekvs_del(teststore, "key"), EKVS_OK)
+      SHOULD_EQUAL(ekvs_get(teststore, "key", &get_ptr, &get_sz), EKVS_NO_KEY)
+      SHOULD_MATCH(ref1.data, "value")
+      ekvs_ref_release(teststore, &ref1);
+      SHOULD_MATCH(ref2.data, "value")
+      ekvs_ref_release(teststore, &ref2);
+      SHOULD_BE_NULL(teststore->retired)
+      ekvs_close(teststore);
+   END_IT
+
+   IT("fails for a missing key without pinning anything")
+      ekvs teststore;
+      ekvs_ref ref;
+      ekvs_open(&teststore, NULL, NULL);
+      SHOULD_EQUAL(ekvs_get_ref(teststore, "missing", &ref), EKVS_NO_KEY)
+      SHOULD_BE_NULL(ref.pin)
+      ekvs_ref_release(teststore, &ref);
+      ekvs_close(teststore);
+   END_IT
+
+   IT("does not evict pinned keys")
+      ekvs teststore;
+      ekvs_opts testopts;
+      ekvs_ref ref;
+      ekvs_cache_stats stats;
+      const void* get_ptr;
+      size_t get_sz = 0;
+      char key[16];
+      char value[64];
+      int i;
+      memset(&testopts, 0, sizeof(ekvs_opts));
+      memset(value, 'v', sizeof(value));
+      value[sizeof(value) - 1] = '\0';
+      testopts.max_memory = 4096;
+      ekvs_open(&teststore, NULL, &testopts);
+      ekvs_set(teststore, "pinned", value, sizeof(value));
+      ekvs_get_ref(teststore, "pinned", &ref);
+      for(i = 0; i < 200; i++)
+      {
+         sprintf(key, "key%d", i);
+         ekvs_set(teststore, key, value, sizeof(value));
+      }
+      ekvs_get_cache_stats(teststore, &stats);
+      SHOULD_NOT_EQUAL(stats.evictions, 0)
+      SHOULD_EQUAL(ekvs_get(teststore, "pinned", &get_ptr, &get_sz), EKVS_OK)
+      SHOULD_EQUAL(get_ptr, ref.data)
+      ekvs_ref_release(teststore, &ref);
+      ekvs_close(teststore);
+   END_IT
+
+   IT("pins values which were stored compressed")
+      ekvs teststore;
+      ekvs_ref ref;
+      char big[1024];
+      memset(big, 'c', sizeof(big));
+      ekvs_open(&teststore, NULL, NULL);
+      ekvs_set_ex(teststore, "key", big, sizeof(big), ekvs_set_compress);
+      SHOULD_EQUAL(ekvs_get_ref(teststore, "key", &ref), EKVS_OK)
+      ekvs_set(teststore, "key", "small", 6);
+      SHOULD_EQUAL(ref.data_sz, sizeof(big))
+      SHOULD_EQUAL(memcmp(ref.data, big, sizeof(big)), 0)
+      ekvs_ref_release(teststore, &ref);
+      ekvs_close(teststore);
+   END_IT
+END_DESCRIBE
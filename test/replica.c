@@ -0,0 +1,232 @@
+#include <ekvs/ekvs.h>
+#include "../src/ekvs_internal.h"
+
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <cspec.h>
+#include <cspec_output_verbose.h>
+
+/* Pump the stream until the follower has applied everything the leader logged */
+static int replica_test_sync(ekvs leader, ekvs follower)
+{
+   ekvs_replica_status status;
+   int i;
+   for(i = 0; i < 1000; i++)
+   {
+      ekvs_replicate_flush(leader);
+      if(ekvs_replica_poll(follower, 1) != EKVS_OK) return 0;
+      ekvs_get_replica_status(follower, &status);
+      if(status.synced && status.applied_lsn == ekvs_lsn(leader)) return 1;
+   }
+   return 0;
+}
+
+static int replica_test_equal(ekvs follower, const char* key, const char* expected)
+{
+   const void* get_ptr;
+   size_t get_sz = 0;
+   if(ekvs_get(follower, key, &get_ptr, &get_sz) != EKVS_OK) return 0;
+   return (get_sz == strlen(expected) && memcmp(get_ptr, expected, get_sz) == 0);
+}
+
+DESCRIBE(ekvs_replica, "ekvs replication")
+   IT("sends a full copy to a new follower, then streams every modification")
+      ekvs leader;
+      ekvs follower;
+      ekvs_opts opts;
+      ekvs_replica_status status;
+      ekvs_runtime_stats stats;
+      ekvs_view views[4];
+      size_t count = 0;
+      const void* get_ptr;
+      size_t get_sz = 0;
+      int64_t counter = 0;
+      char large[64];
+      char key[16];
+      int fds[2];
+      int i;
+      int found = 0;
+      const char* testfile = "replica_test";
+      memset(&opts, 0, sizeof(opts));
+      opts.vlog_threshold = 32;
+      opts.vlog_path = "replica_test.vlog";
+      memset(large, 'l', sizeof(large));
+      ekvs_open(&leader, testfile, &opts);
+      ekvs_set(leader, "plain", "value", 5);
+      ekvs_set(leader, "large", large, sizeof(large));
+      ekvs_set_ex(leader, "packed", "aaaaaaaaaaaaaaaaaaaaaaaa", 24, ekvs_set_compress);
+      ekvs_incrby(leader, "counter", 7, &counter);
+      ekvs_rpush(leader, "list", "a", 1);
+      ekvs_rpush(leader, "list", "b", 1);
+      ekvs_sadd(leader, "set", "12", 2, NULL);
+      ekvs_del(leader, "plain");
+      ekvs_snapshot(leader, NULL);
+      ekvs_set(leader, "after", "snapshot", 8);
+
+      SHOULD_EQUAL(socketpair(AF_UNIX, SOCK_STREAM, 0, fds), 0)
+      SHOULD_EQUAL(ekvs_open_replica(&follower, fds[1], NULL), EKVS_OK)
+      SHOULD_EQUAL(ekvs_replicate(leader, fds[0], 0, 0), EKVS_OK)
+      SHOULD_EQUAL(replica_test_sync(leader, follower), 1)
+
+      SHOULD_EQUAL(ekvs_get(follower, "plain", &get_ptr, &get_sz), EKVS_NO_KEY)
+      SHOULD_EQUAL(ekvs_get(follower, "large", &get_ptr, &get_sz), EKVS_OK)
+      SHOULD_EQUAL(get_sz, sizeof(large))
+      SHOULD_EQUAL(replica_test_equal(follower, "packed", "aaaaaaaaaaaaaaaaaaaaaaaa"), 1)
+      SHOULD_EQUAL(ekvs_get(follower, "counter", &get_ptr, &get_sz), EKVS_OK)
+      memcpy(&counter, get_ptr, sizeof(counter));
+      SHOULD_EQUAL(counter, 7)
+      SHOULD_EQUAL(replica_test_equal(follower, "after", "snapshot"), 1)
+      SHOULD_EQUAL(ekvs_lrange(follower, "list", 0, -1, views, 4, &count), EKVS_OK)
+      SHOULD_EQUAL(count, 2)
+      SHOULD_EQUAL(views[1].data_sz, 1)
+      SHOULD_EQUAL(memcmp(views[1].data, "b", 1), 0)
+      SHOULD_EQUAL(ekvs_sismember(follower, "set", "12", 2, &found), EKVS_OK)
+      SHOULD_EQUAL(found, 1)
+
+      /* Followers only change through the stream */
+      SHOULD_EQUAL(ekvs_set(follower, "plain", "value", 5), EKVS_READ_ONLY)
+      SHOULD_EQUAL(ekvs_del(follower, "after"), EKVS_READ_ONLY)
+      SHOULD_EQUAL(ekvs_rpush(follower, "list", "c", 1), EKVS_READ_ONLY)
+      SHOULD_EQUAL(ekvs_incrby(follower, "counter", 1, &counter), EKVS_READ_ONLY)
+
+      /* Live records, more than the socket holds at once */
+      for(i = 0; i < 5000; i++)
+      {
+         sprintf(key, "key%04d", i);
+         ekvs_set(leader, key, key, strlen(key));
+      }
+      ekvs_set(leader, "large", "replaced", 8);
+      ekvs_incrby(leader, "counter", 5, &counter);
+      ekvs_lpop(leader, "list", &get_ptr, &get_sz);
+      ekvs_srem(leader, "set", "12", 2);
+      ekvs_stats(leader, &stats);
+      SHOULD_EQUAL(stats.replicas, 1)
+      SHOULD_EQUAL(replica_test_sync(leader, follower), 1)
+
+      found = 0;
+      for(i = 0; i < 5000; i++)
+      {
+         sprintf(key, "key%04d", i);
+         found += replica_test_equal(follower, key, key);
+      }
+      SHOULD_EQUAL(found, 5000)
+      SHOULD_EQUAL(replica_test_equal(follower, "large", "replaced"), 1)
+      SHOULD_EQUAL(ekvs_get(follower, "counter", &get_ptr, &get_sz), EKVS_OK)
+      memcpy(&counter, get_ptr, sizeof(counter));
+      SHOULD_EQUAL(counter, 12)
+      SHOULD_EQUAL(ekvs_lrange(follower, "list", 0, -1, views, 4, &count), EKVS_OK)
+      SHOULD_EQUAL(count, 1)
+      SHOULD_EQUAL(views[0].data_sz, 1)
+      SHOULD_EQUAL(memcmp(views[0].data, "b", 1), 0)
+      SHOULD_EQUAL(ekvs_sismember(follower, "set", "12", 2, &found), EKVS_OK)
+      SHOULD_EQUAL(found, 0)
+
+      SHOULD_EQUAL(ekvs_get_replica_status(follower, &status), EKVS_OK)
+      SHOULD_EQUAL(status.applied_lsn, ekvs_lsn(leader))
+      SHOULD_EQUAL(status.lag_bytes, 0)
+      SHOULD_EQUAL(status.full_syncs, 1)
+      SHOULD_NOT_EQUAL(status.run_id, 0)
+      SHOULD_EQUAL(status.records > 5000, 1)
+      SHOULD_EQUAL(ekvs_get_replica_status(leader, &status), EKVS_FAIL)
+
+      /* The follower sees the end of the stream */
+      SHOULD_EQUAL(ekvs_replicate_stop(leader, fds[0]), EKVS_OK)
+      SHOULD_EQUAL(ekvs_replicate_stop(leader, fds[0]), EKVS_NO_KEY)
+      close(fds[0]);
+      SHOULD_EQUAL(ekvs_replica_poll(follower, 0), EKVS_FILE_FAIL)
+      close(fds[1]);
+
+      ekvs_close(follower);
+      ekvs_close(leader);
+      remove(testfile);
+      remove("replica_test.vlog.0");
+   END_IT
+
+   IT("resumes a follower from the backlog, and sends a full copy once it no longer reaches back")
+      ekvs leader;
+      ekvs follower;
+      ekvs_opts opts;
+      ekvs_replica_status status;
+      char key[16];
+      int fds[2];
+      int i;
+      memset(&opts, 0, sizeof(opts));
+      opts.replica_backlog_size = 4096;
+      ekvs_open(&leader, NULL, &opts);
+      ekvs_set(leader, "before", "attach", 6);
+
+      socketpair(AF_UNIX, SOCK_STREAM, 0, fds);
+      ekvs_open_replica(&follower, fds[1], NULL);
+      ekvs_replicate(leader, fds[0], 0, 0);
+      SHOULD_EQUAL(replica_test_sync(leader, follower), 1)
+      SHOULD_EQUAL(replica_test_equal(follower, "before", "attach"), 1)
+
+      /* Disconnect, and miss a few records */
+      ekvs_replicate_stop(leader, fds[0]);
+      close(fds[0]);
+      close(fds[1]);
+      ekvs_set(leader, "while", "away", 4);
+      ekvs_del(leader, "before");
+
+      socketpair(AF_UNIX, SOCK_STREAM, 0, fds);
+      ekvs_get_replica_status(follower, &status);
+      SHOULD_EQUAL(ekvs_replica_attach(follower, fds[1]), EKVS_OK)
+      SHOULD_EQUAL(ekvs_replicate(leader, fds[0], status.run_id, status.applied_lsn), EKVS_OK)
+      SHOULD_EQUAL(replica_test_sync(leader, follower), 1)
+      SHOULD_EQUAL(replica_test_equal(follower, "while", "away"), 1)
+      SHOULD_EQUAL(replica_test_equal(follower, "before", "attach"), 0)
+      ekvs_get_replica_status(follower, &status);
+      SHOULD_EQUAL(status.full_syncs, 1)
+
+      /* Miss more than the backlog holds */
+      ekvs_replicate_stop(leader, fds[0]);
+      close(fds[0]);
+      close(fds[1]);
+      for(i = 0; i < 200; i++)
+      {
+         sprintf(key, "key%03d", i);
+         ekvs_set(leader, key, key, strlen(key));
+      }
+
+      socketpair(AF_UNIX, SOCK_STREAM, 0, fds);
+      ekvs_replica_attach(follower, fds[1]);
+      SHOULD_EQUAL(ekvs_replicate(leader, fds[0], status.run_id, status.applied_lsn), EKVS_OK)
+      SHOULD_EQUAL(replica_test_sync(leader, follower), 1)
+      SHOULD_EQUAL(replica_test_equal(follower, "key000", "key000"), 1)
+      SHOULD_EQUAL(replica_test_equal(follower, "key199", "key199"), 1)
+      ekvs_get_replica_status(follower, &status);
+      SHOULD_EQUAL(status.full_syncs, 2)
+
+      /* A position from another run of the leader is not trusted */
+      ekvs_replicate_stop(leader, fds[0]);
+      close(fds[0]);
+      close(fds[1]);
+      socketpair(AF_UNIX, SOCK_STREAM, 0, fds);
+      ekvs_replica_attach(follower, fds[1]);
+      ekvs_replicate(leader, fds[0], status.run_id + 1, status.applied_lsn);
+      SHOULD_EQUAL(replica_test_sync(leader, follower), 1)
+      ekvs_get_replica_status(follower, &status);
+      SHOULD_EQUAL(status.full_syncs, 3)
+
+      close(fds[0]);
+      close(fds[1]);
+      ekvs_close(follower);
+      ekvs_close(leader);
+   END_IT
+
+   IT("detaches a follower whose stream fails")
+      ekvs leader;
+      ekvs_runtime_stats stats;
+      int fds[2];
+      ekvs_open(&leader, NULL, NULL);
+      socketpair(AF_UNIX, SOCK_STREAM, 0, fds);
+      SHOULD_EQUAL(ekvs_replicate(leader, fds[0], 0, 0), EKVS_OK)
+      close(fds[1]);
+      SHOULD_EQUAL(ekvs_set(leader, "key", "value", 5), EKVS_OK)
+      ekvs_stats(leader, &stats);
+      SHOULD_EQUAL(stats.replicas, 0)
+      close(fds[0]);
+      ekvs_close(leader);
+   END_IT
+END_DESCRIBE
@@ -0,0 +1,212 @@
+#include <ekvs/ekvs.h>
+#include "../src/ekvs_internal.h"
+
+#include <sys/stat.h>
+
+#include <cspec.h>
+#include <cspec_output_verbose.h>
+
+static long segment_test_size(const char* path, unsigned long segment)
+{
+   char name[64];
+   struct stat st;
+   sprintf(name, "%s.log.%08lu", path, segment);
+   if(stat(name, &st) != 0) return -1;
+   return (long)st.st_size;
+}
+
+static void segment_test_cleanup(const char* path)
+{
+   char name[64];
+   unsigned long segment;
+   for(segment = 0; segment < 64; segment++)
+   {
+      sprintf(name, "%s.log.%08lu", path, segment);
+      remove(name);
+   }
+   remove(path);
+}
+
+static int segment_test_count(ekvs store, int keys)
+{
+   const void* get_ptr;
+   size_t get_sz = 0;
+   char key[16];
+   int i;
+   int found = 0;
+   for(i = 0; i < keys; i++)
+   {
+      sprintf(key, "key%03d", i);
+      if(ekvs_get(store, key, &get_ptr, &get_sz) == EKVS_OK && get_sz == 32) found++;
+   }
+   return found;
+}
+
+static void segment_test_fill(ekvs store, int keys)
+{
+   char key[16];
+   char value[32];
+   int i;
+   memset(value, 'v', sizeof(value));
+   for(i = 0; i < keys; i++)
+   {
+      sprintf(key, "key%03d", i);
+      ekvs_set(store, key, value, sizeof(value));
+   }
+}
+
+DESCRIBE(ekvs_segment, "ekvs segmented binlog")
+   IT("writes records to preallocated segments, and replays them in order")
+      ekvs teststore;
+      ekvs_opts opts;
+      ekvs_runtime_stats stats;
+      const char* testfile = "segment_test";
+      memset(&opts, 0, sizeof(opts));
+      opts.binlog_segment_size = 4096;
+      ekvs_open(&teststore, testfile, &opts);
+      SHOULD_EQUAL(segment_test_size(testfile, 0), 4096)
+      segment_test_fill(teststore, 200);
+      ekvs_del(teststore, "key007");
+      ekvs_stats(teststore, &stats);
+      SHOULD_EQUAL(stats.binlog_size, ekvs_lsn(teststore))
+      SHOULD_EQUAL(teststore->serialized.binlog_end, teststore->serialized.binlog_start)
+      SHOULD_EQUAL(teststore->segment, 2)
+      SHOULD_EQUAL(segment_test_size(testfile, 2), 4096)
+      SHOULD_EQUAL(segment_test_size(testfile, 1), 4096)
+      ekvs_close(teststore);
+
+      /* The layout is kept without the option */
+      ekvs_open(&teststore, testfile, NULL);
+      SHOULD_EQUAL(segment_test_count(teststore, 200), 199)
+      SHOULD_EQUAL(teststore->discarded_bytes, 0)
+      ekvs_set(teststore, "key007", "0123456789abcdef0123456789abcdef", 32);
+      ekvs_close(teststore);
+      ekvs_open(&teststore, testfile, NULL);
+      SHOULD_EQUAL(segment_test_count(teststore, 200), 200)
+      ekvs_close(teststore);
+      segment_test_cleanup(testfile);
+   END_IT
+
+   IT("drops the segments covered by a snapshot")
+      ekvs teststore;
+      ekvs_opts opts;
+      uint64_t first;
+      const char* testfile = "segment_test";
+      memset(&opts, 0, sizeof(opts));
+      opts.binlog_segment_size = 4096;
+      ekvs_open(&teststore, testfile, &opts);
+      segment_test_fill(teststore, 200);
+      first = teststore->segment + 1;
+      SHOULD_EQUAL(ekvs_snapshot(teststore, NULL), EKVS_OK)
+      SHOULD_EQUAL(teststore->serialized.first_segment, first)
+      SHOULD_EQUAL(segment_test_size(testfile, 0), -1)
+      SHOULD_EQUAL(segment_test_size(testfile, first - 1), -1)
+      SHOULD_EQUAL(segment_test_size(testfile, first), 4096)
+      ekvs_del(teststore, "key000");
+      ekvs_close(teststore);
+
+      ekvs_open(&teststore, testfile, NULL);
+      SHOULD_EQUAL(segment_test_count(teststore, 200), 199)
+      SHOULD_EQUAL(teststore->segment, first)
+      ekvs_close(teststore);
+      segment_test_cleanup(testfile);
+   END_IT
+
+   IT("discards a damaged tail, and appends over it")
+      ekvs teststore;
+      ekvs_opts opts;
+      FILE* segment;
+      char name[64];
+      long end;
+      const char* testfile = "segment_test";
+      memset(&opts, 0, sizeof(opts));
+      opts.binlog_segment_size = 4096;
+      ekvs_open(&teststore, testfile, &opts);
+      segment_test_fill(teststore, 10);
+      end = (long)teststore->segment_end;
+      ekvs_close(teststore);
+
+      sprintf(name, "%s.log.%08lu", testfile, 0UL);
+      segment = fopen(name, "rb+");
+      fseek(segment, end + 5, SEEK_SET);
+      fwrite("garbage", 1, 7, segment);
+      fclose(segment);
+
+      ekvs_open(&teststore, testfile, NULL);
+      SHOULD_EQUAL(segment_test_count(teststore, 10), 10)
+      SHOULD_NOT_EQUAL(teststore->discarded_bytes, 0)
+      SHOULD_EQUAL((long)teststore->segment_end, end)
+      segment_test_fill(teststore, 20);
+      ekvs_close(teststore);
+
+      ekvs_open(&teststore, testfile, NULL);
+      SHOULD_EQUAL(segment_test_count(teststore, 20), 20)
+      SHOULD_EQUAL(teststore->discarded_bytes, 0)
+      ekvs_close(teststore);
+      segment_test_cleanup(testfile);
+   END_IT
+
+   IT("stops at a damaged record in an earlier segment, and discards the segments after it")
+      ekvs teststore;
+      ekvs_opts opts;
+      FILE* segment;
+      char name[64];
+      int found;
+      const char* testfile = "segment_test";
+      memset(&opts, 0, sizeof(opts));
+      opts.binlog_segment_size = 4096;
+      ekvs_open(&teststore, testfile, &opts);
+      segment_test_fill(teststore, 200);
+      SHOULD_EQUAL(teststore->segment > 1, 1)
+      ekvs_close(teststore);
+
+      sprintf(name, "%s.log.%08lu", testfile, 0UL);
+      segment = fopen(name, "rb+");
+      fseek(segment, 1000, SEEK_SET);
+      fwrite("garbage", 1, 7, segment);
+      fclose(segment);
+
+      ekvs_open(&teststore, testfile, NULL);
+      found = segment_test_count(teststore, 200);
+      SHOULD_EQUAL(found > 0 && found < 200, 1)
+      SHOULD_NOT_EQUAL(teststore->discarded_bytes, 0)
+      SHOULD_EQUAL(teststore->segment, 0)
+      SHOULD_EQUAL(segment_test_size(testfile, 1), -1)
+      segment_test_fill(teststore, 200);
+      ekvs_close(teststore);
+
+      ekvs_open(&teststore, testfile, NULL);
+      SHOULD_EQUAL(segment_test_count(teststore, 200), 200)
+      SHOULD_EQUAL(teststore->discarded_bytes, 0)
+      ekvs_close(teststore);
+      segment_test_cleanup(testfile);
+   END_IT
+
+   IT("gives records larger than a segment one of their own, with or without a writer thread")
+      ekvs teststore;
+      ekvs_opts opts;
+      const void* get_ptr;
+      size_t get_sz = 0;
+      char* big = malloc(10000);
+      const char* testfile = "segment_test";
+      memset(big, 'b', 10000);
+      memset(&opts, 0, sizeof(opts));
+      opts.binlog_segment_size = 4096;
+      opts.async_binlog_size = 4096;
+      ekvs_open(&teststore, testfile, &opts);
+      segment_test_fill(teststore, 50);
+      ekvs_set(teststore, "big", big, 10000);
+      segment_test_fill(teststore, 100);
+      SHOULD_EQUAL(ekvs_wait_durable(teststore, ekvs_lsn(teststore)), EKVS_OK)
+      ekvs_close(teststore);
+
+      ekvs_open(&teststore, testfile, NULL);
+      SHOULD_EQUAL(ekvs_get(teststore, "big", &get_ptr, &get_sz), EKVS_OK)
+      SHOULD_EQUAL(get_sz, 10000)
+      SHOULD_EQUAL(segment_test_count(teststore, 100), 100)
+      SHOULD_EQUAL(teststore->discarded_bytes, 0)
+      ekvs_close(teststore);
+      segment_test_cleanup(testfile);
+      free(big);
+   END_IT
+END_DESCRIBE
@@ -0,0 +1,282 @@
+#include <ekvs/ekvs.h>
+#include "../src/ekvs_internal.h"
+
+#include <cspec.h>
+#include <cspec_output_verbose.h>
+
+#include <sched.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+/* Values are two ints, the second derived from the first, so a torn read shows */
+static void shared_test_value(int* value, int i)
+{
+   value[0] = i;
+   value[1] = i * 7 + 1;
+}
+
+static int shared_test_check(const void* data, size_t data_sz)
+{
+   int value[2];
+   if(data_sz != sizeof(value)) return 0;
+   memcpy(value, data, sizeof(value));
+   return value[1] == value[0] * 7 + 1;
+}
+
+static int shared_test_wait(pid_t pid)
+{
+   int status = 0;
+   if(waitpid(pid, &status, 0) != pid) return -1;
+   return (WIFEXITED(status) ? WEXITSTATUS(status) : -1);
+}
+
+DESCRIBE(ekvs_shared, "ekvs shared memory stores")
+   IT("stores, replaces and deletes keys in a segment")
+      ekvs writer;
+      ekvs reader;
+      ekvs_opts testopts;
+      ekvs_runtime_stats stats;
+      const void* get_ptr;
+      size_t get_sz = 0;
+      int value[2];
+      int64_t result;
+      ekvs_ref ref;
+      char key[16];
+      int i;
+      const char* testfile = "shared_test.shm";
+      remove(testfile);
+      memset(&testopts, 0, sizeof(ekvs_opts));
+      testopts.initial_table_size = 16;
+
+      SHOULD_EQUAL(ekvs_open_shared(&reader, testfile, 0, NULL), EKVS_FILE_FAIL)
+      SHOULD_EQUAL(ekvs_open_shared(&writer, testfile, 1 << 20, &testopts), EKVS_OK)
+      for(i = 0; i < 1000; i++)
+      {
+         sprintf(key, "key%d", i);
+         shared_test_value(value, i);
+         SHOULD_EQUAL(ekvs_set(writer, key, value, sizeof(value)), EKVS_OK)
+      }
+      for(i = 0; i < 1000; i += 2)
+      {
+         sprintf(key, "key%d", i);
+         shared_test_value(value, i + 1000);
+         SHOULD_EQUAL(ekvs_set(writer, key, value, sizeof(value)), EKVS_OK)
+      }
+      for(i = 0; i < 1000; i += 3)
+      {
+         sprintf(key, "key%d", i);
+         SHOULD_EQUAL(ekvs_del(writer, key), EKVS_OK)
+      }
+      SHOULD_EQUAL(ekvs_del(writer, "key0"), EKVS_NO_KEY)
+      SHOULD_EQUAL(ekvs_set(writer, "empty", NULL, 0), EKVS_OK)
+
+      /* A second handle sees the same database */
+      SHOULD_EQUAL(ekvs_open_shared(&reader, testfile, 0, NULL), EKVS_OK)
+      for(i = 0; i < 1000; i++)
+      {
+         sprintf(key, "key%d", i);
+         if(i % 3 == 0)
+         {
+            SHOULD_EQUAL(ekvs_get(reader, key, &get_ptr, &get_sz), EKVS_NO_KEY)
+            continue;
+         }
+         SHOULD_EQUAL(ekvs_get(reader, key, &get_ptr, &get_sz), EKVS_OK)
+         SHOULD_BE_TRUE(shared_test_check(get_ptr, get_sz))
+         memcpy(value, get_ptr, sizeof(value));
+         SHOULD_EQUAL(value[0], (i % 2 == 0 ? i + 1000 : i))
+      }
+      SHOULD_EQUAL(ekvs_get(reader, "empty", &get_ptr, &get_sz), EKVS_OK)
+      SHOULD_EQUAL(get_sz, 0)
+
+      SHOULD_EQUAL(ekvs_stats(reader, &stats), EKVS_OK)
+      SHOULD_EQUAL(stats.population, 1000 - 334 + 1)
+      SHOULD_BE_TRUE(stats.table_size > 16)
+
+      /* Operations on the heap-based table are not available */
+      SHOULD_EQUAL(ekvs_incrby(writer, "counter", 1, &result), EKVS_UNSUPPORTED)
+      SHOULD_EQUAL(ekvs_append(writer, "key1", "x", 1), EKVS_UNSUPPORTED)
+      SHOULD_EQUAL(ekvs_lpush(writer, "list", "x", 1), EKVS_UNSUPPORTED)
+      SHOULD_EQUAL(ekvs_snapshot(writer, "shared_test.snap"), EKVS_UNSUPPORTED)
+      SHOULD_EQUAL(ekvs_get_ref(writer, "key1", &ref), EKVS_UNSUPPORTED)
+      SHOULD_EQUAL(ref.pin, NULL)
+      SHOULD_EQUAL(ekvs_shared_refresh(reader), EKVS_OK)
+
+      ekvs_close(reader);
+      ekvs_close(writer);
+
+      /* The segment outlives its handles */
+      SHOULD_EQUAL(ekvs_open_shared(&reader, testfile, 0, NULL), EKVS_OK)
+      SHOULD_EQUAL(ekvs_get(reader, "key1", &get_ptr, &get_sz), EKVS_OK)
+      ekvs_close(reader);
+      remove(testfile);
+   END_IT
+
+   IT("shares the database between processes")
+      ekvs store;
+      const void* get_ptr;
+      size_t get_sz = 0;
+      int value[2];
+      char key[16];
+      pid_t pid;
+      int i;
+      int ret = EKVS_OK;
+      const char* testfile = "shared_test.shm";
+      remove(testfile);
+      SHOULD_EQUAL(ekvs_open_shared(&store, testfile, 256 * 1024, NULL), EKVS_OK)
+
+      /* Writes from another process */
+      pid = fork();
+      if(pid == 0)
+      {
+         ekvs child;
+         if(ekvs_open_shared(&child, testfile, 0, NULL) != EKVS_OK) _exit(1);
+         for(i = 0; i < 100; i++)
+         {
+            sprintf(key, "child%d", i);
+            shared_test_value(value, i);
+            if(ekvs_set(child, key, value, sizeof(value)) != EKVS_OK) _exit(2);
+         }
+         ekvs_close(child);
+         _exit(0);
+      }
+      SHOULD_EQUAL(shared_test_wait(pid), 0)
+      for(i = 0; i < 100; i++)
+      {
+         sprintf(key, "child%d", i);
+         SHOULD_EQUAL(ekvs_get(store, key, &get_ptr, &get_sz), EKVS_OK)
+         SHOULD_BE_TRUE(shared_test_check(get_ptr, get_sz))
+      }
+
+      /* A reader in another process while this one rewrites keys many times the segment size */
+      pid = fork();
+      if(pid == 0)
+      {
+         ekvs child;
+         int reads = 0;
+         if(ekvs_open_shared(&child, testfile, 0, NULL) != EKVS_OK) _exit(1);
+         while(ekvs_get(child, "done", &get_ptr, &get_sz) == EKVS_NO_KEY)
+         {
+            sprintf(key, "key%d", reads++ % 64);
+            if(ekvs_get(child, key, &get_ptr, &get_sz) == EKVS_OK && !shared_test_check(get_ptr, get_sz)) _exit(2);
+            ekvs_shared_refresh(child);
+         }
+         ekvs_close(child);
+         _exit(0);
+      }
+      for(i = 0; i < 50000 && ret == EKVS_OK; i++)
+      {
+         int tries = 0;
+         sprintf(key, "key%d", i % 64);
+         shared_test_value(value, i);
+
+         /* The segment is full until the reader catches up */
+         while((ret = ekvs_set(store, key, value, sizeof(value))) == EKVS_ALLOCATION_FAIL && tries++ < 100000) sched_yield();
+      }
+      SHOULD_EQUAL(ret, EKVS_OK)
+      ekvs_set(store, "done", NULL, 0);
+      SHOULD_EQUAL(shared_test_wait(pid), 0)
+
+      ekvs_close(store);
+      remove(testfile);
+   END_IT
+
+   IT("reuses memory only once every handle has refreshed")
+      ekvs writer;
+      ekvs reader;
+      const void* held;
+      const void* get_ptr;
+      size_t held_sz = 0;
+      size_t get_sz = 0;
+      int value[2];
+      int i;
+      int ret = EKVS_OK;
+      const char* testfile = "shared_test.shm";
+      remove(testfile);
+      SHOULD_EQUAL(ekvs_open_shared(&writer, testfile, 64 * 1024, NULL), EKVS_OK)
+      SHOULD_EQUAL(ekvs_open_shared(&reader, testfile, 0, NULL), EKVS_OK)
+      shared_test_value(value, 0);
+      ekvs_set(writer, "key", value, sizeof(value));
+      SHOULD_EQUAL(ekvs_get(reader, "key", &held, &held_sz), EKVS_OK)
+
+      /* The reader holds on to the first value, so nothing replaced after it can be reused */
+      for(i = 1; i < 100000 && ret == EKVS_OK; i++)
+      {
+         shared_test_value(value, i);
+         ret = ekvs_set(writer, "key", value, sizeof(value));
+      }
+      SHOULD_EQUAL(ret, EKVS_ALLOCATION_FAIL)
+      memcpy(value, held, sizeof(value));
+      SHOULD_EQUAL(value[0], 0)
+      SHOULD_BE_TRUE(shared_test_check(held, held_sz))
+
+      SHOULD_EQUAL(ekvs_shared_refresh(reader), EKVS_OK)
+      shared_test_value(value, i);
+      SHOULD_EQUAL(ekvs_set(writer, "key", value, sizeof(value)), EKVS_OK)
+      SHOULD_EQUAL(ekvs_get(reader, "key", &get_ptr, &get_sz), EKVS_OK)
+      memcpy(value, get_ptr, sizeof(value));
+      SHOULD_EQUAL(value[0], i)
+
+      /* A closed handle does not hold anything back */
+      ekvs_close(reader);
+      ret = EKVS_OK;
+      for(i = 0; i < 10000 && ret == EKVS_OK; i++)
+      {
+         shared_test_value(value, i);
+         ret = ekvs_set(writer, "key", value, sizeof(value));
+      }
+      SHOULD_EQUAL(ret, EKVS_OK)
+      ekvs_close(writer);
+      remove(testfile);
+   END_IT
+
+   IT("recovers when a writer exits while holding the lock")
+      ekvs store;
+      ekvs_runtime_stats stats;
+      const void* get_ptr;
+      size_t get_sz = 0;
+      int value[2];
+      char key[16];
+      pid_t pid;
+      int i;
+      const char* testfile = "shared_test.shm";
+      remove(testfile);
+      SHOULD_EQUAL(ekvs_open_shared(&store, testfile, 1 << 20, NULL), EKVS_OK)
+      for(i = 0; i < 100; i++)
+      {
+         sprintf(key, "key%d", i);
+         shared_test_value(value, i);
+         ekvs_set(store, key, value, sizeof(value));
+         ekvs_set(store, key, value, sizeof(value));
+      }
+
+      /* The child leaves the lock held and the table marked as changing */
+      pid = fork();
+      if(pid == 0)
+      {
+         ekvs child;
+         struct _ekvs_shm_header* header;
+         if(ekvs_open_shared(&child, testfile, 0, NULL) != EKVS_OK) _exit(1);
+         header = (struct _ekvs_shm_header*)child->shm_map;
+         pthread_mutex_lock(&header->lock);
+         header->seq++;
+         _exit(0);
+      }
+      SHOULD_EQUAL(shared_test_wait(pid), 0)
+
+      /* Readers notice first */
+      SHOULD_EQUAL(ekvs_get(store, "key0", &get_ptr, &get_sz), EKVS_OK)
+      SHOULD_BE_TRUE(shared_test_check(get_ptr, get_sz))
+      SHOULD_EQUAL(ekvs_set(store, "after", NULL, 0), EKVS_OK)
+      for(i = 0; i < 100; i++)
+      {
+         sprintf(key, "key%d", i);
+         SHOULD_EQUAL(ekvs_get(store, key, &get_ptr, &get_sz), EKVS_OK)
+         SHOULD_BE_TRUE(shared_test_check(get_ptr, get_sz))
+      }
+      SHOULD_EQUAL(ekvs_stats(store, &stats), EKVS_OK)
+      SHOULD_EQUAL(stats.population, 101)
+
+      ekvs_close(store);
+      remove(testfile);
+   END_IT
+END_DESCRIBE
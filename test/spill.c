@@ -0,0 +1,119 @@
+#include <ekvs/ekvs.h>
+#include "../src/ekvs_internal.h"
+
+#include <cspec.h>
+#include <cspec_output_verbose.h>
+
+DESCRIBE(ekvs_spill, "ekvs_opts.spill_cold")
+   IT("requires a value log")
+      ekvs teststore;
+      ekvs_opts testopts;
+      memset(&testopts, 0, sizeof(ekvs_opts));
+      testopts.spill_cold = 1;
+      SHOULD_EQUAL(ekvs_open(&teststore, NULL, &testopts), EKVS_FAIL)
+   END_IT
+
+   IT("moves cold values to the value log instead of evicting them")
+      ekvs teststore;
+      ekvs_cache_stats stats;
+      ekvs_opts testopts;
+      const void* get_ptr;
+      size_t get_sz = 0;
+      char key[16];
+      char value[100];
+      int i, found = 0, matched = 0;
+      memset(&testopts, 0, sizeof(ekvs_opts));
+      testopts.initial_table_size = 16;
+      testopts.max_memory = 16 * sizeof(struct _ekvs_db_entry*) + 4 * EKVS_ENTRY_SIZE(5, 100) +
+         10 * EKVS_ENTRY_SIZE(5, sizeof(struct _ekvs_vlog_ptr));
+      testopts.spill_cold = 1;
+      testopts.vlog_path = "spill_test.vlog";
+      remove("spill_test.vlog.0");
+      SHOULD_EQUAL(ekvs_open(&teststore, NULL, &testopts), EKVS_OK)
+      for(i = 0; i < 10; i++)
+      {
+         sprintf(key, "key%02d", i);
+         memset(value, 'a' + i, sizeof(value));
+         ekvs_set_ex(teststore, key, value, sizeof(value), ekvs_set_no_grow);
+      }
+      ekvs_get_cache_stats(teststore, &stats);
+      SHOULD_EQUAL(stats.evictions, 0)
+      SHOULD_NOT_EQUAL(stats.spills, 0)
+      SHOULD_EQUAL(stats.mem_used <= stats.mem_budget, 1)
+      SHOULD_EQUAL(teststore->table_population, 10)
+
+      /* Every value is still there, and reading a spilled one brings it back in */
+      for(i = 0; i < 10; i++)
+      {
+         sprintf(key, "key%02d", i);
+         memset(value, 'a' + i, sizeof(value));
+         if(ekvs_get(teststore, key, &get_ptr, &get_sz) == EKVS_OK) found++;
+         if(get_sz == sizeof(value) && memcmp(get_ptr, value, sizeof(value)) == 0) matched++;
+      }
+      SHOULD_EQUAL(found, 10)
+      SHOULD_EQUAL(matched, 10)
+      ekvs_get_cache_stats(teststore, &stats);
+      SHOULD_EQUAL(stats.faults, stats.spills)
+
+      /* The next write enforces the budget again */
+      ekvs_set(teststore, "key00", "small", 6);
+      ekvs_get_cache_stats(teststore, &stats);
+      SHOULD_EQUAL(stats.mem_used <= stats.mem_budget, 1)
+      SHOULD_EQUAL(ekvs_get(teststore, "key00", &get_ptr, &get_sz), EKVS_OK)
+      SHOULD_MATCH(get_ptr, "small")
+      SHOULD_EQUAL(ekvs_get(teststore, "nokey", &get_ptr, &get_sz), EKVS_NO_KEY)
+      ekvs_close(teststore);
+      remove("spill_test.vlog.0");
+   END_IT
+
+   IT("keeps counters and spilled values across a snapshot")
+      ekvs teststore;
+      ekvs_cache_stats stats;
+      ekvs_opts testopts;
+      const void* get_ptr;
+      size_t get_sz = 0;
+      int64_t count = 0;
+      char key[16];
+      char value[200];
+      int i, matched = 0;
+      const char* testfile = "spill_test";
+      remove(testfile);
+      remove("spill_test.vlog.0");
+      memset(&testopts, 0, sizeof(ekvs_opts));
+      testopts.initial_table_size = 64;
+      testopts.max_memory = 64 * sizeof(struct _ekvs_db_entry*) + 8 * EKVS_ENTRY_SIZE(5, 200) +
+         32 * EKVS_ENTRY_SIZE(5, sizeof(struct _ekvs_vlog_ptr));
+      testopts.spill_cold = 1;
+      SHOULD_EQUAL(ekvs_open(&teststore, testfile, &testopts), EKVS_OK)
+      ekvs_incrby(teststore, "count", 5, NULL);
+      for(i = 0; i < 32; i++)
+      {
+         sprintf(key, "key%02d", i);
+         memset(value, 'A' + i, sizeof(value));
+         ekvs_set(teststore, key, value, sizeof(value));
+      }
+      ekvs_get_cache_stats(teststore, &stats);
+      SHOULD_NOT_EQUAL(stats.spills, 0)
+      SHOULD_EQUAL(ekvs_snapshot(teststore, NULL), EKVS_OK)
+      ekvs_close(teststore);
+
+      SHOULD_EQUAL(ekvs_open(&teststore, testfile, &testopts), EKVS_OK)
+      ekvs_get_cache_stats(teststore, &stats);
+      SHOULD_EQUAL(stats.mem_used <= stats.mem_budget, 1)
+      SHOULD_EQUAL(ekvs_incrby(teststore, "count", 1, &count), EKVS_OK)
+      SHOULD_EQUAL(count, 6)
+      for(i = 0; i < 32; i++)
+      {
+         sprintf(key, "key%02d", i);
+         memset(value, 'A' + i, sizeof(value));
+         if(ekvs_get(teststore, key, &get_ptr, &get_sz) == EKVS_OK && get_sz == sizeof(value) &&
+            memcmp(get_ptr, value, sizeof(value)) == 0) matched++;
+      }
+      SHOULD_EQUAL(matched, 32)
+      ekvs_get_cache_stats(teststore, &stats);
+      SHOULD_NOT_EQUAL(stats.faults, 0)
+      ekvs_close(teststore);
+      remove(testfile);
+      remove("spill_test.vlog.0");
+   END_IT
+END_DESCRIBE
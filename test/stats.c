@@ -0,0 +1,80 @@
+#include <ekvs/ekvs.h>
+#include "../src/ekvs_internal.h"
+
+#include <cspec.h>
+#include <cspec_output_verbose.h>
+
+DESCRIBE(ekvs_stats, "ekvs_stats")
+   IT("reports the shape of the table and where memory goes")
+      ekvs teststore;
+      ekvs_runtime_stats stats;
+      ekvs_cache_stats cache_stats;
+      uint64_t buckets = 0;
+      uint64_t keys = 0;
+      char key[16];
+      int i;
+      ekvs_open(&teststore, NULL, NULL);
+      for(i = 0; i < 100; i++)
+      {
+         sprintf(key, "key%03d", i);
+         ekvs_set(teststore, key, "0123456789", 10);
+      }
+      SHOULD_EQUAL(ekvs_stats(teststore, &stats), EKVS_OK)
+      SHOULD_EQUAL(stats.population, 100)
+      SHOULD_EQUAL(stats.table_size, teststore->serialized.table_sz)
+      for(i = 0; i < EKVS_STATS_CHAIN_LENGTHS; i++)
+      {
+         buckets += stats.chain_lengths[i];
+         keys += stats.chain_lengths[i] * i;
+      }
+      SHOULD_EQUAL(buckets, stats.table_size)
+      SHOULD_EQUAL(stats.max_chain_length < EKVS_STATS_CHAIN_LENGTHS, 1)
+      SHOULD_EQUAL(keys, 100)
+      SHOULD_EQUAL(stats.key_bytes, 600)
+      SHOULD_EQUAL(stats.value_bytes, 1000)
+      ekvs_get_cache_stats(teststore, &cache_stats);
+      SHOULD_EQUAL(stats.key_bytes + stats.value_bytes + stats.overhead_bytes, cache_stats.mem_used)
+      SHOULD_EQUAL(stats.binlog_records, 0)
+      ekvs_close(teststore);
+   END_IT
+
+   IT("counts binlog writes, table growth and snapshots")
+      ekvs teststore;
+      ekvs_runtime_stats stats;
+      ekvs_opts opts;
+      char key[16];
+      int i;
+      const char* testfile = "stats_test";
+      memset(&opts, 0, sizeof(opts));
+      opts.initial_table_size = 8;
+      ekvs_open(&teststore, testfile, &opts);
+      for(i = 0; i < 100; i++)
+      {
+         sprintf(key, "key%03d", i);
+         ekvs_set(teststore, key, "value", 5);
+      }
+      ekvs_del(teststore, "key000");
+      ekvs_stats(teststore, &stats);
+      SHOULD_EQUAL(stats.binlog_size, teststore->serialized.binlog_end - teststore->serialized.binlog_start)
+#ifndef EKVS_NO_STATS
+      SHOULD_EQUAL(stats.binlog_records, 101)
+      SHOULD_EQUAL(stats.binlog_flushes, 101)
+      SHOULD_EQUAL(stats.binlog_bytes, stats.binlog_size)
+      SHOULD_EQUAL(stats.binlog_write_max_ns <= stats.binlog_write_ns, 1)
+      SHOULD_NOT_EQUAL(stats.binlog_write_ns, 0)
+      SHOULD_NOT_EQUAL(stats.grow_count, 0)
+      SHOULD_EQUAL(stats.grow_max_ns <= stats.grow_ns, 1)
+      SHOULD_EQUAL(stats.snapshot_count, 0)
+#endif
+      SHOULD_EQUAL(ekvs_snapshot(teststore, NULL), EKVS_OK)
+      ekvs_stats(teststore, &stats);
+      SHOULD_EQUAL(stats.binlog_size, 0)
+#ifndef EKVS_NO_STATS
+      SHOULD_EQUAL(stats.snapshot_count, 1)
+      SHOULD_NOT_EQUAL(stats.snapshot_ns, 0)
+      SHOULD_EQUAL(stats.binlog_records, 101)
+#endif
+      ekvs_close(teststore);
+      remove(testfile);
+   END_IT
+END_DESCRIBE
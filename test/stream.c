@@ -0,0 +1,161 @@
+#include <ekvs/ekvs.h>
+#include "../src/ekvs_internal.h"
+
+#include <cspec.h>
+#include <cspec_output_verbose.h>
+
+/* A growing buffer, read back in small uneven pieces to exercise partial reads */
+struct stream_test_buffer {
+   char* data;
+   size_t size;
+   size_t cap;
+   size_t pos;
+   size_t limit;              /* Writes fail once the buffer would exceed this, if not 0 */
+};
+
+static size_t stream_test_write(void* ctx, const void* data, size_t size)
+{
+   struct stream_test_buffer* buf = ctx;
+   if(buf->limit != 0 && buf->size + size > buf->limit) return 0;
+   if(buf->size + size > buf->cap)
+   {
+      buf->cap = (buf->size + size) * 2;
+      buf->data = realloc(buf->data, buf->cap);
+   }
+   memcpy(buf->data + buf->size, data, size);
+   buf->size += size;
+   return size;
+}
+
+static size_t stream_test_read(void* ctx, void* data, size_t size)
+{
+   struct stream_test_buffer* buf = ctx;
+   if(size > 333) size = 333;
+   if(size > buf->size - buf->pos) size = buf->size - buf->pos;
+   memcpy(data, buf->data + buf->pos, size);
+   buf->pos += size;
+   return size;
+}
+
+DESCRIBE(ekvs_snapshot_stream, "int ekvs_snapshot_stream(ekvs store, ekvs_write_ptr write_cb, void* ctx)")
+   IT("copies an in-memory store to a new one through callbacks")
+      ekvs teststore;
+      ekvs copystore;
+      ekvs_opts testopts;
+      struct stream_test_buffer buf;
+      const void* get_ptr;
+      size_t get_sz = 0;
+      char key[16];
+      char value[64];
+      uint64_t len = 0;
+      int64_t count = 0;
+      int i, matched = 0;
+      memset(&buf, 0, sizeof(buf));
+      memset(&testopts, 0, sizeof(ekvs_opts));
+      testopts.compression = ekvs_compress_lz;
+      SHOULD_EQUAL(ekvs_open(&teststore, NULL, &testopts), EKVS_OK)
+      for(i = 0; i < 5000; i++)
+      {
+         sprintf(key, "key%04d", i);
+         sprintf(value, "value %d value %d value %d", i, i, i);
+         ekvs_set(teststore, key, value, strlen(value) + 1);
+      }
+      ekvs_rpush(teststore, "list", "a", 1);
+      ekvs_rpush(teststore, "list", "b", 1);
+      ekvs_incrby(teststore, "count", 42, &count);
+
+      SHOULD_EQUAL(ekvs_snapshot_stream(teststore, stream_test_write, &buf), EKVS_OK)
+      SHOULD_EQUAL(ekvs_open_stream(&copystore, stream_test_read, &buf, NULL), EKVS_OK)
+      SHOULD_EQUAL(buf.pos, buf.size)
+      SHOULD_EQUAL(copystore->serialized.table_sz >= teststore->serialized.table_sz, 1)
+      for(i = 0; i < 5000; i++)
+      {
+         sprintf(key, "key%04d", i);
+         sprintf(value, "value %d value %d value %d", i, i, i);
+         if(ekvs_get(copystore, key, &get_ptr, &get_sz) == EKVS_OK && strcmp(get_ptr, value) == 0) matched++;
+      }
+      SHOULD_EQUAL(matched, 5000)
+      SHOULD_EQUAL(ekvs_llen(copystore, "list", &len), EKVS_OK)
+      SHOULD_EQUAL(len, 2)
+      SHOULD_EQUAL(ekvs_incrby(copystore, "count", 1, &count), EKVS_OK)
+      SHOULD_EQUAL(count, 43)
+
+      /* The copy is an ordinary store */
+      SHOULD_EQUAL(ekvs_set(copystore, "new", "key", 4), EKVS_OK)
+      SHOULD_EQUAL(ekvs_get(copystore, "new", &get_ptr, &get_sz), EKVS_OK)
+      ekvs_close(copystore);
+      ekvs_close(teststore);
+      free(buf.data);
+   END_IT
+
+   IT("writes values held in the value log in place")
+      ekvs teststore;
+      ekvs_opts testopts;
+      struct stream_test_buffer buf;
+      const void* get_ptr;
+      size_t get_sz = 0;
+      memset(&buf, 0, sizeof(buf));
+      memset(&testopts, 0, sizeof(ekvs_opts));
+      testopts.vlog_threshold = 8;
+      testopts.vlog_path = "stream_test.vlog";
+      SHOULD_EQUAL(ekvs_open(&teststore, NULL, &testopts), EKVS_OK)
+      ekvs_set(teststore, "large", "a much larger value", 20);
+      SHOULD_EQUAL(ekvs_snapshot_stream(teststore, stream_test_write, &buf), EKVS_OK)
+      ekvs_close(teststore);
+      remove("stream_test.vlog.0");
+
+      SHOULD_EQUAL(ekvs_open_stream(&teststore, stream_test_read, &buf, NULL), EKVS_OK)
+      SHOULD_EQUAL(ekvs_get(teststore, "large", &get_ptr, &get_sz), EKVS_OK)
+      SHOULD_EQUAL(get_sz, 20)
+      SHOULD_MATCH(get_ptr, "a much larger value")
+      ekvs_close(teststore);
+      free(buf.data);
+   END_IT
+
+   IT("fails on short writes, and on cut or corrupt streams")
+      ekvs teststore;
+      ekvs copystore;
+      struct stream_test_buffer buf;
+      char key[16];
+      int i;
+      memset(&buf, 0, sizeof(buf));
+      SHOULD_EQUAL(ekvs_snapshot_stream(NULL, stream_test_write, &buf), EKVS_FAIL)
+      SHOULD_EQUAL(ekvs_open_stream(NULL, stream_test_read, &buf, NULL), EKVS_FAIL)
+      SHOULD_EQUAL(ekvs_open(&teststore, NULL, NULL), EKVS_OK)
+      SHOULD_EQUAL(ekvs_snapshot_stream(teststore, NULL, &buf), EKVS_FAIL)
+      for(i = 0; i < 100; i++)
+      {
+         sprintf(key, "key%04d", i);
+         ekvs_set(teststore, key, key, strlen(key) + 1);
+      }
+
+      buf.limit = 100;
+      SHOULD_EQUAL(ekvs_snapshot_stream(teststore, stream_test_write, &buf), EKVS_FILE_FAIL)
+      SHOULD_EQUAL(ekvs_last_error(teststore), EKVS_FILE_FAIL)
+      buf.limit = 0;
+      buf.size = 0;
+      SHOULD_EQUAL(ekvs_snapshot_stream(teststore, stream_test_write, &buf), EKVS_OK)
+      ekvs_close(teststore);
+
+      /* Missing the end marker */
+      buf.size -= sizeof(struct _ekvs_block_header);
+      SHOULD_EQUAL(ekvs_open_stream(&copystore, stream_test_read, &buf, NULL), EKVS_FILE_FAIL)
+      SHOULD_EQUAL(copystore, NULL)
+      buf.size += sizeof(struct _ekvs_block_header);
+
+      buf.pos = 0;
+      buf.data[buf.size / 2] ^= 0x55;
+      SHOULD_EQUAL(ekvs_open_stream(&copystore, stream_test_read, &buf, NULL), EKVS_FILE_FAIL)
+      buf.data[buf.size / 2] ^= 0x55;
+
+      buf.pos = 0;
+      buf.data[0] ^= 0x55;
+      SHOULD_EQUAL(ekvs_open_stream(&copystore, stream_test_read, &buf, NULL), EKVS_FILE_FAIL)
+      buf.data[0] ^= 0x55;
+
+      buf.pos = 0;
+      SHOULD_EQUAL(ekvs_open_stream(&copystore, stream_test_read, &buf, NULL), EKVS_OK)
+      ekvs_close(copystore);
+      free(buf.data);
+   END_IT
+END_DESCRIBE
@@ -0,0 +1,141 @@
+#include <ekvs/ekvs.h>
+#include "../src/ekvs_internal.h"
+
+#include <cspec.h>
+#include <cspec_output_verbose.h>
+
+#define TRACE_TEST_EVENTS 64
+
+static ekvs_trace_event trace_test_events[TRACE_TEST_EVENTS];
+static size_t trace_test_count;
+static size_t trace_test_types[ekvs_trace_event_types];
+
+static void trace_test_callback(void* ctx, const ekvs_trace_event* event)
+{
+   (void)ctx;
+   if(trace_test_count < TRACE_TEST_EVENTS) trace_test_events[trace_test_count] = *event;
+   trace_test_count++;
+   trace_test_types[event->type]++;
+}
+
+static size_t trace_test_find(uint32_t type)
+{
+   size_t i;
+   for(i = 0; i < trace_test_count && i < TRACE_TEST_EVENTS; i++)
+   {
+      if(trace_test_events[i].type == type) return i;
+   }
+   return TRACE_TEST_EVENTS;
+}
+
+static size_t trace_test_count_file(const char* path, const char* needle)
+{
+   char line[512];
+   size_t count = 0;
+   FILE* file = fopen(path, "r");
+   if(file == NULL) return 0;
+   while(fgets(line, sizeof(line), file) != NULL)
+   {
+      if(strstr(line, needle) != NULL) count++;
+   }
+   fclose(file);
+   return count;
+}
+
+DESCRIBE(ekvs_trace, "ekvs tracing")
+   IT("reports operations, and the internal events within them")
+      ekvs teststore;
+      ekvs_opts opts;
+      const void* get_ptr;
+      size_t get_sz = 0;
+      size_t set_index, write_index, flush_index;
+      const char* testfile = "trace_test";
+      memset(&opts, 0, sizeof(opts));
+      opts.trace_callback = trace_test_callback;
+      trace_test_count = 0;
+      ekvs_open(&teststore, testfile, &opts);
+      ekvs_set(teststore, "key", "value", 6);
+      set_index = trace_test_find(ekvs_trace_set);
+      write_index = trace_test_find(ekvs_trace_binlog_write);
+      flush_index = trace_test_find(ekvs_trace_binlog_flush);
+      SHOULD_EQUAL(trace_test_count, 3)
+      SHOULD_EQUAL(write_index, 0)
+      SHOULD_EQUAL(flush_index, 1)
+      SHOULD_EQUAL(set_index, 2)
+      SHOULD_EQUAL(trace_test_events[set_index].hash, _ekvs_hash("key", 3))
+      SHOULD_EQUAL(trace_test_events[set_index].probes, 1)
+      SHOULD_EQUAL(trace_test_events[set_index].bytes, EKVS_BINLOG_HEADER_SIZE + 3 + 6)
+      SHOULD_EQUAL(trace_test_events[write_index].bytes, EKVS_BINLOG_HEADER_SIZE + 3 + 6)
+      SHOULD_EQUAL(trace_test_events[write_index].start >= trace_test_events[set_index].start, 1)
+      SHOULD_EQUAL(trace_test_events[flush_index].start + trace_test_events[flush_index].duration <=
+         trace_test_events[set_index].start + trace_test_events[set_index].duration, 1)
+
+      trace_test_count = 0;
+      ekvs_get(teststore, "key", &get_ptr, &get_sz);
+      SHOULD_EQUAL(trace_test_count, 1)
+      SHOULD_EQUAL(trace_test_events[0].type, ekvs_trace_get)
+      SHOULD_EQUAL(trace_test_events[0].probes, 1)
+      SHOULD_EQUAL(trace_test_events[0].bytes, 0)
+
+      trace_test_count = 0;
+      ekvs_del(teststore, "key");
+      SHOULD_EQUAL(trace_test_count, 3)
+      SHOULD_EQUAL(trace_test_events[2].type, ekvs_trace_del)
+
+      trace_test_count = 0;
+      ekvs_snapshot(teststore, NULL);
+      SHOULD_EQUAL(trace_test_count, 1)
+      SHOULD_EQUAL(trace_test_events[0].type, ekvs_trace_snapshot)
+      SHOULD_NOT_EQUAL(trace_test_events[0].bytes, 0)
+      ekvs_close(teststore);
+      remove(testfile);
+   END_IT
+
+   IT("reports table growth and eviction")
+      ekvs teststore;
+      ekvs_opts opts;
+      char key[16];
+      int i;
+      memset(&opts, 0, sizeof(opts));
+      opts.initial_table_size = 4;
+      opts.max_memory = 4096;
+      opts.trace_callback = trace_test_callback;
+      memset(trace_test_types, 0, sizeof(trace_test_types));
+      ekvs_open(&teststore, NULL, &opts);
+      for(i = 0; i < 100; i++)
+      {
+         sprintf(key, "key%03d", i);
+         ekvs_set(teststore, key, "value", 6);
+      }
+      SHOULD_EQUAL(trace_test_types[ekvs_trace_set], 100)
+      SHOULD_NOT_EQUAL(trace_test_types[ekvs_trace_grow], 0)
+      SHOULD_NOT_EQUAL(trace_test_types[ekvs_trace_evict], 0)
+      SHOULD_EQUAL(trace_test_types[ekvs_trace_binlog_write], 0)
+      ekvs_close(teststore);
+   END_IT
+
+   IT("keeps the latest events in a ring, and dumps them as Chrome trace JSON")
+      ekvs teststore;
+      ekvs_opts opts;
+      ekvs_trace_ring ring;
+      const void* get_ptr;
+      size_t get_sz = 0;
+      int i;
+      const char* tracefile = "trace_test.json";
+      SHOULD_EQUAL(ekvs_trace_ring_create(&ring, 5), EKVS_OK)
+      memset(&opts, 0, sizeof(opts));
+      opts.trace_callback = ekvs_trace_ring_record;
+      opts.trace_ctx = ring;
+      ekvs_open(&teststore, NULL, &opts);
+      ekvs_set(teststore, "key", "value", 6);
+      for(i = 0; i < 20; i++) ekvs_get(teststore, "key", &get_ptr, &get_sz);
+      SHOULD_EQUAL(ekvs_trace_ring_dump(ring, tracefile), EKVS_OK)
+      SHOULD_EQUAL(trace_test_count_file(tracefile, "\"ph\": \"X\""), 8)
+      SHOULD_EQUAL(trace_test_count_file(tracefile, "\"name\": \"get\""), 8)
+      SHOULD_EQUAL(trace_test_count_file(tracefile, "traceEvents"), 1)
+      SHOULD_NOT_EQUAL(ekvs_trace_ticks_per_us(), 0)
+      ekvs_close(teststore);
+      ekvs_trace_ring_destroy(ring);
+      remove(tracefile);
+   END_IT
+END_DESCRIBE
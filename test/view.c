@@ -0,0 +1,194 @@
+#include <ekvs/ekvs.h>
+#include "../src/ekvs_internal.h"
+
+#include <cspec.h>
+#include <cspec_output_verbose.h>
+
+#include <stdlib.h>
+
+struct view_test_walk {
+   int count;
+   int wrong;
+};
+
+/* Keys are "key<i>" holding i, unless i is negative */
+static int view_test_check(void* ctx, const char* key, size_t key_sz, const void* data, size_t data_sz)
+{
+   struct view_test_walk* walk = ctx;
+   char buf[16];
+   int value;
+   walk->count++;
+   if(key_sz >= sizeof(buf) || data_sz != sizeof(value))
+   {
+      walk->wrong++;
+      return 0;
+   }
+   memcpy(buf, key, key_sz);
+   buf[key_sz] = '\0';
+   memcpy(&value, data, sizeof(value));
+   if(value < 0 || atoi(buf + 3) != value) walk->wrong++;
+   return 0;
+}
+
+static int view_test_stop(void* ctx, const char* key, size_t key_sz, const void* data, size_t data_sz)
+{
+   (void)key; (void)key_sz; (void)data; (void)data_sz;
+   return ++((struct view_test_walk*)ctx)->count == 3;
+}
+
+DESCRIBE(ekvs_read_view, "ekvs read views")
+   IT("sees values as they were when it was opened")
+      ekvs teststore;
+      ekvs_read_view view;
+      ekvs_runtime_stats stats;
+      const void* get_ptr;
+      size_t get_sz = 0;
+      char big[512];
+      int64_t counter;
+      int added;
+      memset(big, 'z', sizeof(big));
+      ekvs_open(&teststore, NULL, NULL);
+      ekvs_set(teststore, "replaced", "old", 3);
+      ekvs_set(teststore, "deleted", "gone", 4);
+      ekvs_set(teststore, "appended", "abc", 3);
+      ekvs_set_ex(teststore, "packed", big, sizeof(big), ekvs_set_compress);
+      ekvs_incrby(teststore, "counter", 5, NULL);
+      ekvs_rpush(teststore, "list", "x", 1);
+      ekvs_sadd(teststore, "set", "1", 1, &added);
+
+      SHOULD_EQUAL(ekvs_view_open(teststore, &view), EKVS_OK)
+      ekvs_set(teststore, "replaced", "new", 3);
+      ekvs_del(teststore, "deleted");
+      ekvs_append(teststore, "appended", "def", 3);
+      ekvs_set(teststore, "packed", "small", 5);
+      ekvs_set(teststore, "added", "late", 4);
+      ekvs_incrby(teststore, "counter", 10, NULL);
+      ekvs_rpush(teststore, "list", "y", 1);
+      ekvs_sadd(teststore, "set", "2", 1, &added);
+      ekvs_set(teststore, "replaced", "newer", 5);
+
+      SHOULD_EQUAL(ekvs_view_get(view, "replaced", &get_ptr, &get_sz), EKVS_OK)
+      SHOULD_EQUAL(get_sz, 3)
+      SHOULD_EQUAL(memcmp(get_ptr, "old", 3), 0)
+      SHOULD_EQUAL(ekvs_view_get(view, "deleted", &get_ptr, &get_sz), EKVS_OK)
+      SHOULD_EQUAL(memcmp(get_ptr, "gone", 4), 0)
+      SHOULD_EQUAL(ekvs_view_get(view, "appended", &get_ptr, &get_sz), EKVS_OK)
+      SHOULD_EQUAL(get_sz, 3)
+      SHOULD_EQUAL(ekvs_view_get(view, "packed", &get_ptr, &get_sz), EKVS_OK)
+      SHOULD_EQUAL(get_sz, sizeof(big))
+      SHOULD_EQUAL(memcmp(get_ptr, big, sizeof(big)), 0)
+      SHOULD_EQUAL(ekvs_view_get(view, "added", &get_ptr, &get_sz), EKVS_NO_KEY)
+      SHOULD_EQUAL(ekvs_view_get(view, "counter", &get_ptr, &get_sz), EKVS_OK)
+      memcpy(&counter, get_ptr, sizeof(counter));
+      SHOULD_EQUAL(counter, 5)
+      SHOULD_EQUAL(ekvs_view_get(view, "list", &get_ptr, &get_sz), EKVS_WRONG_TYPE)
+      SHOULD_EQUAL(ekvs_view_get(view, "set", &get_ptr, &get_sz), EKVS_WRONG_TYPE)
+
+      /* The database itself moved on */
+      SHOULD_EQUAL(ekvs_get(teststore, "replaced", &get_ptr, &get_sz), EKVS_OK)
+      SHOULD_EQUAL(memcmp(get_ptr, "newer", 5), 0)
+      SHOULD_EQUAL(ekvs_get(teststore, "deleted", &get_ptr, &get_sz), EKVS_NO_KEY)
+
+      SHOULD_EQUAL(ekvs_stats(teststore, &stats), EKVS_OK)
+      SHOULD_EQUAL(stats.read_views, 1)
+      SHOULD_BE_TRUE(stats.read_view_bytes > sizeof(big))
+      ekvs_view_close(view);
+      SHOULD_EQUAL(ekvs_stats(teststore, &stats), EKVS_OK)
+      SHOULD_EQUAL(stats.read_views, 0)
+      SHOULD_EQUAL(stats.read_view_bytes, 0)
+      ekvs_close(teststore);
+   END_IT
+
+   IT("iterates a stable state while writes continue")
+      ekvs teststore;
+      ekvs_read_view first;
+      ekvs_read_view second;
+      ekvs_runtime_stats stats;
+      struct view_test_walk walk;
+      const void* get_ptr;
+      size_t get_sz = 0;
+      uint64_t first_bytes;
+      char key[16];
+      int value;
+      int i;
+      ekvs_open(&teststore, NULL, NULL);
+      for(i = 0; i < 1000; i++)
+      {
+         sprintf(key, "key%d", i);
+         ekvs_set(teststore, key, &i, sizeof(i));
+      }
+
+      SHOULD_EQUAL(ekvs_view_open(teststore, &first), EKVS_OK)
+      for(i = 0; i < 1000; i += 2)
+      {
+         sprintf(key, "key%d", i);
+         value = -1;
+         ekvs_set(teststore, key, &value, sizeof(value));
+      }
+      for(i = 1; i < 1000; i += 4)
+      {
+         sprintf(key, "key%d", i);
+         ekvs_del(teststore, key);
+      }
+
+      /* A second view sees the writes made so far */
+      SHOULD_EQUAL(ekvs_view_open(teststore, &second), EKVS_OK)
+      for(i = 1000; i < 1500; i++)
+      {
+         sprintf(key, "key%d", i);
+         ekvs_set(teststore, key, &i, sizeof(i));
+      }
+      for(i = 0; i < 1000; i += 2)
+      {
+         sprintf(key, "key%d", i);
+         ekvs_set(teststore, key, &i, sizeof(i));
+      }
+
+      memset(&walk, 0, sizeof(walk));
+      SHOULD_EQUAL(ekvs_view_iterate(first, view_test_check, &walk), EKVS_OK)
+      SHOULD_EQUAL(walk.count, 1000)
+      SHOULD_EQUAL(walk.wrong, 0)
+
+      memset(&walk, 0, sizeof(walk));
+      SHOULD_EQUAL(ekvs_view_iterate(second, view_test_check, &walk), EKVS_OK)
+      SHOULD_EQUAL(walk.count, 750)
+      SHOULD_EQUAL(walk.wrong, 500)
+      SHOULD_EQUAL(ekvs_view_get(second, "key1", &get_ptr, &get_sz), EKVS_NO_KEY)
+      SHOULD_EQUAL(ekvs_view_get(first, "key1", &get_ptr, &get_sz), EKVS_OK)
+
+      memset(&walk, 0, sizeof(walk));
+      SHOULD_EQUAL(ekvs_view_iterate(first, view_test_stop, &walk), EKVS_OK)
+      SHOULD_EQUAL(walk.count, 3)
+
+      /* Closing the older view frees what only it needed */
+      SHOULD_EQUAL(ekvs_stats(teststore, &stats), EKVS_OK)
+      first_bytes = stats.read_view_bytes;
+      ekvs_view_close(first);
+      SHOULD_EQUAL(ekvs_stats(teststore, &stats), EKVS_OK)
+      SHOULD_BE_TRUE(stats.read_view_bytes > 0)
+      SHOULD_BE_TRUE(stats.read_view_bytes < first_bytes)
+      memset(&walk, 0, sizeof(walk));
+      SHOULD_EQUAL(ekvs_view_iterate(second, view_test_check, &walk), EKVS_OK)
+      SHOULD_EQUAL(walk.count, 750)
+      SHOULD_EQUAL(walk.wrong, 500)
+
+      /* Views left open are freed with the database */
+      ekvs_close(teststore);
+   END_IT
+
+   IT("is not supported for images")
+      ekvs teststore;
+      ekvs rostore;
+      ekvs_read_view view;
+      const char* testfile = "view_test.ro";
+      ekvs_open(&teststore, NULL, NULL);
+      ekvs_set(teststore, "key", "value", 5);
+      SHOULD_EQUAL(ekvs_build_readonly(teststore, testfile), EKVS_OK)
+      SHOULD_EQUAL(ekvs_open_readonly(&rostore, testfile, NULL), EKVS_OK)
+      SHOULD_EQUAL(ekvs_view_open(rostore, &view), EKVS_UNSUPPORTED)
+      SHOULD_BE_NULL(view)
+      ekvs_close(rostore);
+      ekvs_close(teststore);
+      remove(testfile);
+   END_IT
+END_DESCRIBE
@@ -0,0 +1,185 @@
+#include <ekvs/ekvs.h>
+#include "../src/ekvs_internal.h"
+
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cspec.h>
+#include <cspec_output_verbose.h>
+
+DESCRIBE(ekvs_vlog, "ekvs value log for large values")
+   IT("stores values over the threshold out-of-line, and reads them back")
+      ekvs teststore;
+      ekvs_opts testopts;
+      const void* get_ptr;
+      size_t get_sz = 0;
+      memset(&testopts, 0, sizeof(ekvs_opts));
+      testopts.vlog_threshold = 8;
+      testopts.vlog_path = "vlog_test.vlog";
+      ekvs_open(&teststore, NULL, &testopts);
+      SHOULD_EQUAL(ekvs_set(teststore, "small", "value", 6), EKVS_OK)
+      SHOULD_EQUAL(ekvs_set(teststore, "large", "a much larger value", 20), EKVS_OK)
+      SHOULD_EQUAL(ekvs_get(teststore, "large", &get_ptr, &get_sz), EKVS_OK)
+      SHOULD_EQUAL(get_sz, 20)
+      SHOULD_MATCH(get_ptr, "a much larger value")
+      SHOULD_EQUAL(ekvs_get(teststore, "small", &get_ptr, &get_sz), EKVS_OK)
+      SHOULD_MATCH(get_ptr, "value")
+      ekvs_close(teststore);
+      remove("vlog_test.vlog.0");
+   END_IT
+
+   IT("replays value log references from the binlog, and from snapshots")
+      ekvs teststore;
+      ekvs_opts testopts;
+      const void* get_ptr;
+      size_t get_sz = 0;
+      const char* testfile = "vlog_test";
+      memset(&testopts, 0, sizeof(ekvs_opts));
+      testopts.vlog_threshold = 8;
+      ekvs_open(&teststore, testfile, &testopts);
+      ekvs_set(teststore, "key1", "first large value", 18);
+      ekvs_set(teststore, "key2", "second large value", 19);
+      ekvs_close(teststore);
+      ekvs_open(&teststore, testfile, &testopts);
+      SHOULD_EQUAL(ekvs_get(teststore, "key1", &get_ptr, &get_sz), EKVS_OK)
+      SHOULD_MATCH(get_ptr, "first large value")
+      SHOULD_EQUAL(ekvs_snapshot(teststore, NULL), EKVS_OK)
+      ekvs_close(teststore);
+      ekvs_open(&teststore, testfile, NULL);
+      SHOULD_EQUAL(ekvs_get(teststore, "key2", &get_ptr, &get_sz), EKVS_OK)
+      SHOULD_MATCH(get_ptr, "second large value")
+      ekvs_close(teststore);
+      remove(testfile);
+      remove("vlog_test.vlog.0");
+   END_IT
+
+   IT("garbage-collects values which are no longer referenced")
+      ekvs teststore;
+      ekvs_opts testopts;
+      const void* get_ptr;
+      size_t get_sz = 0;
+      const char* testfile = "vlog_test";
+      FILE* vlog;
+      memset(&testopts, 0, sizeof(ekvs_opts));
+      testopts.vlog_threshold = 8;
+      ekvs_open(&teststore, testfile, &testopts);
+      ekvs_set(teststore, "key1", "first large value", 18);
+      ekvs_set(teststore, "key1", "first large value, again", 25);
+      ekvs_set(teststore, "key2", "second large value", 19);
+      ekvs_del(teststore, "key2");
+      ekvs_get(teststore, "key1", &get_ptr, &get_sz);
+      SHOULD_EQUAL(ekvs_vlog_gc(teststore), EKVS_OK)
+      SHOULD_EQUAL(teststore->vlog_end, 2 * sizeof(uint64_t) + 4 + 25)
+      SHOULD_EQUAL(teststore->vlog_old_maps, NULL)
+      vlog = fopen("vlog_test.vlog.0", "rb");
+      SHOULD_EQUAL(vlog, NULL)
+      ekvs_close(teststore);
+      ekvs_open(&teststore, testfile, &testopts);
+      SHOULD_EQUAL(ekvs_get(teststore, "key1", &get_ptr, &get_sz), EKVS_OK)
+      SHOULD_MATCH(get_ptr, "first large value, again")
+      SHOULD_EQUAL(ekvs_get(teststore, "key2", &get_ptr, &get_sz), EKVS_NO_KEY)
+      ekvs_close(teststore);
+      remove(testfile);
+      remove("vlog_test.vlog.1");
+   END_IT
+   IT("keeps the old generation mapped while a reference points into it")
+      ekvs teststore;
+      ekvs_opts testopts;
+      ekvs_ref ref;
+      const char* testfile = "vlog_test";
+      memset(&testopts, 0, sizeof(ekvs_opts));
+      testopts.vlog_threshold = 8;
+      ekvs_open(&teststore, testfile, &testopts);
+      ekvs_set(teststore, "key1", "first large value", 18);
+      ekvs_set(teststore, "key2", "second large value", 19);
+      SHOULD_EQUAL(ekvs_get_ref(teststore, "key1", &ref), EKVS_OK)
+      ekvs_del(teststore, "key2");
+      SHOULD_EQUAL(ekvs_vlog_gc(teststore), EKVS_OK)
+      SHOULD_NOT_EQUAL(teststore->vlog_old_maps, NULL)
+      SHOULD_MATCH(ref.data, "first large value")
+      ekvs_ref_release(teststore, &ref);
+
+      /* Nothing is pinned any more, so the next collection unmaps both generations */
+      SHOULD_EQUAL(ekvs_vlog_gc(teststore), EKVS_OK)
+      SHOULD_EQUAL(teststore->vlog_old_maps, NULL)
+      ekvs_close(teststore);
+      remove(testfile);
+      remove("vlog_test.vlog.2");
+   END_IT
+
+   IT("syncs the value log before the records which reference it are durable")
+      ekvs teststore;
+      ekvs_opts testopts;
+      const void* get_ptr;
+      size_t get_sz = 0;
+      const char* testfile = "vlog_test";
+      memset(&testopts, 0, sizeof(ekvs_opts));
+      testopts.vlog_threshold = 8;
+      ekvs_open(&teststore, testfile, &testopts);
+      ekvs_set(teststore, "key1", "first large value", 18);
+      SHOULD_NOT_EQUAL(teststore->vlog_synced, teststore->vlog_end)
+      SHOULD_EQUAL(ekvs_wait_durable(teststore, ekvs_lsn(teststore)), EKVS_OK)
+      SHOULD_EQUAL(teststore->vlog_synced, teststore->vlog_end)
+      ekvs_set(teststore, "key2", "second large value", 19);
+      SHOULD_EQUAL(ekvs_snapshot(teststore, NULL), EKVS_OK)
+      SHOULD_EQUAL(teststore->vlog_synced, teststore->vlog_end)
+      ekvs_close(teststore);
+
+      /* The background writer syncs it with each batch, and follows collections */
+      testopts.async_binlog_size = 4096;
+      ekvs_open(&teststore, testfile, &testopts);
+      ekvs_set(teststore, "key1", "first large value, again", 25);
+      SHOULD_EQUAL(ekvs_wait_durable(teststore, ekvs_lsn(teststore)), EKVS_OK)
+      SHOULD_EQUAL(ekvs_vlog_gc(teststore), EKVS_OK)
+      ekvs_set(teststore, "key3", "third large value", 18);
+      SHOULD_EQUAL(ekvs_wait_durable(teststore, ekvs_lsn(teststore)), EKVS_OK)
+      ekvs_close(teststore);
+      ekvs_open(&teststore, testfile, NULL);
+      SHOULD_EQUAL(ekvs_get(teststore, "key1", &get_ptr, &get_sz), EKVS_OK)
+      SHOULD_MATCH(get_ptr, "first large value, again")
+      SHOULD_EQUAL(ekvs_get(teststore, "key3", &get_ptr, &get_sz), EKVS_OK)
+      SHOULD_MATCH(get_ptr, "third large value")
+      ekvs_close(teststore);
+      remove(testfile);
+      remove("vlog_test.vlog.0");
+      remove("vlog_test.vlog.1");
+   END_IT
+   IT("keeps the old generation when the snapshot after a collection fails")
+      ekvs teststore;
+      ekvs_opts testopts;
+      const void* get_ptr;
+      size_t get_sz = 0;
+      const char* testfile = "vlog_test";
+      FILE* vlog;
+      memset(&testopts, 0, sizeof(ekvs_opts));
+      testopts.vlog_threshold = 8;
+      ekvs_open(&teststore, testfile, &testopts);
+      ekvs_set(teststore, "key1", "first large value", 18);
+      ekvs_set(teststore, "key1", "first large value, again", 25);
+      ekvs_set(teststore, "key2", "second large value", 19);
+
+      /* The snapshot is written to <db>.lock, which cannot be opened as a file */
+      mkdir("vlog_test.lock", 0700);
+      SHOULD_EQUAL(ekvs_vlog_gc(teststore), EKVS_FILE_FAIL)
+      rmdir("vlog_test.lock");
+      SHOULD_EQUAL(teststore->serialized.vlog_gen, 0)
+      vlog = fopen("vlog_test.vlog.1", "rb");
+      SHOULD_EQUAL(vlog, NULL)
+      SHOULD_EQUAL(ekvs_get(teststore, "key1", &get_ptr, &get_sz), EKVS_OK)
+      SHOULD_MATCH(get_ptr, "first large value, again")
+      ekvs_set(teststore, "key3", "third large value", 18);
+      ekvs_close(teststore);
+
+      ekvs_open(&teststore, testfile, &testopts);
+      SHOULD_EQUAL(ekvs_get(teststore, "key2", &get_ptr, &get_sz), EKVS_OK)
+      SHOULD_MATCH(get_ptr, "second large value")
+      SHOULD_EQUAL(ekvs_get(teststore, "key3", &get_ptr, &get_sz), EKVS_OK)
+      SHOULD_MATCH(get_ptr, "third large value")
+      SHOULD_EQUAL(ekvs_vlog_gc(teststore), EKVS_OK)
+      SHOULD_EQUAL(ekvs_get(teststore, "key1", &get_ptr, &get_sz), EKVS_OK)
+      SHOULD_MATCH(get_ptr, "first large value, again")
+      ekvs_close(teststore);
+      remove(testfile);
+      remove("vlog_test.vlog.1");
+   END_IT
+END_DESCRIBE
@@ -0,0 +1,126 @@
+#include <ekvs/ekvs.h>
+#include "../src/ekvs_internal.h"
+
+#include <cspec.h>
+#include <cspec_output_verbose.h>
+
+DESCRIBE(ekvs_writer, "ekvs asynchronous binlog")
+   IT("writes queued records in the background, and waits for them on request")
+      ekvs teststore;
+      ekvs_opts opts;
+      ekvs_runtime_stats stats;
+      const void* get_ptr;
+      size_t get_sz = 0;
+      uint64_t lsn;
+      char key[16];
+      char value[100];
+      int i;
+      int found = 0;
+      const char* testfile = "writer_test";
+      memset(&opts, 0, sizeof(opts));
+      opts.async_binlog_size = 4096;
+      memset(value, 'v', sizeof(value));
+      ekvs_open(&teststore, testfile, &opts);
+      SHOULD_EQUAL(ekvs_lsn(teststore), 0)
+      ekvs_set(teststore, "first", "1", 1);
+      lsn = ekvs_lsn(teststore);
+      SHOULD_EQUAL(lsn, EKVS_BINLOG_HEADER_SIZE + 5 + 1)
+      SHOULD_EQUAL(ekvs_wait_durable(teststore, lsn), EKVS_OK)
+      SHOULD_EQUAL(ekvs_durable_lsn(teststore) >= lsn, 1)
+
+      /* Many times the ring, so it wraps and the producer waits for space */
+      for(i = 0; i < 1000; i++)
+      {
+         sprintf(key, "key%03d", i);
+         ekvs_set(teststore, key, value, sizeof(value));
+      }
+      SHOULD_EQUAL(ekvs_lsn(teststore), lsn + 1000 * (EKVS_BINLOG_HEADER_SIZE + 6 + sizeof(value)))
+      SHOULD_EQUAL(ekvs_wait_durable(teststore, ekvs_lsn(teststore)), EKVS_OK)
+      SHOULD_EQUAL(ekvs_durable_lsn(teststore), ekvs_lsn(teststore))
+      ekvs_stats(teststore, &stats);
+#ifndef EKVS_NO_STATS
+      SHOULD_EQUAL(stats.binlog_records, 1001)
+#endif
+      SHOULD_NOT_EQUAL(stats.binlog_flushes, 0)
+      ekvs_close(teststore);
+
+      ekvs_open(&teststore, testfile, NULL);
+      for(i = 0; i < 1000; i++)
+      {
+         sprintf(key, "key%03d", i);
+         if(ekvs_get(teststore, key, &get_ptr, &get_sz) == EKVS_OK && get_sz == sizeof(value)) found++;
+      }
+      SHOULD_EQUAL(found, 1000)
+      SHOULD_EQUAL(teststore->discarded_bytes, 0)
+      ekvs_close(teststore);
+      remove(testfile);
+   END_IT
+
+   IT("passes records larger than the ring through in pieces")
+      ekvs teststore;
+      ekvs_opts opts;
+      const void* get_ptr;
+      size_t get_sz = 0;
+      char* big = malloc(20000);
+      const char* testfile = "writer_test";
+      memset(&opts, 0, sizeof(opts));
+      opts.async_binlog_size = 4096;
+      memset(big, 'b', 20000);
+      big[19999] = 'e';
+      ekvs_open(&teststore, testfile, &opts);
+      SHOULD_EQUAL(ekvs_set(teststore, "big", big, 20000), EKVS_OK)
+      ekvs_set(teststore, "small", "s", 1);
+      ekvs_close(teststore);
+
+      ekvs_open(&teststore, testfile, NULL);
+      SHOULD_EQUAL(ekvs_get(teststore, "big", &get_ptr, &get_sz), EKVS_OK)
+      SHOULD_EQUAL(get_sz, 20000)
+      SHOULD_EQUAL(memcmp(get_ptr, big, 20000), 0)
+      SHOULD_EQUAL(ekvs_get(teststore, "small", &get_ptr, &get_sz), EKVS_OK)
+      ekvs_close(teststore);
+      remove(testfile);
+      free(big);
+   END_IT
+
+   IT("keeps logging to the new file after a snapshot")
+      ekvs teststore;
+      ekvs_opts opts;
+      const void* get_ptr;
+      size_t get_sz = 0;
+      const char* testfile = "writer_test";
+      memset(&opts, 0, sizeof(opts));
+      opts.async_binlog_size = 4096;
+      ekvs_open(&teststore, testfile, &opts);
+      ekvs_set(teststore, "before", "1", 1);
+      SHOULD_EQUAL(ekvs_snapshot(teststore, NULL), EKVS_OK)
+      ekvs_set(teststore, "after", "2", 1);
+      ekvs_del(teststore, "before");
+      SHOULD_EQUAL(ekvs_wait_durable(teststore, ekvs_lsn(teststore)), EKVS_OK)
+      ekvs_close(teststore);
+
+      ekvs_open(&teststore, testfile, NULL);
+      SHOULD_EQUAL(ekvs_get(teststore, "before", &get_ptr, &get_sz), EKVS_NO_KEY)
+      SHOULD_EQUAL(ekvs_get(teststore, "after", &get_ptr, &get_sz), EKVS_OK)
+      ekvs_close(teststore);
+      remove(testfile);
+   END_IT
+
+   IT("flushes to disk on request without a writer thread")
+      ekvs teststore;
+      const char* testfile = "writer_test";
+      ekvs_open(&teststore, testfile, NULL);
+      ekvs_set(teststore, "key", "value", 5);
+      SHOULD_NOT_EQUAL(ekvs_lsn(teststore), 0)
+      SHOULD_EQUAL(ekvs_durable_lsn(teststore), 0)
+      SHOULD_EQUAL(ekvs_wait_durable(teststore, ekvs_lsn(teststore)), EKVS_OK)
+      SHOULD_EQUAL(ekvs_durable_lsn(teststore), ekvs_lsn(teststore))
+      ekvs_close(teststore);
+      remove(testfile);
+
+      ekvs_open(&teststore, NULL, NULL);
+      ekvs_set(teststore, "key", "value", 5);
+      SHOULD_EQUAL(ekvs_lsn(teststore), 0)
+      SHOULD_EQUAL(ekvs_wait_durable(teststore, 100), EKVS_OK)
+      ekvs_close(teststore);
+   END_IT
+END_DESCRIBE